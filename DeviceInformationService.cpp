@@ -16,6 +16,7 @@
  */
 
 #include "DeviceInformationService.h"
+#include "PMGattTable.h"
 
 #if BLE_FEATURE_GATT_SERVER
 
@@ -62,10 +63,18 @@ ble_error_t DeviceInformationService::add_service(
         param_string_uuids[param_index++] = GattCharacteristic::UUID_SOFTWARE_REVISION_STRING_CHAR;
     }
 
+    /* the characteristics are built in static storage, as the stack may refer to them after this returns */
+    static PMGattPool<GattCharacteristic, 9> chars;
+    static uint8_t system_id_value[8];
+    static uint8_t pnp_value[7];
     GattCharacteristic* param_chars[9];
 
+    if (chars.count()) {
+        return BLE_ERROR_ALREADY_INITIALIZED;
+    }
+
     for (int i = 0; i < param_index; i++) {
-        param_chars[i] = new GattCharacteristic(
+        param_chars[i] = chars.emplace(
             param_string_uuids[i],
             (uint8_t *)param_strings[i],
             strlen(param_strings[i]), /* Min length */
@@ -74,8 +83,6 @@ ble_error_t DeviceInformationService::add_service(
         );
     }
 
-    uint8_t system_id_value[8];
-
     if (system_id) {
         /* pack the values */
         for (int i = 0; i < 5; i++) {
@@ -85,7 +92,7 @@ ble_error_t DeviceInformationService::add_service(
             system_id_value[5 + i] = system_id->organizationally_unique_identifier >> (i * 8);
         }
 
-        param_chars[param_index++] = new GattCharacteristic(
+        param_chars[param_index++] = chars.emplace(
             GattCharacteristic::UUID_SYSTEM_ID_CHAR,
             system_id_value,
             8, /* Min length */
@@ -95,7 +102,7 @@ ble_error_t DeviceInformationService::add_service(
     }
 
     if (cert_data_list && cert_data_list->data) {
-        param_chars[param_index++] = new GattCharacteristic(
+        param_chars[param_index++] = chars.emplace(
             GattCharacteristic::UUID_IEEE_REGULATORY_CERTIFICATION_DATA_LIST_CHAR,
             (uint8_t*)cert_data_list->data,
             cert_data_list->data[0] + 1, /* Min length */
@@ -104,8 +111,6 @@ ble_error_t DeviceInformationService::add_service(
         );
     }
 
-    uint8_t pnp_value[7];
-
     if (pnp_id) {
         /* pack the values */
         pnp_value[0] = pnp_id->vendor_id_source;
@@ -116,7 +121,7 @@ ble_error_t DeviceInformationService::add_service(
         pnp_value[5] = pnp_id->product_version;
         pnp_value[6] = pnp_id->product_version >> 8;
 
-        param_chars[param_index++] = new GattCharacteristic(
+        param_chars[param_index++] = chars.emplace(
             GattCharacteristic::UUID_PNP_ID_CHAR,
             pnp_value,
             7, /* Min length */
@@ -127,13 +132,7 @@ ble_error_t DeviceInformationService::add_service(
 
     GattService deviceInformationService(GattService::UUID_DEVICE_INFORMATION_SERVICE, param_chars, param_index);
 
-    ble_error_t status = ble.gattServer().addService(deviceInformationService);
-
-    for (int i = 0; i < param_index; i++) {
-        delete param_chars[i];
-    }
-
-    return status;
+    return ble.gattServer().addService(deviceInformationService);
 }
 
 #endif // BLE_FEATURE_GATT_SERVER
@@ -84,8 +84,8 @@ public:
      * @param[in] cert_data_list The device's Regulatory Certification Data List.
      * @param[in] pnp_id The device's Plug and Play ID.
      *
-     * @note Do not call more than once. Calling this multiple times will create multiple
-     * instances of the service which is against the spec.
+     * @note Do not call more than once. Multiple instances of the service are against the spec,
+     * so later calls return BLE_ERROR_ALREADY_INITIALIZED.
      */
     static ble_error_t add_service(
         BLE &ble,
@@ -0,0 +1,138 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_BATCH_RING_H
+#define PMSENSE_BATCH_RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "platform/Callback.h"
+
+/**
+ * Shared ring of timestamped samples for batched notifications.
+ *
+ * Samples are numbered as they are pushed and every connection keeps its own cursor (the number of
+ * the next sample it has not had), so one ring serves any number of connections each sending at
+ * its own ATT MTU and pace. A cursor that falls more than SAMPLES behind has lost the samples in
+ * between and is moved up to the oldest one held.
+ *
+ * A batch is a sample count byte followed by that many samples, each a little endian uint32_t
+ * timestamp and the sample's value bytes.
+ *
+ * @tparam SAMPLES Samples held for the slowest connection.
+ * @tparam MAX_SAMPLE_SIZE Largest value size in bytes.
+ * @tparam MAX_PAYLOAD Largest batch in bytes.
+ */
+template <uint8_t SAMPLES, uint8_t MAX_SAMPLE_SIZE, uint16_t MAX_PAYLOAD>
+class PMBatchRing
+{
+public:
+    /** Set the value size of every sample. Returns false if it is over MAX_SAMPLE_SIZE. */
+    bool set_sample_size(uint8_t sample_size)
+    {
+        if (sample_size > MAX_SAMPLE_SIZE) return false;
+        _sample_size = sample_size;
+        return true;
+    }
+
+    uint8_t get_sample_size() const
+    {
+        return _sample_size;
+    }
+
+    /** Number the next sample pushed will get; a cursor equal to it has had everything. */
+    uint32_t next() const
+    {
+        return _next;
+    }
+
+    void push(uint32_t timestamp, const uint8_t *value)
+    {
+        uint8_t *p = _ring[_next % SAMPLES];
+        p[0] = timestamp;
+        p[1] = timestamp >> 8;
+        p[2] = timestamp >> 16;
+        p[3] = timestamp >> 24;
+        memcpy(p + 4, value, _sample_size);
+        _next++;
+    }
+
+    /** Samples a cursor has not had yet. */
+    uint32_t pending(uint32_t cursor) const
+    {
+        return _next - cursor;
+    }
+
+    /** Move a cursor that has fallen behind up to the oldest sample held. Returns the samples it lost. */
+    uint32_t catch_up(uint32_t &cursor) const
+    {
+        uint32_t lost = 0;
+        if (_next - cursor > SAMPLES) {
+            lost = _next - cursor - SAMPLES;
+            cursor = _next - SAMPLES;
+        }
+        return lost;
+    }
+
+    /** Samples per batch in a payload of capacity bytes, at most max_samples and at least one. */
+    uint8_t limit(uint16_t capacity, uint8_t max_samples) const
+    {
+        if (capacity > MAX_PAYLOAD) capacity = MAX_PAYLOAD;
+        uint16_t fit = (capacity - 1) / (4 + _sample_size);
+        if (fit > SAMPLES) fit = SAMPLES;
+        if (fit < 1) fit = 1;
+        return (max_samples < fit) ? max_samples : fit;
+    }
+
+    /**
+     * Send a cursor everything it has not had, in batches of up to limit samples.
+     *
+     * @param[in,out] cursor Advanced past each batch that was sent.
+     * @param[in] send Sends one batch; returning false stops, leaving the rest for the next flush.
+     *
+     * @returns False if a batch could not be sent.
+     */
+    bool flush(uint32_t &cursor, uint8_t limit, mbed::Callback<bool(const uint8_t *, uint16_t)> send) const
+    {
+        uint8_t sample_len = 4 + _sample_size;
+        while (cursor != _next) {
+            uint8_t buf[MAX_PAYLOAD];
+            uint8_t n = 0;
+            uint16_t len = 1;
+            while (n < limit && cursor + n != _next && len + sample_len <= MAX_PAYLOAD) {
+                memcpy(buf + len, _ring[(cursor + n) % SAMPLES], sample_len);
+                len += sample_len;
+                n++;
+            }
+            buf[0] = n;
+            if (!send(buf, len)) {
+                return false;
+            }
+            cursor += n;
+        }
+        return true;
+    }
+
+protected:
+    uint8_t _ring[SAMPLES][4 + MAX_SAMPLE_SIZE] = {};
+    uint8_t _sample_size = 0;
+    uint32_t _next = 0;                 // number of the next sample pushed
+};
+
+#endif // PMSENSE_BATCH_RING_H
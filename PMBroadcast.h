@@ -0,0 +1,152 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_BROADCAST_H
+#define PMSENSE_BROADCAST_H
+
+#include <stdint.h>
+
+#include "Panasonic_SNGCJA5.h"
+
+/**
+ * PM frame carried in advertising manufacturer specific data, so passive scanners can collect
+ * readings without connecting. All values are little endian:
+ *
+ *   u16 company id, u8 format, u16 sequence number (low 16 bits), u8 status,
+ *   3 x u16 mass density (PM1.0, PM2.5, PM10 in 0.1 ug/m3), 6 x u16 particle counts
+ */
+#define PMBCAST_COMPANY_ID              (0xFFFFu)            ///< Bluetooth SIG id reserved for testing
+#define PMBCAST_FORMAT                  (0x01u)
+#define PMBCAST_FRAME_SIZE              (24u)                ///< Fits a legacy payload alongside the flags
+#define PMBCAST_MDV_DIVISOR             (100u)               ///< Sensor mass density LSB is 0.001 ug/m3
+
+/**
+ * Extended and periodic advertising carry the same frame with format PMBCAST_FORMAT_HISTORY,
+ * followed by recent per-second samples, oldest first:
+ *
+ *   u32 timestamp of the first sample, u8 sample count,
+ *   then per sample: u8 seconds since the previous sample, u16 PM2.5 mass density (0.1 ug/m3),
+ *   u16 0.5um to 2.5um count
+ */
+#define PMBCAST_FORMAT_HISTORY          (0x02u)
+#define PMBCAST_HISTORY_SAMPLES         (30u)
+#define PMBCAST_HISTORY_SAMPLE_SIZE     (5u)
+#define PMBCAST_EXT_FRAME_SIZE          (PMBCAST_FRAME_SIZE + 5u + PMBCAST_HISTORY_SAMPLES * PMBCAST_HISTORY_SAMPLE_SIZE)
+
+// Status flags
+#define PMBCAST_STATUS_ERROR            (0x01u)              ///< A bus or sensor error occurred this interval
+#define PMBCAST_STATUS_PARTIAL          (0x02u)              ///< Fewer samples than the interval length
+#define PMBCAST_STATUS_UNSENT           (0x04u)              ///< Interval records are waiting for a central
+
+/** Decoded broadcast frame. */
+typedef struct {
+    uint16_t seq;
+    uint8_t status;
+    PM_MDVPC_Data pmdata;       // mass densities rounded to 0.1 ug/m3
+} PMBroadcastFrame;
+
+static inline uint8_t *pmbcast_put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static inline uint16_t pmbcast_get_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint16_t pmbcast_mdv(uint32_t mdv)
+{
+    mdv /= PMBCAST_MDV_DIVISOR;
+    return (mdv > UINT16_MAX) ? UINT16_MAX : mdv;
+}
+
+/** Encode a frame into buf, which must hold PMBCAST_FRAME_SIZE bytes. Returns the length. */
+static inline uint8_t pmbcast_encode(uint8_t *buf, uint32_t seq, uint8_t status, const PM_MDVPC_Data &pmdata)
+{
+    uint8_t *p = pmbcast_put_u16(buf, PMBCAST_COMPANY_ID);
+    *p++ = PMBCAST_FORMAT;
+    p = pmbcast_put_u16(p, seq);
+    *p++ = status;
+    p = pmbcast_put_u16(p, pmbcast_mdv(pmdata.pm10_mdv));
+    p = pmbcast_put_u16(p, pmbcast_mdv(pmdata.pm25_mdv));
+    p = pmbcast_put_u16(p, pmbcast_mdv(pmdata.pm100_mdv));
+    p = pmbcast_put_u16(p, pmdata.reg1_pc);
+    p = pmbcast_put_u16(p, pmdata.reg2_pc);
+    p = pmbcast_put_u16(p, pmdata.reg3_pc);
+    p = pmbcast_put_u16(p, pmdata.reg4_pc);
+    p = pmbcast_put_u16(p, pmdata.reg5_pc);
+    p = pmbcast_put_u16(p, pmdata.reg6_pc);
+    return p - buf;
+}
+
+/**
+ * Append per-second samples to a frame encoded by pmbcast_encode(), turning it into a
+ * PMBCAST_FORMAT_HISTORY frame. Samples are given oldest first. Returns the total length.
+ */
+static inline uint8_t pmbcast_encode_history(uint8_t *buf, const uint32_t *timestamps, const PM_MDVPC_Data *samples, uint8_t n)
+{
+    if (n > PMBCAST_HISTORY_SAMPLES) {
+        timestamps += n - PMBCAST_HISTORY_SAMPLES;
+        samples += n - PMBCAST_HISTORY_SAMPLES;
+        n = PMBCAST_HISTORY_SAMPLES;
+    }
+    buf[2] = PMBCAST_FORMAT_HISTORY;
+
+    uint8_t *p = buf + PMBCAST_FRAME_SIZE;
+    uint32_t first = n ? timestamps[0] : 0;
+    p = pmbcast_put_u16(p, first);
+    p = pmbcast_put_u16(p, first >> 16);
+    *p++ = n;
+    for (uint8_t i = 0; i < n; i++) {
+        uint32_t dt = i ? (timestamps[i] - timestamps[i - 1]) : 0;
+        *p++ = (dt > UINT8_MAX) ? UINT8_MAX : dt;
+        p = pmbcast_put_u16(p, pmbcast_mdv(samples[i].pm25_mdv));
+        uint32_t pc = (uint32_t)samples[i].reg2_pc + samples[i].reg3_pc;
+        p = pmbcast_put_u16(p, (pc > UINT16_MAX) ? UINT16_MAX : pc);
+    }
+    return p - buf;
+}
+
+/** Decode manufacturer specific data. Returns false if it is not a PM broadcast frame. */
+static inline bool pmbcast_decode(const uint8_t *buf, uint8_t len, PMBroadcastFrame &frame)
+{
+    if (len < PMBCAST_FRAME_SIZE || pmbcast_get_u16(buf) != PMBCAST_COMPANY_ID ||
+        (buf[2] != PMBCAST_FORMAT && buf[2] != PMBCAST_FORMAT_HISTORY)) {
+        return false;
+    }
+    const uint8_t *p = buf + 3;
+    frame.seq = pmbcast_get_u16(p);
+    frame.status = p[2];
+    p += 3;
+    frame.pmdata.pm10_mdv = (uint32_t)pmbcast_get_u16(p) * PMBCAST_MDV_DIVISOR;
+    frame.pmdata.pm25_mdv = (uint32_t)pmbcast_get_u16(p + 2) * PMBCAST_MDV_DIVISOR;
+    frame.pmdata.pm100_mdv = (uint32_t)pmbcast_get_u16(p + 4) * PMBCAST_MDV_DIVISOR;
+    p += 6;
+    frame.pmdata.reg1_pc = pmbcast_get_u16(p);
+    frame.pmdata.reg2_pc = pmbcast_get_u16(p + 2);
+    frame.pmdata.reg3_pc = pmbcast_get_u16(p + 4);
+    frame.pmdata.reg4_pc = pmbcast_get_u16(p + 6);
+    frame.pmdata.reg5_pc = pmbcast_get_u16(p + 8);
+    frame.pmdata.reg6_pc = pmbcast_get_u16(p + 10);
+    return true;
+}
+
+#endif // PMSENSE_BROADCAST_H
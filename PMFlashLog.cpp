@@ -0,0 +1,278 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PMFlashLog.h"
+
+#include "drivers/MbedCRC.h"
+
+int PMFlashLog::init()
+{
+    mbed::Timer recovery_timer;
+    recovery_timer.start();
+
+    if (_bd.init() != BD_ERROR_OK) {
+        return PMFLASHLOG_ERR_DEVICE;
+    }
+
+    _align = _bd.get_program_size();
+    if (_bd.get_read_size() > _align) _align = _bd.get_read_size();
+    _seg_size = _bd.get_erase_size();
+    _segments = _bd.size() / _seg_size;
+    _data_start = align(PMFLASHLOG_SEG_HEADER_SIZE);
+
+    if (_align > PMFLASHLOG_MAX_ALIGN || (_align & (_align - 1)) || _segments < 2 ||
+        _seg_size < _data_start + align(PMFLASHLOG_REC_HEADER_SIZE + PMFLASHLOG_MAX_RECORD)) {
+        return PMFLASHLOG_ERR_PARAM;
+    }
+
+    /* Only the segment headers are read to find the newest and oldest segments */
+    bool found = false;
+    uint32_t min_seq = 0;
+    for (uint32_t seg = 0; seg < _segments; seg++) {
+        seg_header_t hdr;
+        if (!read_seg_header(seg, hdr)) continue;
+        if (hdr.erase_count > _max_erase_count) _max_erase_count = hdr.erase_count;
+        if (!found || (int32_t)(hdr.seq - _tail_seq) > 0) {
+            _tail_seq = hdr.seq;
+            _tail_seg = seg;
+        }
+        if (!found || (int32_t)(hdr.seq - min_seq) < 0) {
+            min_seq = hdr.seq;
+        }
+        found = true;
+    }
+
+    if (!found) {
+        /* blank device */
+        int err = open_segment(0, 1);
+        if (err) return err;
+        _first_seq = 1;
+    }
+    else {
+        /* segments are written in turn, so the ring holds at most _segments consecutive sequence numbers */
+        _first_seq = ((_tail_seq - min_seq) >= _segments) ? (_tail_seq - _segments + 1) : min_seq;
+        scan_tail();
+    }
+
+    recovery_timer.stop();
+    _recovery_us = recovery_timer.elapsed_time().count();
+    return PMFLASHLOG_ERR_OK;
+}
+
+int PMFlashLog::deinit()
+{
+    return (_bd.deinit() == BD_ERROR_OK) ? PMFLASHLOG_ERR_OK : PMFLASHLOG_ERR_DEVICE;
+}
+
+int PMFlashLog::append(const void *data, uint16_t len)
+{
+    if (len > PMFLASHLOG_MAX_RECORD) {
+        return PMFLASHLOG_ERR_PARAM;
+    }
+
+    uint32_t size = align(PMFLASHLOG_REC_HEADER_SIZE + len);
+    if (_write_off + size > _seg_size) {
+        /* move on to the next segment in the ring */
+        int err = open_segment((_tail_seg + 1) % _segments, _tail_seq + 1);
+        if (err) return err;
+    }
+
+    memset(_buf, 0xFF, size);
+    _buf[0] = PMFLASHLOG_RECORD_MAGIC;
+    _buf[1] = 0x00;
+    _buf[2] = len;
+    _buf[3] = len >> 8;
+    memcpy(_buf + PMFLASHLOG_REC_HEADER_SIZE, data, len);
+    uint32_t crc = record_crc(_tail_seq, len, _buf + PMFLASHLOG_REC_HEADER_SIZE);
+    memcpy(_buf + 4, &crc, sizeof(crc));
+
+    if (_bd.program(_buf, seg_addr(_tail_seg) + _write_off, size) != BD_ERROR_OK) {
+        /* don't write over a partly programmed area */
+        _write_off = _seg_size;
+        return PMFLASHLOG_ERR_DEVICE;
+    }
+    _write_off += size;
+    _appends++;
+    return PMFLASHLOG_ERR_OK;
+}
+
+void PMFlashLog::seek_oldest(cursor_t &c) const
+{
+    c.seg_seq = _first_seq;
+    c.offset = _data_start;
+}
+
+void PMFlashLog::seek_recent(cursor_t &c, uint32_t records, uint16_t record_len) const
+{
+    /* the tail segment may hold none of them yet, so count it as well as the full segments */
+    uint32_t per_segment = (_seg_size - _data_start) / align(PMFLASHLOG_REC_HEADER_SIZE + record_len);
+    uint32_t back = per_segment ? (records + per_segment - 1) / per_segment : _segments;
+    c.seg_seq = ((_tail_seq - _first_seq) > back) ? (_tail_seq - back) : _first_seq;
+    c.offset = _data_start;
+}
+
+int PMFlashLog::read(cursor_t &c, void *data, uint16_t maxlen, uint16_t &len)
+{
+    while (true) {
+        if ((int32_t)(c.seg_seq - _tail_seq) > 0) {
+            return PMFLASHLOG_ERR_END;
+        }
+        if ((int32_t)(c.seg_seq - _first_seq) < 0) {
+            /* segment has been recycled since the cursor was set */
+            c.seg_seq = _first_seq;
+            c.offset = _data_start;
+        }
+
+        uint32_t limit = (c.seg_seq == _tail_seq) ? _write_off : _seg_size;
+        uint32_t size = 0;
+        if (c.offset < limit) {
+            int err = read_record(c.seg_seq, c.offset, limit, data, maxlen, len, size);
+            if (err == PMFLASHLOG_ERR_OK) {
+                c.offset += size;
+                return err;
+            }
+            if (err == PMFLASHLOG_ERR_DEVICE) {
+                return err;
+            }
+            /* otherwise erased space or a record torn before the segment was closed */
+        }
+
+        /* end of this segment */
+        if (c.seg_seq == _tail_seq) {
+            return PMFLASHLOG_ERR_END;
+        }
+        c.seg_seq++;
+        c.offset = _data_start;
+    }
+}
+
+bool PMFlashLog::read_seg_header(uint32_t seg, seg_header_t &hdr)
+{
+    if (_bd.read(_buf, seg_addr(seg), _data_start) != BD_ERROR_OK) {
+        return false;
+    }
+    memcpy(&hdr, _buf, sizeof(hdr));
+    if (hdr.magic != PMFLASHLOG_MAGIC) {
+        return false;
+    }
+
+    mbed::MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    uint32_t crc = 0;
+    ct.compute(&hdr, offsetof(seg_header_t, crc), &crc);
+    return (crc == hdr.crc);
+}
+
+int PMFlashLog::open_segment(uint32_t seg, uint32_t seq)
+{
+    /* carry the erase count forward so wear can be tracked per segment */
+    seg_header_t hdr;
+    uint32_t erase_count = read_seg_header(seg, hdr) ? hdr.erase_count + 1 : 1;
+
+    if (_bd.erase(seg_addr(seg), _seg_size) != BD_ERROR_OK) {
+        return PMFLASHLOG_ERR_DEVICE;
+    }
+
+    hdr.magic = PMFLASHLOG_MAGIC;
+    hdr.seq = seq;
+    hdr.erase_count = erase_count;
+    mbed::MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    ct.compute(&hdr, offsetof(seg_header_t, crc), &hdr.crc);
+
+    memset(_buf, 0xFF, _data_start);
+    memcpy(_buf, &hdr, sizeof(hdr));
+    if (_bd.program(_buf, seg_addr(seg), _data_start) != BD_ERROR_OK) {
+        return PMFLASHLOG_ERR_DEVICE;
+    }
+
+    _tail_seg = seg;
+    _tail_seq = seq;
+    _write_off = _data_start;
+    if (seq - _first_seq >= _segments) {
+        _first_seq = seq - _segments + 1;
+    }
+    if (erase_count > _max_erase_count) _max_erase_count = erase_count;
+    return PMFLASHLOG_ERR_OK;
+}
+
+void PMFlashLog::scan_tail()
+{
+    uint32_t offset = _data_start;
+    uint16_t len;
+    uint32_t size;
+    int err;
+
+    while ((err = read_record(_tail_seq, offset, _seg_size, nullptr, 0, len, size)) == PMFLASHLOG_ERR_OK) {
+        offset += size;
+    }
+
+    _write_off = offset;
+    if (err != PMFLASHLOG_ERR_END) {
+        /* torn or unreadable record: leave it alone and start a new segment on the next append */
+        _write_off = _seg_size;
+    }
+}
+
+int PMFlashLog::read_record(uint32_t seg_seq, uint32_t offset, uint32_t limit, void *data, uint16_t maxlen, uint16_t &len, uint32_t &size)
+{
+    uint32_t hdr_size = align(PMFLASHLOG_REC_HEADER_SIZE);
+    if (offset + hdr_size > limit) {
+        return PMFLASHLOG_ERR_END;
+    }
+
+    bd_addr_t addr = seg_addr(seg_for_seq(seg_seq)) + offset;
+    if (_bd.read(_buf, addr, hdr_size) != BD_ERROR_OK) {
+        return PMFLASHLOG_ERR_DEVICE;
+    }
+    if (_buf[0] != PMFLASHLOG_RECORD_MAGIC) {
+        /* erased space: end of the records in this segment */
+        return PMFLASHLOG_ERR_END;
+    }
+
+    len = _buf[2] | (_buf[3] << 8);
+    size = align(PMFLASHLOG_REC_HEADER_SIZE + len);
+    if (len > PMFLASHLOG_MAX_RECORD || offset + size > limit) {
+        return PMFLASHLOG_ERR_PARAM;
+    }
+    if (size > hdr_size && _bd.read(_buf + hdr_size, addr + hdr_size, size - hdr_size) != BD_ERROR_OK) {
+        return PMFLASHLOG_ERR_DEVICE;
+    }
+
+    uint32_t crc;
+    memcpy(&crc, _buf + 4, sizeof(crc));
+    if (crc != record_crc(seg_seq, len, _buf + PMFLASHLOG_REC_HEADER_SIZE)) {
+        return PMFLASHLOG_ERR_PARAM;
+    }
+
+    if (data) {
+        if (len > maxlen) return PMFLASHLOG_ERR_PARAM;
+        memcpy(data, _buf + PMFLASHLOG_REC_HEADER_SIZE, len);
+    }
+    return PMFLASHLOG_ERR_OK;
+}
+
+uint32_t PMFlashLog::record_crc(uint32_t seg_seq, uint16_t len, const uint8_t *payload)
+{
+    mbed::MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    uint32_t crc = 0;
+    ct.compute_partial_start(&crc);
+    ct.compute_partial(&seg_seq, sizeof(seg_seq), &crc);
+    ct.compute_partial(&len, sizeof(len), &crc);
+    ct.compute_partial(payload, len, &crc);
+    ct.compute_partial_stop(&crc);
+    return crc;
+}
@@ -0,0 +1,167 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_FLASH_LOG_H
+#define PMSENSE_FLASH_LOG_H
+
+#include "mbed.h"
+#include "blockdevice/BlockDevice.h"
+#include "platform/NonCopyable.h"
+
+#define PMFLASHLOG_MAGIC                (0x504D4C47u)        ///< "PMLG" segment header magic
+#define PMFLASHLOG_RECORD_MAGIC         (0xA5u)
+#define PMFLASHLOG_SEG_HEADER_SIZE      (16u)
+#define PMFLASHLOG_REC_HEADER_SIZE      (8u)
+#define PMFLASHLOG_MAX_RECORD           (64u)                ///< Largest payload accepted by append()
+#define PMFLASHLOG_MAX_ALIGN            (16u)                ///< Largest program size supported
+
+#define PMFLASHLOG_ERR_OK               (0)
+#define PMFLASHLOG_ERR_END              (-1)                 ///< No more records to read
+#define PMFLASHLOG_ERR_PARAM            (-2)                 ///< Record too large or device geometry unsupported
+#define PMFLASHLOG_ERR_DEVICE           (-3)                 ///< Block device read/program/erase failed
+
+/**
+ * Wear-levelled, append-only record log on an mbed BlockDevice.
+ *
+ * The device is split into erase-unit sized segments used as a ring. Each segment starts with
+ * a header holding a monotonic sequence number and the segment's erase count. Records are
+ * appended with a CRC-32 that also covers the segment sequence number, so data left behind by
+ * an earlier use of a segment can never be mistaken for a valid record. Segments are recycled
+ * strictly in turn so every segment sees the same number of erases.
+ *
+ * On init() only the segment headers are read to find the newest (tail) segment, and only that
+ * segment is scanned to find the write position. A record torn by a power cut fails its CRC and
+ * is ignored; the next append then starts a fresh segment.
+ *
+ * Works with any BlockDevice, e.g. FlashIAPBlockDevice on target or HeapBlockDevice on a host.
+ */
+class PMFlashLog : private mbed::NonCopyable<PMFlashLog>
+{
+public:
+    /** Read position used to walk the log from oldest to newest. */
+    typedef struct {
+        uint32_t seg_seq;
+        uint32_t offset;
+    } cursor_t;
+
+    PMFlashLog(mbed::BlockDevice &bd) : _bd(bd)
+    {
+    }
+
+    /** Initialise the block device and recover the log. Returns PMFLASHLOG_ERR_xxx. */
+    int init();
+
+    int deinit();
+
+    /** Append one record of up to PMFLASHLOG_MAX_RECORD bytes. Returns PMFLASHLOG_ERR_xxx. */
+    int append(const void *data, uint16_t len);
+
+    /** Position a cursor at the oldest record held. */
+    void seek_oldest(cursor_t &c) const;
+
+    /**
+     * Position a cursor so that reading on from it returns the newest records records of
+     * record_len bytes, or everything held if that is fewer (a segment closed early by a power
+     * cut may leave it a few short). Whole segments are skipped, so replaying the tail of the
+     * log after a reboot only reads the segments it needs.
+     */
+    void seek_recent(cursor_t &c, uint32_t records, uint16_t record_len) const;
+
+    /**
+     * Read the record at the cursor and advance it.
+     * Pass a buffer of PMFLASHLOG_MAX_RECORD bytes, otherwise larger records end the segment early.
+     *
+     * @returns PMFLASHLOG_ERR_OK, PMFLASHLOG_ERR_END once the newest record has been read,
+     * or another error.
+     */
+    int read(cursor_t &c, void *data, uint16_t maxlen, uint16_t &len);
+
+    /** Records appended since init(). */
+    uint32_t get_appends() const
+    {
+        return _appends;
+    }
+
+    /** Number of segments in the ring. */
+    uint32_t get_segments() const
+    {
+        return _segments;
+    }
+
+    /** Highest erase count seen on any segment. */
+    uint32_t get_max_erase_count() const
+    {
+        return _max_erase_count;
+    }
+
+    /** Time taken by the last recovery in init(). */
+    uint32_t get_recovery_time_us() const
+    {
+        return _recovery_us;
+    }
+
+protected:
+    typedef struct {
+        uint32_t magic;
+        uint32_t seq;
+        uint32_t erase_count;
+        uint32_t crc;
+    } seg_header_t;
+
+    bool read_seg_header(uint32_t seg, seg_header_t &hdr);
+    int open_segment(uint32_t seg, uint32_t seq);
+    void scan_tail();
+    int read_record(uint32_t seg_seq, uint32_t offset, uint32_t limit, void *data, uint16_t maxlen, uint16_t &len, uint32_t &size);
+    uint32_t record_crc(uint32_t seg_seq, uint16_t len, const uint8_t *payload);
+
+    uint32_t align(uint32_t size) const
+    {
+        return (size + _align - 1) & ~(_align - 1);
+    }
+
+    bd_addr_t seg_addr(uint32_t seg) const
+    {
+        return (bd_addr_t)seg * _seg_size;
+    }
+
+    uint32_t seg_for_seq(uint32_t seq) const
+    {
+        return (_tail_seg + _segments - ((_tail_seq - seq) % _segments)) % _segments;
+    }
+
+protected:
+    mbed::BlockDevice &_bd;
+
+    uint32_t _align = 1;                // program/read alignment
+    uint32_t _seg_size = 0;
+    uint32_t _segments = 0;
+    uint32_t _data_start = 0;           // first record offset within a segment
+
+    uint32_t _tail_seg = 0;
+    uint32_t _tail_seq = 0;
+    uint32_t _first_seq = 0;            // oldest segment still holding records
+    uint32_t _write_off = 0;
+
+    uint32_t _appends = 0;
+    uint32_t _max_erase_count = 0;
+    uint32_t _recovery_us = 0;
+
+    uint8_t _buf[PMFLASHLOG_REC_HEADER_SIZE + PMFLASHLOG_MAX_RECORD + PMFLASHLOG_MAX_ALIGN];
+};
+
+#endif // PMSENSE_FLASH_LOG_H
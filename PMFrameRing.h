@@ -0,0 +1,99 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_FRAME_RING_H
+#define PMSENSE_FRAME_RING_H
+
+#include <stdint.h>
+
+#include "platform/mbed_atomic.h"
+#include "platform/NonCopyable.h"
+
+/**
+ * Wait-free single producer, single consumer ring for handing frames between threads.
+ *
+ * The producer only writes the head and the consumer only writes the tail, each published with
+ * release ordering after the slot has been written or read, so neither side ever takes a lock or
+ * waits for the other. When the consumer is N items behind, push() fails and the item is counted
+ * as dropped rather than overwriting one the consumer may be reading.
+ *
+ * @tparam T Item type, copied in and out.
+ * @tparam N Capacity, a power of two.
+ */
+template <typename T, uint32_t N>
+class PMFrameRing : private mbed::NonCopyable<PMFrameRing<T, N> >
+{
+    static_assert((N & (N - 1)) == 0, "PMFrameRing capacity must be a power of two");
+
+public:
+    /** Producer side. Returns false if the ring is full. */
+    bool push(const T &item)
+    {
+        uint32_t head = _head;
+        uint32_t tail = core_util_atomic_load_explicit_u32(&_tail, mbed_memory_order_acquire);
+        if (head - tail >= N) {
+            core_util_atomic_store_u32(&_dropped, _dropped + 1);
+            return false;
+        }
+        _items[head & (N - 1)] = item;
+        core_util_atomic_store_explicit_u32(&_head, head + 1, mbed_memory_order_release);
+        if (head + 1 - tail > _high_water) {
+            core_util_atomic_store_u32(&_high_water, head + 1 - tail);
+        }
+        return true;
+    }
+
+    /** Consumer side. Returns false if the ring is empty. */
+    bool pop(T &item)
+    {
+        uint32_t tail = _tail;
+        uint32_t head = core_util_atomic_load_explicit_u32(&_head, mbed_memory_order_acquire);
+        if (head == tail) {
+            return false;
+        }
+        item = _items[tail & (N - 1)];
+        core_util_atomic_store_explicit_u32(&_tail, tail + 1, mbed_memory_order_release);
+        return true;
+    }
+
+    /** Items refused because the ring was full. */
+    uint32_t get_dropped() const
+    {
+        return core_util_atomic_load_u32(&_dropped);
+    }
+
+    /** Most items ever waiting at once. */
+    uint32_t get_high_water() const
+    {
+        return core_util_atomic_load_u32(&_high_water);
+    }
+
+    static constexpr uint32_t capacity()
+    {
+        return N;
+    }
+
+protected:
+    T _items[N];
+    volatile uint32_t _head = 0;            // written by the producer only
+    volatile uint32_t _tail = 0;            // written by the consumer only
+    volatile uint32_t _dropped = 0;
+    volatile uint32_t _high_water = 0;
+};
+
+#endif // PMSENSE_FRAME_RING_H
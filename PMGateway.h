@@ -0,0 +1,1002 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_GATEWAY_H
+#define PMSENSE_GATEWAY_H
+
+#include "mbed.h"
+
+#include "ble_app2.h"
+#include "PMHistory.h"
+#include "PMBroadcast.h"
+#include "PMPollScheduler.h"
+#include "PMHistoryTransfer.h"
+
+#ifdef MBED_CONF_APP_GATEWAY_HANDLE_CACHE
+#define PMGW_HANDLE_CACHE               (MBED_CONF_APP_GATEWAY_HANDLE_CACHE)
+#else
+#define PMGW_HANDLE_CACHE               (0)
+#endif
+
+#if PMGW_HANDLE_CACHE
+#include "PMHandleCache.h"
+#endif
+
+#ifdef MBED_CONF_APP_GATEWAY_MAX_NODES
+#define PMGW_MAX_NODES                  (MBED_CONF_APP_GATEWAY_MAX_NODES)
+#else
+#define PMGW_MAX_NODES                  (32u)
+#endif
+
+// Links the controller can hold, shared with centrals connected to this node
+#ifdef MBED_CONF_CORDIO_MAX_CONNECTIONS
+#define PMGW_MAX_CONNECTIONS            (MBED_CONF_CORDIO_MAX_CONNECTIONS)
+#else
+#define PMGW_MAX_CONNECTIONS            (3u)
+#endif
+
+#define PMGW_FEED_SAMPLES               (256u)               ///< Merged samples kept for feed consumers
+#define PMGW_RETRY_MIN_S                (5u)                 ///< Wait before reconnecting to a node
+#define PMGW_RETRY_MAX_S                (300u)               ///< Longest backoff after repeated failures
+#define PMGW_CONN_INTERVAL_MIN          (40u)                ///< 50 ms, in 1.25 ms units
+#define PMGW_CONN_INTERVAL_MAX          (64u)                ///< 80 ms, leaves room for other links
+#define PMGW_SUPERVISION_TIMEOUT        (400u)               ///< 4 s, in 10 ms units
+#define PMGW_OPEN_SCAN_EVERY            (6u)                 ///< With the accept list, every Nth scan looks for new nodes
+#define PMGW_ACCEPT_LIST_SIZE           (8u)                 ///< Largest accept list built from the node table
+
+// Node states
+#define PMGW_NODE_IDLE                  (0u)                 ///< Seen advertising, not connected
+#define PMGW_NODE_CONNECTING            (1u)
+#define PMGW_NODE_CONNECTED             (2u)                 ///< Waiting its turn for discovery
+#define PMGW_NODE_DISCOVERING           (3u)
+#define PMGW_NODE_SUBSCRIBING           (4u)
+#define PMGW_NODE_STREAMING             (5u)
+#define PMGW_NODE_READY                 (6u)                 ///< Poll mode: subscribed, waiting for the link to pull on
+#define PMGW_NODE_PULLING               (7u)
+#define PMGW_NODE_DONE                  (8u)                 ///< Poll mode: pull complete, disconnecting
+#define PMGW_NODE_VERIFYING             (9u)                 ///< Checking cached handles against the Database Hash
+
+// Poll mode
+#define PMGW_POLL_LINKS                 (2u)                 ///< One link pulling while the next is set up
+#define PMGW_POLL_SEEN_S                (60u)                ///< Only poll nodes heard advertising this recently
+
+// Sample sources
+#define PMGW_SOURCE_NOTIFY              (0u)                 ///< PM Count notification on a connection
+#define PMGW_SOURCE_BROADCAST           (1u)                 ///< Broadcast frame in an advertising report
+#define PMGW_SOURCE_HISTORY             (2u)                 ///< Per-second sample from a history pull
+
+static const std::chrono::milliseconds PMGW_CONNECT_TIMEOUT = std::chrono::seconds(5);
+static const std::chrono::milliseconds PMGW_POLL_PERIOD = std::chrono::seconds(1);
+
+/**! One entry of the gateway's merged feed **/
+typedef struct {
+    uint32_t timestamp;             ///< Arrival at the gateway in seconds since boot
+    uint32_t node_timestamp;        ///< Sample time on the node's clock for history samples, otherwise 0
+    uint8_t node;                   ///< Index in the gateway node table
+    uint8_t source;                 ///< PMGW_SOURCE_NOTIFY, PMGW_SOURCE_BROADCAST or PMGW_SOURCE_HISTORY
+    uint16_t values[2];             ///< 0.5um to 2.5um counts, counts above 2.5um
+} PMGatewaySample;
+
+/**
+ * Gateway role: collects PM Counts from many PMsense nodes at once.
+ *
+ * The gateway scans for nodes advertising the PMsense service UUID and keeps a table of those
+ * it has seen. It connects to them one at a time until the controller's links are in use,
+ * discovers the PM Count characteristic and its CCCD, and subscribes. Discovery is serialised,
+ * as only one characteristic is tracked at a time. Notifications from every node, and broadcast
+ * frames from nodes it is not connected to, are merged into one timestamped feed.
+ *
+ * Failed or lost nodes are retried with exponential backoff, so an unreachable node does not
+ * hold the connection slot the others are waiting for. The node keeps its own peripheral role:
+ * advertising and the session table work as in BLEApp.
+ *
+ * With more nodes than links, enable_polling() switches to visiting nodes in turn instead:
+ * connect, pull the per-second samples recorded since the last visit with the history transfer
+ * service, and disconnect. PMPollScheduler picks the next node by backlog and staleness. The
+ * next node is connected and subscribed while the current pull drains, so its pull starts as
+ * soon as the link is free.
+ *
+ * With the handle cache enabled, the handles found by discovery are stored in KVStore under the
+ * node's address, with its GATT Database Hash. On reconnecting, the gateway reads the hash and,
+ * if it is unchanged, writes the CCCD straight away instead of discovering again. The time from
+ * connecting to the first notification is kept for cached and discovered links alike.
+ */
+class PMGateway : public BLEApp
+{
+public:
+    typedef struct {
+        bool used;
+        uint8_t state;
+        ble::peer_address_type_t address_type;
+        ble::address_t address;
+        ble::connection_handle_t handle;
+        GattAttribute::Handle_t value_handle;   ///< PM Count value
+        GattAttribute::Handle_t cccd_handle;
+        int8_t rssi;
+        uint32_t last_seen;                     ///< Last advertising report, seconds since boot
+        uint32_t retry_at;                      ///< Earliest time to connect again
+        uint16_t retry_s;                       ///< Current backoff
+        uint16_t last_bcast_seq;
+        bool has_bcast;
+        uint32_t samples;
+        uint32_t connects;
+        uint32_t failures;
+
+        // poll mode
+        GattAttribute::Handle_t control_handle; ///< History Control Point
+        uint32_t series_id;                     ///< Node's series (boot) the pulled samples came from
+        uint32_t next_seq;                      ///< Next per-second sample to pull from that series
+        bool pulled;                            ///< series_id and next_seq are valid
+        uint32_t pull_samples;                  ///< Samples received in the current pull
+
+        uint64_t connected_ms;                  ///< When the current link came up
+        bool awaiting_data;                     ///< No notification yet on the current link
+        bool cached;                            ///< Handles on the current link came from the cache
+#if PMGW_HANDLE_CACHE
+        PMHandleCacheEntry handles;             ///< Being discovered, or loaded from the cache
+#endif
+    } node_t;
+
+    /**
+     * Start collecting from nodes. Call once BLE is initialised.
+     *
+     * @param[in] service_uuid PMsense service UUID the nodes advertise.
+     * @param[in] count_uuid PM Count characteristic to subscribe to.
+     */
+    void start_gateway(const char *service_uuid, const char *count_uuid)
+    {
+        _gw_service = UUID(service_uuid);
+        _gw_count = UUID(count_uuid);
+        _scan_filter.clear_services();
+        _scan_filter.add_service(_gw_service);
+
+        _ble.gattClient().onServiceDiscoveryTermination(makeFunctionPointer(this, &PMGateway::on_discovery_termination));
+        _ble.gattClient().onDataWritten(makeFunctionPointer(this, &PMGateway::on_client_write));
+        _ble.gattClient().onHVX(makeFunctionPointer(this, &PMGateway::on_hvx));
+#if PMGW_HANDLE_CACHE
+        _ble.gattClient().onDataRead(makeFunctionPointer(this, &PMGateway::on_client_read));
+#endif
+
+        _gw_enabled = true;
+        printf("Gateway started, up to %u links\r\n", PMGW_MAX_CONNECTIONS);
+        post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
+    }
+
+    /**
+     * Collect by visiting nodes in turn and pulling their history, rather than staying subscribed.
+     * Call after start_gateway().
+     *
+     * @param[in] control_uuid History Control Point characteristic.
+     * @param[in] data_uuid History Data characteristic.
+     */
+    void enable_polling(const char *control_uuid, const char *data_uuid)
+    {
+        _poll_control = UUID(control_uuid);
+        _poll_data = UUID(data_uuid);
+        _poll_mode = true;
+        if (!_poll_tick_id) {
+            _poll_tick_id = post_every(PMQPROBE_SITE_TIMER, PMGW_POLL_PERIOD, [this]() { poll_tick(); });
+        }
+        printf("Gateway polling, %u links\r\n", PMGW_POLL_LINKS);
+    }
+
+#if BLE_FEATURE_WHITELIST
+    /**
+     * Let the controller drop reports from devices that are not known nodes.
+     *
+     * Scans then use an accept list built from the node table, so the host only sees reports
+     * from nodes; every PMGW_OPEN_SCAN_EVERY scans is left open to find new ones. Not used while
+     * the table holds more nodes than the controller's accept list.
+     */
+    void enable_accept_list(bool enable = true)
+    {
+        _gw_accept_list = enable;
+    }
+#endif
+
+    /** Poll scheduler, for its collection latency and radio utilisation report. */
+    PMPollScheduler<PMGW_MAX_NODES> &poll_scheduler()
+    {
+        return _poll;
+    }
+
+    /** Set a callback for each sample added to the merged feed. */
+    void on_gateway_sample(mbed::Callback<void(const PMGatewaySample &sample)> cb)
+    {
+        _gw_sample_cb = cb;
+    }
+
+    /** Merged feed; consumers keep their own cursor into it. */
+    const HistoryBuffer<PMGatewaySample, PMGW_FEED_SAMPLES> &gateway_feed() const
+    {
+        return _gw_feed;
+    }
+
+    const node_t *get_node(uint8_t index) const
+    {
+        return (index < PMGW_MAX_NODES && _gw_nodes[index].used) ? &_gw_nodes[index] : nullptr;
+    }
+
+    /** Links held to nodes, including one being set up. */
+    uint8_t get_node_connections() const
+    {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < PMGW_MAX_NODES; i++) {
+            if (_gw_nodes[i].used && _gw_nodes[i].state != PMGW_NODE_IDLE) count++;
+        }
+        return count;
+    }
+
+    /** Print the node table. */
+    void print_nodes() const
+    {
+        printf("Gateway nodes (%u links):\r\n", get_node_connections());
+        for (uint8_t i = 0; i < PMGW_MAX_NODES; i++) {
+            const node_t &node = _gw_nodes[i];
+            if (!node.used) continue;
+            printf("  %2u %02x:%02x:%02x:%02x:%02x:%02x %-11s rssi %d, %lu samples, %lu connects, %lu failures\r\n", i,
+                   node.address[5], node.address[4], node.address[3], node.address[2], node.address[1], node.address[0],
+                   state_name(node.state), node.rssi, node.samples, node.connects, node.failures);
+        }
+    }
+
+    /** Print the time from connecting to the first notification, with and without cached handles. */
+    void print_connect_report() const
+    {
+        for (uint8_t cached = 0; cached < 2; cached++) {
+            const first_data_t &stats = _gw_first_data[cached];
+            if (!stats.links) continue;
+            printf("Gateway connect to first data (%s): mean %lu ms, max %lu ms over %lu links\r\n",
+                   cached ? "cached" : "discovered", (uint32_t)(stats.total_ms / stats.links), stats.max_ms, stats.links);
+        }
+#if PMGW_HANDLE_CACHE
+        printf("Gateway handle cache: %lu hits, %lu misses, %lu saved, %lu invalidated\r\n", _gw_cache.get_loads(),
+               _gw_cache.get_misses(), _gw_cache.get_saves(), _gw_cache.get_invalidations());
+#endif
+    }
+
+protected:
+    static const char *state_name(uint8_t state)
+    {
+        static const char *names[] = {"idle", "connecting", "connected", "discovering", "subscribing", "streaming",
+                                      "ready", "pulling", "done", "verifying"};
+        return (state <= PMGW_NODE_VERIFYING) ? names[state] : "?";
+    }
+
+    static uint32_t now_s()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(Kernel::Clock::now().time_since_epoch()).count();
+    }
+
+    static uint64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(Kernel::Clock::now().time_since_epoch()).count();
+    }
+
+    /** Advertise as a peripheral if named, and scan for nodes while gateway mode is on. */
+    void start_activity() override
+    {
+        if (!_gw_enabled) {
+            BLEApp::start_activity();
+            return;
+        }
+        if (!_ble.hasInitialized()) {
+            return;
+        }
+        if (_advertising_name) {
+            start_advertising();
+        }
+        start_gateway_scan();
+    }
+
+    /** Scan actively, so scan responses carrying the service UUID in broadcast mode are seen. */
+    void start_gateway_scan()
+    {
+        if (_is_scanning || _gw_connecting >= 0) {
+            return;
+        }
+
+        ble::ScanParameters scan_params;
+        scan_params.set1mPhyConfiguration(ble::scan_interval_t(160), ble::scan_window_t(80), true);
+#if BLE_FEATURE_WHITELIST
+        bool open_scan = (++_gw_scans % PMGW_OPEN_SCAN_EVERY) == 0;
+        if (_gw_accept_list && !open_scan && load_accept_list()) {
+            scan_params.setFilter(ble::scanning_filter_policy_t::FILTER_ADVERTISING);
+        }
+#endif
+        _ble.gap().setScanParameters(scan_params);
+
+        ble_error_t error = _ble.gap().startScan(ble::scan_duration_t(ble::second_t(10)));
+        if (error) {
+            print_error(error, "Gateway Gap::startScan() failed");
+            return;
+        }
+        _is_scanning = true;
+    }
+
+    void onAdvertisingReport(const ble::AdvertisingReportEvent &event) override
+    {
+        if (!_gw_enabled) {
+            BLEApp::onAdvertisingReport(event);
+            return;
+        }
+
+        /* unchanged reports are dropped until the hold time passes; new broadcast frames get through */
+        if (_scan_filter.is_duplicate(event.getPeerAddressType(), event.getPeerAddress(),
+                                      event.getType().scan_response(), event.getPayload(), get_scan_time_ms())) {
+            return;
+        }
+
+        PMScanFilter<>::match_t match = _scan_filter.match(event.getPayload());
+        PMBroadcastFrame frame;
+        bool has_frame = match.manufacturer && pmbcast_decode(match.manufacturer, match.manufacturer_len, frame);
+        if (!match.service && !has_frame) {
+            /* not a PMsense node */
+            return;
+        }
+
+        int8_t index = find_node(event.getPeerAddressType(), event.getPeerAddress());
+        if (index < 0) {
+            index = add_node(event.getPeerAddressType(), event.getPeerAddress());
+            if (index < 0) return;
+        }
+        node_t &node = _gw_nodes[index];
+        node.rssi = event.getRssi();
+        node.last_seen = now_s();
+        _poll.on_seen(index, node.last_seen, has_frame, has_frame ? frame.seq : 0);
+
+        if (has_frame && node.state != PMGW_NODE_STREAMING && (!node.has_bcast || frame.seq != node.last_bcast_seq)) {
+            /* nodes we are not subscribed to still reach the feed through their broadcasts */
+            node.has_bcast = true;
+            node.last_bcast_seq = frame.seq;
+            uint16_t values[2];
+            uint32_t pm05_cnt = (uint32_t)frame.pmdata.reg2_pc + frame.pmdata.reg3_pc;
+            uint32_t pm25_cnt = (uint32_t)frame.pmdata.reg4_pc + frame.pmdata.reg5_pc + frame.pmdata.reg6_pc;
+            values[0] = (pm05_cnt > UINT16_MAX) ? UINT16_MAX : pm05_cnt;
+            values[1] = (pm25_cnt > UINT16_MAX) ? UINT16_MAX : pm25_cnt;
+            add_sample(index, PMGW_SOURCE_BROADCAST, values);
+        }
+
+        if (!_poll_mode && event.getType().connectable() && node.state == PMGW_NODE_IDLE && node.last_seen >= node.retry_at) {
+            connect_node(index);
+        }
+    }
+
+#if BLE_FEATURE_WHITELIST
+    /** Put the known nodes on the controller's accept list. Returns false if they do not all fit. */
+    bool load_accept_list()
+    {
+        BLEProtocol::Address_t addresses[PMGW_ACCEPT_LIST_SIZE];
+        ble::whitelist_t accept_list;
+        accept_list.addresses = addresses;
+        accept_list.size = 0;
+        accept_list.capacity = _ble.gap().getMaxWhitelistSize();
+        if (accept_list.capacity > PMGW_ACCEPT_LIST_SIZE) accept_list.capacity = PMGW_ACCEPT_LIST_SIZE;
+
+        for (uint8_t i = 0; i < PMGW_MAX_NODES; i++) {
+            const node_t &node = _gw_nodes[i];
+            if (!node.used) continue;
+            if (accept_list.size == accept_list.capacity) return false;
+            BLEProtocol::Address_t &entry = addresses[accept_list.size++];
+            entry.type = (node.address_type == ble::peer_address_type_t::PUBLIC) ?
+                         BLEProtocol::AddressType::PUBLIC : BLEProtocol::AddressType::RANDOM_STATIC;
+            memcpy(entry.address, node.address.data(), sizeof(entry.address));
+        }
+        if (!accept_list.size) return false;
+
+        ble_error_t error = _ble.gap().setWhitelist(accept_list);
+        if (error) {
+            print_error(error, "Gateway Gap::setWhitelist() failed");
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    int8_t find_node(const ble::peer_address_type_t &type, const ble::address_t &address) const
+    {
+        for (uint8_t i = 0; i < PMGW_MAX_NODES; i++) {
+            if (_gw_nodes[i].used && _gw_nodes[i].address_type == type && _gw_nodes[i].address == address) return i;
+        }
+        return -1;
+    }
+
+    int8_t find_node(ble::connection_handle_t connHandle) const
+    {
+        for (uint8_t i = 0; i < PMGW_MAX_NODES; i++) {
+            if (_gw_nodes[i].used && _gw_nodes[i].state != PMGW_NODE_IDLE &&
+                _gw_nodes[i].state != PMGW_NODE_CONNECTING && _gw_nodes[i].handle == connHandle) return i;
+        }
+        return -1;
+    }
+
+    /** Add a node, replacing the idle node heard from least recently if the table is full. */
+    int8_t add_node(const ble::peer_address_type_t &type, const ble::address_t &address)
+    {
+        int8_t slot = -1;
+        for (uint8_t i = 0; i < PMGW_MAX_NODES; i++) {
+            if (!_gw_nodes[i].used) {
+                slot = i;
+                break;
+            }
+            if (_gw_nodes[i].state == PMGW_NODE_IDLE && (slot < 0 || _gw_nodes[i].last_seen < _gw_nodes[slot].last_seen)) {
+                slot = i;
+            }
+        }
+        if (slot < 0) return -1;
+
+        _gw_nodes[slot] = node_t();
+        _poll.reset(slot, now_s());
+        _gw_nodes[slot].used = true;
+        _gw_nodes[slot].address_type = type;
+        _gw_nodes[slot].address = address;
+        return slot;
+    }
+
+    /** Connect to a node if a link is free and no other connection is being set up. */
+    void connect_node(uint8_t index)
+    {
+        if (_gw_connecting >= 0) return;
+        if (get_node_connections() + get_session_count() >= PMGW_MAX_CONNECTIONS) return;
+
+        /* initiating and scanning are not run together */
+        _ble.gap().stopScan();
+        _is_scanning = false;
+
+        node_t &node = _gw_nodes[index];
+        ble::ConnectionParameters connection_params;
+        connection_params.setConnectionParameters(
+            ble::conn_interval_t(PMGW_CONN_INTERVAL_MIN),
+            ble::conn_interval_t(PMGW_CONN_INTERVAL_MAX),
+            ble::slave_latency_t(0),
+            ble::supervision_timeout_t(PMGW_SUPERVISION_TIMEOUT)
+        );
+
+        ble_error_t error = _ble.gap().connect(node.address_type, node.address, connection_params);
+        if (error) {
+            print_error(error, "Gateway Gap::connect() failed");
+            node_failed(node);
+            post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
+            return;
+        }
+
+        node.state = PMGW_NODE_CONNECTING;
+        _gw_connecting = index;
+        _poll.on_link(true, now_ms());
+        _gw_connect_timeout_id = post_in(PMQPROBE_SITE_TIMER, PMGW_CONNECT_TIMEOUT, [this]() {
+            _gw_connect_timeout_id = 0;
+            /* completes with an error status */
+            _ble.gap().cancelConnect();
+        });
+    }
+
+    void onConnectionComplete(const ble::ConnectionCompleteEvent &event) override
+    {
+        bool ours = (_gw_connecting >= 0) &&
+                    (event.getStatus() != BLE_ERROR_NONE || event.getOwnRole() == ble::connection_role_t::CENTRAL);
+        if (!ours) {
+            BLEApp::onConnectionComplete(event);
+            return;
+        }
+
+        uint8_t index = _gw_connecting;
+        node_t &node = _gw_nodes[index];
+        _gw_connecting = -1;
+        if (_gw_connect_timeout_id) {
+            _event_queue.cancel(_gw_connect_timeout_id);
+            _gw_connect_timeout_id = 0;
+        }
+        post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
+
+        if (event.getStatus() != BLE_ERROR_NONE) {
+            print_error(event.getStatus(), "Gateway connection failed");
+            _poll.on_link(false, now_ms());
+            node_failed(node);
+            return;
+        }
+
+        node.handle = event.getConnectionHandle();
+        node.state = PMGW_NODE_CONNECTED;
+        node.connects++;
+        node.connected_ms = now_ms();
+        node.awaiting_data = true;
+        node.cached = false;
+        printf("Gateway connected to node %u, handle %u\r\n", index, node.handle);
+#if PMGW_HANDLE_CACHE
+        if (use_cached_handles(node)) return;
+#endif
+        discover_next();
+    }
+
+    void onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) override
+    {
+        int8_t index = find_node(event.getConnectionHandle());
+        if (index < 0) {
+            BLEApp::onDisconnectionComplete(event);
+            return;
+        }
+
+        node_t &node = _gw_nodes[index];
+        _poll.on_link(false, now_ms());
+        if (node.state == PMGW_NODE_DONE) {
+            node.state = PMGW_NODE_IDLE;
+        }
+        else if (node.state == PMGW_NODE_STREAMING) {
+            printf("Gateway lost node %u\r\n", index);
+            node.state = PMGW_NODE_IDLE;
+            node.retry_at = now_s() + PMGW_RETRY_MIN_S;
+        }
+        else {
+            printf("Gateway lost node %u (%s)\r\n", index, state_name(node.state));
+            if (_poll_mode) _poll.on_failed(index);
+            node_failed(node);
+        }
+
+        if (_gw_discovering == index) {
+            _gw_discovering = -1;
+            discover_next();
+        }
+        if (_poll_pulling == index) {
+            /* samples received so far are kept; the next pull resumes after them */
+            _poll_pulling = -1;
+            start_next_pull();
+        }
+        post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
+    }
+
+    /** Back off before trying a node again. */
+    void node_failed(node_t &node)
+    {
+        node.state = PMGW_NODE_IDLE;
+        node.failures++;
+        node.retry_s = (node.retry_s < PMGW_RETRY_MIN_S) ? PMGW_RETRY_MIN_S : node.retry_s * 2;
+        if (node.retry_s > PMGW_RETRY_MAX_S) node.retry_s = PMGW_RETRY_MAX_S;
+        node.retry_at = now_s() + node.retry_s;
+    }
+
+    /** Start discovery on the next connected node, one at a time. */
+    void discover_next()
+    {
+        if (_gw_discovering >= 0) return;
+
+        for (uint8_t i = 0; i < PMGW_MAX_NODES; i++) {
+            node_t &node = _gw_nodes[i];
+            if (!node.used || node.state != PMGW_NODE_CONNECTED) continue;
+
+            _gw_discovering = i;
+            _gw_char_found = false;
+            node.state = PMGW_NODE_DISCOVERING;
+            node.control_handle = 0;
+#if PMGW_HANDLE_CACHE
+            /* discover the whole table once, so every handle the gateway may use can be cached */
+            PMHandleCache::begin(node.handles, node.address_type, node.address);
+            ble_error_t error = _ble.gattClient().launchServiceDiscovery(
+                node.handle,
+                nullptr,
+                makeFunctionPointer(this, &PMGateway::on_characteristic)
+            );
+#else
+            /* polling needs both history characteristics, so discover them all */
+            ble_error_t error = _ble.gattClient().launchServiceDiscovery(
+                node.handle,
+                nullptr,
+                makeFunctionPointer(this, &PMGateway::on_characteristic),
+                _gw_service,
+                _poll_mode ? UUID(UUID::ShortUUIDBytes_t(BLE_UUID_UNKNOWN)) : _gw_count
+            );
+#endif
+            if (error) {
+                print_error(error, "Gateway service discovery failed");
+                _gw_discovering = -1;
+                _ble.gap().disconnect(node.handle, ble::local_disconnection_reason_t::USER_TERMINATION);
+                continue;
+            }
+            return;
+        }
+    }
+
+    void on_characteristic(const DiscoveredCharacteristic *characteristic)
+    {
+        if (_gw_discovering < 0 || characteristic->getConnectionHandle() != _gw_nodes[_gw_discovering].handle) return;
+#if PMGW_HANDLE_CACHE
+        remember_handle(_gw_nodes[_gw_discovering].handles, characteristic->getUUID(), characteristic->getValueHandle());
+#endif
+        const UUID &wanted = _poll_mode ? _poll_data : _gw_count;
+        if (characteristic->getUUID() == wanted && characteristic->getProperties().notify()) {
+            _gw_char = *characteristic;
+            _gw_char_found = true;
+        }
+        else if (_poll_mode && characteristic->getUUID() == _poll_control) {
+            _gw_nodes[_gw_discovering].control_handle = characteristic->getValueHandle();
+        }
+    }
+
+    void on_discovery_termination(ble::connection_handle_t connHandle)
+    {
+        if (_gw_discovering < 0 || connHandle != _gw_nodes[_gw_discovering].handle) return;
+        node_t &node = _gw_nodes[_gw_discovering];
+
+        ble_error_t error = BLE_ERROR_NOT_FOUND;
+        if (_gw_char_found && (!_poll_mode || node.control_handle)) {
+            node.value_handle = _gw_char.getValueHandle();
+            node.cccd_handle = 0;
+            error = _ble.gattClient().discoverCharacteristicDescriptors(
+                _gw_char,
+                makeFunctionPointer(this, &PMGateway::on_descriptor),
+                makeFunctionPointer(this, &PMGateway::on_descriptor_termination)
+            );
+        }
+        if (error) {
+            printf("Gateway node %u has no %s characteristic\r\n", _gw_discovering, _poll_mode ? "history" : "PM Count");
+            _gw_discovering = -1;
+            _ble.gap().disconnect(node.handle, ble::local_disconnection_reason_t::USER_TERMINATION);
+            discover_next();
+        }
+    }
+
+    void on_descriptor(const CharacteristicDescriptorDiscovery::DiscoveryCallbackParams_t *params)
+    {
+        if (_gw_discovering < 0) return;
+        if (params->descriptor.getUUID() == UUID(BLE_UUID_DESCRIPTOR_CLIENT_CHAR_CONFIG)) {
+            _gw_nodes[_gw_discovering].cccd_handle = params->descriptor.getAttributeHandle();
+            _ble.gattClient().terminateCharacteristicDescriptorDiscovery(params->characteristic);
+        }
+    }
+
+    /** Subscribe once the CCCD is known, then let the next node discover. */
+    void on_descriptor_termination(const CharacteristicDescriptorDiscovery::TerminationCallbackParams_t *params)
+    {
+        if (_gw_discovering < 0) return;
+        node_t &node = _gw_nodes[_gw_discovering];
+        _gw_discovering = -1;
+
+#if PMGW_HANDLE_CACHE
+        if (node.cccd_handle) {
+            PMHandleCacheEntry &entry = node.handles;
+            if (_poll_mode) entry.data_cccd = node.cccd_handle;
+            else entry.count_cccd = node.cccd_handle;
+            if (entry.db_hash_handle && !_ble.gattClient().read(node.handle, entry.db_hash_handle, 0)) {
+                /* saved and subscribed once the hash is read */
+                discover_next();
+                return;
+            }
+            entry.db_hash_handle = 0;
+            _gw_cache.save(entry);
+        }
+#endif
+        subscribe(node);
+        discover_next();
+    }
+
+    /** Enable notifications on the node's data characteristic. */
+    bool subscribe(node_t &node)
+    {
+        ble_error_t error = BLE_ERROR_NOT_FOUND;
+        if (node.cccd_handle) {
+            uint8_t cccd[2] = {BLE_HVX_NOTIFICATION, 0};
+            error = _ble.gattClient().write(GattClient::GATT_OP_WRITE_REQ, node.handle, node.cccd_handle, sizeof(cccd), cccd);
+        }
+        if (error) {
+            print_error(error, "Gateway subscription failed");
+            _ble.gap().disconnect(node.handle, ble::local_disconnection_reason_t::USER_TERMINATION);
+            return false;
+        }
+        node.state = PMGW_NODE_SUBSCRIBING;
+        return true;
+    }
+
+#if PMGW_HANDLE_CACHE
+    /** Keep the handles the gateway uses, or may use, from a discovered characteristic. */
+    void remember_handle(PMHandleCacheEntry &entry, const UUID &uuid, GattAttribute::Handle_t handle)
+    {
+        if (uuid == _gw_count) entry.count_value = handle;
+        else if (uuid == _poll_control) entry.control_value = handle;
+        else if (uuid == _poll_data) entry.data_value = handle;
+        else if (uuid == UUID(PMHC_DB_HASH_UUID)) entry.db_hash_handle = handle;
+        else if (uuid == UUID(GattCharacteristic::UUID_MODEL_NUMBER_STRING_CHAR)) entry.dis_model = handle;
+        else if (uuid == UUID(GattCharacteristic::UUID_FIRMWARE_REVISION_STRING_CHAR)) entry.dis_firmware = handle;
+    }
+
+    /**
+     * Use the node's cached handles on a new link instead of discovering.
+     *
+     * @returns false if the node has to be discovered.
+     */
+    bool use_cached_handles(node_t &node)
+    {
+        PMHandleCacheEntry &entry = node.handles;
+        if (!_gw_cache.load(node.address_type, node.address, entry)) return false;
+        bool complete = _poll_mode ? (entry.control_value && entry.data_value && entry.data_cccd)
+                                   : (entry.count_value && entry.count_cccd);
+        if (!complete) return false;
+
+        node.cached = true;
+        if (entry.db_hash_handle) {
+            /* trusted once the node's Database Hash is confirmed unchanged */
+            if (_ble.gattClient().read(node.handle, entry.db_hash_handle, 0)) {
+                node.cached = false;
+                return false;
+            }
+            node.state = PMGW_NODE_VERIFYING;
+            return true;
+        }
+        apply_cached_handles(node);
+        subscribe(node);
+        return true;
+    }
+
+    void apply_cached_handles(node_t &node)
+    {
+        const PMHandleCacheEntry &entry = node.handles;
+        node.value_handle = _poll_mode ? entry.data_value : entry.count_value;
+        node.cccd_handle = _poll_mode ? entry.data_cccd : entry.count_cccd;
+        node.control_handle = entry.control_value;
+    }
+
+    /** Database Hash read: check it against the cache, or store it with freshly discovered handles. */
+    void on_client_read(const GattReadCallbackParams *params)
+    {
+        int8_t index = find_node(params->connHandle);
+        if (index < 0) return;
+        node_t &node = _gw_nodes[index];
+        PMHandleCacheEntry &entry = node.handles;
+        if (params->handle != entry.db_hash_handle) return;
+
+        /* on failure len holds the error status instead, which is never the hash size */
+        bool read = (params->len == PMHC_DB_HASH_SIZE);
+
+        if (node.state == PMGW_NODE_VERIFYING) {
+            if (read && memcmp(params->data, entry.db_hash, PMHC_DB_HASH_SIZE) == 0) {
+                apply_cached_handles(node);
+                subscribe(node);
+                return;
+            }
+            printf("Gateway node %u changed its GATT table, discovering\r\n", index);
+            _gw_cache.remove(node.address_type, node.address);
+            node.cached = false;
+            node.state = PMGW_NODE_CONNECTED;
+            discover_next();
+        }
+        else if (node.state == PMGW_NODE_DISCOVERING && _gw_discovering != index) {
+            if (read) memcpy(entry.db_hash, params->data, PMHC_DB_HASH_SIZE);
+            else entry.db_hash_handle = 0;
+            _gw_cache.save(entry);
+            subscribe(node);
+        }
+    }
+#endif
+
+    void on_client_write(const GattWriteCallbackParams *params)
+    {
+        int8_t index = find_node(params->connHandle);
+        if (index < 0) return;
+        node_t &node = _gw_nodes[index];
+        bool cccd = (node.state == PMGW_NODE_SUBSCRIBING && params->handle == node.cccd_handle);
+        bool control = (node.state == PMGW_NODE_PULLING && params->handle == node.control_handle);
+        if (!cccd && !control) return;
+
+        if (params->status != BLE_ERROR_NONE) {
+            print_error(params->status, "Gateway write failed");
+#if PMGW_HANDLE_CACHE
+            if (cccd && node.cached) {
+                /* discovered again on the next connect */
+                _gw_cache.remove(node.address_type, node.address);
+            }
+#endif
+            _ble.gap().disconnect(node.handle, ble::local_disconnection_reason_t::USER_TERMINATION);
+            return;
+        }
+        if (control) return;
+
+        node.retry_s = 0;
+        if (_poll_mode) {
+            node.state = PMGW_NODE_READY;
+            start_next_pull();
+            return;
+        }
+        node.state = PMGW_NODE_STREAMING;
+        printf("Gateway streaming from node %u, %u links in use\r\n", index, get_node_connections());
+    }
+
+    /** PM Count notifications carry two big endian counts. */
+    void on_hvx(const GattHVXCallbackParams *params)
+    {
+        int8_t index = find_node(params->connHandle);
+        if (index < 0 || params->handle != _gw_nodes[index].value_handle) return;
+        if (_gw_nodes[index].awaiting_data) {
+            _gw_nodes[index].awaiting_data = false;
+            add_first_data(_gw_nodes[index]);
+        }
+        if (_gw_nodes[index].state == PMGW_NODE_PULLING) {
+            on_history_packet(index, params->data, params->len);
+            return;
+        }
+        if (params->len < 4) return;
+
+        uint16_t values[2];
+        values[0] = (params->data[0] << 8) | params->data[1];
+        values[1] = (params->data[2] << 8) | params->data[3];
+        add_sample(index, PMGW_SOURCE_NOTIFY, values);
+    }
+
+    /** Start a pull on the next node with a link ready, once the previous pull has finished. */
+    void start_next_pull()
+    {
+        if (_poll_pulling >= 0) return;
+
+        for (uint8_t i = 0; i < PMGW_MAX_NODES; i++) {
+            node_t &node = _gw_nodes[i];
+            if (!node.used || node.state != PMGW_NODE_READY) continue;
+
+            /* resume after the last sample pulled, or fetch everything the node holds; a node that
+               has restarted since sends its new series from the start instead */
+            uint8_t request[13];
+            request[0] = node.pulled ? HISTXFER_OP_RESUME : HISTXFER_OP_START;
+            uint32_t arg = node.pulled ? node.next_seq : 0;
+            for (uint8_t b = 0; b < 4; b++) {
+                request[1 + b] = arg >> (8 * b);
+                request[5 + b] = HISTXFER_END_OF_TIME >> (8 * b);
+                request[9 + b] = node.series_id >> (8 * b);
+            }
+            node.state = PMGW_NODE_PULLING;
+            node.pull_samples = 0;
+            ble_error_t error = _ble.gattClient().write(GattClient::GATT_OP_WRITE_REQ, node.handle, node.control_handle,
+                                                         node.pulled ? sizeof(request) : 9, request);
+            if (error) {
+                print_error(error, "Gateway history request failed");
+                _ble.gap().disconnect(node.handle, ble::local_disconnection_reason_t::USER_TERMINATION);
+                continue;
+            }
+            _poll_pulling = i;
+            return;
+        }
+    }
+
+    /** Unpack a history data packet into the feed; the last one ends the visit. */
+    void on_history_packet(uint8_t index, const uint8_t *data, uint16_t len)
+    {
+        if (len < HISTXFER_HEADER_SIZE) return;
+        node_t &node = _gw_nodes[index];
+        uint32_t series_id = get_u32(data + 1);
+        uint32_t seq = get_u32(data + 5);
+        uint16_t records = (len - HISTXFER_HEADER_SIZE) / HISTXFER_RECORD_SIZE;
+
+        if (node.pulled && series_id != node.series_id) {
+            /* the node restarted, and answered the resume with its new series from the start */
+            printf("Gateway node %u restarted (series %08lx), pulling from its start\r\n", index, series_id);
+            node.pulled = false;
+        }
+
+        const uint8_t *p = data + HISTXFER_HEADER_SIZE;
+        for (uint16_t i = 0; i < records; i++, p += HISTXFER_RECORD_SIZE) {
+            uint16_t values[2];
+            const uint8_t *pc = p + 16;     // timestamp and mass densities come first
+            uint32_t pm05_cnt = (uint32_t)get_u16(pc + 2) + get_u16(pc + 4);
+            uint32_t pm25_cnt = (uint32_t)get_u16(pc + 6) + get_u16(pc + 8) + get_u16(pc + 10);
+            values[0] = (pm05_cnt > UINT16_MAX) ? UINT16_MAX : pm05_cnt;
+            values[1] = (pm25_cnt > UINT16_MAX) ? UINT16_MAX : pm25_cnt;
+            add_sample(index, PMGW_SOURCE_HISTORY, values, get_u32(p));
+        }
+        if (records) {
+            node.series_id = series_id;
+            node.next_seq = seq + records;
+            node.pulled = true;
+            node.pull_samples += records;
+        }
+
+        if (data[0] & HISTXFER_FLAG_LAST) {
+            _poll.on_pulled(index, now_s(), node.pull_samples);
+            printf("Gateway pulled %lu samples from node %u\r\n", node.pull_samples, index);
+            node.state = PMGW_NODE_DONE;
+            _poll_pulling = -1;
+            _ble.gap().disconnect(node.handle, ble::local_disconnection_reason_t::USER_TERMINATION);
+            start_next_pull();
+        }
+    }
+
+    /** Connect to the most overdue node while a poll link is free; runs every PMGW_POLL_PERIOD. */
+    void poll_tick()
+    {
+        if (_gw_connecting >= 0) return;
+        if (get_node_connections() >= PMGW_POLL_LINKS) return;
+
+        uint32_t now = now_s();
+        int next = _poll.select(now, [this, now](uint8_t i) {
+            const node_t &node = _gw_nodes[i];
+            return node.used && node.state == PMGW_NODE_IDLE && now >= node.retry_at &&
+                   now - node.last_seen <= PMGW_POLL_SEEN_S;
+        });
+        if (next >= 0) {
+            connect_node(next);
+        }
+    }
+
+    static uint16_t get_u16(const uint8_t *p)
+    {
+        return p[0] | (p[1] << 8);
+    }
+
+    static uint32_t get_u32(const uint8_t *p)
+    {
+        return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+    }
+
+    void add_first_data(const node_t &node)
+    {
+        uint32_t ms = now_ms() - node.connected_ms;
+        first_data_t &stats = _gw_first_data[node.cached ? 1 : 0];
+        stats.links++;
+        stats.total_ms += ms;
+        if (ms > stats.max_ms) stats.max_ms = ms;
+    }
+
+    void add_sample(uint8_t index, uint8_t source, const uint16_t values[2], uint32_t node_timestamp = 0)
+    {
+        PMGatewaySample sample;
+        sample.timestamp = now_s();
+        sample.node_timestamp = node_timestamp;
+        sample.node = index;
+        sample.source = source;
+        sample.values[0] = values[0];
+        sample.values[1] = values[1];
+        _gw_feed.push(sample);
+        _gw_nodes[index].samples++;
+        if (_gw_sample_cb) {
+            _gw_sample_cb(sample);
+        }
+    }
+
+protected:
+    typedef struct {
+        uint32_t links;
+        uint64_t total_ms;
+        uint32_t max_ms;
+    } first_data_t;
+
+    bool _gw_enabled = false;
+    UUID _gw_service;
+    UUID _gw_count;
+
+    node_t _gw_nodes[PMGW_MAX_NODES] = {};
+    int8_t _gw_connecting = -1;             // node with a connection being set up
+    int _gw_connect_timeout_id = 0;
+    int8_t _gw_discovering = -1;            // node whose characteristics are being discovered
+    DiscoveredCharacteristic _gw_char;
+    bool _gw_char_found = false;
+#if BLE_FEATURE_WHITELIST
+    bool _gw_accept_list = false;
+    uint32_t _gw_scans = 0;
+#endif
+    first_data_t _gw_first_data[2] = {};    // discovered, cached
+#if PMGW_HANDLE_CACHE
+    PMHandleCache _gw_cache;
+#endif
+
+    // poll mode
+    bool _poll_mode = false;
+    UUID _poll_control;
+    UUID _poll_data;
+    PMPollScheduler<PMGW_MAX_NODES> _poll;
+    int8_t _poll_pulling = -1;              // node whose history is being pulled
+    int _poll_tick_id = 0;
+
+    HistoryBuffer<PMGatewaySample, PMGW_FEED_SAMPLES> _gw_feed;
+    mbed::Callback<void(const PMGatewaySample &sample)> _gw_sample_cb;
+};
+
+#endif // PMSENSE_GATEWAY_H
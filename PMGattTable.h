@@ -0,0 +1,189 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_GATT_TABLE_H
+#define PMSENSE_GATT_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+
+#include "ble/BLE.h"
+
+// Characteristic Presentation Format (0x2904) formats and units, from the Bluetooth Assigned Numbers
+#define PMGATT_FORMAT_UINT8             (0x04u)
+#define PMGATT_FORMAT_UINT16            (0x06u)
+#define PMGATT_FORMAT_UINT32            (0x08u)
+#define PMGATT_FORMAT_UTF8              (0x19u)
+#define PMGATT_FORMAT_STRUCT            (0x1Bu)
+#define PMGATT_UNIT_UNITLESS            (0x2700u)
+#define PMGATT_UNIT_SECOND              (0x2703u)
+#define PMGATT_UNIT_COUNT_PER_M3        (0x27B5u)
+#define PMGATT_UNIT_KG_PER_M3           (0x27C4u)
+#define PMGATT_NAMESPACE_SIG            (0x01u)
+#define PMGATT_FORMAT_SIZE              (7u)
+
+#define PMGATT_USER_DESCRIPTION_UUID    (0x2901u)
+#define PMGATT_PRESENTATION_FORMAT_UUID (0x2904u)
+#define PMGATT_MAX_DESCRIPTORS          (2u)                 ///< User description and presentation format
+
+/**! 128-bit UUID, parsed from its string form by the compiler **/
+struct PMGattUUID {
+    uint8_t bytes[UUID::LENGTH_OF_LONG_UUID];          ///< Most significant byte first, as written
+
+    operator UUID() const
+    {
+        return UUID(bytes, UUID::MSB);
+    }
+};
+
+/* Not constexpr, so a bad character in a UUID string stops the build instead of being parsed */
+uint8_t pmgatt_invalid_uuid_character();
+
+constexpr uint8_t pmgatt_hex(char c)
+{
+    return (c >= '0' && c <= '9') ? c - '0' :
+           (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+           (c >= 'A' && c <= 'F') ? c - 'A' + 10 : pmgatt_invalid_uuid_character();
+}
+
+/** Parse "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx". Use it to initialise a constexpr PMGattUUID. */
+constexpr PMGattUUID pmgatt_uuid(const char *str)
+{
+    PMGattUUID uuid = {};
+    size_t digits = 0;
+    for (size_t i = 0; str[i]; i++) {
+        if (str[i] == '-') continue;
+        uint8_t &b = uuid.bytes[(digits / 2) % UUID::LENGTH_OF_LONG_UUID];
+        b = (b << 4) | pmgatt_hex(str[i]);
+        digits++;
+    }
+    return (digits == UUID::LENGTH_OF_LONG_UUID * 2) ? uuid : (pmgatt_invalid_uuid_character(), uuid);
+}
+
+/**! Characteristic Presentation Format descriptor value, packed by the compiler **/
+struct PMGattFormat {
+    uint8_t value[PMGATT_FORMAT_SIZE];
+};
+
+constexpr PMGattFormat pmgatt_format(uint8_t format, int8_t exponent, uint16_t unit,
+                                     uint8_t name_space = PMGATT_NAMESPACE_SIG, uint16_t description = 0)
+{
+    return PMGattFormat{{format, (uint8_t)exponent, (uint8_t)unit, (uint8_t)(unit >> 8), name_space,
+                         (uint8_t)description, (uint8_t)(description >> 8)}};
+}
+
+/**
+ * Value storage and descriptors for a PMGattCharacteristic.
+ *
+ * A separate base so it is constructed before the GattCharacteristic that points at it.
+ */
+template <size_t SIZE>
+class PMGattStorage
+{
+protected:
+    PMGattStorage(const char *description, const PMGattFormat *format) :
+        _description(PMGATT_USER_DESCRIPTION_UUID, (uint8_t *)description,
+                     description ? strlen(description) : 0, description ? strlen(description) : 0, false),
+        _format(PMGATT_PRESENTATION_FORMAT_UUID, format ? (uint8_t *)format->value : nullptr,
+                PMGATT_FORMAT_SIZE, PMGATT_FORMAT_SIZE, false)
+    {
+        if (description) _descriptors[_descriptor_count++] = &_description;
+        if (format) _descriptors[_descriptor_count++] = &_format;
+    }
+
+protected:
+    uint8_t _value[SIZE] = {0};
+    GattAttribute _description;
+    GattAttribute _format;
+    GattAttribute *_descriptors[PMGATT_MAX_DESCRIPTORS] = {nullptr};
+    uint8_t _descriptor_count = 0;
+};
+
+/**
+ * A characteristic that carries its own value buffer and descriptors.
+ *
+ * Define these at file scope, or as members of a service object with static storage, so the whole
+ * service table is laid out by the linker and nothing is allocated at boot. The stack keeps
+ * pointers to descriptors and to characteristics with authorization callbacks, so they must
+ * outlive the call to addService() in any case. The description and format are not copied and
+ * must be string literals or constants.
+ *
+ * @tparam SIZE Maximum value length in bytes.
+ */
+template <size_t SIZE>
+class PMGattCharacteristic : private PMGattStorage<SIZE>, public GattCharacteristic
+{
+public:
+    /**
+     * @param[in] uuid Characteristic UUID.
+     * @param[in] properties GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_xxx.
+     * @param[in] description User description (0x2901), or nullptr for none.
+     * @param[in] format Presentation format (0x2904), or nullptr for none.
+     * @param[in] variable_length Writes may be shorter than SIZE.
+     * @param[in] length Initial value length.
+     */
+    PMGattCharacteristic(const UUID &uuid, uint8_t properties, const char *description = nullptr,
+                         const PMGattFormat *format = nullptr, bool variable_length = false, size_t length = SIZE) :
+        PMGattStorage<SIZE>(description, format),
+        GattCharacteristic(uuid, this->_value, length, SIZE, properties, this->_descriptors,
+                           this->_descriptor_count, variable_length)
+    {
+    }
+
+    /** Value buffer, for setting the initial value before the service is added. */
+    uint8_t *value()
+    {
+        return this->_value;
+    }
+
+    static constexpr size_t size()
+    {
+        return SIZE;
+    }
+};
+
+/**
+ * Static storage for up to N objects built at run time, for tables whose entries depend on
+ * arguments. Objects are never destroyed.
+ */
+template <typename T, size_t N>
+class PMGattPool
+{
+public:
+    /** Construct the next object in place. Returns nullptr when all N are in use. */
+    template <typename... Args>
+    T *emplace(Args &&... args)
+    {
+        if (_count >= N) return nullptr;
+        return new (&_storage[_count++]) T(static_cast<Args &&>(args)...);
+    }
+
+    size_t count() const
+    {
+        return _count;
+    }
+
+protected:
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type _storage[N];
+    size_t _count = 0;
+};
+
+#endif // PMSENSE_GATT_TABLE_H
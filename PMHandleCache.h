@@ -0,0 +1,157 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_HANDLE_CACHE_H
+#define PMSENSE_HANDLE_CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ble/BLE.h"
+#include "kvstore_global_api.h"
+
+#define PMHC_VERSION                    (2u)
+#define PMHC_DB_HASH_SIZE               (16u)                ///< GATT Database Hash characteristic value
+#define PMHC_DB_HASH_UUID               (0x2B2Au)
+
+/**! Attribute handles discovered on a node, stored under its address **/
+typedef struct {
+    uint8_t version;
+    uint8_t address_type;
+    uint8_t address[6];
+    uint8_t db_hash[PMHC_DB_HASH_SIZE];     ///< GATT Database Hash read after discovery, if the node has one
+    uint16_t db_hash_handle;        ///< 0 if the node has no Database Hash
+    // PMsense service
+    uint16_t count_value;
+    uint16_t count_cccd;
+    uint16_t control_value;
+    uint16_t data_value;
+    uint16_t data_cccd;
+    // Device Information service
+    uint16_t dis_model;
+    uint16_t dis_firmware;
+} PMHandleCacheEntry;
+
+/**
+ * Persistent cache of the GATT handles of the nodes a gateway connects to.
+ *
+ * Entries are kept in the global KVStore, one key per peer address, so they survive a gateway
+ * restart. An entry is only trusted while the node's GATT Database Hash still matches the one
+ * read when it was discovered; nodes without a Database Hash are trusted until a write to a
+ * cached handle fails. Either way the entry is then removed and the node discovered again.
+ */
+class PMHandleCache
+{
+public:
+    /** Look up a node. Returns false if it has no entry, or the entry is from another version. */
+    bool load(const ble::peer_address_type_t &type, const ble::address_t &address, PMHandleCacheEntry &entry)
+    {
+        char key[KEY_SIZE];
+        make_key(type, address, key);
+
+        size_t actual = 0;
+        int err = kv_get(key, &entry, sizeof(entry), &actual);
+        if (err != MBED_SUCCESS || actual != sizeof(entry) || entry.version != PMHC_VERSION) {
+            _misses++;
+            return false;
+        }
+        _loads++;
+        return true;
+    }
+
+    /** Store a node's entry. Unchanged entries are not written again, to spare the flash. */
+    bool save(const PMHandleCacheEntry &entry)
+    {
+        ble::address_t address(entry.address);
+        char key[KEY_SIZE];
+        make_key((ble::peer_address_type_t::type)entry.address_type, address, key);
+
+        PMHandleCacheEntry stored;
+        size_t actual = 0;
+        if (kv_get(key, &stored, sizeof(stored), &actual) == MBED_SUCCESS && actual == sizeof(stored) &&
+            memcmp(&stored, &entry, sizeof(entry)) == 0) {
+            return true;
+        }
+
+        int err = kv_set(key, &entry, sizeof(entry), 0);
+        if (err != MBED_SUCCESS) {
+            printf("Handle cache save failed (%d)\r\n", err);
+            return false;
+        }
+        printf("Handle cache stored %s\r\n", key);
+        _saves++;
+        return true;
+    }
+
+    /** Drop a node's entry once it no longer matches the node. */
+    void remove(const ble::peer_address_type_t &type, const ble::address_t &address)
+    {
+        char key[KEY_SIZE];
+        make_key(type, address, key);
+        if (kv_remove(key) == MBED_SUCCESS) {
+            _invalidations++;
+        }
+    }
+
+    /** Start an entry for a node about to be discovered. */
+    static void begin(PMHandleCacheEntry &entry, const ble::peer_address_type_t &type, const ble::address_t &address)
+    {
+        memset(&entry, 0, sizeof(entry));
+        entry.version = PMHC_VERSION;
+        entry.address_type = type.value();
+        memcpy(entry.address, address.data(), sizeof(entry.address));
+    }
+
+    uint32_t get_loads() const
+    {
+        return _loads;
+    }
+
+    uint32_t get_misses() const
+    {
+        return _misses;
+    }
+
+    uint32_t get_saves() const
+    {
+        return _saves;
+    }
+
+    uint32_t get_invalidations() const
+    {
+        return _invalidations;
+    }
+
+protected:
+    static const size_t KEY_SIZE = 24;      // "/kv/gwh" + type + 12 hex digits + NUL is 21
+
+    static void make_key(const ble::peer_address_type_t &type, const ble::address_t &address, char key[KEY_SIZE])
+    {
+        snprintf(key, KEY_SIZE, "/kv/gwh%u%02x%02x%02x%02x%02x%02x", type.value() & 0x0F, address[5], address[4],
+                 address[3], address[2], address[1], address[0]);
+    }
+
+protected:
+    uint32_t _loads = 0;
+    uint32_t _misses = 0;
+    uint32_t _saves = 0;
+    uint32_t _invalidations = 0;
+};
+
+#endif // PMSENSE_HANDLE_CACHE_H
@@ -0,0 +1,110 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_HISTORY_H
+#define PMSENSE_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Panasonic_SNGCJA5.h"
+
+/**! Structure holding one reporting interval of PM data **/
+typedef struct PMHistory_record {
+    uint32_t seq;                   ///< Sequence number, increments by one per interval and carries on across reboots
+    uint32_t timestamp;             ///< End of the interval in node time (seconds, see PMSense_timestamp)
+    PM_MDVPC_Data pmdata;           ///< Interval averages
+} PMHistoryRecord;
+
+/**
+ * Bounded history buffer addressed by sequence number.
+ *
+ * The producer pushes items and never blocks. Once the buffer is full the oldest item is
+ * overwritten. Consumers keep their own cursor (the next sequence number they want) so
+ * any number of them can read at their own pace and see exactly what they have missed.
+ *
+ * @tparam T Item type.
+ * @tparam N Number of items held.
+ */
+template <typename T, size_t N>
+class HistoryBuffer
+{
+public:
+    /** Append an item, overwriting the oldest if full. Returns the item's sequence number. */
+    uint32_t push(const T &item)
+    {
+        uint32_t seq = _next_seq++;
+        _buf[seq % N] = item;
+        if (_next_seq - _first_seq > N) {
+            _first_seq = _next_seq - N;
+            _overwritten++;
+        }
+        return seq;
+    }
+
+    /** Drop everything held and number the next item pushed seq, e.g. to carry on from items restored after a reboot. */
+    void reset(uint32_t seq)
+    {
+        _first_seq = seq;
+        _next_seq = seq;
+    }
+
+    /** Copy out the item with the given sequence number. Returns false if it is not (or no longer) held. */
+    bool get(uint32_t seq, T &item) const
+    {
+        if (seq < _first_seq || seq >= _next_seq) return false;
+        item = _buf[seq % N];
+        return true;
+    }
+
+    /** Sequence number of the oldest item held. */
+    uint32_t first_seq() const
+    {
+        return _first_seq;
+    }
+
+    /** Sequence number the next pushed item will get. */
+    uint32_t next_seq() const
+    {
+        return _next_seq;
+    }
+
+    uint32_t count() const
+    {
+        return _next_seq - _first_seq;
+    }
+
+    static constexpr size_t capacity()
+    {
+        return N;
+    }
+
+    /** Number of items lost to overwriting. */
+    uint32_t get_overwritten() const
+    {
+        return _overwritten;
+    }
+
+protected:
+    T _buf[N];
+    uint32_t _first_seq = 0;
+    uint32_t _next_seq = 0;
+    uint32_t _overwritten = 0;
+};
+
+#endif // PMSENSE_HISTORY_H
@@ -0,0 +1,360 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_HISTORY_TRANSFER_H
+#define PMSENSE_HISTORY_TRANSFER_H
+
+#include "mbed.h"
+#include "ble/BLE.h"
+#include "platform/NonCopyable.h"
+
+#include "pretty_printer.h"
+#include "Panasonic_SNGCJA5.h"
+
+// Control point opcodes
+#define HISTXFER_OP_START               (0x01u)              ///< u32 start time, u32 end time (node time in seconds)
+#define HISTXFER_OP_RESUME              (0x02u)              ///< u32 sequence number, u32 end time, optional u32 series id
+#define HISTXFER_OP_ABORT               (0x03u)
+
+// Data packet layout: u8 flags, u32 series id, u32 sequence number of the first record, then packed records
+#define HISTXFER_FLAG_LAST              (0x01u)              ///< No more packets follow for this request
+#define HISTXFER_HEADER_SIZE            (9u)
+#define HISTXFER_RECORD_SIZE            (28u)                ///< u32 timestamp, 3 x u32 mass density, 6 x u16 counts
+#define HISTXFER_MAX_PACKET             (244u)               ///< Largest notification payload (ATT MTU 247)
+#define HISTXFER_MIN_MTU                (3u + HISTXFER_HEADER_SIZE + HISTXFER_RECORD_SIZE)   ///< Smallest ATT MTU a packet with a record fits
+#define HISTXFER_END_OF_TIME            (0xFFFFFFFFu)
+
+#ifdef MBED_CONF_APP_HISTORY_TRANSFER_CREDITS
+#define HISTXFER_CREDITS                (MBED_CONF_APP_HISTORY_TRANSFER_CREDITS)
+#else
+#define HISTXFER_CREDITS                (4u)                 ///< Notifications queued in the stack at once
+#endif
+
+/**
+ * Bulk history download over a control point / data characteristic pair.
+ *
+ * A client subscribes to the data characteristic and writes a request to the control point:
+ * START with a time range, or RESUME with the sequence number after the last record it holds.
+ * The connection needs an ATT MTU of at least HISTXFER_MIN_MTU; a request on a link that has
+ * not exchanged a larger MTU than the default of 23 is ignored.
+ * The node then streams the per-second samples in notifications filled up to the negotiated
+ * ATT MTU. Each packet carries the sequence number of its first record; records within a packet
+ * are consecutive. The final packet has HISTXFER_FLAG_LAST set, and may hold no records.
+ *
+ * Sequence numbers start again from 0 when the node restarts, so every packet also carries the
+ * series id, which is different on every boot. A RESUME that names another series is served from
+ * the oldest sample held, as the sequence number it asks for means nothing in this one.
+ *
+ * Up to HISTXFER_CREDITS notifications are queued in the stack at once, and each onDataSent
+ * returns a credit and tops the queue up, so the link stays busy without blocking the event
+ * queue. The credit, not a write error, is what stops the queue: Cordio does not report every
+ * notification it could not buffer, and one it drops silently would be lost from the transfer.
+ *
+ * One transfer runs at a time, to the connection that requested it; a request from another
+ * connection is ignored until it completes.
+ *
+ * @tparam Series A PMTimeSeries instance type.
+ */
+template <typename Series>
+class PMHistoryTransfer : private mbed::NonCopyable<PMHistoryTransfer<Series> >
+{
+public:
+    PMHistoryTransfer(BLE &ble, Series &series, const char *cp_uuid, const char *data_uuid) :
+        _ble(ble),
+        _series(series),
+        _cp_char(UUID(cp_uuid), _cp_value, 0, sizeof(_cp_value),
+                 GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE),
+        _data_char(UUID(data_uuid), _data_value, 0, HISTXFER_MAX_PACKET,
+                   GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY)
+    {
+    }
+
+    /** Characteristics to add to the service table. */
+    GattCharacteristic &control_characteristic()
+    {
+        return _cp_char;
+    }
+
+    GattCharacteristic &data_characteristic()
+    {
+        return _data_char;
+    }
+
+    /** Set a callback for each data packet: its length, and whether the write failed outright. */
+    void on_write(mbed::Callback<void(uint16_t len, bool failed)> cb)
+    {
+        _write_cb = cb;
+    }
+
+    /** Set the id sent with every packet. Call once at startup with a value new to this boot. */
+    void set_series_id(uint32_t series_id)
+    {
+        _series_id = series_id;
+    }
+
+    uint32_t get_series_id() const
+    {
+        return _series_id;
+    }
+
+    /** Call when the ATT MTU of the connection a transfer is running on changes. */
+    void set_mtu(uint16_t attMtuSize)
+    {
+        _mtu = attMtuSize;
+    }
+
+    /**
+     * Pass on Gatt Server write events. Returns true if the write was for the control point.
+     *
+     * @param[in] params The write event.
+     * @param[in] attMtuSize Negotiated ATT MTU of the writing connection, used only if its request is accepted.
+     */
+    bool on_data_written(const GattWriteCallbackParams &params, uint16_t attMtuSize)
+    {
+        if (params.handle != _cp_char.getValueHandle()) return false;
+
+        if (_active && params.connHandle != _conn) {
+            printf("History request from connection %u ignored: transfer to %u in progress\r\n", params.connHandle, _conn);
+            return true;
+        }
+
+        if (params.len >= 1 && params.data[0] == HISTXFER_OP_ABORT) {
+            if (_active) stop("aborted");
+            return true;
+        }
+        if (params.len < 9) {
+            printf("History request too short\r\n");
+            return true;
+        }
+
+        uint32_t arg = get_u32(params.data + 1);
+        _end_ts = get_u32(params.data + 5);
+
+        if (attMtuSize < HISTXFER_MIN_MTU) {
+            // not one record would fit in a packet, so the transfer could never move on
+            printf("History request ignored: ATT MTU %u, at least %u needed\r\n", attMtuSize, HISTXFER_MIN_MTU);
+            return true;
+        }
+
+        bool enabled = false;
+        _ble.gattServer().areUpdatesEnabled(params.connHandle, _data_char, &enabled);
+        if (!enabled) {
+            printf("History request ignored: data notifications not enabled\r\n");
+            return true;
+        }
+
+        bool found;
+        if (params.data[0] == HISTXFER_OP_RESUME && params.len >= 13 && get_u32(params.data + 9) != _series_id) {
+            printf("History resume for series %08lx, sending series %08lx from its start\r\n", get_u32(params.data + 9), _series_id);
+            found = _series.seek_oldest(_cursor);
+        }
+        else if (params.data[0] == HISTXFER_OP_RESUME) {
+            found = _series.seek_seq(arg, _cursor);
+        }
+        else {
+            // seek is block granular, so skip forward to the start time
+            found = _series.seek(arg, _cursor);
+            typename Series::cursor_t probe = _cursor;
+            uint32_t timestamp;
+            PM_MDVPC_Data pmdata;
+            while (found && _series.read(probe, timestamp, pmdata) && timestamp < arg) {
+                _cursor = probe;
+            }
+        }
+
+        if (!found) {
+            _cursor.seq = _series.next_seq();      // nothing to send; reply with an empty last packet
+        }
+
+        if (params.connHandle != _conn) _inflight = 0;     // credits still out are for the other link
+        _conn = params.connHandle;
+        _mtu = attMtuSize;
+        _active = true;
+        _done = !found;
+        _bytes = 0;
+        _timer.reset();
+        _timer.start();
+        printf("History transfer from %s %lu\r\n", (params.data[0] == HISTXFER_OP_RESUME) ? "seq" : "time", arg);
+        pump();
+        return true;
+    }
+
+    /** Pass on notification sent events. */
+    void on_data_sent(const GattDataSentCallbackParams &params)
+    {
+        if (params.connHandle != _conn || params.attHandle != _data_char.getValueHandle()) return;
+        // packets of a stopped transfer still hold credits until they are sent
+        if (_inflight) _inflight--;
+        if (_active) pump();
+    }
+
+    /** Call on disconnection; the client resumes with HISTXFER_OP_RESUME. */
+    void on_disconnect(ble::connection_handle_t connHandle)
+    {
+        if (connHandle != _conn) return;
+        if (_active) stop("interrupted");
+        _inflight = 0;              // the stack drops what was queued for the link
+    }
+
+    bool is_active() const
+    {
+        return _active;
+    }
+
+    /** Connection the current or last transfer is for. */
+    ble::connection_handle_t get_connection() const
+    {
+        return _conn;
+    }
+
+    /** Notifications queued in the stack and not yet confirmed by onDataSent. */
+    uint8_t get_inflight() const
+    {
+        return _inflight;
+    }
+
+    /** Throughput of the last completed transfer in bytes per second. */
+    uint32_t get_throughput() const
+    {
+        return _throughput;
+    }
+
+protected:
+    static uint32_t get_u32(const uint8_t *p)
+    {
+        return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+    }
+
+    static uint8_t put_u32(uint8_t *p, uint32_t v)
+    {
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+        p[3] = v >> 24;
+        return 4;
+    }
+
+    static uint8_t put_u16(uint8_t *p, uint16_t v)
+    {
+        p[0] = v;
+        p[1] = v >> 8;
+        return 2;
+    }
+
+    /** Fill a packet from a copy of the cursor so nothing is lost if the stack rejects it. */
+    uint16_t build_packet(typename Series::cursor_t &next, bool &last)
+    {
+        uint16_t max_len = (_mtu > 3) ? (_mtu - 3) : 20;
+        if (max_len > HISTXFER_MAX_PACKET) max_len = HISTXFER_MAX_PACKET;
+
+        uint16_t len = HISTXFER_HEADER_SIZE;
+        put_u32(_packet + 1, _series_id);
+        put_u32(_packet + 5, next.seq);
+        last = _done;
+
+        while (!last && len + HISTXFER_RECORD_SIZE <= max_len) {
+            typename Series::cursor_t probe = next;
+            uint32_t timestamp;
+            PM_MDVPC_Data pmdata;
+            if (!_series.read(probe, timestamp, pmdata) || timestamp > _end_ts) {
+                last = true;        // caught up with the present or reached the end of the range
+                break;
+            }
+            next = probe;
+            uint8_t *p = _packet + len;
+            p += put_u32(p, timestamp);
+            p += put_u32(p, pmdata.pm10_mdv);
+            p += put_u32(p, pmdata.pm25_mdv);
+            p += put_u32(p, pmdata.pm100_mdv);
+            p += put_u16(p, pmdata.reg1_pc);
+            p += put_u16(p, pmdata.reg2_pc);
+            p += put_u16(p, pmdata.reg3_pc);
+            p += put_u16(p, pmdata.reg4_pc);
+            p += put_u16(p, pmdata.reg5_pc);
+            p += put_u16(p, pmdata.reg6_pc);
+            len += HISTXFER_RECORD_SIZE;
+        }
+        _packet[0] = last ? HISTXFER_FLAG_LAST : 0x00;
+        return len;
+    }
+
+    /** Queue notifications until the credits are used up or the request is complete. */
+    void pump()
+    {
+        while (_active && _inflight < HISTXFER_CREDITS) {
+            typename Series::cursor_t next = _cursor;
+            bool last;
+            uint16_t len = build_packet(next, last);
+
+            ble_error_t error = _ble.gattServer().write(_conn, _data_char.getValueHandle(), _packet, len);
+            if (error) {
+                if (_inflight == 0) {
+                    if (_write_cb) _write_cb(len, true);
+                    print_error(error, "History transfer write failed");
+                    stop("failed");
+                }
+                return;             // wait for onDataSent
+            }
+
+            _cursor = next;
+            _inflight++;
+            _bytes += len;
+            if (_write_cb) _write_cb(len, false);
+            if (last) {
+                stop("complete");
+            }
+        }
+    }
+
+    void stop(const char *reason)
+    {
+        _timer.stop();
+        uint32_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(_timer.elapsed_time()).count();
+        _throughput = elapsed_ms ? (uint32_t)(((uint64_t)_bytes * 1000) / elapsed_ms) : 0;
+        printf("History transfer %s: %lu bytes in %lu ms (%lu bytes/s), next seq %lu\r\n", reason,
+               _bytes, elapsed_ms, _throughput, _cursor.seq);
+        _active = false;
+    }
+
+protected:
+    BLE &_ble;
+    Series &_series;
+
+    uint8_t _cp_value[13] = {0};
+    uint8_t _data_value[HISTXFER_MAX_PACKET] = {0};
+    uint8_t _packet[HISTXFER_MAX_PACKET] = {0};
+    GattCharacteristic _cp_char;
+    GattCharacteristic _data_char;
+
+    ble::connection_handle_t _conn = 0;
+    uint32_t _series_id = 0;
+    typename Series::cursor_t _cursor = {};
+    uint32_t _end_ts = HISTXFER_END_OF_TIME;
+    uint16_t _mtu = 23;
+    bool _active = false;
+    bool _done = false;
+    uint8_t _inflight = 0;
+
+    mbed::Callback<void(uint16_t len, bool failed)> _write_cb;
+
+    mbed::Timer _timer;
+    uint32_t _bytes = 0;
+    uint32_t _throughput = 0;
+};
+
+#endif // PMSENSE_HISTORY_TRANSFER_H
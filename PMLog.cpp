@@ -0,0 +1,129 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PMLog.h"
+
+#include <string.h>
+
+#include "hal/us_ticker_api.h"
+#include "platform/mbed_retarget.h"
+#include "rtos/ThisThread.h"
+#include "rtos/Thread.h"
+
+using namespace std::chrono_literals;
+
+static const std::chrono::milliseconds PMLOG_DRAIN_PERIOD = 20ms;
+
+static PMLog pmlog;
+static rtos::Thread pmlog_drain_thread(osPriorityLow, PMLOG_DRAIN_STACK, nullptr, "pmlog");
+
+PMLog &PMLog::instance()
+{
+    return pmlog;
+}
+
+bool PMLog::write_record(uint32_t token, uint8_t nargs, const uint32_t *args)
+{
+    uint32_t head = core_util_atomic_load_u32(&_head);
+    do {
+        if (head - core_util_atomic_load_explicit_u32(&_tail, mbed_memory_order_acquire) >= PMLOG_RECORDS) {
+            core_util_atomic_incr_u32(&_dropped, 1);
+            return false;
+        }
+    } while (!core_util_atomic_cas_u32(&_head, &head, head + 1));
+
+    record_t &record = _records[head & (PMLOG_RECORDS - 1)];
+    record.token = token;
+    record.time_us = now_us();
+    record.nargs = nargs;
+    memcpy(record.args, args, nargs * sizeof(uint32_t));
+    core_util_atomic_store_explicit_u32(&record.seq, head + 1, mbed_memory_order_release);
+    core_util_atomic_incr_u32(&_written, 1);
+    return true;
+}
+
+size_t PMLog::read(uint8_t *buf, size_t size)
+{
+    if (core_util_atomic_flag_test_and_set(&_reading)) {
+        return 0;
+    }
+
+    uint8_t *p = buf;
+    uint32_t dropped = core_util_atomic_load_u32(&_dropped);
+    if (dropped != _dropped_reported && size >= PMLOG_HEADER_SIZE + 4) {
+        *p++ = PMLOG_MARKER;
+        p = put_u32(p, PMLOG_TOKEN_DROPPED);
+        p = put_u32(p, now_us());
+        *p++ = 1;
+        p = put_u32(p, dropped - _dropped_reported);
+        _dropped_reported = dropped;
+    }
+
+    uint32_t tail = _tail;
+    while (true) {
+        const record_t &record = _records[tail & (PMLOG_RECORDS - 1)];
+        if (core_util_atomic_load_explicit_u32(&record.seq, mbed_memory_order_acquire) != tail + 1) break;
+        if ((size_t)(p - buf) + PMLOG_HEADER_SIZE + record.nargs * 4 > size) break;
+
+        *p++ = PMLOG_MARKER;
+        p = put_u32(p, record.token);
+        p = put_u32(p, record.time_us);
+        *p++ = record.nargs;
+        for (uint8_t i = 0; i < record.nargs; i++) {
+            p = put_u32(p, record.args[i]);
+        }
+        tail++;
+        core_util_atomic_store_explicit_u32(&_tail, tail, mbed_memory_order_release);
+    }
+
+    core_util_atomic_flag_clear(&_reading);
+    return p - buf;
+}
+
+void PMLog::start_drain()
+{
+    pmlog_drain_thread.start(mbed::callback(this, &PMLog::drain));
+}
+
+void PMLog::drain()
+{
+    /* straight to the console file handle, so stdio does not convert newlines in the records */
+    mbed::FileHandle *console = mbed::mbed_file_handle(STDOUT_FILENO);
+    uint8_t buf[PMLOG_MAX_ENCODED * 8];
+    while (true) {
+        size_t len = read(buf, sizeof(buf));
+        if (len) {
+            fflush(stdout);
+            console->write(buf, len);
+        }
+        else {
+            rtos::ThisThread::sleep_for(PMLOG_DRAIN_PERIOD);
+        }
+    }
+}
+
+uint32_t PMLog::now_us()
+{
+    return us_ticker_read();
+}
+
+uint8_t *PMLog::put_u32(uint8_t *p, uint32_t v)
+{
+    for (uint8_t i = 0; i < 4; i++) p[i] = v >> (8 * i);
+    return p + 4;
+}
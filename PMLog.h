@@ -0,0 +1,155 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_LOG_H
+#define PMSENSE_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <type_traits>
+
+#include "platform/mbed_atomic.h"
+#include "platform/NonCopyable.h"
+
+#ifdef MBED_CONF_APP_BINARY_LOG
+#define PMLOG_BINARY                    (MBED_CONF_APP_BINARY_LOG)
+#else
+#define PMLOG_BINARY                    (0)
+#endif
+
+#ifdef MBED_CONF_APP_BINARY_LOG_RECORDS
+#define PMLOG_RECORDS                   (MBED_CONF_APP_BINARY_LOG_RECORDS)
+#else
+#define PMLOG_RECORDS                   (64u)
+#endif
+
+#define PMLOG_MAX_ARGS                  (4u)
+#define PMLOG_MARKER                    (0x1Eu)              ///< ASCII record separator, starts each record in the stream
+#define PMLOG_HEADER_SIZE               (10u)                ///< Marker, u32 token, u32 time (us), u8 argument count
+#define PMLOG_MAX_ENCODED               (PMLOG_HEADER_SIZE + PMLOG_MAX_ARGS * 4)
+#define PMLOG_TOKEN_DROPPED             (0u)                 ///< Reserved token: one u32 argument, records lost
+#define PMLOG_DRAIN_STACK               (1024u)
+
+#define PMLOG_FNV_OFFSET                (2166136261u)
+#define PMLOG_FNV_PRIME                 (16777619u)
+
+/** FNV-1a hash of a format string, evaluated by the compiler for string literals. */
+constexpr uint32_t pmlog_token(const char *fmt, uint32_t hash = PMLOG_FNV_OFFSET)
+{
+    return *fmt ? pmlog_token(fmt + 1, (hash ^ (uint8_t)*fmt) * PMLOG_FNV_PRIME) : hash;
+}
+
+/** Arguments are stored as 32 bit words; strings and floats cannot be deferred. */
+template <typename T>
+inline uint32_t pmlog_arg(T value)
+{
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "PMLOG arguments must be integers");
+    return (uint32_t)value;
+}
+
+/**
+ * Log a line without formatting it.
+ *
+ * With binary-log enabled only the token of the format string, a timestamp and up to
+ * PMLOG_MAX_ARGS integer arguments are stored, in a few hundred cycles and without locking, so it
+ * can be used from interrupts and time critical handlers. tools/pmlog_decode.py finds the format
+ * strings in the sources and turns the records back into text. Otherwise it is a printf, with the
+ * line ending added.
+ */
+#if PMLOG_BINARY
+#define PMLOG(fmt, ...)                 PMLog::instance().write(std::integral_constant<uint32_t, pmlog_token(fmt)>::value, ##__VA_ARGS__)
+#else
+#define PMLOG(fmt, ...)                 printf(fmt "\r\n", ##__VA_ARGS__)
+#endif
+
+/**
+ * Lock-free RAM ring of binary log records.
+ *
+ * Any number of threads and interrupts may write: a writer claims a slot by advancing the head
+ * with compare and swap, fills it, then publishes it by storing its sequence number. Records are
+ * read out in order, encoded as PMLOG_MARKER, u32 token, u32 time in microseconds, u8 argument
+ * count and the u32 arguments, all little endian. A slot claimed but not yet published holds up
+ * the reader until it is. When the ring is full new records are dropped and counted, and the
+ * count is reported in the stream as a PMLOG_TOKEN_DROPPED record.
+ *
+ * Records are taken out by the low priority drain thread, which writes them to the console, or
+ * by read() for a BLE characteristic. Only one reader runs at a time; another gets nothing.
+ */
+class PMLog : private mbed::NonCopyable<PMLog>
+{
+    static_assert((PMLOG_RECORDS & (PMLOG_RECORDS - 1)) == 0, "PMLog records must be a power of two");
+
+public:
+    /** The ring PMLOG() writes to. */
+    static PMLog &instance();
+
+    template <typename... Args>
+    bool write(uint32_t token, Args... args)
+    {
+        static_assert(sizeof...(Args) <= PMLOG_MAX_ARGS, "Too many PMLOG arguments");
+        const uint32_t values[sizeof...(Args) + 1] = {pmlog_arg(args)...};
+        return write_record(token, sizeof...(Args), values);
+    }
+
+    bool write_record(uint32_t token, uint8_t nargs, const uint32_t *args);
+
+    /**
+     * Take whole records out of the ring.
+     *
+     * @returns Bytes of encoded records, 0 if there were none or another reader is active.
+     */
+    size_t read(uint8_t *buf, size_t size);
+
+    /** Start the thread that writes records to the console whenever nothing else is running. */
+    void start_drain();
+
+    uint32_t get_written() const
+    {
+        return core_util_atomic_load_u32(&_written);
+    }
+
+    uint32_t get_dropped() const
+    {
+        return core_util_atomic_load_u32(&_dropped);
+    }
+
+protected:
+    typedef struct {
+        volatile uint32_t seq;          ///< Head value that claimed the slot, plus one, once it is written
+        uint32_t token;
+        uint32_t time_us;
+        uint8_t nargs;
+        uint32_t args[PMLOG_MAX_ARGS];
+    } record_t;
+
+    static uint32_t now_us();
+    static uint8_t *put_u32(uint8_t *p, uint32_t v);
+    void drain();
+
+protected:
+    record_t _records[PMLOG_RECORDS] = {};
+    volatile uint32_t _head = 0;
+    volatile uint32_t _tail = 0;            // written by the reader only
+    volatile uint32_t _written = 0;
+    volatile uint32_t _dropped = 0;
+    uint32_t _dropped_reported = 0;         // reader only
+    core_util_atomic_flag _reading = CORE_UTIL_ATOMIC_FLAG_INIT;
+};
+
+#endif // PMSENSE_LOG_H
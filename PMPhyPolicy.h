@@ -0,0 +1,250 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_PHY_POLICY_H
+#define PMSENSE_PHY_POLICY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// PHY levels, fastest first; each step trades throughput for range
+#define PHY_LEVEL_2M                    (0u)
+#define PHY_LEVEL_1M                    (1u)
+#define PHY_LEVEL_CODED_S2              (2u)
+#define PHY_LEVEL_CODED_S8              (3u)
+#define PHY_LEVELS                      (4u)
+
+#define PHY_RSSI_UNKNOWN                (127)
+#define PHY_RSSI_HYSTERESIS             (6)                  ///< dB above a level's threshold before stepping back up
+#define PHY_MAX_ERROR_PERCENT           (10u)                ///< Error rate in a window that forces a more robust PHY
+#define PHY_MIN_WINDOW_PACKETS          (5u)                 ///< Packets needed before the error rate is trusted
+#define PHY_CLEAN_WINDOWS               (6u)                 ///< Error free windows before trying a faster PHY
+#define PHY_LATE_INTERVALS              (3u)                 ///< Connection intervals between confirmations that mark a retried packet
+
+/**
+ * Chooses the PHY for a connection from link quality.
+ *
+ * The link is judged over evaluation windows from the notification error rate, supervision
+ * timeouts and, when the application can supply it, the RSSI. The stack acknowledges every
+ * notification at link layer and retries it unseen, so a write rarely fails; instead, while
+ * notifications are queued, a confirmation (onDataSent) arriving more than PHY_LATE_INTERVALS
+ * connection intervals after the previous one counts as a retried packet.
+ *
+ * Poor links step down to a more robust PHY straight away; a faster PHY is only tried after
+ * several clean windows, so the policy does not flap at the edge of range. The chosen level carries over to the next
+ * connection, as a sensor rarely moves: each connection has its own policy, which is absorbed
+ * into a site wide policy when it ends.
+ *
+ * Per-PHY statistics are kept so the throughput and retry cost of each PHY can be compared
+ * for a site.
+ */
+class PMPhyPolicy
+{
+public:
+    typedef struct {
+        uint32_t connected_ms;      ///< Time spent connected on this PHY
+        uint32_t packets;           ///< Notifications sent
+        uint32_t bytes;             ///< Notification payload bytes sent
+        uint32_t errors;            ///< Writes that failed, or were confirmed late, and so were retried
+        uint32_t link_losses;       ///< Connections lost to a supervision timeout
+    } phy_stats_t;
+
+    /** Restrict the policy to the PHYs both the controller and the application allow. */
+    void set_supported(bool le_2m, bool le_coded)
+    {
+        _min_level = le_2m ? PHY_LEVEL_2M : PHY_LEVEL_1M;
+        _max_level = le_coded ? PHY_LEVEL_CODED_S8 : PHY_LEVEL_1M;
+        if (_level < _min_level) _level = _min_level;
+        if (_level > _max_level) _level = _max_level;
+    }
+
+    /** Start from a level, e.g. the one the previous connection ended on. */
+    void set_level(uint8_t level)
+    {
+        _level = (level < _min_level) ? _min_level : (level > _max_level) ? _max_level : level;
+        _clean_windows = 0;
+    }
+
+    /** Add the statistics of a finished connection, and carry on from the level it reached. */
+    void absorb(const PMPhyPolicy &other)
+    {
+        for (uint8_t i = 0; i < PHY_LEVELS; i++) {
+            _stats[i].connected_ms += other._stats[i].connected_ms;
+            _stats[i].packets += other._stats[i].packets;
+            _stats[i].bytes += other._stats[i].bytes;
+            _stats[i].errors += other._stats[i].errors;
+            _stats[i].link_losses += other._stats[i].link_losses;
+        }
+        set_level(other._level);
+    }
+
+    /** Latest RSSI of the connection, or PHY_RSSI_UNKNOWN. */
+    void set_rssi(int8_t rssi)
+    {
+        _rssi = rssi;
+    }
+
+    /** Record the PHY actually in use, from the PHY update event. */
+    void set_active(uint8_t level)
+    {
+        _active = level;
+    }
+
+    /** Connection interval in use, which sets when a confirmation counts as late. */
+    void set_interval_us(uint32_t interval_us)
+    {
+        _interval_us = interval_us;
+    }
+
+    /** A notification was queued in the stack at now_us. */
+    void on_sent(uint16_t bytes, uint32_t now_us)
+    {
+        _window_packets++;
+        _stats[_active].packets++;
+        _stats[_active].bytes += bytes;
+        if (!_unconfirmed++) _confirm_us = now_us;
+    }
+
+    /** The stack confirmed a notification of this connection at now_us. */
+    void on_data_sent(uint32_t now_us)
+    {
+        if (!_unconfirmed) return;
+        _unconfirmed--;
+        uint32_t gap_us = now_us - _confirm_us;
+        _confirm_us = now_us;
+        if (_interval_us && gap_us > _interval_us * PHY_LATE_INTERVALS) {
+            on_error();
+        }
+    }
+
+    void on_error()
+    {
+        _window_errors++;
+        _stats[_active].errors++;
+    }
+
+    /** A lost link steps down immediately, and is counted against the PHY in use. */
+    void on_link_loss()
+    {
+        _stats[_active].link_losses++;
+        step_down();
+    }
+
+    void on_connected_time(uint32_t ms)
+    {
+        _stats[_active].connected_ms += ms;
+    }
+
+    /**
+     * Close the current evaluation window.
+     *
+     * @returns The PHY level the connection should use.
+     */
+    uint8_t evaluate()
+    {
+        uint32_t total = _window_packets + _window_errors;
+        bool errors_high = (total >= PHY_MIN_WINDOW_PACKETS) &&
+                           (_window_errors * 100 > total * PHY_MAX_ERROR_PERCENT);
+        bool rssi_low = (_rssi != PHY_RSSI_UNKNOWN) && (_rssi < rssi_threshold(_level));
+
+        if (errors_high || rssi_low) {
+            step_down();
+        }
+        else if (_window_errors == 0 && total > 0) {
+            _clean_windows++;
+            bool rssi_ok = (_rssi == PHY_RSSI_UNKNOWN) || (_level == _min_level) ||
+                           (_rssi >= rssi_threshold(_level - 1) + PHY_RSSI_HYSTERESIS);
+            if (_clean_windows >= PHY_CLEAN_WINDOWS && rssi_ok && _level > _min_level) {
+                _level--;
+                _clean_windows = 0;
+            }
+        }
+
+        _window_packets = 0;
+        _window_errors = 0;
+        return _level;
+    }
+
+    uint8_t get_level() const
+    {
+        return _level;
+    }
+
+    uint8_t get_active() const
+    {
+        return _active;
+    }
+
+    const phy_stats_t &get_stats(uint8_t level) const
+    {
+        return _stats[level];
+    }
+
+    static const char *level_name(uint8_t level)
+    {
+        static const char *names[PHY_LEVELS] = {"2M", "1M", "Coded S2", "Coded S8"};
+        return (level < PHY_LEVELS) ? names[level] : "?";
+    }
+
+    /** Print throughput and retries for each PHY used so far. */
+    void print_report() const
+    {
+        printf("PHY report:\r\n");
+        for (uint8_t i = 0; i < PHY_LEVELS; i++) {
+            const phy_stats_t &s = _stats[i];
+            if (!s.connected_ms) continue;
+            uint32_t attempts = s.packets + s.errors;
+            printf("  %-8s %lu s connected, %lu bytes/s, %lu packets, %lu%% retried, %lu link losses\r\n",
+                   level_name(i), s.connected_ms / 1000, (uint32_t)(((uint64_t)s.bytes * 1000) / s.connected_ms),
+                   s.packets, attempts ? (s.errors * 100) / attempts : 0, s.link_losses);
+        }
+    }
+
+protected:
+    /** RSSI below which a PHY level is no longer reliable. */
+    static int8_t rssi_threshold(uint8_t level)
+    {
+        static const int8_t thresholds[PHY_LEVELS] = {-75, -82, -90, -128};
+        return thresholds[level];
+    }
+
+    void step_down()
+    {
+        if (_level < _max_level) _level++;
+        _clean_windows = 0;
+    }
+
+protected:
+    uint8_t _level = PHY_LEVEL_2M;
+    uint8_t _active = PHY_LEVEL_1M;
+    uint8_t _min_level = PHY_LEVEL_1M;
+    uint8_t _max_level = PHY_LEVEL_1M;
+    int8_t _rssi = PHY_RSSI_UNKNOWN;
+    uint32_t _interval_us = 0;
+
+    uint32_t _unconfirmed = 0;                  ///< Notifications queued and not yet confirmed
+    uint32_t _confirm_us = 0;                   ///< Last confirmation, or when the queue last filled
+
+    uint32_t _window_packets = 0;
+    uint32_t _window_errors = 0;
+    uint8_t _clean_windows = 0;
+
+    phy_stats_t _stats[PHY_LEVELS] = {};
+};
+
+#endif // PMSENSE_PHY_POLICY_H
@@ -0,0 +1,227 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_POLL_SCHEDULER_H
+#define PMSENSE_POLL_SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "platform/Callback.h"
+
+#define PMPOLL_BACKLOG_WEIGHT           (60u)                ///< Seconds of staleness one waiting record is worth
+#define PMPOLL_ASSUMED_RECORD_S         (10u)                ///< Record interval assumed for nodes that do not broadcast
+#define PMPOLL_MIN_PERIOD_S             (30u)                ///< Shortest time between pulls from one node
+#define PMPOLL_LATENCY_BUCKETS          (10u)
+
+/**
+ * Chooses which node a polling gateway collects from next.
+ *
+ * Each node is scored by its backlog and its staleness. The backlog is the number of interval
+ * records it has made since the last pull, taken from the sequence number in its broadcast
+ * frames; for nodes that do not broadcast, it is estimated from the time since the last pull.
+ * The staleness is the seconds since the last pull. A waiting record counts as
+ * PMPOLL_BACKLOG_WEIGHT seconds, so a busy node is visited sooner, while the staleness term
+ * ensures quiet nodes are still visited.
+ *
+ * Collection latency is the time from a node first having data waiting to that data being
+ * pulled. It is kept in a fixed bucket histogram for percentiles, together with the share of
+ * time the gateway radio held a poll link.
+ *
+ * @tparam N Number of nodes, indexed like the gateway node table.
+ */
+template <size_t N>
+class PMPollScheduler
+{
+public:
+    /** Forget a node, e.g. when its slot in the node table is reused. */
+    void reset(uint8_t index, uint32_t now)
+    {
+        _entries[index] = entry_t();
+        _entries[index].known = true;
+        _entries[index].first_seen_s = now;
+        _entries[index].waiting = true;
+        _entries[index].waiting_since_s = now;
+    }
+
+    /** Record an advertising report, with the record sequence number if it carried a broadcast frame. */
+    void on_seen(uint8_t index, uint32_t now, bool has_seq, uint16_t seq)
+    {
+        entry_t &e = _entries[index];
+        if (has_seq) {
+            if (!e.has_seq) e.pulled_seq = seq;       // count from the first frame heard
+            e.has_seq = true;
+            e.latest_seq = seq;
+        }
+        if (!e.waiting && backlog(index, now)) {
+            e.waiting = true;
+            e.waiting_since_s = now;
+        }
+    }
+
+    /** Records waiting on a node. */
+    uint32_t backlog(uint8_t index, uint32_t now) const
+    {
+        const entry_t &e = _entries[index];
+        if (!e.last_pull_s) return 1;           // never pulled: everything it holds is waiting
+        if (e.has_seq) return (uint16_t)(e.latest_seq - e.pulled_seq);
+        return staleness(index, now) / PMPOLL_ASSUMED_RECORD_S;
+    }
+
+    /** Seconds since a node was last pulled, or first seen. */
+    uint32_t staleness(uint8_t index, uint32_t now) const
+    {
+        const entry_t &e = _entries[index];
+        return now - (e.last_pull_s ? e.last_pull_s : e.first_seen_s);
+    }
+
+    uint32_t priority(uint8_t index, uint32_t now) const
+    {
+        return backlog(index, now) * PMPOLL_BACKLOG_WEIGHT + staleness(index, now);
+    }
+
+    /**
+     * Pick the next node to pull from.
+     *
+     * @param[in] eligible Returns true for nodes that can be connected to now.
+     *
+     * @returns Node index, or -1 if none is due.
+     */
+    int select(uint32_t now, mbed::Callback<bool(uint8_t)> eligible) const
+    {
+        int best = -1;
+        uint32_t best_priority = 0;
+        for (size_t i = 0; i < N; i++) {
+            const entry_t &e = _entries[i];
+            if (!e.known || !eligible(i)) continue;
+            if (e.last_pull_s && (now - e.last_pull_s < PMPOLL_MIN_PERIOD_S || !backlog(i, now))) continue;
+            uint32_t p = priority(i, now);
+            if (best < 0 || p > best_priority) {
+                best = i;
+                best_priority = p;
+            }
+        }
+        return best;
+    }
+
+    /** A pull completed; everything the node held up to now has been collected. */
+    void on_pulled(uint8_t index, uint32_t now, uint32_t samples)
+    {
+        entry_t &e = _entries[index];
+        if (e.waiting) {
+            add_latency(now - e.waiting_since_s);
+        }
+        e.pulled_seq = e.latest_seq;
+        e.last_pull_s = now ? now : 1;
+        e.waiting = false;
+        _pulls++;
+        _samples += samples;
+    }
+
+    void on_failed(uint8_t index)
+    {
+        _failures++;
+    }
+
+    /** Track poll links for radio utilisation. */
+    void on_link(bool up, uint64_t now_ms)
+    {
+        account(now_ms);
+        if (up) _links++;
+        else if (_links) _links--;
+    }
+
+    /** Upper bound in seconds of the bucket holding the given percentile of collection latency. */
+    uint32_t latency_percentile(uint8_t percent) const
+    {
+        uint32_t total = 0;
+        for (uint8_t i = 0; i < PMPOLL_LATENCY_BUCKETS; i++) total += _latency[i];
+        if (!total) return 0;
+
+        uint32_t target = (total * percent + 99) / 100;
+        uint32_t count = 0;
+        for (uint8_t i = 0; i < PMPOLL_LATENCY_BUCKETS; i++) {
+            count += _latency[i];
+            if (count >= target) return bucket_limit(i);
+        }
+        return bucket_limit(PMPOLL_LATENCY_BUCKETS - 1);
+    }
+
+    /** Percent of the time since the first link that a poll link was held. */
+    uint32_t utilisation(uint64_t now_ms)
+    {
+        account(now_ms);
+        uint64_t elapsed = now_ms - _start_ms;
+        return elapsed ? (uint32_t)((_busy_ms * 100) / elapsed) : 0;
+    }
+
+    void print_report(uint64_t now_ms)
+    {
+        printf("Poll report: %lu pulls, %lu samples, %lu failures, radio %lu%% busy\r\n", _pulls, _samples,
+               _failures, utilisation(now_ms));
+        printf("  Collection latency p50 <= %lu s, p90 <= %lu s, p99 <= %lu s\r\n", latency_percentile(50),
+               latency_percentile(90), latency_percentile(99));
+    }
+
+protected:
+    typedef struct {
+        bool known;
+        bool has_seq;
+        uint16_t latest_seq;            ///< Newest record broadcast
+        uint16_t pulled_seq;            ///< Newest record broadcast when last pulled
+        uint32_t first_seen_s;
+        uint32_t last_pull_s;           ///< 0 if never pulled
+        bool waiting;                   ///< Data is waiting to be pulled
+        uint32_t waiting_since_s;       ///< When data was first waiting after the last pull
+    } entry_t;
+
+    static uint32_t bucket_limit(uint8_t bucket)
+    {
+        static const uint32_t limits[PMPOLL_LATENCY_BUCKETS] = {10, 30, 60, 120, 300, 600, 1200, 1800, 3600, UINT32_MAX};
+        return limits[bucket];
+    }
+
+    void add_latency(uint32_t seconds)
+    {
+        uint8_t i = 0;
+        while (i < PMPOLL_LATENCY_BUCKETS - 1 && seconds > bucket_limit(i)) i++;
+        _latency[i]++;
+    }
+
+    void account(uint64_t now_ms)
+    {
+        if (!_start_ms) _start_ms = now_ms ? now_ms : 1;
+        if (_links && _last_ms) _busy_ms += now_ms - _last_ms;
+        _last_ms = now_ms;
+    }
+
+protected:
+    entry_t _entries[N] = {};
+    uint32_t _latency[PMPOLL_LATENCY_BUCKETS] = {0};
+    uint32_t _pulls = 0;
+    uint32_t _samples = 0;
+    uint32_t _failures = 0;
+
+    uint8_t _links = 0;
+    uint64_t _start_ms = 0;
+    uint64_t _last_ms = 0;
+    uint64_t _busy_ms = 0;
+};
+
+#endif // PMSENSE_POLL_SCHEDULER_H
@@ -0,0 +1,217 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_QUEUE_PROBE_H
+#define PMSENSE_QUEUE_PROBE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "platform/mbed_atomic.h"
+#include "PMStats.h"
+
+#if defined(__MBED__)
+#include "cmsis.h"
+#endif
+
+#if defined(DWT_CTRL_CYCCNTENA_Msk)
+#define PMQPROBE_DWT                    (1)
+#else
+#include <time.h>
+#define PMQPROBE_DWT                    (0)
+#endif
+
+// Where work on the event queue comes from
+#define PMQPROBE_SITE_BLE               (0u)                 ///< BLE::processEvents, with the GAP and GATT handlers it runs
+#define PMQPROBE_SITE_ACTIVITY          (1u)                 ///< start_activity() and other BLEApp housekeeping
+#define PMQPROBE_SITE_TIMER             (2u)                 ///< Batch age, connection parameter, PHY and gateway timers
+#define PMQPROBE_SITE_APP               (3u)                 ///< Application work posted through BLEApp::post(), e.g. sensor frames
+#define PMQPROBE_SITE_CALLBACK          (4u)                 ///< User callbacks, timed inside the event that runs them
+#define PMQPROBE_SITES                  (5u)
+
+#define PMQPROBE_SITE_SIZE              (20u)                ///< Per site: events, wait p99 and max, run p99 and max (u32 each)
+#define PMQPROBE_DIAG_SIZE              (4u + PMQPROBE_SITES * PMQPROBE_SITE_SIZE)   ///< u16 high water, u16 depth, then the sites
+
+#define PMQPROBE_MAX_LATENCY_US         (30000000u)          ///< Timed events further out than this are not given a wait time
+
+/**
+ * Instrumentation for an event queue: how long events wait and how long they hold the queue.
+ *
+ * BLEApp::post() stamps each event when it is queued and the stamp travels with it. At dispatch,
+ * the wait since it was queued (or since it fell due, for delayed events) goes into the site's
+ * wait histogram, and the time the handler runs into its run histogram. Periodic events only
+ * record their run time. The number of queued immediate events gives the queue depth and its
+ * high water mark; delayed events are left out, as they can be cancelled.
+ *
+ * Times come from the DWT cycle counter where the core has one, otherwise from clock_gettime.
+ * on_post() can be called from any thread or interrupt; the rest runs on the dispatching thread.
+ */
+class PMQueueProbe
+{
+public:
+    PMQueueProbe()
+    {
+#if PMQPROBE_DWT
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+    }
+
+    /** Count an event being queued. Returns the stamp it carries to on_dispatch(). */
+    uint32_t on_post(bool immediate, uint32_t delay_us = 0)
+    {
+        if (immediate) {
+            uint32_t depth = core_util_atomic_incr_u32(&_depth, 1);
+            if (depth > core_util_atomic_load_u32(&_high_water)) {
+                core_util_atomic_store_u32(&_high_water, depth);
+            }
+        }
+        return now() + delay_us * ticks_per_us();
+    }
+
+    /** An immediate event could not be queued. */
+    void on_post_failed()
+    {
+        core_util_atomic_decr_u32(&_depth, 1);
+    }
+
+    /**
+     * An event is about to run.
+     *
+     * @param[in] due Stamp from on_post(), or 0 for periodic events.
+     *
+     * @returns Stamp to pass to on_done().
+     */
+    uint32_t on_dispatch(uint8_t site, uint32_t due, bool immediate)
+    {
+        uint32_t start = now();
+        if (immediate) {
+            core_util_atomic_decr_u32(&_depth, 1);
+        }
+        if (due) {
+            int32_t late = (int32_t)(start - due);
+            _sites[site].wait.add((late > 0) ? late / ticks_per_us() : 0);
+        }
+        return start;
+    }
+
+    void on_done(uint8_t site, uint32_t start)
+    {
+        _sites[site].run.add((now() - start) / ticks_per_us());
+    }
+
+    void reset()
+    {
+        for (uint8_t i = 0; i < PMQPROBE_SITES; i++) {
+            _sites[i].wait.reset();
+            _sites[i].run.reset();
+        }
+        core_util_atomic_store_u32(&_high_water, core_util_atomic_load_u32(&_depth));
+    }
+
+    /** Dump every site to the console. */
+    void print() const
+    {
+        static const char *names[PMQPROBE_SITES] = {"BLE events", "Activity", "Timers", "Application", "Callbacks"};
+        printf("Event queue: depth %lu, high water %lu\r\n", core_util_atomic_load_u32(&_depth),
+               core_util_atomic_load_u32(&_high_water));
+        for (uint8_t i = 0; i < PMQPROBE_SITES; i++) {
+            const site_t &site = _sites[i];
+            if (!site.run.count()) continue;
+            char name[32];
+            snprintf(name, sizeof(name), "  %s wait", names[i]);
+            site.wait.print(name);
+            snprintf(name, sizeof(name), "  %s run", names[i]);
+            site.run.print(name);
+        }
+    }
+
+    /** Pack the summary for the diagnostics characteristic. Returns PMQPROBE_DIAG_SIZE. */
+    size_t encode(uint8_t buf[PMQPROBE_DIAG_SIZE]) const
+    {
+        uint8_t *p = buf;
+        p = put_u16(p, core_util_atomic_load_u32(&_high_water));
+        p = put_u16(p, core_util_atomic_load_u32(&_depth));
+        for (uint8_t i = 0; i < PMQPROBE_SITES; i++) {
+            const site_t &site = _sites[i];
+            p = put_u32(p, site.run.count());
+            p = put_u32(p, site.wait.percentile(99));
+            p = put_u32(p, site.wait.max());
+            p = put_u32(p, site.run.percentile(99));
+            p = put_u32(p, site.run.max());
+        }
+        return p - buf;
+    }
+
+    uint32_t get_high_water() const
+    {
+        return core_util_atomic_load_u32(&_high_water);
+    }
+
+protected:
+    typedef struct {
+        TimeHistogram wait;             ///< Queued, or due, until dispatched
+        TimeHistogram run;              ///< Handler execution
+    } site_t;
+
+#if PMQPROBE_DWT
+    static uint32_t now()
+    {
+        return DWT->CYCCNT;
+    }
+
+    static uint32_t ticks_per_us()
+    {
+        return SystemCoreClock / 1000000;
+    }
+#else
+    static uint32_t now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    }
+
+    static uint32_t ticks_per_us()
+    {
+        return 1;
+    }
+#endif
+
+    static uint8_t *put_u16(uint8_t *p, uint32_t v)
+    {
+        if (v > UINT16_MAX) v = UINT16_MAX;
+        p[0] = v;
+        p[1] = v >> 8;
+        return p + 2;
+    }
+
+    static uint8_t *put_u32(uint8_t *p, uint32_t v)
+    {
+        for (uint8_t i = 0; i < 4; i++) p[i] = v >> (8 * i);
+        return p + 4;
+    }
+
+protected:
+    site_t _sites[PMQPROBE_SITES];
+    volatile uint32_t _depth = 0;
+    volatile uint32_t _high_water = 0;
+};
+
+#endif // PMSENSE_QUEUE_PROBE_H
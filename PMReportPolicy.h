@@ -0,0 +1,140 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_REPORT_POLICY_H
+#define PMSENSE_REPORT_POLICY_H
+
+#include <stdint.h>
+
+#define REPORT_MODE_ALWAYS              (0x00u)              ///< Notify every interval
+#define REPORT_MODE_ON_CHANGE           (0x01u)              ///< Notify when a value moves beyond the deadband
+#define REPORT_MODE_HEARTBEAT           (0x02u)              ///< Notify every heartbeat intervals only
+
+#define REPORT_POLICY_SIZE              (5u)                 ///< Characteristic value: mode, u16 abs deadband, rel deadband %, heartbeat
+#define REPORT_MAX_VALUES               (6u)
+
+/**
+ * Decides whether an interval result is worth a notification.
+ *
+ * In REPORT_MODE_ON_CHANGE a value is reported when any of its parts differs from the last
+ * reported value by more than the absolute deadband or by more than the relative deadband
+ * (percent of the last reported value). A deadband of 0 is not applied; with both at 0 any
+ * change is reported. A non-zero heartbeat forces a report after that many intervals without one,
+ * so a central can tell a quiet sensor from a lost one.
+ *
+ * The policy is set from a REPORT_POLICY_SIZE byte characteristic value:
+ * u8 mode, u16 absolute deadband (little endian), u8 relative deadband %, u8 heartbeat intervals.
+ */
+class PMReportPolicy
+{
+public:
+    /** Returns true if values should be reported; if so they become the new reference. */
+    bool evaluate(const uint16_t *values, uint8_t n)
+    {
+        if (n > REPORT_MAX_VALUES) n = REPORT_MAX_VALUES;
+        _evaluated++;
+
+        bool report = !_has_last;
+        if (_mode == REPORT_MODE_ALWAYS) {
+            report = true;
+        }
+        else if (_mode == REPORT_MODE_ON_CHANGE) {
+            for (uint8_t i = 0; i < n && !report; i++) {
+                report = changed(_last[i], values[i]);
+            }
+        }
+        if (_heartbeat && _since_report + 1 >= _heartbeat) {
+            report = true;
+        }
+
+        if (report) {
+            for (uint8_t i = 0; i < n; i++) _last[i] = values[i];
+            _has_last = true;
+            _since_report = 0;
+            _reported++;
+        }
+        else {
+            _since_report++;
+        }
+        return report;
+    }
+
+    /** Set the policy from a characteristic value. Returns false if it is invalid. */
+    bool set_config(const uint8_t *data, uint16_t len)
+    {
+        if (len < REPORT_POLICY_SIZE || data[0] > REPORT_MODE_HEARTBEAT) return false;
+        if (data[0] == REPORT_MODE_HEARTBEAT && data[4] == 0) return false;
+
+        _mode = data[0];
+        _abs_deadband = data[1] | (data[2] << 8);
+        _rel_deadband = data[3];
+        _heartbeat = data[4];
+        _since_report = 0;
+        return true;
+    }
+
+    /** Current policy in characteristic format. */
+    void get_config(uint8_t data[REPORT_POLICY_SIZE]) const
+    {
+        data[0] = _mode;
+        data[1] = _abs_deadband;
+        data[2] = _abs_deadband >> 8;
+        data[3] = _rel_deadband;
+        data[4] = _heartbeat;
+    }
+
+    uint32_t get_evaluated() const
+    {
+        return _evaluated;
+    }
+
+    uint32_t get_reported() const
+    {
+        return _reported;
+    }
+
+    uint32_t get_suppressed() const
+    {
+        return _evaluated - _reported;
+    }
+
+protected:
+    bool changed(uint16_t last, uint16_t value) const
+    {
+        uint16_t diff = (value > last) ? (value - last) : (last - value);
+        if (_abs_deadband == 0 && _rel_deadband == 0) return (diff != 0);
+        if (_abs_deadband && diff > _abs_deadband) return true;
+        if (_rel_deadband && (uint32_t)diff * 100 > (uint32_t)last * _rel_deadband) return true;
+        return false;
+    }
+
+protected:
+    uint8_t _mode = REPORT_MODE_ALWAYS;
+    uint16_t _abs_deadband = 0;
+    uint8_t _rel_deadband = 0;
+    uint8_t _heartbeat = 0;
+
+    uint16_t _last[REPORT_MAX_VALUES] = {0};
+    bool _has_last = false;
+    uint16_t _since_report = 0;
+
+    uint32_t _evaluated = 0;
+    uint32_t _reported = 0;
+};
+
+#endif // PMSENSE_REPORT_POLICY_H
@@ -0,0 +1,264 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_SCAN_FILTER_H
+#define PMSENSE_SCAN_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble/BLE.h"
+
+#define PMSCAN_PEER_SLOTS               (64u)                ///< Recent peers remembered, a power of two
+#define PMSCAN_MAX_PROBE                (8u)                 ///< Slots searched for a peer before evicting
+#define PMSCAN_HOLD_MS                  (1000u)              ///< Unchanged reports from a peer dropped for this long
+#define PMSCAN_MAX_SERVICES             (2u)
+#define PMSCAN_MAX_NAME                 (29u)                ///< Longest name that fits in a legacy advertisement
+
+#define PMSCAN_FNV_OFFSET               (2166136261u)
+#define PMSCAN_FNV_PRIME                (16777619u)
+
+/**
+ * Cheap first pass over advertising reports for dense scans.
+ *
+ * is_duplicate() looks the peer up in a fixed open-addressed table of recently heard peers and
+ * drops a report whose payload is unchanged since the last one passed, until PMSCAN_HOLD_MS has
+ * gone by. Each lookup is a hash of the address plus at most PMSCAN_MAX_PROBE slots; when those
+ * are all taken, the least recently passed peer among them is evicted. A peer's advertising
+ * reports and scan responses are tracked apart within its one slot, so an active scan neither
+ * defeats it nor needs twice the slots.
+ *
+ * match() then walks the AD structures of the reports that pass once, without copying them. A
+ * 128-bit service UUID is compared by a precomputed 32-bit fingerprint first, and the name by
+ * its precomputed length, so most fields are rejected without a full compare.
+ *
+ * @tparam SLOTS Size of the recent peer table, a power of two.
+ */
+template <size_t SLOTS = PMSCAN_PEER_SLOTS>
+class PMScanFilter
+{
+    static_assert((SLOTS & (SLOTS - 1)) == 0, "PMScanFilter slots must be a power of two");
+
+public:
+    /**! Result of matching one payload **/
+    typedef struct {
+        bool name;                      ///< Complete local name matched
+        bool service;                   ///< A service UUID matched
+        const uint8_t *manufacturer;    ///< Manufacturer specific data, or nullptr
+        uint8_t manufacturer_len;
+    } match_t;
+
+    /** Set the complete local name to match, or nullptr for none. */
+    void set_name(const char *name)
+    {
+        _name_len = 0;
+        if (!name) return;
+        size_t len = strlen(name);
+        if (len > PMSCAN_MAX_NAME) len = PMSCAN_MAX_NAME;
+        memcpy(_name, name, len);
+        _name_len = len;
+    }
+
+    /** Add a service UUID to match. Returns false if PMSCAN_MAX_SERVICES are already set. */
+    bool add_service(const UUID &uuid)
+    {
+        if (_service_count >= PMSCAN_MAX_SERVICES) return false;
+        _services[_service_count] = uuid;
+        _fingerprints[_service_count] = fingerprint(uuid.getBaseUUID(), uuid.getLen());
+        _service_count++;
+        return true;
+    }
+
+    void clear_services()
+    {
+        _service_count = 0;
+    }
+
+    /**
+     * Check a report against the recent peer table, recording it if it passes.
+     *
+     * @returns true if the same peer sent the same payload less than PMSCAN_HOLD_MS ago.
+     */
+    bool is_duplicate(const ble::peer_address_type_t &type, const ble::address_t &address, bool scan_response,
+                      mbed::Span<const uint8_t> payload, uint32_t now_ms)
+    {
+        _reports++;
+        uint32_t payload_hash = fnv1a(PMSCAN_FNV_OFFSET, payload.data(), payload.size());
+        size_t home = fnv1a(PMSCAN_FNV_OFFSET ^ type.value(), address.data(), address.size()) & (SLOTS - 1);
+
+        size_t victim = SLOTS;
+        for (size_t probe = 0; probe < PMSCAN_MAX_PROBE; probe++) {
+            size_t i = (home + probe) & (SLOTS - 1);
+            peer_t &peer = _peers[i];
+            if (!peer.used) {
+                /* entries are only ever replaced, so the peer is not further along */
+                victim = i;
+                break;
+            }
+            if (peer.address_type == type.value() && memcmp(peer.address, address.data(), sizeof(peer.address)) == 0) {
+                report_t &last = peer.last[scan_response];
+                if (last.payload_hash == payload_hash && now_ms - last.passed_ms < PMSCAN_HOLD_MS) {
+                    _duplicates++;
+                    return true;
+                }
+                last.payload_hash = payload_hash;
+                last.passed_ms = now_ms;
+                peer.passed_ms = now_ms;
+                return false;
+            }
+            if (victim == SLOTS || now_ms - peer.passed_ms > now_ms - _peers[victim].passed_ms) {
+                victim = i;
+            }
+        }
+
+        peer_t &peer = _peers[victim];
+        if (peer.used) _evictions++;
+        peer = peer_t();
+        peer.used = true;
+        peer.address_type = type.value();
+        memcpy(peer.address, address.data(), sizeof(peer.address));
+        peer.last[scan_response].payload_hash = payload_hash;
+        peer.last[scan_response].passed_ms = now_ms;
+        /* the other kind of report has not passed yet: a hash of 0 with a time past the hold */
+        peer.last[!scan_response].passed_ms = now_ms - PMSCAN_HOLD_MS;
+        peer.passed_ms = now_ms;
+        return false;
+    }
+
+    /** Find the name, service UUIDs and manufacturer data in a payload. */
+    match_t match(mbed::Span<const uint8_t> payload) const
+    {
+        match_t result = {false, false, nullptr, 0};
+        const uint8_t *p = payload.data();
+        size_t remaining = payload.size();
+
+        while (remaining >= 2) {
+            uint8_t len = p[0];
+            if (len == 0 || len >= remaining) break;
+            ble::adv_data_type_t::type type = (ble::adv_data_type_t::type)p[1];
+            const uint8_t *value = p + 2;
+            uint8_t value_len = len - 1;
+
+            switch (type) {
+                case ble::adv_data_type_t::COMPLETE_LOCAL_NAME:
+                    result.name |= (_name_len && value_len == _name_len && memcmp(value, _name, _name_len) == 0);
+                    break;
+                case ble::adv_data_type_t::COMPLETE_LIST_128BIT_SERVICE_IDS:
+                case ble::adv_data_type_t::INCOMPLETE_LIST_128BIT_SERVICE_IDS:
+                    result.service |= match_services(value, value_len, UUID::LENGTH_OF_LONG_UUID);
+                    break;
+                case ble::adv_data_type_t::COMPLETE_LIST_16BIT_SERVICE_IDS:
+                case ble::adv_data_type_t::INCOMPLETE_LIST_16BIT_SERVICE_IDS:
+                    result.service |= match_services(value, value_len, sizeof(UUID::ShortUUIDBytes_t));
+                    break;
+                case ble::adv_data_type_t::MANUFACTURER_SPECIFIC_DATA:
+                    result.manufacturer = value;
+                    result.manufacturer_len = value_len;
+                    break;
+                default:
+                    break;
+            }
+            p += len + 1;
+            remaining -= len + 1;
+        }
+        return result;
+    }
+
+    uint32_t get_reports() const
+    {
+        return _reports;
+    }
+
+    uint32_t get_duplicates() const
+    {
+        return _duplicates;
+    }
+
+    uint32_t get_evictions() const
+    {
+        return _evictions;
+    }
+
+protected:
+    typedef struct {
+        uint32_t payload_hash;
+        uint32_t passed_ms;             ///< When this kind of report from the peer last passed
+    } report_t;
+
+    typedef struct {
+        bool used;
+        uint8_t address_type;
+        uint8_t address[6];
+        report_t last[2];               ///< Advertising report, scan response
+        uint32_t passed_ms;             ///< When a report from the peer last passed
+    } peer_t;
+
+    static uint32_t fnv1a(uint32_t hash, const uint8_t *data, size_t len)
+    {
+        for (size_t i = 0; i < len; i++) {
+            hash ^= data[i];
+            hash *= PMSCAN_FNV_PRIME;
+        }
+        return hash;
+    }
+
+    /** UUID bytes folded into one word; short UUIDs are their own fingerprint. */
+    static uint32_t fingerprint(const uint8_t *uuid, size_t len)
+    {
+        uint32_t fp = 0;
+        for (size_t i = 0; i + sizeof(fp) <= len; i += sizeof(fp)) {
+            uint32_t word;
+            memcpy(&word, uuid + i, sizeof(word));
+            fp ^= word;
+        }
+        if (len < sizeof(fp)) {
+            fp = uuid[0] | (uuid[1] << 8);
+        }
+        return fp;
+    }
+
+    bool match_services(const uint8_t *list, size_t len, size_t uuid_len) const
+    {
+        for (size_t i = 0; i + uuid_len <= len; i += uuid_len) {
+            uint32_t fp = fingerprint(list + i, uuid_len);
+            for (uint8_t s = 0; s < _service_count; s++) {
+                if (_fingerprints[s] == fp && _services[s].getLen() == uuid_len &&
+                    memcmp(_services[s].getBaseUUID(), list + i, uuid_len) == 0) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+protected:
+    peer_t _peers[SLOTS] = {};
+
+    char _name[PMSCAN_MAX_NAME] = {0};
+    uint8_t _name_len = 0;
+    UUID _services[PMSCAN_MAX_SERVICES];
+    uint32_t _fingerprints[PMSCAN_MAX_SERVICES] = {0};
+    uint8_t _service_count = 0;
+
+    uint32_t _reports = 0;
+    uint32_t _duplicates = 0;
+    uint32_t _evictions = 0;
+};
+
+#endif // PMSENSE_SCAN_FILTER_H
@@ -0,0 +1,379 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_SAMPLER_H
+#define PMSENSE_SAMPLER_H
+
+#include "mbed.h"
+#include "events/mbed_events.h"
+#include "platform/Callback.h"
+#include "platform/NonCopyable.h"
+
+#include "Panasonic_SNGCJA5.h"
+
+#define SAMPLER_ERR_NONE                (0)
+#define SAMPLER_ERR_I2C                 (-1)                 ///< Transfer could not start or completed with an error
+#define SAMPLER_ERR_SENSOR              (-2)                 ///< Sensor status register reports a fault
+#define SAMPLER_ERR_OVERRUN             (-3)                 ///< Previous acquisition still pending at the next tick
+
+// Phase lock settings (all in ms)
+#define SAMPLER_PERIOD_MIN_MS           (900u)               ///< Limits for the tracked sensor update period
+#define SAMPLER_PERIOD_MAX_MS           (1100u)
+#define SAMPLER_RETRY_MS                (40u)                ///< Re-read delay after a duplicate frame
+#define SAMPLER_GUARD_MS                (20u)                ///< Target read time after a detected sensor update
+#define SAMPLER_NUDGE_MIN_MS            (2u)                 ///< Per frame step used to probe for the update edge
+#define SAMPLER_NUDGE_MAX_MS            (20u)
+#define SAMPLER_PROBE_FRAMES            (10u)                ///< Frames without an edge before the probe step is doubled
+#define SAMPLER_MAX_RETRIES             (3u)                 ///< Duplicates in a row before a frame is treated as unchanged air
+
+/**
+ * Asynchronous, phase-locked acquisition state machine for the SN-GCJA5.
+ *
+ * Every tick the sampler reads the status register using I2C::transfer and, if the sensor
+ * reports no error, chains a burst read of the mass-density and particle count registers.
+ * I2C completion events arrive in interrupt context and are posted back onto the event queue
+ * so the frame callback always runs in the thread dispatching it. Nothing here waits on the
+ * bus, so the event queue stays free for other work during the transfers. The counters and
+ * period are plain members, so read them from that same thread.
+ *
+ * The sensor refreshes its registers about once per second from its own clock. Reading on a
+ * free running 1 s tick would, over time, read the same frame twice or miss one. Instead the
+ * sampler compares each frame with the previous one:
+ * - a duplicate means the read landed before the sensor update. It is dropped and re-read
+ *   SAMPLER_RETRY_MS later, which locates the update edge;
+ * - the next read is then placed SAMPLER_GUARD_MS after the expected update, and moved a
+ *   little earlier every frame so the edge keeps being probed as the clocks drift;
+ * - the time between edges gives the sensor's actual update period, which replaces the
+ *   nominal period.
+ * If the frame stays unchanged for SAMPLER_MAX_RETRIES re-reads the air is taken to be steady,
+ * so the frame is passed on once per period and probing pauses until the data changes again.
+ *
+ * The frame callback is called once per sensor frame with an error code (SAMPLER_ERR_xxx) and,
+ * when the error is SAMPLER_ERR_NONE, the decoded sensor data. Duplicates never reach it.
+ */
+class PMSenseSampler : private mbed::NonCopyable<PMSenseSampler>
+{
+public:
+    typedef mbed::Callback<void(int error, const PM_MDVPC_Data &pmdata)> frame_cb_t;
+
+    PMSenseSampler(Panasonic_SNGCJA5 &sensor) : _sensor(sensor)
+    {
+    }
+
+    /** Set callback for a completed (or failed) acquisition. */
+    void on_frame(frame_cb_t cb)
+    {
+        _frame_cb = cb;
+    }
+
+    /**
+     * Start acquisition on the given event queue.
+     *
+     * @param[in] queue Event queue the frame callback is dispatched on.
+     * @param[in] period Nominal sensor update period.
+     *
+     * @returns True on success.
+     */
+    bool start(events::EventQueue &queue, std::chrono::milliseconds period = 1000ms)
+    {
+        if (_tick_id) return false;
+        _queue = &queue;
+        _period_ms = period.count();
+        _nudge_ms = SAMPLER_NUDGE_MIN_MS;
+        _retries = 0;
+        _edge_valid = false;
+        _last_valid = false;
+        _tick_id = _queue->call(this, &PMSenseSampler::tick);
+        return (_tick_id != 0);
+    }
+
+    /** Stop acquisition. Any transfer in progress is aborted. */
+    void stop()
+    {
+        if (_queue && _tick_id) {
+            _queue->cancel(_tick_id);
+        }
+        _tick_id = 0;
+        abort();
+    }
+
+    bool is_running() const
+    {
+        return (_tick_id != 0);
+    }
+
+    /** Number of acquisitions where the previous transfer was still pending. */
+    uint32_t get_overruns() const
+    {
+        return _overruns;
+    }
+
+    /** Number of duplicate frames dropped. */
+    uint32_t get_duplicates() const
+    {
+        return _duplicates;
+    }
+
+    /** Number of frames dropped because the sensor reported a fault. */
+    uint32_t get_stale() const
+    {
+        return _stale;
+    }
+
+    /** Number of completions dropped because they belonged to an aborted transfer. */
+    uint32_t get_stale_events() const
+    {
+        return _stale_events;
+    }
+
+    /** Number of unchanged frames passed on while the air was steady. */
+    uint32_t get_holdovers() const
+    {
+        return _holdovers;
+    }
+
+    /** The tracked sensor update period in ms. */
+    uint32_t get_period_ms() const
+    {
+        return _period_ms;
+    }
+
+    /** True once the sensor update edge has been located. */
+    bool is_locked() const
+    {
+        return _edge_valid;
+    }
+
+protected:
+    enum state_t {
+        IDLE,
+        READ_STATUS,
+        READ_DATA
+    };
+
+    static uint32_t now_ms()
+    {
+        return (uint32_t)rtos::Kernel::Clock::now().time_since_epoch().count();
+    }
+
+    /** (Re)schedule the next tick. */
+    void schedule_at(uint32_t when_ms)
+    {
+        int32_t delay_ms = (int32_t)(when_ms - now_ms());
+        if (delay_ms < 0) delay_ms = 0;
+        if (_tick_id) {
+            _queue->cancel(_tick_id);
+        }
+        _tick_id = _queue->call_in(std::chrono::milliseconds(delay_ms), this, &PMSenseSampler::tick);
+    }
+
+    /** Start a new acquisition. Runs on the event queue. */
+    void tick()
+    {
+        if (_state != IDLE) {
+            _overruns++;
+            abort();
+            complete(SAMPLER_ERR_OVERRUN);
+        }
+
+        _read_ms = now_ms();
+        if (_retries == 0) {
+            _slot_ms = _read_ms;
+        }
+        // keep acquisition alive should a transfer never complete
+        schedule_at(_slot_ms + _period_ms);
+
+        _txreg[0] = SNGCJA5_STATUS;
+        _state = READ_STATUS;
+        if (!start_transfer(_status, sizeof(_status))) {
+            complete(SAMPLER_ERR_I2C);
+        }
+    }
+
+    bool start_transfer(uint8_t *buff, uint8_t ds)
+    {
+        // a completion still queued from an earlier (aborted) transfer must not be taken for this one
+        uint32_t generation = ++_generation;
+#if DEVICE_I2C_ASYNCH
+        // the callback carries the generation it was started with: one firing after an abort
+        // would otherwise be tagged with the transfer that replaced it
+        return (_sensor.getData_NonBlocking(_txreg, buff, ds, [this, generation](int event) {
+            on_i2c_event(event, generation);
+        }) == 0);
+#else
+        // No asynchronous I2C on this target, so fall back to a blocking read
+        int i2cError = _sensor.getData(_txreg, buff, ds);
+        _queue->call(this, &PMSenseSampler::process_event,
+                     i2cError ? I2C_EVENT_ERROR : I2C_EVENT_TRANSFER_COMPLETE, (uint32_t)_generation);
+        return true;
+#endif
+    }
+
+    /** I2C completion callback. Called in interrupt context, for the transfer of the given generation. */
+    void on_i2c_event(int event, uint32_t generation)
+    {
+        _queue->call(this, &PMSenseSampler::process_event, event, generation);
+    }
+
+    /** Advance the state machine once a transfer has finished. Runs on the event queue. */
+    void process_event(int event, uint32_t generation)
+    {
+        if (generation != _generation) {
+            _stale_events++;
+            return;             // queued by a transfer that has since been aborted
+        }
+        if (_state == IDLE) {
+            return;
+        }
+
+        if (!(event & I2C_EVENT_TRANSFER_COMPLETE) || (event & I2C_EVENT_ERROR)) {
+            complete(SAMPLER_ERR_I2C);
+            return;
+        }
+
+        if (_state == READ_STATUS) {
+            if (_status[0] != 0) {
+                _stale++;
+                complete(SAMPLER_ERR_SENSOR);
+                return;
+            }
+            _txreg[0] = SNGCJA5_ALL;
+            _state = READ_DATA;
+            if (!start_transfer(_data, sizeof(_data))) {
+                complete(SAMPLER_ERR_I2C);
+            }
+        }
+        else {
+            process_frame();
+        }
+    }
+
+    /** Classify the frame just read and place the next read relative to the sensor update. */
+    void process_frame()
+    {
+        if (_last_valid && memcmp(_data, _last, sizeof(_data)) == 0) {
+            _duplicates++;
+            if (_retries < SAMPLER_MAX_RETRIES && !_freewheel) {
+                // read landed before the sensor update, so try again shortly
+                _retries++;
+                _state = IDLE;
+                schedule_at(_read_ms + SAMPLER_RETRY_MS);
+                return;
+            }
+            // the data is genuinely not changing so pass it on and stop probing for now
+            _holdovers++;
+            _retries = 0;
+            _freewheel = true;
+            _pmdata = _sensor.convert2struct(_data);
+            complete(SAMPLER_ERR_NONE);
+            return;
+        }
+
+        uint32_t next_ms;
+        if (_retries > 0 && !_freewheel) {
+            // the update happened between the last two reads
+            uint32_t edge_ms = _read_ms - (SAMPLER_RETRY_MS / 2);
+            if (_edge_valid && _frames_since_edge > 0) {
+                uint32_t measured_ms = (edge_ms - _edge_ms) / _frames_since_edge;
+                if (measured_ms >= SAMPLER_PERIOD_MIN_MS && measured_ms <= SAMPLER_PERIOD_MAX_MS) {
+                    _period_ms += ((int32_t)(measured_ms - _period_ms)) / 4;
+                }
+            }
+            _edge_ms = edge_ms;
+            _edge_valid = true;
+            _frames_since_edge = 0;
+            _nudge_ms = SAMPLER_NUDGE_MIN_MS;
+            next_ms = edge_ms + _period_ms + SAMPLER_GUARD_MS;
+        }
+        else {
+            // step a little earlier each frame so that drift is caught as a duplicate
+            if (_frames_since_edge && (_frames_since_edge % SAMPLER_PROBE_FRAMES) == 0 && _nudge_ms < SAMPLER_NUDGE_MAX_MS) {
+                _nudge_ms *= 2;
+            }
+            next_ms = _slot_ms + _period_ms - (_freewheel ? 0 : _nudge_ms);
+        }
+
+        _frames_since_edge++;
+        _retries = 0;
+        _freewheel = false;
+        memcpy(_last, _data, sizeof(_data));
+        _last_valid = true;
+
+        _pmdata = _sensor.convert2struct(_data);
+        complete(SAMPLER_ERR_NONE);
+        schedule_at(next_ms);
+    }
+
+    void complete(int error)
+    {
+        _state = IDLE;
+        if (error != SAMPLER_ERR_NONE) {
+            _retries = 0;
+        }
+        if (_frame_cb) {
+            _frame_cb(error, _pmdata);
+        }
+    }
+
+    void abort()
+    {
+#if DEVICE_I2C_ASYNCH
+        if (_state != IDLE) {
+            _sensor.abort_NonBlocking();
+        }
+#endif
+        _generation++;
+        _state = IDLE;
+    }
+
+protected:
+    Panasonic_SNGCJA5 &_sensor;
+    events::EventQueue *_queue = nullptr;
+    int _tick_id = 0;
+
+    state_t _state = IDLE;
+    volatile uint32_t _generation = 0;  // transfer the I2C callback belongs to, bumped per transfer and abort
+    // transfer buffers must persist until the I2C callback has fired
+    char _txreg[1] = {SNGCJA5_STATUS};
+    uint8_t _status[1] = {0x00};
+    uint8_t _data[SNGCJA5_DATASIZE] = {'\0'};
+    uint8_t _last[SNGCJA5_DATASIZE] = {'\0'};
+    bool _last_valid = false;
+    PM_MDVPC_Data _pmdata = {};
+
+    // phase lock state
+    uint32_t _period_ms = 1000;
+    uint32_t _slot_ms = 0;              // first read for the current sensor frame
+    uint32_t _read_ms = 0;              // most recent read
+    uint32_t _edge_ms = 0;              // last located sensor update
+    bool _edge_valid = false;
+    bool _freewheel = false;
+    uint16_t _frames_since_edge = 0;
+    uint8_t _nudge_ms = SAMPLER_NUDGE_MIN_MS;
+    uint8_t _retries = 0;
+
+    uint32_t _overruns = 0;
+    uint32_t _duplicates = 0;
+    uint32_t _stale = 0;
+    uint32_t _holdovers = 0;
+    uint32_t _stale_events = 0;
+
+    frame_cb_t _frame_cb;
+};
+
+#endif // PMSENSE_SAMPLER_H
@@ -0,0 +1,135 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2020 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PMSenseService.h"
+
+#if BLE_FEATURE_GATT_SERVER
+
+static constexpr PMGattUUID SERVICE_UUID = pmgatt_uuid(PMSENSE_SERVICE_UUID);
+static constexpr PMGattUUID COUNT_UUID = pmgatt_uuid(PMSENSE_COUNT_UUID);
+static constexpr PMGattUUID HISTOGRAM_UUID = pmgatt_uuid("20220214-1e1e-1e1e-1e1e-f8f381aa84ed");
+static constexpr PMGattUUID DENSITY_UUID = pmgatt_uuid("20220214-1414-1414-1414-f8f381aa84ed");
+static constexpr PMGattUUID STATUS_UUID = pmgatt_uuid("20220214-1717-1717-1717-f8f381aa84ed");
+static constexpr PMGattUUID INTERVAL_UUID = pmgatt_uuid("20220214-1616-1616-1616-f8f381aa84ed");
+
+/* opaque structures, no exponent, unit = concentration (count per m3) */
+static constexpr PMGattFormat COUNT_FORMAT = pmgatt_format(PMGATT_FORMAT_STRUCT, 0, PMGATT_UNIT_COUNT_PER_M3);
+/* opaque structure, no exponent, unit = mass density (kg per m3); the description gives the scale */
+static constexpr PMGattFormat DENSITY_FORMAT = pmgatt_format(PMGATT_FORMAT_STRUCT, 0, PMGATT_UNIT_KG_PER_M3);
+/* unsigned 8 bit integer, no exponent, unit = time (second) */
+static constexpr PMGattFormat INTERVAL_FORMAT = pmgatt_format(PMGATT_FORMAT_UINT8, 0, PMGATT_UNIT_SECOND);
+
+static const uint8_t READ = GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ;
+static const uint8_t WRITE = GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE;
+static const uint8_t NOTIFY = GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY;
+
+PMSenseService::PMSenseService() :
+    _count(COUNT_UUID, READ | NOTIFY, "+0.5um and +2.5um PM Counts", &COUNT_FORMAT),
+    _histogram(HISTOGRAM_UUID, READ, "0.3, 0.5, 1.0, 2.5, 5.0 and 7.5um Particle Counts", &COUNT_FORMAT),
+    _density(DENSITY_UUID, READ, "PM1.0, PM2.5 and PM10 Mass Density (0.001 ug/m3)", &DENSITY_FORMAT),
+    _status(STATUS_UUID, READ, "Status (1: error, 2: partial, 4: unsent)"),
+    _interval(INTERVAL_UUID, READ | WRITE, "Update Interval (>= 10 sec)", &INTERVAL_FORMAT)
+{
+}
+
+ble_error_t PMSenseService::add_service(BLE &ble, uint8_t interval, GattCharacteristic *extra[], uint8_t extra_count)
+{
+    if (extra_count > PMSENSE_MAX_EXTRA) {
+        return BLE_ERROR_PARAM_OUT_OF_RANGE;
+    }
+
+    _count.setReadAuthorizationCallback(this, &PMSenseService::on_read);
+    _histogram.setReadAuthorizationCallback(this, &PMSenseService::on_read);
+    _density.setReadAuthorizationCallback(this, &PMSenseService::on_read);
+    _status.setReadAuthorizationCallback(this, &PMSenseService::on_read);
+    _interval.value()[0] = interval;
+
+    GattCharacteristic *table[5 + PMSENSE_MAX_EXTRA] = {&_count, &_interval, &_histogram, &_density, &_status};
+    uint8_t count = 5;
+    for (uint8_t i = 0; i < extra_count; i++) {
+        table[count++] = extra[i];
+    }
+
+    GattService service(SERVICE_UUID, table, count);
+    return ble.gattServer().addService(service);
+}
+
+void PMSenseService::publish(const PM_MDVPC_Data &pmdata, uint8_t status)
+{
+    uint16_t counts[PMSENSE_COUNT_VALUES];
+    count_values(pmdata, counts);
+    uint8_t *p = _count.value();
+    for (uint8_t i = 0; i < PMSENSE_COUNT_VALUES; i++) {
+        *p++ = counts[i] >> 8;
+        *p++ = counts[i];
+    }
+
+    p = _histogram.value();
+    p = put_u16(p, pmdata.reg1_pc);
+    p = put_u16(p, pmdata.reg2_pc);
+    p = put_u16(p, pmdata.reg3_pc);
+    p = put_u16(p, pmdata.reg4_pc);
+    p = put_u16(p, pmdata.reg5_pc);
+    put_u16(p, pmdata.reg6_pc);
+
+    p = _density.value();
+    p = put_u32(p, pmdata.pm10_mdv);
+    p = put_u32(p, pmdata.pm25_mdv);
+    put_u32(p, pmdata.pm100_mdv);
+
+    _status.value()[0] = status;
+    _published = true;
+}
+
+void PMSenseService::count_values(const PM_MDVPC_Data &pmdata, uint16_t values[PMSENSE_COUNT_VALUES])
+{
+    // We want the counts for 0.5um and above
+    uint32_t pm05_cnt = (uint32_t)pmdata.reg2_pc + pmdata.reg3_pc;
+    uint32_t pm25_cnt = (uint32_t)pmdata.reg4_pc + pmdata.reg5_pc + pmdata.reg6_pc;
+    values[0] = (pm05_cnt > UINT16_MAX) ? UINT16_MAX : pm05_cnt;
+    values[1] = (pm25_cnt > UINT16_MAX) ? UINT16_MAX : pm25_cnt;
+}
+
+void PMSenseService::on_read(GattReadAuthCallbackParams *params)
+{
+    /* until the first reading, reads get the initial value held by the stack */
+    if (_published) {
+        GattCharacteristic *chars[] = {&_count, &_histogram, &_density, &_status};
+        for (GattCharacteristic *c : chars) {
+            if (c->getValueHandle() == params->handle) {
+                params->data = c->getValueAttribute().getValuePtr();
+                params->len = c->getValueAttribute().getMaxLength();
+            }
+        }
+    }
+    params->authorizationReply = AUTH_CALLBACK_REPLY_SUCCESS;
+}
+
+uint8_t *PMSenseService::put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+uint8_t *PMSenseService::put_u32(uint8_t *p, uint32_t v)
+{
+    for (uint8_t i = 0; i < 4; i++) p[i] = v >> (8 * i);
+    return p + 4;
+}
+
+#endif // BLE_FEATURE_GATT_SERVER
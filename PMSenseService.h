@@ -19,42 +19,87 @@
 #define BLE_PM_SENSE_SERVICE_H
 
 #include "ble/BLE.h"
+#include "Panasonic_SNGCJA5.h"
+#include "PMGattTable.h"
 
 #if BLE_FEATURE_GATT_SERVER
 
-/** This is a custom Particulate Matter Sensing which exposes PM counts and the Sample Update frequency.
+// The service UUID is also advertised, and both are used by gateways to find PMsense nodes
+#define PMSENSE_SERVICE_UUID            "20220214-1313-1313-1313-f8f381aa84ed"
+#define PMSENSE_COUNT_UUID              "20220214-1515-1515-1515-f8f381aa84ed"
+
+#define PMSENSE_COUNT_VALUES            (2u)                 ///< 0.5um to 2.5um, and 2.5um and above
+#define PMSENSE_COUNT_SIZE              (PMSENSE_COUNT_VALUES * 2u)     ///< u16 each, most significant byte first
+#define PMSENSE_HISTOGRAM_BINS          (6u)
+#define PMSENSE_HISTOGRAM_SIZE          (PMSENSE_HISTOGRAM_BINS * 2u)   ///< u16 each: 0.3, 0.5, 1.0, 2.5, 5.0 and 7.5um
+#define PMSENSE_DENSITY_SIZE            (12u)                ///< u32 each: PM1.0, PM2.5 and PM10 in 0.001 ug/m3
+#define PMSENSE_STATUS_SIZE             (1u)                 ///< PMBCAST_STATUS_xxx flags
+#define PMSENSE_MAX_EXTRA               (8u)                 ///< Characteristics a firmware may add to the service
+
+/** This is a custom Particulate Matter Sensing service which exposes the sensor readings and the update interval.
  *
- * The PM Count characteristic added is read and notify only. Do no construct this class.
- * Use the static method add_service to add the chosen Device Information Service characteristics to the server.
+ * The service owns its characteristics: PM Counts (read, notify), the six-bin particle count
+ * histogram, the PM1.0, PM2.5 and PM10 mass densities and the status (read only), and the update
+ * interval (read, write). Define it at file scope so the whole table is in static storage.
  *
- * You can read the specification of the service on the bluetooth website, currently at:
- * https://www.bluetooth.com/specifications/specs/
- * Otherwise search the website for "Device Information Service".
+ * publish() encodes a reading straight into the characteristic value buffers, and reads are
+ * answered from those buffers, so publishing costs no GATT writes. Notifying subscribers, and
+ * handling interval writes, is left to the firmware, which may also add its own characteristics
+ * to the service.
+ *
+ * All values are little endian, except PM Counts which keeps its original most significant
+ * byte first order.
  */
 class PMSenseService {
 public:
-    /** Adds device-specific information into the BLE stack. This must only be called once.
+    PMSenseService();
+
+    /** Adds the service to the BLE stack. This must only be called once.
      *
      * @param[in] ble A reference to a BLE object for the underlying controller.
-     * @param[in] Custom Gatt Service UUID.
-     * @param[in] Custom Characteristic UUID for PM Counts.
-     * @param[in] Custom Characteristic UUID for PM Intervals.
-     *
-     * @note Do not call more than once. Calling this multiple times will create multiple
-     * instances of the service which is against the spec.
+     * @param[in] interval Update interval in seconds returned until a central writes its own.
+     * @param[in] extra Further characteristics of the firmware, added to the end of the service.
+     * @param[in] extra_count Number of extra characteristics, up to PMSENSE_MAX_EXTRA.
      */
-    static ble_error_t add_service(
-        BLE &ble,
-        const char *gattservice_uuid    = nullptr,
-        const char *pmcountchar_uuid    = nullptr,
-        const char *pmintervalchar_uuid = nullptr
-    );
+    ble_error_t add_service(BLE &ble, uint8_t interval, GattCharacteristic *extra[] = nullptr, uint8_t extra_count = 0);
+
+    /** Encode an interval reading into the characteristic values, with its PMBCAST_STATUS_xxx flags. */
+    void publish(const PM_MDVPC_Data &pmdata, uint8_t status = 0);
+
+    /** The PM Count values of a reading: 0.5um to 2.5um, and 2.5um and above, saturated to 16 bits. */
+    static void count_values(const PM_MDVPC_Data &pmdata, uint16_t values[PMSENSE_COUNT_VALUES]);
+
+    GattAttribute::Handle_t count_handle() const
+    {
+        return _count.getValueHandle();
+    }
+
+    GattAttribute::Handle_t interval_handle() const
+    {
+        return _interval.getValueHandle();
+    }
+
+    /** For a firmware to answer interval reads itself, e.g. per connection. */
+    GattCharacteristic &interval_characteristic()
+    {
+        return _interval;
+    }
+
+private:
+    void on_read(GattReadAuthCallbackParams *params);
+
+    static uint8_t *put_u16(uint8_t *p, uint16_t v);
+    static uint8_t *put_u32(uint8_t *p, uint32_t v);
 
 private:
-    PMSenseService() = delete;
-    ~PMSenseService() = delete;
+    PMGattCharacteristic<PMSENSE_COUNT_SIZE> _count;
+    PMGattCharacteristic<PMSENSE_HISTOGRAM_SIZE> _histogram;
+    PMGattCharacteristic<PMSENSE_DENSITY_SIZE> _density;
+    PMGattCharacteristic<PMSENSE_STATUS_SIZE> _status;
+    PMGattCharacteristic<sizeof(uint8_t)> _interval;
+    bool _published = false;
 };
 
 #endif // BLE_FEATURE_GATT_SERVER
 
-#endif /* #ifndef BLE_DEVICE_INFORMATION_SERVICE_H */
+#endif /* #ifndef BLE_PM_SENSE_SERVICE_H */
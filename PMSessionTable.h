@@ -0,0 +1,153 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_SESSION_TABLE_H
+#define PMSENSE_SESSION_TABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ble/BLE.h"
+
+/**
+ * Fixed table of per-connection sessions, looked up by connection handle.
+ *
+ * A slot keeps its index for as long as its connection lasts, so other per-connection state can
+ * be kept in parallel arrays indexed the same way. Each session also records the value handles
+ * its central has enabled updates on.
+ *
+ * @tparam Session Session type, with at least bool used, ble::connection_handle_t handle and
+ * GattAttribute::Handle_t subscriptions[SUBSCRIPTIONS] (0 for a free entry).
+ * @tparam N Number of slots.
+ * @tparam SUBSCRIPTIONS Length of Session::subscriptions.
+ */
+template <typename Session, uint8_t N, uint8_t SUBSCRIPTIONS>
+class PMSessionTable
+{
+public:
+    Session &operator[](uint8_t index)
+    {
+        return _sessions[index];
+    }
+
+    const Session &operator[](uint8_t index) const
+    {
+        return _sessions[index];
+    }
+
+    /** Claim a free slot for a new connection, if fewer than limit are in use. Returns nullptr otherwise. */
+    Session *open(ble::connection_handle_t connHandle, uint8_t limit = N)
+    {
+        if (count() >= limit) return nullptr;
+        for (uint8_t i = 0; i < N; i++) {
+            if (!_sessions[i].used) {
+                _sessions[i] = Session();
+                _sessions[i].used = true;
+                _sessions[i].handle = connHandle;
+                return &_sessions[i];
+            }
+        }
+        return nullptr;
+    }
+
+    /** Free every slot. */
+    void clear()
+    {
+        for (uint8_t i = 0; i < N; i++) {
+            _sessions[i].used = false;
+        }
+    }
+
+    /** Session for a connection, or nullptr. */
+    Session *get(ble::connection_handle_t connHandle)
+    {
+        int8_t i = index_of(connHandle);
+        return (i < 0) ? nullptr : &_sessions[i];
+    }
+
+    /** Slot of a connection's session (0 to N - 1), or -1. */
+    int8_t index_of(ble::connection_handle_t connHandle) const
+    {
+        for (uint8_t i = 0; i < N; i++) {
+            if (_sessions[i].used && _sessions[i].handle == connHandle) return i;
+        }
+        return -1;
+    }
+
+    /** Session in a slot, or nullptr if the slot is free. */
+    Session *at(uint8_t index)
+    {
+        return (index < N && _sessions[index].used) ? &_sessions[index] : nullptr;
+    }
+
+    uint8_t count() const
+    {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < N; i++) {
+            if (_sessions[i].used) count++;
+        }
+        return count;
+    }
+
+    /** Number of sessions with updates enabled on the characteristic. */
+    uint8_t subscriber_count(GattAttribute::Handle_t ValueHandle) const
+    {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < N; i++) {
+            if (_sessions[i].used && is_subscribed(_sessions[i], ValueHandle)) count++;
+        }
+        return count;
+    }
+
+    /** True if the session has updates enabled on the characteristic. */
+    static bool is_subscribed(const Session &s, GattAttribute::Handle_t ValueHandle)
+    {
+        for (uint8_t i = 0; i < SUBSCRIPTIONS; i++) {
+            if (s.subscriptions[i] == ValueHandle) return true;
+        }
+        return false;
+    }
+
+    /** Record a CCCD enabled by a session's central. Returns false if its subscription list is full. */
+    static bool add_subscription(Session &s, GattAttribute::Handle_t ValueHandle)
+    {
+        int8_t free_slot = -1;
+        for (uint8_t i = 0; i < SUBSCRIPTIONS; i++) {
+            if (s.subscriptions[i] == ValueHandle) return true;
+            if (!s.subscriptions[i] && free_slot < 0) free_slot = i;
+        }
+        if (free_slot < 0) {
+            printf("Subscription table full for connection %u\r\n", s.handle);
+            return false;
+        }
+        s.subscriptions[free_slot] = ValueHandle;
+        return true;
+    }
+
+    static void remove_subscription(Session &s, GattAttribute::Handle_t ValueHandle)
+    {
+        for (uint8_t i = 0; i < SUBSCRIPTIONS; i++) {
+            if (s.subscriptions[i] == ValueHandle) s.subscriptions[i] = 0;
+        }
+    }
+
+protected:
+    Session _sessions[N] = {};
+};
+
+#endif // PMSENSE_SESSION_TABLE_H
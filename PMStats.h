@@ -0,0 +1,270 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_STATS_H
+#define PMSENSE_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Panasonic_SNGCJA5.h"
+
+#define PMSTATS_FRAC_BITS               (8u)                 ///< Fractional bits used for the running mean and variance
+#define PMSTATS_HIST_BUCKETS            (21u)                ///< Power of two buckets; the last holds 2^19 us (0.5 s) and up
+
+/**
+ * Overflow-safe streaming statistics for one sensor channel.
+ *
+ * Keeps the sample count, a 32-bit sum, min, max and a running variance using Welford's method
+ * in fixed point (Q.8), so every update is O(1) and the footprint is constant however many samples
+ * are added. The remainder of each mean step is carried into the next, so the mean stays exact to
+ * Q.8 however long the run; otherwise it stops following the data once a step is below 1/256 of
+ * the count. Samples may take the whole range of T, up to 32 bits: the sum saturates rather than
+ * wraps, each variance step is multiplied without overflow, and the sum of squared deviations
+ * saturates once it no longer fits in 64 bits (a variance well beyond UINT32_MAX, which is what
+ * variance() then reports).
+ *
+ * @tparam T Sample type (uint16_t for particle counts, uint32_t for mass densities).
+ */
+template <typename T>
+class StreamingStats
+{
+    static_assert(sizeof(T) <= sizeof(uint32_t), "StreamingStats samples are at most 32 bits");
+
+public:
+    StreamingStats()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        _count = 0;
+        _sum = 0;
+        _min = 0;
+        _max = 0;
+        _mean_q = 0;
+        _mean_rem = 0;
+        _m2_q = 0;
+    }
+
+    /** Add a sample. */
+    void update(T x)
+    {
+        _count++;
+        if (_count == 1) {
+            _min = x;
+            _max = x;
+        }
+        else {
+            if (x < _min) _min = x;
+            if (x > _max) _max = x;
+        }
+
+        _sum = (_sum > UINT32_MAX - x) ? UINT32_MAX : _sum + x;
+
+        // Welford: mean += delta/n; m2 += delta * (x - new mean)
+        int64_t x_q = (int64_t)x << PMSTATS_FRAC_BITS;
+        int64_t delta = x_q - _mean_q;
+        // n * mean + remainder is the exact Q.8 sum
+        int64_t step = delta + _mean_rem;
+        _mean_q += step / (int64_t)_count;
+        _mean_rem = step % (int64_t)_count;
+        int64_t spread = x_q - _mean_q;
+        // both terms have the sign of delta, except through rounding, when the step is dropped
+        if ((delta > 0 && spread > 0) || (delta < 0 && spread < 0)) {
+            uint64_t m2_step = mul_q(abs_q(delta), abs_q(spread));
+            _m2_q = (_m2_q > UINT64_MAX - m2_step) ? UINT64_MAX : _m2_q + m2_step;
+        }
+    }
+
+    uint32_t count() const
+    {
+        return _count;
+    }
+
+    uint32_t sum() const
+    {
+        return _sum;
+    }
+
+    T min() const
+    {
+        return _min;
+    }
+
+    T max() const
+    {
+        return _max;
+    }
+
+    /** Rounded mean of the samples, or 0 if there are none. */
+    T mean() const
+    {
+        return (T)((_mean_q + (1 << (PMSTATS_FRAC_BITS - 1))) >> PMSTATS_FRAC_BITS);
+    }
+
+    /** Population variance in the squared sample unit, or 0 if there are fewer than 2 samples. */
+    uint32_t variance() const
+    {
+        if (_count < 2) return 0;
+        uint64_t var = (_m2_q / _count) >> PMSTATS_FRAC_BITS;
+        return (var > UINT32_MAX) ? UINT32_MAX : (uint32_t)var;
+    }
+
+protected:
+    static uint64_t abs_q(int64_t v)
+    {
+        return (v < 0) ? (uint64_t)(-v) : (uint64_t)v;
+    }
+
+    /** Product of two Q.8 magnitudes (each below 2^40) in Q.8, saturated to 64 bits. */
+    static uint64_t mul_q(uint64_t a, uint64_t b)
+    {
+        if (a <= UINT32_MAX && b <= UINT32_MAX) {
+            return (a * b) >> PMSTATS_FRAC_BITS;
+        }
+        // one term is 2^32 or more: drop its fraction bits before multiplying instead of after
+        if (a < b) {
+            uint64_t t = a;
+            a = b;
+            b = t;
+        }
+        a >>= PMSTATS_FRAC_BITS;
+        return (b && a > UINT64_MAX / b) ? UINT64_MAX : a * b;
+    }
+
+    uint32_t _count;
+    uint32_t _sum;
+    T _min;
+    T _max;
+    int64_t _mean_q;
+    int64_t _mean_rem;
+    uint64_t _m2_q;
+};
+
+/** Aggregates sensor frames over a reporting interval for all six count bins and three mass densities. */
+class PMIntervalAggregator
+{
+public:
+    void reset()
+    {
+        for (uint8_t i = 0; i < 3; i++) mdv[i].reset();
+        for (uint8_t i = 0; i < 6; i++) pc[i].reset();
+    }
+
+    void update(const PM_MDVPC_Data &pmdata)
+    {
+        mdv[0].update(pmdata.pm10_mdv);
+        mdv[1].update(pmdata.pm25_mdv);
+        mdv[2].update(pmdata.pm100_mdv);
+        pc[0].update(pmdata.reg1_pc);
+        pc[1].update(pmdata.reg2_pc);
+        pc[2].update(pmdata.reg3_pc);
+        pc[3].update(pmdata.reg4_pc);
+        pc[4].update(pmdata.reg5_pc);
+        pc[5].update(pmdata.reg6_pc);
+    }
+
+    uint32_t count() const
+    {
+        return pc[0].count();
+    }
+
+    /** Interval averages as a sensor frame. */
+    PM_MDVPC_Data mean() const
+    {
+        PM_MDVPC_Data pmdata;
+        pmdata.pm10_mdv = mdv[0].mean();
+        pmdata.pm25_mdv = mdv[1].mean();
+        pmdata.pm100_mdv = mdv[2].mean();
+        pmdata.reg1_pc = pc[0].mean();
+        pmdata.reg2_pc = pc[1].mean();
+        pmdata.reg3_pc = pc[2].mean();
+        pmdata.reg4_pc = pc[3].mean();
+        pmdata.reg5_pc = pc[4].mean();
+        pmdata.reg6_pc = pc[5].mean();
+        return pmdata;
+    }
+
+    StreamingStats<uint32_t> mdv[3];        ///< PM1.0, PM2.5 and PM10 mass densities
+    StreamingStats<uint16_t> pc[6];         ///< 0.3, 0.5, 1.0, 2.5, 5.0 and 7.5um particle counts
+};
+
+/**
+ * Histogram of times in microseconds, for jitter and latency.
+ *
+ * Bucket 0 holds 0 us and bucket b holds [2^(b-1), 2^b) us, so resolution follows the scale of
+ * the value and a fixed footprint covers microseconds to seconds. Percentiles are reported as
+ * the upper bound of the bucket they fall in.
+ */
+class TimeHistogram
+{
+public:
+    void reset()
+    {
+        for (uint8_t i = 0; i < PMSTATS_HIST_BUCKETS; i++) _buckets[i] = 0;
+        _count = 0;
+        _max = 0;
+    }
+
+    void add(uint32_t us)
+    {
+        uint8_t b = 0;
+        while (b < PMSTATS_HIST_BUCKETS - 1 && (us >> b)) b++;
+        _buckets[b]++;
+        _count++;
+        if (us > _max) _max = us;
+    }
+
+    uint32_t count() const
+    {
+        return _count;
+    }
+
+    uint32_t max() const
+    {
+        return _max;
+    }
+
+    /** Upper bound in us of the bucket holding the given percentile, or 0 if empty. */
+    uint32_t percentile(uint8_t percent) const
+    {
+        if (!_count) return 0;
+        uint32_t target = ((uint64_t)_count * percent + 99) / 100;
+        uint32_t seen = 0;
+        for (uint8_t b = 0; b < PMSTATS_HIST_BUCKETS; b++) {
+            seen += _buckets[b];
+            if (seen >= target) return (b == PMSTATS_HIST_BUCKETS - 1) ? _max : (1u << b) - 1;
+        }
+        return _max;
+    }
+
+    void print(const char *name) const
+    {
+        printf("%s: p50 <= %lu us, p90 <= %lu us, p99 <= %lu us, max %lu us over %lu\r\n", name, percentile(50),
+               percentile(90), percentile(99), _max, _count);
+    }
+
+protected:
+    uint32_t _buckets[PMSTATS_HIST_BUCKETS] = {0};
+    uint32_t _count = 0;
+    uint32_t _max = 0;
+};
+
+#endif // PMSENSE_STATS_H
@@ -0,0 +1,363 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_TIMESERIES_H
+#define PMSENSE_TIMESERIES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "Panasonic_SNGCJA5.h"
+
+#define PMTS_BLOCK_SIZE                 (256u)               ///< Bytes of encoded samples per block
+#define PMTS_FIELDS                     (9u)                 ///< Values per sample (3 mass densities, 6 counts)
+#define PMTS_MAX_SAMPLE_SIZE            (3u + 5u + (PMTS_FIELDS * 5u))
+#define PMTS_INDEX_SIZE                 (12u)                ///< RAM per block for the block index
+
+/** Unsigned LEB128 style varint helpers used by the time-series encoder. */
+inline uint8_t pmts_put_varint(uint8_t *p, uint32_t v)
+{
+    uint8_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+inline uint32_t pmts_get_varint(const uint8_t *&p)
+{
+    uint32_t v = 0;
+    uint8_t shift = 0;
+    while (*p & 0x80) {
+        v |= (uint32_t)(*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+    v |= (uint32_t)(*p++) << shift;
+    return v;
+}
+
+inline uint32_t pmts_zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+inline int32_t pmts_unzigzag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+/**
+ * Compressed in-RAM ring buffer of per-second sensor frames.
+ *
+ * Samples are packed into fixed size blocks. The first sample of a block is stored in full
+ * (its timestamp is kept in the block index) so each block decodes on its own. Every following
+ * sample stores one varint holding a bitmask of the fields that changed and the time step
+ * (0 to 2 s inline, otherwise an extra varint), then a zig-zag varint delta for each changed field.
+ * Air that barely changes costs under 2 bytes per sample instead of the 28 of a raw frame; with
+ * the Poisson noise of real 1 Hz particle counts, where nearly every field changes every second,
+ * it is nearer 7 to 12 bytes (tools/host/timeseries_bench).
+ *
+ * Appending is O(1); when every block is used the oldest block is dropped. Lookup by timestamp
+ * is a binary search over the block index, so random access is block granular. Every sample is
+ * also given a sequence number, one more than the previous sample, which can be used to resume
+ * reading where a previous reader stopped.
+ *
+ * @tparam BLOCKS Number of blocks held.
+ * @tparam BLOCK_SIZE Encoded bytes per block.
+ */
+template <size_t BLOCKS, size_t BLOCK_SIZE = PMTS_BLOCK_SIZE>
+class PMTimeSeries
+{
+public:
+    /** Read position used to walk the series. */
+    typedef struct {
+        uint32_t block;             ///< Block sequence number
+        uint32_t seq;               ///< Sequence number of the next sample
+        uint16_t index;             ///< Next sample within the block
+        uint16_t offset;            ///< Byte offset of that sample
+        uint32_t timestamp;         ///< Decoder state: previous sample
+        uint32_t fields[PMTS_FIELDS];
+    } cursor_t;
+
+    /** Append a sample. Timestamps are in seconds and should not go backwards. */
+    void append(uint32_t timestamp, const PM_MDVPC_Data &pmdata)
+    {
+        uint32_t fields[PMTS_FIELDS];
+        to_fields(pmdata, fields);
+        uint8_t enc[PMTS_MAX_SAMPLE_SIZE];
+
+        if (_next_block != _first_block && timestamp >= _prev_ts) {
+            block_t &b = _index[(_next_block - 1) % BLOCKS];
+            uint8_t len = encode_delta(timestamp - _prev_ts, fields, enc);
+            if (b.used + len <= BLOCK_SIZE && b.count < UINT16_MAX) {
+                memcpy(_data[(_next_block - 1) % BLOCKS] + b.used, enc, len);
+                b.used += len;
+                b.count++;
+                store_prev(timestamp, fields);
+                _samples++;
+                _next_seq++;
+                _bytes += len;
+                return;
+            }
+        }
+
+        // start a new block, dropping the oldest if all are in use
+        if (_next_block - _first_block == BLOCKS) {
+            const block_t &old = _index[_first_block % BLOCKS];
+            _samples -= old.count;
+            _bytes -= old.used;
+            _first_block++;
+            _evicted++;
+        }
+        block_t &b = _index[_next_block % BLOCKS];
+        uint8_t len = 0;
+        for (uint8_t f = 0; f < PMTS_FIELDS; f++) {
+            len += pmts_put_varint(enc + len, fields[f]);
+        }
+        memcpy(_data[_next_block % BLOCKS], enc, len);
+        b.start_ts = timestamp;
+        b.first_seq = _next_seq++;
+        b.count = 1;
+        b.used = len;
+        _next_block++;
+        store_prev(timestamp, fields);
+        _samples++;
+        _bytes += len;
+    }
+
+    /**
+     * Position a cursor at the start of the block holding the given timestamp
+     * (or the oldest block if the timestamp is older than anything held).
+     *
+     * @returns False if the series is empty.
+     */
+    bool seek(uint32_t timestamp, cursor_t &c) const
+    {
+        if (_next_block == _first_block) return false;
+
+        uint32_t lo = _first_block, hi = _next_block - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo + 1) / 2;
+            if (_index[mid % BLOCKS].start_ts <= timestamp) lo = mid;
+            else hi = mid - 1;
+        }
+        c.block = lo;
+        c.seq = _index[lo % BLOCKS].first_seq;
+        c.index = 0;
+        c.offset = 0;
+        return true;
+    }
+
+    /**
+     * Position a cursor at the sample with the given sequence number (or the oldest sample
+     * if it has already been dropped).
+     *
+     * @returns False if the sample has not been appended yet.
+     */
+    bool seek_seq(uint32_t seq, cursor_t &c) const
+    {
+        if (_next_block == _first_block || seq >= _next_seq) return false;
+
+        uint32_t lo = _first_block, hi = _next_block - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo + 1) / 2;
+            if (_index[mid % BLOCKS].first_seq <= seq) lo = mid;
+            else hi = mid - 1;
+        }
+        c.block = lo;
+        c.seq = _index[lo % BLOCKS].first_seq;
+        c.index = 0;
+        c.offset = 0;
+
+        // decode up to the requested sample
+        uint32_t timestamp;
+        PM_MDVPC_Data pmdata;
+        while (c.seq < seq && read(c, timestamp, pmdata)) {
+        }
+        return true;
+    }
+
+    /** Position a cursor at the oldest sample held. */
+    bool seek_oldest(cursor_t &c) const
+    {
+        c.block = _first_block;
+        c.seq = (_next_block != _first_block) ? _index[_first_block % BLOCKS].first_seq : _next_seq;
+        c.index = 0;
+        c.offset = 0;
+        return (_next_block != _first_block);
+    }
+
+    /**
+     * Decode the sample at the cursor and advance it. The sample's sequence number is c.seq - 1
+     * on return.
+     *
+     * @returns False at the end of the series or if the cursor's block has been dropped.
+     */
+    bool read(cursor_t &c, uint32_t &timestamp, PM_MDVPC_Data &pmdata) const
+    {
+        if (c.block < _first_block) return false;
+
+        while (c.block < _next_block) {
+            const block_t &b = _index[c.block % BLOCKS];
+            if (c.index < b.count) {
+                const uint8_t *base = _data[c.block % BLOCKS];
+                const uint8_t *p = base + c.offset;
+                if (c.index == 0) {
+                    c.timestamp = b.start_ts;
+                    for (uint8_t f = 0; f < PMTS_FIELDS; f++) {
+                        c.fields[f] = pmts_get_varint(p);
+                    }
+                }
+                else {
+                    uint32_t hdr = pmts_get_varint(p);
+                    uint32_t dt = hdr & 0x03;
+                    if (dt == 3) dt = pmts_get_varint(p);
+                    c.timestamp += dt;
+                    for (uint8_t f = 0; f < PMTS_FIELDS; f++) {
+                        if (hdr & (1u << (f + 2))) {
+                            c.fields[f] += pmts_unzigzag(pmts_get_varint(p));
+                        }
+                    }
+                }
+                c.offset = p - base;
+                c.index++;
+                c.seq++;
+                timestamp = c.timestamp;
+                from_fields(c.fields, pmdata);
+                return true;
+            }
+            c.block++;
+            c.index = 0;
+            c.offset = 0;
+            if (c.block < _next_block) c.seq = _index[c.block % BLOCKS].first_seq;
+        }
+        return false;
+    }
+
+    /** Timestamp of the oldest sample held. */
+    uint32_t oldest_timestamp() const
+    {
+        return (_next_block != _first_block) ? _index[_first_block % BLOCKS].start_ts : 0;
+    }
+
+    /** Timestamp of the newest sample held. */
+    uint32_t newest_timestamp() const
+    {
+        return _prev_ts;
+    }
+
+    /** Sequence number the next appended sample will get. */
+    uint32_t next_seq() const
+    {
+        return _next_seq;
+    }
+
+    uint32_t samples() const
+    {
+        return _samples;
+    }
+
+    /** Encoded bytes currently in use. */
+    uint32_t bytes_used() const
+    {
+        return _bytes;
+    }
+
+    /** Number of blocks dropped to make room. */
+    uint32_t get_evicted() const
+    {
+        return _evicted;
+    }
+
+protected:
+    typedef struct {
+        uint32_t start_ts;
+        uint32_t first_seq;
+        uint16_t count;
+        uint16_t used;
+    } block_t;
+    static_assert(sizeof(block_t) == PMTS_INDEX_SIZE, "PMTS_INDEX_SIZE must match the block index entry");
+
+    uint8_t encode_delta(uint32_t dt, const uint32_t fields[PMTS_FIELDS], uint8_t *enc) const
+    {
+        uint32_t hdr = (dt < 3) ? dt : 3;
+        for (uint8_t f = 0; f < PMTS_FIELDS; f++) {
+            if (fields[f] != _prev[f]) hdr |= (1u << (f + 2));
+        }
+        uint8_t len = pmts_put_varint(enc, hdr);
+        if (dt >= 3) len += pmts_put_varint(enc + len, dt);
+        for (uint8_t f = 0; f < PMTS_FIELDS; f++) {
+            if (fields[f] != _prev[f]) {
+                len += pmts_put_varint(enc + len, pmts_zigzag((int32_t)(fields[f] - _prev[f])));
+            }
+        }
+        return len;
+    }
+
+    void store_prev(uint32_t timestamp, const uint32_t fields[PMTS_FIELDS])
+    {
+        _prev_ts = timestamp;
+        memcpy(_prev, fields, sizeof(_prev));
+    }
+
+    static void to_fields(const PM_MDVPC_Data &pmdata, uint32_t fields[PMTS_FIELDS])
+    {
+        fields[0] = pmdata.pm10_mdv;
+        fields[1] = pmdata.pm25_mdv;
+        fields[2] = pmdata.pm100_mdv;
+        fields[3] = pmdata.reg1_pc;
+        fields[4] = pmdata.reg2_pc;
+        fields[5] = pmdata.reg3_pc;
+        fields[6] = pmdata.reg4_pc;
+        fields[7] = pmdata.reg5_pc;
+        fields[8] = pmdata.reg6_pc;
+    }
+
+    static void from_fields(const uint32_t fields[PMTS_FIELDS], PM_MDVPC_Data &pmdata)
+    {
+        pmdata.pm10_mdv = fields[0];
+        pmdata.pm25_mdv = fields[1];
+        pmdata.pm100_mdv = fields[2];
+        pmdata.reg1_pc = fields[3];
+        pmdata.reg2_pc = fields[4];
+        pmdata.reg3_pc = fields[5];
+        pmdata.reg4_pc = fields[6];
+        pmdata.reg5_pc = fields[7];
+        pmdata.reg6_pc = fields[8];
+    }
+
+protected:
+    uint8_t _data[BLOCKS][BLOCK_SIZE];
+    block_t _index[BLOCKS];
+    uint32_t _first_block = 0;
+    uint32_t _next_block = 0;
+    uint32_t _next_seq = 0;
+
+    // encoder state: last sample appended
+    uint32_t _prev_ts = 0;
+    uint32_t _prev[PMTS_FIELDS] = {0};
+
+    uint32_t _samples = 0;
+    uint32_t _bytes = 0;
+    uint32_t _evicted = 0;
+};
+
+#endif // PMSENSE_TIMESERIES_H
@@ -0,0 +1,106 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMSENSE_UPDATE_CURSOR_H
+#define PMSENSE_UPDATE_CURSOR_H
+
+#include <stdint.h>
+
+#include "platform/mbed_assert.h"
+
+/**
+ * A central's place in the interval history, moved on only once the stack confirms an update.
+ *
+ * One update is in flight at a time: begin() notes the records it covers and confirm(), from
+ * onDataSent, moves past them. A confirmation with nothing in flight, because updates were
+ * disabled or the link dropped after the notification was queued, moves nothing and is counted.
+ *
+ * A confirmation takes exactly one update off the count in flight, and a new update may only
+ * start from none, so the cursor can never pass records whose update was not confirmed as long
+ * as the next update is started after the confirming callback has returned, not from inside it:
+ * then a callback delivered twice finds nothing in flight the second time.
+ */
+class PMUpdateCursor
+{
+public:
+    /** Start at seq with nothing in flight. */
+    void reset(uint32_t seq)
+    {
+        _seq = seq;
+        _inflight = 0;
+        _records = 0;
+    }
+
+    /** Next record the central has not been sent. */
+    uint32_t seq() const
+    {
+        return _seq;
+    }
+
+    bool in_flight() const
+    {
+        return _inflight != 0;
+    }
+
+    /** Confirmations that arrived with nothing in flight. */
+    uint32_t get_unmatched() const
+    {
+        return _unmatched;
+    }
+
+    /** Move past records without sending them, when none is in flight. */
+    void skip_to(uint32_t seq)
+    {
+        if (!_inflight) _seq = seq;
+    }
+
+    /** An update covering records from seq() on was queued. */
+    void begin(uint8_t records)
+    {
+        MBED_ASSERT(_inflight == 0);
+        _inflight = 1;
+        _records = records;
+    }
+
+    /** Forget the update in flight; it is sent again from seq(). */
+    void cancel()
+    {
+        _inflight = 0;
+    }
+
+    /** The stack confirmed the update in flight. Returns the records moved past. */
+    uint8_t confirm()
+    {
+        if (!_inflight) {
+            _unmatched++;
+            return 0;
+        }
+        _inflight--;
+        MBED_ASSERT(_inflight == 0);
+        _seq += _records;
+        return _records;
+    }
+
+protected:
+    uint32_t _seq = 0;
+    uint8_t _inflight = 0;              // updates queued and not yet confirmed, at most one
+    uint8_t _records = 0;               // records the update in flight covers
+    uint32_t _unmatched = 0;
+};
+
+#endif // PMSENSE_UPDATE_CURSOR_H
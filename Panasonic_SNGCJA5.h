@@ -38,6 +38,8 @@
 #define SNGCJA5_REG6                    (0x18u)              ///< 7.5um Particle Count
 
 #define SNGCJA5_STATUS                  (0x26u)
+#define SNGCJA5_DATASIZE                (0x1Au)              ///< Mass-density and particle count registers (0x00 to 0x19)
+#define SNGCJA5_BLOCKSIZE               (0x27u)              ///< Full register block from SNGCJA5_ALL up to and including SNGCJA5_STATUS
 #define TIME2FIRSTREAD                  8s
 #define UNSTABLECOUNTER                 (20u)
 
@@ -69,22 +71,55 @@ public:
     
 	int getData(char* reg, uint8_t *buff, uint8_t ds) {
         int readAck = 2;
+        _busTimer.reset();
+        _busTimer.start();
         readAck = _i2c.write(_i2cAddress, reg, 1, true);
         if (readAck != 2) {                 // 2 = timeout
             wait_us(600);
             readAck = _i2c.read(_i2cAddress, (char*)buff, ds, false);
 
         }
+        _busTimer.stop();
+        _busTransactions++;
+        _busBlocked_us += _busTimer.elapsed_time().count();
         return readAck;
     }
 
+    /** Reads mass-density, all six particle counts and the status byte in a single
+     *  burst transaction starting at SNGCJA5_ALL.
+     *
+     * @param[out] pmdata The decoded sensor payload.
+     * @param[out] status The sensor status register (0 = no sensor error).
+     *
+     * @returns 0 on success, otherwise the I2C error code.
+     */
+    int readAll(PM_MDVPC_Data &pmdata, uint8_t &status) {
+        char reg[1] = {SNGCJA5_ALL};
+        uint8_t PMbuffer[SNGCJA5_BLOCKSIZE] = {'\0'};
+        int readAck = getData(reg, PMbuffer, sizeof(PMbuffer));
+        if (readAck == 0) {
+            status = PMbuffer[SNGCJA5_STATUS];
+            pmdata = convert2struct(PMbuffer);
+        }
+        return readAck;
+    }
+
+#if DEVICE_I2C_ASYNCH
     int getData_NonBlocking (char* reg, uint8_t *buff, uint8_t ds, const event_callback_t &cb) {
         int readAck = 2;            // Returns zero if the transfer has started, or -1 if I2C peripheral is busy
         // With this sensor only 1 byte is ever transferred before data is returned
+        // Note: reg and buff must remain valid until the callback has fired
         readAck = _i2c.transfer(_i2cAddress, reg, 1, (char*)buff, ds, cb);
+        if (readAck == 0) _busTransactions++;
         return readAck;
     }
 
+    /** Abort an ongoing non-blocking transfer, e.g. when its callback never arrived. */
+    void abort_NonBlocking() {
+        _i2c.abort_transfer();
+    }
+#endif
+
     uint32_t convert4byte(uint8_t buff[4]) {
         uint32_t Val = (buff[0] | buff[1] <<8 | buff[2] <<16 | buff[3] <<24);
         return Val;
@@ -120,12 +155,32 @@ public:
 
         return pmdata;
     }
+
+    /** Number of register read transactions (address write + data read) issued on the bus. */
+    uint32_t getBusTransactions() const {
+        return _busTransactions;
+    }
+
+    /** Total time in microseconds spent blocked inside getData(). */
+    uint64_t getBusBlockedTime_us() const {
+        return _busBlocked_us;
+    }
+
+    void resetBusCounters() {
+        _busTransactions = 0;
+        _busBlocked_us = 0;
+    }
 	
     
 protected:
 	// the memory buffer for the sensor
     I2C &_i2c;
     uint8_t _i2cAddress;
+
+    // bus usage counters
+    Timer _busTimer;
+    uint32_t _busTransactions = 0;
+    uint64_t _busBlocked_us = 0;
 };
 
 #endif // I2C_SN_GCJA5_H
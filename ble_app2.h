@@ -27,8 +27,43 @@
 #include "platform/Callback.h"
 #include "platform/NonCopyable.h"
 
+#include "PMBatchRing.h"
+#include "PMPhyPolicy.h"
+#include "PMScanFilter.h"
+#include "PMStats.h"
+#include "PMQueueProbe.h"
+#include "PMSessionTable.h"
+
+#ifdef MBED_CONF_APP_EVENT_QUEUE_PROBE
+#define BLEAPP_QUEUE_PROBE              (MBED_CONF_APP_EVENT_QUEUE_PROBE)
+#else
+#define BLEAPP_QUEUE_PROBE              (0)
+#endif
+
 
 static const uint16_t MAX_ADVERTISING_PAYLOAD_SIZE = 50;
+static const uint16_t MAX_BATCH_PAYLOAD_SIZE = 244;        // notification payload for an ATT MTU of 247
+static const uint16_t DEFAULT_ATT_MTU = 23;
+static const uint8_t MAX_SESSION_SUBSCRIPTIONS = 6;        // CCCDs one connection can enable
+static const uint8_t BATCH_RING_SAMPLES = 32;              // batched samples kept for the slowest central
+static const uint8_t MAX_BATCH_SAMPLE_SIZE = 16;
+static const uint8_t MAX_BROADCAST_DATA_SIZE = 26;         // legacy payload less the flags and AD header
+static const uint16_t MAX_EXTENDED_ADVERTISING_PAYLOAD_SIZE = 191;  // fits a single AUX_SYNC_IND
+#ifdef MBED_CONF_APP_MAX_SESSIONS
+static const uint8_t MAX_SESSIONS = MBED_CONF_APP_MAX_SESSIONS;  // centrals served at once
+#else
+static const uint8_t MAX_SESSIONS = 1;
+#endif
+static const std::chrono::milliseconds PHY_EVALUATION_PERIOD = std::chrono::seconds(5);
+
+// connection parameter management
+static const std::chrono::milliseconds CONN_PARAM_UPDATE_DELAY = std::chrono::seconds(5);  // let the central finish discovery first
+static const uint32_t CONN_INTERVAL_MIN_US = 50000;
+static const uint32_t CONN_INTERVAL_MAX_US = 1000000;
+static const uint32_t CONN_MAX_SLEEP_US = 8000000;          // longest time between connection events we take part in
+static const uint32_t CONN_BULK_INTERVAL_MIN_US = 7500;
+static const uint32_t CONN_BULK_INTERVAL_MAX_US = 30000;
+static const uint32_t CONN_EVENT_ACTIVE_US = 2000;          // estimated radio on time per connection event (wake up, empty PDUs)
 
 /**
  * This is a simplified app that handles running a BLE process for you. This will initialise the instance
@@ -44,10 +79,39 @@ static const uint16_t MAX_ADVERTISING_PAYLOAD_SIZE = 50;
  * Use the stop() method to end the BLE process. This will stop servicing the event queue and shutdown
  * the BLE instance. This will cause the start() method that started it to return.
  *
+ * Up to MAX_SESSIONS centrals can be connected at once. Each has a session holding its ATT MTU, the
+ * characteristics it subscribed to, its batch cursor, connection parameters and PHY policy; data
+ * is published once and notified to each subscribed session.
+ *
+ * Work goes onto the event queue through post(), post_in() and post_every(). With the
+ * event-queue-probe option these stamp each event for PMQueueProbe; without it they are the
+ * plain EventQueue calls.
  */
 class BLEApp : private mbed::NonCopyable<BLEApp>, public ble::Gap::EventHandler, public ble::GattServer::EventHandler
 {
 public:
+    /** State kept for each connected central. */
+    typedef struct {
+        bool used;
+        ble::connection_handle_t handle;
+        uint16_t att_mtu;
+        GattAttribute::Handle_t subscriptions[MAX_SESSION_SUBSCRIPTIONS];  ///< Value handles with updates enabled, 0 if free
+        uint16_t interval;                  ///< Update interval the central asked for in seconds, 0 for the default
+        uint32_t batch_cursor;              ///< Next shared batch sample to send this central
+
+        // connection parameters
+        uint32_t report_period_us;
+        bool bulk_transfer;
+        int conn_param_id;
+
+        // runtime PHY selection
+        PMPhyPolicy phy_policy;
+        uint8_t phy_requested;
+        int64_t phy_since_us;               ///< Start of the time not yet accounted to the PHY in use
+    } session_t;
+
+    typedef PMSessionTable<session_t, MAX_SESSIONS, MAX_SESSION_SUBSCRIPTIONS> session_table_t;
+
     /**
      * Construct a BLEApp from a BLE instance.
      * Call start() to initiate ble processing.
@@ -75,10 +139,17 @@ public:
             return;
         }
 
+        _latency_timer.start();
+
         /* Register the BLEApp as the handler for gap events */
         _gap_handler.addEventHandler(this);
         _ble.gap().setEventHandler(&_gap_handler);
 
+        /* and for gatt server events, once: the chain does not skip a handler added twice,
+         * so adding it per connection would deliver every callback once per connection made */
+        _gatt_server_handler.addEventHandler(this);
+        _ble.gattServer().setEventHandler(&_gatt_server_handler);
+
 
         /* This will inform us of all events so we can schedule their handling
          * using our event queue */
@@ -91,7 +162,7 @@ public:
         );
 
         if (error) {
-            print_error(error, "Error returned by BLE::init.\r\n");
+            print_error(error, "Error returned by BLE::init.");
             return;
         }
 
@@ -109,7 +180,7 @@ public:
     void stop()
     {
         /* let any left over events run */
-        _event_queue.call([this]() {
+        post(PMQPROBE_SITE_ACTIVITY, [this]() {
             if (_ble.hasInitialized()) {
                 _ble.shutdown();
                 printf("Ble App stopped.\r\n");
@@ -117,6 +188,7 @@ public:
             _event_queue.break_dispatch();
 
             _connected = false;
+            _sessions.clear();
             _is_connecting = false;
             _is_scanning = false;
             _gap_handler = ChainableGapEventHandler();
@@ -164,7 +236,7 @@ public:
     {
         ble_error_t error = _ble.gattServer().addService(newService);
         if (error) {
-            print_error(error, "Error adding new Gatt service.\r\n");
+            print_error(error, "Error adding new Gatt service.");
             return false;
         }
         
@@ -187,16 +259,16 @@ public:
                     memcpy(new_uuid, uuidstr, length);
                 }
 
-                _event_queue.call([this,new_uuid]() {
+                post(PMQPROBE_SITE_ACTIVITY, [this,new_uuid]() {
                     delete _GATT_uuid128;
                     _GATT_uuid128 = new_uuid;
-                    _event_queue.call([this]() { start_activity(); });
+                    post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
                 });
             }
             return true;
         }
         else {
-            print_error(BLE_ERROR_NONE, "Short GATT UUID already set\r\n");
+            print_error(BLE_ERROR_NONE, "Short GATT UUID already set");
         }
 
         return false;
@@ -207,15 +279,15 @@ public:
     {
         if (!_GATT_uuid128) {
             if (uuidval > 0) {
-                _event_queue.call([this,uuidval]() {
+                post(PMQPROBE_SITE_ACTIVITY, [this,uuidval]() {
                     _GATT_uuid16 = uuidval;
-                    _event_queue.call([this]() { start_activity(); });
+                    post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
                 });
             }
             return true;
         }
         else {
-            print_error(BLE_ERROR_NONE, "Long GATT UUID already set\r\n");
+            print_error(BLE_ERROR_NONE, "Long GATT UUID already set");
         }
 
         return false;
@@ -235,15 +307,79 @@ public:
             memcpy(new_name, advertising_name, length);
         }
 
-        _event_queue.call([this,new_name]() {
+        post(PMQPROBE_SITE_ACTIVITY, [this,new_name]() {
             delete _advertising_name;
             _advertising_name = new_name;
-            _event_queue.call([this]() { start_activity(); });
+            post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
         });
 
         return true;
     }
 
+    /**
+     * Run f on the event queue. Use this rather than the queue itself, so the probe sees the work.
+     *
+     * Safe from any thread; PMQPROBE_SITE_xxx says where the work comes from.
+     *
+     * @returns Event id, or 0 if the queue is full.
+     */
+    template <typename F>
+    int post(uint8_t site, F f)
+    {
+#if BLEAPP_QUEUE_PROBE
+        uint32_t due = _queue_probe.on_post(true);
+        int id = _event_queue.call([this, site, due, f]() {
+            uint32_t start = _queue_probe.on_dispatch(site, due, true);
+            f();
+            _queue_probe.on_done(site, start);
+        });
+        if (!id) _queue_probe.on_post_failed();
+        return id;
+#else
+        return _event_queue.call(f);
+#endif
+    }
+
+    /** Run f on the event queue after delay. */
+    template <typename Duration, typename F>
+    int post_in(uint8_t site, Duration delay, F f)
+    {
+#if BLEAPP_QUEUE_PROBE
+        uint32_t delay_us = std::chrono::duration_cast<std::chrono::microseconds>(delay).count();
+        uint32_t due = (delay_us <= PMQPROBE_MAX_LATENCY_US) ? _queue_probe.on_post(false, delay_us) : 0;
+        return _event_queue.call_in(delay, [this, site, due, f]() {
+            uint32_t start = _queue_probe.on_dispatch(site, due, false);
+            f();
+            _queue_probe.on_done(site, start);
+        });
+#else
+        return _event_queue.call_in(delay, f);
+#endif
+    }
+
+    /** Run f on the event queue every period. */
+    template <typename Duration, typename F>
+    int post_every(uint8_t site, Duration period, F f)
+    {
+#if BLEAPP_QUEUE_PROBE
+        return _event_queue.call_every(period, [this, site, f]() {
+            uint32_t start = _queue_probe.on_dispatch(site, 0, false);
+            f();
+            _queue_probe.on_done(site, start);
+        });
+#else
+        return _event_queue.call_every(period, f);
+#endif
+    }
+
+#if BLEAPP_QUEUE_PROBE
+    /** Event queue wait and run times, for the console and the diagnostics characteristic. */
+    PMQueueProbe &queue_probe()
+    {
+        return _queue_probe;
+    }
+#endif
+
     /** Set name we want to connect to. */
     bool set_target_name(const char *target_name)
     {
@@ -258,15 +394,198 @@ public:
             memcpy(new_name, target_name, length);
         }
 
-        _event_queue.call([this,new_name]() {
+        post(PMQPROBE_SITE_ACTIVITY, [this,new_name]() {
             delete _target_name;
             _target_name = new_name;
-            _event_queue.call([this]() { start_activity(); });
+            _scan_filter.set_name(new_name);
+            post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
         });
 
         return true;
     }
 
+    /**
+     * Enable broadcast mode, or update the broadcast data if already enabled.
+     *
+     * The data is advertised as manufacturer specific data (starting with the company id), and
+     * the service UUID and name move to the scan response. The payload is refreshed in place,
+     * so advertising carries on uninterrupted, and advertising continues as scannable only while
+     * a single connection is held. Pass nullptr to return to normal advertising.
+     * Call from the event queue.
+     *
+     * @returns False if the data does not fit in a legacy advertising payload.
+     */
+    bool set_broadcast_data(const uint8_t *data, uint8_t len)
+    {
+        if (len > MAX_BROADCAST_DATA_SIZE) {
+            return false;
+        }
+
+        bool was_broadcasting = (_broadcast_len > 0);
+        _broadcast_len = data ? len : 0;
+        if (_broadcast_len) {
+            memcpy(_broadcast_data, data, _broadcast_len);
+        }
+
+        if (was_broadcasting != (_broadcast_len > 0) || !_ble.gap().isAdvertisingActive(_adv_handle)) {
+            /* scan response and advertising type change with the mode */
+            post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
+            return true;
+        }
+
+        ble_error_t error = update_advertising_payload();
+        if (error) {
+            print_error(error, "Broadcast data update failed");
+            return false;
+        }
+        _broadcast_updates++;
+        return true;
+    }
+
+#if BLE_FEATURE_EXTENDED_ADVERTISING && BLE_FEATURE_PERIODIC_ADVERTISING
+    /**
+     * Broadcast data on a second, non-connectable extended advertising set, and repeat it with
+     * periodic advertising so a scanner can sync to the set once and then receive each update
+     * at a known time instead of scanning. The legacy connectable set is left as it is.
+     *
+     * The set is created on the first call; later calls refresh both payloads in place.
+     * Call from the event queue.
+     *
+     * @param[in] data Manufacturer specific data, starting with the company id.
+     * @param[in] periodic_interval Periodic advertising interval, normally the data update interval.
+     *
+     * @returns False if the controller does not support extended and periodic advertising.
+     */
+    bool set_extended_broadcast_data(const uint8_t *data, uint16_t len, std::chrono::milliseconds periodic_interval)
+    {
+        if (_ext_adv_unsupported) return false;
+
+        if (_ext_adv_handle == ble::INVALID_ADVERTISING_HANDLE && !start_extended_advertising(periodic_interval)) {
+            _ext_adv_unsupported = true;
+            return false;
+        }
+
+        uint8_t adv_buffer[MAX_EXTENDED_ADVERTISING_PAYLOAD_SIZE];
+        ble::AdvertisingDataBuilder adv_data_builder(adv_buffer);
+        ble_error_t error = adv_data_builder.setManufacturerSpecificData(mbed::make_Span(data, len));
+        if (error) {
+            print_error(error, "AdvertisingDataBuilder::setManufacturerSpecificData() failed");
+            return false;
+        }
+
+        error = _ble.gap().setAdvertisingPayload(_ext_adv_handle, adv_data_builder.getAdvertisingData());
+        if (error) {
+            print_error(error, "Extended Gap::setAdvertisingPayload() failed");
+            return false;
+        }
+
+        error = _ble.gap().setPeriodicAdvertisingPayload(_ext_adv_handle, adv_data_builder.getAdvertisingData());
+        if (error) {
+            print_error(error, "Gap::setPeriodicAdvertisingPayload() failed");
+            return false;
+        }
+
+        if (!_ble.gap().isPeriodicAdvertisingActive(_ext_adv_handle)) {
+            /* periodic advertising needs a payload before it can start */
+            error = _ble.gap().startPeriodicAdvertising(_ext_adv_handle);
+            if (error) {
+                print_error(error, "Gap::startPeriodicAdvertising() failed");
+                return false;
+            }
+            printf("Periodic advertising started\r\n");
+        }
+        return true;
+    }
+#endif
+
+    /**
+     * Choose the PHY of each connection at runtime instead of a fixed preference.
+     * Each connection starts from the PHY that worked last time and is re-evaluated every
+     * PHY_EVALUATION_PERIOD. Call once BLE is initialised.
+     *
+     * @param[in] allow_coded Allow the long range Coded PHY, if the controller supports it.
+     */
+    void enable_phy_policy(bool allow_coded = true)
+    {
+        _phy_le_2m = _ble.gap().isFeatureSupported(ble::controller_supported_features_t::LE_2M_PHY);
+        _phy_le_coded = allow_coded && _ble.gap().isFeatureSupported(ble::controller_supported_features_t::LE_CODED_PHY);
+        _phy_site.set_supported(_phy_le_2m, _phy_le_coded);
+
+        /* let the controller accept any PHY the policy may ask for */
+        ble::phy_set_t phys(/* 1M */ true, /* 2M */ _phy_le_2m, /* coded */ _phy_le_coded);
+        ble_error_t error = _ble.gap().setPreferredPhys(/* tx */&phys, /* rx */&phys);
+        if (error) {
+            print_error(error, "GAP::setPreferedPhys failed");
+            return;
+        }
+        _phy_policy_enabled = true;
+        printf("PHY policy enabled (2M %s, Coded %s), starting on %s\r\n", _phy_le_2m ? "yes" : "no",
+               _phy_le_coded ? "yes" : "no", PMPhyPolicy::level_name(_phy_site.get_level()));
+    }
+
+    /** PHY policy of a connection, e.g. to feed it the RSSI or errors seen outside BLEApp. Returns nullptr if not connected. */
+    PMPhyPolicy *phy_policy(ble::connection_handle_t connHandle)
+    {
+        session_t *s = get_session(connHandle);
+        return s ? &s->phy_policy : nullptr;
+    }
+
+    /** Clock the PHY policies time notifications and their confirmations by. */
+    uint32_t get_phy_time_us() const
+    {
+        return _latency_timer.elapsed_time().count();
+    }
+
+    /** Statistics of every connection so far, and the PHY the next connection starts on. */
+    const PMPhyPolicy &site_phy_policy() const
+    {
+        return _phy_site;
+    }
+
+    /**
+     * Set how often the application sends data on a connection, so it can be slowed down to match.
+     *
+     * The connection interval is set to a fraction of the period and peripheral latency lets the
+     * node sleep through the events in between, so the radio wakes about once per report while
+     * the central can still reach the node within one interval by waiting for it. The supervision
+     * timeout is set to three sleep periods. Parameters are requested CONN_PARAM_UPDATE_DELAY
+     * after connecting, and again whenever the period changes.
+     */
+    void set_report_period(ble::connection_handle_t connHandle, std::chrono::milliseconds period)
+    {
+        session_t *s = get_session(connHandle);
+        if (!s) return;
+        uint32_t period_us = period.count() * 1000;
+        if (period_us == s->report_period_us) return;
+        s->report_period_us = period_us;
+        if (!s->bulk_transfer && !s->conn_param_id) {
+            request_connection_parameters(*s, false);
+        }
+    }
+
+    /** Shorten the connection interval for a bulk transfer until end_bulk_transfer() is called. */
+    void begin_bulk_transfer(ble::connection_handle_t connHandle)
+    {
+        session_t *s = get_session(connHandle);
+        if (!s || s->bulk_transfer) return;
+        s->bulk_transfer = true;
+        request_connection_parameters(*s, true);
+    }
+
+    void end_bulk_transfer(ble::connection_handle_t connHandle)
+    {
+        session_t *s = get_session(connHandle);
+        if (!s || !s->bulk_transfer) return;
+        s->bulk_transfer = false;
+        request_connection_parameters(*s, false);
+    }
+
+    /** Number of in place broadcast data updates. */
+    uint32_t get_broadcast_updates() const
+    {
+        return _broadcast_updates;
+    }
+
     /** Sets the advertising duration in seconds, or allows indefinite advertising if zero. */
     bool set_AdvertisingDuration(uint16_t sec = 0)
     {
@@ -293,51 +612,245 @@ public:
         return _target_name;
     }
 
+    /** Advertising report pre-filter, for its duplicate and eviction counts. */
+    const PMScanFilter<> &get_scan_filter() const
+    {
+        return _scan_filter;
+    }
+
     /** Retrieve the advertising duration in seconds. */
     uint16_t get_advertising_duration()
     {
         return _advDuration_sec;
     }
 
-    /** Assign a new value to the characteristic handle. */
+    /** Worst-case time in microseconds a BLE event waited in the event queue before being processed. */
+    uint32_t get_max_ble_event_latency_us() const
+    {
+        return _max_ble_event_latency_us;
+    }
+
+    void reset_max_ble_event_latency()
+    {
+        _max_ble_event_latency_us = 0;
+    }
+
+    /** Time BLE events have waited in the event queue since start, for jitter percentiles. */
+    const TimeHistogram &get_ble_event_latency() const
+    {
+        return _ble_event_latency;
+    }
+
+    /** Assign a new value to the characteristic handle, notifying every subscribed connection. */
     bool updateCharacteristicByteValue(GattAttribute::Handle_t ValueHandle, const uint8_t *value, uint16_t size, bool local_only = false) const
     {
 
         ble_error_t error = _ble.gattServer().write(ValueHandle, value, size, local_only);
 
         if (error) {
-            print_error(error, "Error updating CharacteristicValue.\r\n");
+            print_error(error, "Error updating CharacteristicValue.");
             return false;
         }
         return true;
     }
 
-    /** Assign a new value to the characteristic handle. */
+    /** Assign a new value to the characteristic handle, notifying every subscribed connection. */
     bool updateCharacteristicShortValue(GattAttribute::Handle_t ValueHandle, uint16_t *value, uint16_t size, bool msb = true, bool local_only = false) const
     {
         
         uint8_t u8vals[size*2];
-        if (msb) {
-            for (uint8_t i = 0; i < size; i++) {
-                u8vals[i*2] = value[i] >> 8;
-                u8vals[(i*2)+1] = value[i];
-            }
+        encode_short_values(value, size, msb, u8vals);
+
+        ble_error_t error = _ble.gattServer().write(ValueHandle, (const uint8_t*)u8vals, size*2, local_only);
+
+        if (error) {
+            print_error(error, "Error updating CharacteristicValue.");
+            return false;
         }
-        else {
-            for (uint8_t i = 0; i < size; i++) {
-                u8vals[i*2] = value[i];
-                u8vals[(i*2)+1] = value[i] >> 8;
+        return true;
+    }
+
+    /**
+     * Notify one connection of a new value, if it has updates enabled on the characteristic.
+     * Otherwise nothing is written and the write is counted as avoided; the characteristic should
+     * produce its value on read (see GattCharacteristic::setReadAuthorizationCallback).
+     *
+     * @returns True if the notification was queued.
+     */
+    bool notifyCharacteristicByteValue(ble::connection_handle_t connHandle, GattAttribute::Handle_t ValueHandle, const uint8_t *value, uint16_t size)
+    {
+        session_t *s = get_session(connHandle);
+        if (!s || !is_subscribed(*s, ValueHandle)) {
+            _writes_avoided++;
+            return false;
+        }
+
+        ble_error_t error = _ble.gattServer().write(connHandle, ValueHandle, value, size);
+        if (error) {
+            s->phy_policy.on_error();
+            print_error(error, "Error notifying CharacteristicValue.");
+            return false;
+        }
+        s->phy_policy.on_sent(size, get_phy_time_us());
+        _writes_published++;
+        return true;
+    }
+
+    bool notifyCharacteristicShortValue(ble::connection_handle_t connHandle, GattAttribute::Handle_t ValueHandle, uint16_t *value, uint16_t size, bool msb = true)
+    {
+        uint8_t u8vals[size*2];
+        encode_short_values(value, size, msb, u8vals);
+        return notifyCharacteristicByteValue(connHandle, ValueHandle, u8vals, size*2);
+    }
+
+    /**
+     * Publish a new value to every connection subscribed to the characteristic.
+     *
+     * @returns True if at least one notification was queued.
+     */
+    bool publishCharacteristicShortValue(GattAttribute::Handle_t ValueHandle, uint16_t *value, uint16_t size, bool msb = true)
+    {
+        bool sent = false;
+        bool subscribed = false;
+        for (uint8_t i = 0; i < MAX_SESSIONS; i++) {
+            if (_sessions[i].used && is_subscribed(_sessions[i], ValueHandle)) {
+                subscribed = true;
+                sent |= notifyCharacteristicShortValue(_sessions[i].handle, ValueHandle, value, size, msb);
             }
         }
+        if (!subscribed) _writes_avoided++;
+        return sent;
+    }
 
-        ble_error_t error = _ble.gattServer().write(ValueHandle, (const uint8_t*)u8vals, size*2, local_only);
+    /** Number of connections with updates enabled on the characteristic. */
+    uint8_t get_subscriber_count(GattAttribute::Handle_t ValueHandle) const
+    {
+        return _sessions.subscriber_count(ValueHandle);
+    }
 
-        if (error) {
-            print_error(error, "Error updating CharacteristicValue.\r\n");
+    bool has_subscribers(GattAttribute::Handle_t ValueHandle) const
+    {
+        return get_subscriber_count(ValueHandle) > 0;
+    }
+
+    /** True if the connection has updates enabled on the characteristic. */
+    bool is_subscribed(const session_t &s, GattAttribute::Handle_t ValueHandle) const
+    {
+        return session_table_t::is_subscribed(s, ValueHandle);
+    }
+
+    /** GATT writes skipped because nobody was subscribed. */
+    uint32_t get_writes_avoided() const
+    {
+        return _writes_avoided;
+    }
+
+    /** GATT writes made on behalf of subscribers. */
+    uint32_t get_writes_published() const
+    {
+        return _writes_published;
+    }
+
+    /** Session for a connection, or nullptr. */
+    session_t *get_session(ble::connection_handle_t connHandle)
+    {
+        return _sessions.get(connHandle);
+    }
+
+    /** Slot of a connection's session in the table (0 to MAX_SESSIONS - 1), or -1. */
+    int8_t get_session_index(ble::connection_handle_t connHandle) const
+    {
+        return _sessions.index_of(connHandle);
+    }
+
+    /** Session in a slot of the table, or nullptr if the slot is free. */
+    session_t *get_session_at(uint8_t index)
+    {
+        return _sessions.at(index);
+    }
+
+    uint8_t get_session_count() const
+    {
+        return _sessions.count();
+    }
+
+    /** Get the ATT MTU negotiated for a connection. */
+    uint16_t get_att_mtu(ble::connection_handle_t connHandle) const
+    {
+        int8_t i = get_session_index(connHandle);
+        return (i < 0) ? DEFAULT_ATT_MTU : _sessions[i].att_mtu;
+    }
+
+    /**
+     * Enable batching of timestamped samples into single notifications.
+     *
+     * Each notification holds a sample count followed by that many samples, each a little endian
+     * uint32_t timestamp and sample_size value bytes. Samples are kept in a shared ring and each
+     * connection has its own cursor into it, so a batch is sent to a connection once it holds
+     * max_samples or no further sample would fit in that connection's ATT MTU, or max_age after
+     * the first sample of the batch was added.
+     *
+     * @param[in] ValueHandle Characteristic the batches are written to (variable length, up to
+     * MAX_BATCH_PAYLOAD_SIZE bytes).
+     * @param[in] sample_size Value bytes per sample, up to MAX_BATCH_SAMPLE_SIZE.
+     * @param[in] max_samples Samples per notification, limited by the ATT MTU.
+     * @param[in] max_age Longest a sample is held before the batch is sent.
+     */
+    bool set_batching(GattAttribute::Handle_t ValueHandle, uint8_t sample_size, uint8_t max_samples, std::chrono::milliseconds max_age)
+    {
+        if (!_batch.set_sample_size(sample_size)) {
+            return false;
+        }
+        _batch_handle = ValueHandle;
+        _batch_max_samples = max_samples;
+        _batch_max_age = max_age;
+        return true;
+    }
+
+    /** Add a sample to the batches. Returns false if batching is not set up or nobody is subscribed. */
+    bool add_batched_sample(uint32_t timestamp, const uint8_t *value)
+    {
+        if (!_batch_handle || !_batch_max_samples) return false;
+        if (!has_subscribers(_batch_handle)) {
+            _writes_avoided++;
             return false;
         }
+
+        _batch.push(timestamp, value);
+
+        if (!_batch_age_id && _batch_max_age.count() > 0) {
+            _batch_age_id = post_in(PMQPROBE_SITE_TIMER, _batch_max_age, [this]() {
+                _batch_age_id = 0;
+                flush_batch();
+            });
+        }
+
+        for (uint8_t i = 0; i < MAX_SESSIONS; i++) {
+            session_t &s = _sessions[i];
+            if (s.used && is_subscribed(s, _batch_handle) && _batch.pending(s.batch_cursor) >= batch_limit(s)) {
+                flush_batch(s);
+            }
+        }
         return true;
     }
+
+    /** Send every connection the samples it has not had yet. */
+    bool flush_batch()
+    {
+        if (_batch_age_id) {
+            _event_queue.cancel(_batch_age_id);
+            _batch_age_id = 0;
+        }
+        if (!_batch_handle) return true;
+
+        bool sent = true;
+        for (uint8_t i = 0; i < MAX_SESSIONS; i++) {
+            if (_sessions[i].used && is_subscribed(_sessions[i], _batch_handle)) {
+                sent &= flush_batch(_sessions[i]);
+            }
+        }
+        return sent;
+    }
     
 
     /**
@@ -428,14 +941,14 @@ protected:
     void on_init_complete(BLE::InitializationCompleteCallbackContext *event)
     {
         if (event->error) {
-            print_error(event->error, "Error during the initialisation\r\n");
+            print_error(event->error, "Error during the initialisation");
             return;
         }
        
-        _event_queue.call([this]() { _post_init_cb(_ble, _event_queue); });
+        post(PMQPROBE_SITE_CALLBACK, [this]() { _post_init_cb(_ble, _event_queue); });
 
         /* All calls are serialised on the user thread through the event queue */
-        _event_queue.call([this]() { start_activity(); });
+        post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
     }
 
     /**
@@ -447,22 +960,44 @@ protected:
         _is_connecting = false;
         
         if (event.getStatus() == BLE_ERROR_NONE) {
+            session_t *s = open_session(event.getConnectionHandle());
+            if (!s) {
+                printf("Session table full, disconnecting\r\n");
+                _ble.gap().disconnect(event.getConnectionHandle(), ble::local_disconnection_reason_t::LOW_RESOURCES);
+                return;
+            }
             _connected = true;
-            _conn_handle = event.getConnectionHandle();
             _ble.gap().stopAdvertising(_adv_handle);
+            /* advertise again if another central may connect, or to carry on broadcasting */
+            post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
+
+            log_connection_parameters(s->handle, event.getConnectionInterval(), event.getConnectionLatency().value(),
+                                      event.getSupervisionTimeout());
+            s->phy_policy.set_interval_us(event.getConnectionInterval().valueInUs());
+            /* the application sets the report period from its connect callback */
+            schedule_connection_parameters(*s);
 
             if (_post_connect_cb) {
+                CallbackTimer timer(this);
                 _post_connect_cb(_ble, _event_queue, event);
             }
 
-            // Initialise the Gatt Server events handler
-            _gatt_server_handler.addEventHandler(this);
-            _ble.gattServer().setEventHandler(&_gatt_server_handler);
-
+            if (_phy_policy_enabled) {
+                /* connections from legacy advertising always start on 1M */
+                s->phy_policy.set_supported(_phy_le_2m, _phy_le_coded);
+                s->phy_policy.set_level(_phy_site.get_level());
+                s->phy_policy.set_active(PHY_LEVEL_1M);
+                s->phy_requested = PHY_LEVEL_1M;
+                s->phy_since_us = _latency_timer.elapsed_time().count();
+                apply_phy(*s, s->phy_policy.get_level());
+                if (!_phy_eval_id) {
+                    _phy_eval_id = post_every(PMQPROBE_SITE_TIMER, PHY_EVALUATION_PERIOD, [this]() { evaluate_phy(); });
+                }
+            }
         } 
         else {
             printf("Failed to connect\r\n");
-            _event_queue.call([this]() { start_activity(); });
+            post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
         }
     }
 
@@ -472,14 +1007,36 @@ protected:
      */
     void onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) override
     {
-        if (_connected) {
-            _connected = false;
+        session_t *s = get_session(event.getConnectionHandle());
+        if (s) {
+            if (s->conn_param_id) {
+                _event_queue.cancel(s->conn_param_id);
+                s->conn_param_id = 0;
+            }
+
+            if (_phy_policy_enabled) {
+                account_phy_time(*s);
+                if (event.getReason() == ble::disconnection_reason_t::CONNECTION_TIMEOUT) {
+                    s->phy_policy.on_link_loss();
+                }
+                /* the next connection starts from where this one ended up */
+                _phy_site.absorb(s->phy_policy);
+                _phy_site.print_report();
+            }
 
             if (_post_disconnect_cb) {
+                CallbackTimer timer(this);
                 _post_disconnect_cb(_ble, _event_queue, event);
             }
 
-            _event_queue.call([this]() { start_activity(); });
+            s->used = false;
+            _connected = (get_session_count() > 0);
+            if (!_connected && _phy_eval_id) {
+                _event_queue.cancel(_phy_eval_id);
+                _phy_eval_id = 0;
+            }
+
+            post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
         }
     }
 
@@ -490,7 +1047,16 @@ protected:
     */
     void onUpdatesEnabled(const GattUpdatesEnabledCallbackParams &params) override
     {
+        session_t *s = get_session(params.connHandle);
+        if (s) {
+            session_table_t::add_subscription(*s, params.attHandle);
+            if (params.attHandle == _batch_handle) {
+                /* batches start from the next sample */
+                s->batch_cursor = _batch.next();
+            }
+        }
         if (_post_serverupdatesenabled_cb) {
+            CallbackTimer timer(this);
             _post_serverupdatesenabled_cb(params);
         }
         //printf("update enabled on handle %d\r\n", params.attHandle);
@@ -505,7 +1071,12 @@ protected:
     */
     void onUpdatesDisabled(const GattUpdatesDisabledCallbackParams &params) override
     {
+        session_t *s = get_session(params.connHandle);
+        if (s) {
+            session_table_t::remove_subscription(*s, params.attHandle);
+        }
         if (_post_serverupdatesdisabled_cb) {
+            CallbackTimer timer(this);
             _post_serverupdatesdisabled_cb(params);
         }
         //printf("update disabled on handle %d\r\n", params.attHandle);
@@ -520,6 +1091,7 @@ protected:
     void onDataWritten(const GattWriteCallbackParams &params) override
     {
         if (_post_serverwriteevents_cb) {
+            CallbackTimer timer(this);
             _post_serverwriteevents_cb(params);
         }
     }
@@ -534,6 +1106,7 @@ protected:
     void onDataRead(const GattReadCallbackParams &params) override
     {
         if (_post_serverreadevents_cb) {
+            CallbackTimer timer(this);
             _post_serverreadevents_cb(params);
         }
     }
@@ -545,14 +1118,66 @@ protected:
     */
     void onDataSent(const GattDataSentCallbackParams &params) override
     {
-        if (_post_serverreadevents_cb) {
+        session_t *s = get_session(params.connHandle);
+        if (s) {
+            s->phy_policy.on_data_sent(get_phy_time_us());
+        }
+        if (_post_serversentevents_cb) {
+            CallbackTimer timer(this);
             _post_serversentevents_cb(params);
         }
     }
 
+    /**
+    * Handler called when new connection parameters are in use.
+    */
+    void onConnectionParametersUpdateComplete(const ble::ConnectionParametersUpdateCompleteEvent &event) override
+    {
+        if (event.getStatus() != BLE_ERROR_NONE) {
+            print_error(event.getStatus(), "Connection parameter update failed");
+            return;
+        }
+        log_connection_parameters(event.getConnectionHandle(), event.getConnectionInterval(),
+                                  event.getPeripheralLatency().value(), event.getSupervisionTimeout());
+        session_t *s = get_session(event.getConnectionHandle());
+        if (s) {
+            s->phy_policy.set_interval_us(event.getConnectionInterval().valueInUs());
+        }
+    }
+
+    /**
+    * Handler called when the PHY of a connection changes, or a PHY change request completes.
+    */
+    void onPhyUpdateComplete(ble_error_t status, ble::connection_handle_t connectionHandle,
+                             ble::phy_t txPhy, ble::phy_t rxPhy) override
+    {
+        if (status) {
+            print_error(status, "PHY update failed");
+            return;
+        }
+        session_t *s = get_session(connectionHandle);
+        if (!s) return;
+
+        /* stats up to now belong to the previous PHY */
+        account_phy_time(*s);
+        uint8_t level = PHY_LEVEL_1M;
+        if (txPhy == ble::phy_t::LE_2M) level = PHY_LEVEL_2M;
+        else if (txPhy == ble::phy_t::LE_CODED) {
+            /* the event does not say which coding is in use, so assume the one asked for */
+            level = (s->phy_requested == PHY_LEVEL_CODED_S2) ? PHY_LEVEL_CODED_S2 : PHY_LEVEL_CODED_S8;
+        }
+        s->phy_policy.set_active(level);
+        printf("Connection %u now on %s PHY\r\n", connectionHandle, PMPhyPolicy::level_name(level));
+    }
+
     void onAttMtuChange(ble::connection_handle_t connectionHandle, uint16_t attMtuSize) override
     {
+        session_t *s = get_session(connectionHandle);
+        if (s) {
+            s->att_mtu = attMtuSize;
+        }
         if (_post_mtuchange_cb) {
+            CallbackTimer timer(this);
             _post_mtuchange_cb(connectionHandle, attMtuSize);
         }
 
@@ -562,7 +1187,7 @@ protected:
     /** Restarts main activity */
     void onAdvertisingEnd(const ble::AdvertisingEndEvent &event) override
     {
-        _event_queue.call([this]() { start_activity(); });
+        post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
     }
 
     /**
@@ -588,22 +1213,30 @@ protected:
     }
 
     /**
-     * Start the advertising process; it ends when a device connects.
+     * Start the advertising process; it ends when a device connects, unless broadcasting.
      */
     void start_advertising()
     {
         ble_error_t error;
 
-        // Added new check for when only one connection allowed
-        if (_single_connection_only && _connected ) return;
+        // only accept connections while there is a free session
+        bool connectable = get_session_count() < (_single_connection_only ? 1 : MAX_SESSIONS);
+        if (!connectable && !_broadcast_len) return;
 
-        if (!_advertising_name || _ble.gap().isAdvertisingActive(_adv_handle)) {
-            /* we're already advertising or we are already connected */
+        if (!_advertising_name) {
             return;
         }
+        if (_ble.gap().isAdvertisingActive(_adv_handle)) {
+            if (connectable == _adv_connectable) {
+                /* we're already advertising */
+                return;
+            }
+            /* the advertising type has to change, e.g. broadcasting carries on after a disconnection */
+            _ble.gap().stopAdvertising(_adv_handle);
+        }
 
         ble::AdvertisingParameters adv_params(
-            ble::advertising_type_t::CONNECTABLE_UNDIRECTED,
+            connectable ? ble::advertising_type_t::CONNECTABLE_UNDIRECTED : ble::advertising_type_t::SCANNABLE_UNDIRECTED,
             ble::adv_interval_t(ble::millisecond_t(40))
         );
 
@@ -614,34 +1247,94 @@ protected:
             return;
         }
 
-        uint8_t adv_buffer[MAX_ADVERTISING_PAYLOAD_SIZE];
-        ble::AdvertisingDataBuilder adv_data_builder(adv_buffer);
-        
-        adv_data_builder.clear();
-        adv_data_builder.setFlags();
+        error = update_advertising_payload();
+        if (error) {
+            return;
+        }
+
+        if (_broadcast_len) {
+            /* the name and service UUID no longer fit alongside the broadcast data */
+            uint8_t scan_buffer[MAX_ADVERTISING_PAYLOAD_SIZE];
+            ble::AdvertisingDataBuilder scan_data_builder(scan_buffer);
+            error = build_identity(scan_data_builder);
+            if (error) {
+                return;
+            }
+            error = _ble.gap().setAdvertisingScanResponse(
+                _adv_handle, scan_data_builder.getAdvertisingData()
+            );
+            if (error) {
+                print_error(error, "Gap::setAdvertisingScanResponse() failed");
+                return;
+            }
+        }
+
+        if (_advDuration_sec > 0) {
+            error = _ble.gap().startAdvertising(_adv_handle, ble::adv_duration_t(ble::second_t(_advDuration_sec)));
+        }
+        else {
+            error = _ble.gap().startAdvertising(_adv_handle);
+        }
+
+        if (error) {
+            print_error(error, "Gap::startAdvertising() failed");
+            return;
+        }
+        _adv_connectable = connectable;
+    }
+
+    /** Add the service UUID and name to an advertising or scan response payload. */
+    ble_error_t build_identity(ble::AdvertisingDataBuilder &adv_data_builder)
+    {
+        ble_error_t error = BLE_ERROR_NONE;
 
         if (_GATT_uuid128 && _GATT_uuid16 == 0) {
             UUID _GATT_uuid = UUID(_GATT_uuid128);
             error = adv_data_builder.setLocalServiceList(mbed::make_Span(&_GATT_uuid, 1));
             if (error) {
-                print_error(error, "AdvertisingDataBuilder::setLocalServiceList() failed?)\r\n");
-                return;
+                print_error(error, "AdvertisingDataBuilder::setLocalServiceList() failed?)");
+                return error;
             }
         }
         else if  (!_GATT_uuid128 && _GATT_uuid16 > 0) {
             UUID _GATT_uuid = UUID(_GATT_uuid16);
             error = adv_data_builder.setLocalServiceList(mbed::make_Span(&_GATT_uuid, 1));
             if (error) {
-                print_error(error, "AdvertisingDataBuilder::setLocalServiceList() failed?)\r\n");
-                return;
+                print_error(error, "AdvertisingDataBuilder::setLocalServiceList() failed?)");
+                return error;
             }
         }
 
         error = adv_data_builder.setName(_advertising_name);
 
         if (error) {
-            print_error(error, "AdvertisingDataBuilder::setName() failed (name too long?)\r\n");
-            return;
+            print_error(error, "AdvertisingDataBuilder::setName() failed (name too long?)");
+        }
+        return error;
+    }
+
+    /** Build and set the advertising payload; can be called while advertising. */
+    ble_error_t update_advertising_payload()
+    {
+        ble_error_t error;
+        uint8_t adv_buffer[MAX_ADVERTISING_PAYLOAD_SIZE];
+        ble::AdvertisingDataBuilder adv_data_builder(adv_buffer);
+
+        adv_data_builder.clear();
+        adv_data_builder.setFlags();
+
+        if (_broadcast_len) {
+            error = adv_data_builder.setManufacturerSpecificData(mbed::make_Span(_broadcast_data, _broadcast_len));
+            if (error) {
+                print_error(error, "AdvertisingDataBuilder::setManufacturerSpecificData() failed");
+                return error;
+            }
+        }
+        else {
+            error = build_identity(adv_data_builder);
+            if (error) {
+                return error;
+            }
         }
 
         /* Set payload for the set */
@@ -650,22 +1343,54 @@ protected:
         );
 
         if (error) {
-            print_error(error, "Gap::setAdvertisingPayload() failed\r\n");
-            return;
+            print_error(error, "Gap::setAdvertisingPayload() failed");
         }
+        return error;
+    }
 
-        if (_advDuration_sec > 0) {
-            error = _ble.gap().startAdvertising(_adv_handle, ble::adv_duration_t(ble::second_t(_advDuration_sec)));
+#if BLE_FEATURE_EXTENDED_ADVERTISING && BLE_FEATURE_PERIODIC_ADVERTISING
+    /** Create the extended advertising set, start it and configure periodic advertising on it. */
+    bool start_extended_advertising(std::chrono::milliseconds periodic_interval)
+    {
+        if (!_ble.gap().isFeatureSupported(ble::controller_supported_features_t::LE_EXTENDED_ADVERTISING) ||
+            !_ble.gap().isFeatureSupported(ble::controller_supported_features_t::LE_PERIODIC_ADVERTISING)) {
+            printf("Extended and periodic advertising not supported\r\n");
+            return false;
         }
-        else {
-            error = _ble.gap().startAdvertising(_adv_handle);
+
+        ble::AdvertisingParameters adv_params(
+            ble::advertising_type_t::NON_CONNECTABLE_UNDIRECTED,
+            ble::adv_interval_t(ble::millisecond_t(1000))
+        );
+        adv_params.setUseLegacyPDU(false);
+
+        ble_error_t error = _ble.gap().createAdvertisingSet(&_ext_adv_handle, adv_params);
+        if (error) {
+            print_error(error, "Gap::createAdvertisingSet() failed");
+            _ext_adv_handle = ble::INVALID_ADVERTISING_HANDLE;
+            return false;
         }
 
+        /* periodic advertising interval is limited to 81.91 s */
+        if (periodic_interval > std::chrono::milliseconds(81910)) {
+            periodic_interval = std::chrono::milliseconds(81910);
+        }
+        ble::periodic_interval_t interval(ble::millisecond_t(periodic_interval.count()));
+        error = _ble.gap().setPeriodicAdvertisingParameters(_ext_adv_handle, interval, interval);
         if (error) {
-            print_error(error, "Gap::startAdvertising() failed\r\n");
-            return;
+            print_error(error, "Gap::setPeriodicAdvertisingParameters() failed");
+            return false;
+        }
+
+        error = _ble.gap().startAdvertising(_ext_adv_handle);
+        if (error) {
+            print_error(error, "Extended Gap::startAdvertising() failed");
+            return false;
         }
+        printf("Extended advertising set %u started\r\n", _ext_adv_handle);
+        return true;
     }
+#endif
 
     /** scan for GattServer */
     void start_scanning()
@@ -692,7 +1417,7 @@ protected:
     /** Restarts main activity */
     void onScanTimeout(const ble::ScanTimeoutEvent &event) override {
         _is_scanning = false;
-        _event_queue.call([this]() { start_activity(); });
+        post(PMQPROBE_SITE_ACTIVITY, [this]() { start_activity(); });
     }
 
     /** Check advertising report for name and connect to any device with the name GattServer */
@@ -707,46 +1432,233 @@ protected:
             return;
         }
 
-        ble::AdvertisingDataParser adv_data(event.getPayload());
+        /* drop repeats before looking inside the payload */
+        if (_scan_filter.is_duplicate(event.getPeerAddressType(), event.getPeerAddress(),
+                                      event.getType().scan_response(), event.getPayload(), get_scan_time_ms())) {
+            return;
+        }
 
-        /* parse the advertising payload, looking for a discoverable device */
-        while (adv_data.hasNext()) {
-            ble::AdvertisingDataParser::element_t field = adv_data.next();
+        /* connect to a discoverable device */
+        if (_scan_filter.match(event.getPayload()).name) {
+            printf("We found \"%s\", connecting...\r\n", _target_name);
 
-            /* connect to a discoverable device */
-            if (field.type == ble::adv_data_type_t::COMPLETE_LOCAL_NAME) {
-                if (field.value.size() == strlen(_target_name) &&
-                    (memcmp(field.value.data(), _target_name, field.value.size()) == 0)) {
+            ble_error_t error = _ble.gap().stopScan();
 
-                    printf("We found \"%s\", connecting...\r\n", _target_name);
+            if (error) {
+                print_error(error, "Error caused by Gap::stopScan");
+                return;
+            }
 
-                    ble_error_t error = _ble.gap().stopScan();
+            const ble::ConnectionParameters connection_params;
 
-                    if (error) {
-                        print_error(error, "Error caused by Gap::stopScan");
-                        return;
-                    }
+            error = _ble.gap().connect(
+                event.getPeerAddressType(),
+                event.getPeerAddress(),
+                connection_params
+            );
+
+            if (error) {
+                _ble.gap().startScan();
+                return;
+            }
+
+            /* we may have already scan events waiting
+             * to be processed so we need to remember
+             * that we are already connecting and ignore them */
+            _is_connecting = true;
+        }
+    }
 
-                    const ble::ConnectionParameters connection_params;
+    /** Clock for the scan filter's hold time. */
+    uint32_t get_scan_time_ms() const
+    {
+        return _latency_timer.elapsed_time().count() / 1000;
+    }
 
-                    error = _ble.gap().connect(
-                        event.getPeerAddressType(),
-                        event.getPeerAddress(),
-                        connection_params
-                    );
+    /** Times a user callback for the queue probe while in scope; does nothing without the probe. */
+    class CallbackTimer
+    {
+    public:
+#if BLEAPP_QUEUE_PROBE
+        CallbackTimer(BLEApp *app) : _probe(app->_queue_probe), _start(_probe.on_dispatch(PMQPROBE_SITE_CALLBACK, 0, false))
+        {
+        }
 
-                    if (error) {
-                        _ble.gap().startScan();
-                        return;
-                    }
+        ~CallbackTimer()
+        {
+            _probe.on_done(PMQPROBE_SITE_CALLBACK, _start);
+        }
 
-                    /* we may have already scan events waiting
-                     * to be processed so we need to remember
-                     * that we are already connecting and ignore them */
-                    _is_connecting = true;
+    private:
+        PMQueueProbe &_probe;
+        uint32_t _start;
+#else
+        CallbackTimer(BLEApp *app)
+        {
+        }
+#endif
+    };
 
-                    return;
-                }
+    /** Batch payload that fits in a notification at a connection's ATT MTU. */
+    uint16_t batch_capacity(const session_t &s) const
+    {
+        uint16_t capacity = s.att_mtu - 3;
+        return (capacity > MAX_BATCH_PAYLOAD_SIZE) ? MAX_BATCH_PAYLOAD_SIZE : capacity;
+    }
+
+    /** Samples per batch notification for a connection. */
+    uint8_t batch_limit(const session_t &s) const
+    {
+        return _batch.limit(batch_capacity(s), _batch_max_samples);
+    }
+
+    /** Send a connection the batched samples it has not had yet, in as many notifications as it takes. */
+    bool flush_batch(session_t &s)
+    {
+        uint32_t lost = _batch.catch_up(s.batch_cursor);
+        if (lost) {
+            printf("Batch overrun on connection %u: %lu samples lost\r\n", s.handle, lost);
+        }
+
+        /* a batch the stack cannot take is kept for the next flush */
+        ble::connection_handle_t handle = s.handle;
+        return _batch.flush(s.batch_cursor, batch_limit(s), [this, handle](const uint8_t *buf, uint16_t len) {
+            return notifyCharacteristicByteValue(handle, _batch_handle, buf, len);
+        });
+    }
+
+    /** Ask for connection parameters once the central has had time to finish discovery. */
+    void schedule_connection_parameters(session_t &s)
+    {
+        ble::connection_handle_t handle = s.handle;
+        s.conn_param_id = post_in(PMQPROBE_SITE_TIMER, CONN_PARAM_UPDATE_DELAY, [this, handle]() {
+            session_t *s = get_session(handle);
+            if (!s) return;
+            s->conn_param_id = 0;
+            request_connection_parameters(*s, s->bulk_transfer);
+        });
+    }
+
+    /** Ask the central for parameters suited to bulk transfer or to the report period. */
+    void request_connection_parameters(session_t &s, bool bulk)
+    {
+        uint32_t interval_min_us, interval_max_us, latency, timeout_ms;
+
+        if (bulk) {
+            interval_min_us = CONN_BULK_INTERVAL_MIN_US;
+            interval_max_us = CONN_BULK_INTERVAL_MAX_US;
+            latency = 0;
+            timeout_ms = 4000;
+        }
+        else {
+            if (!s.report_period_us) return;
+            uint32_t interval_us = s.report_period_us / 16;
+            if (interval_us < CONN_INTERVAL_MIN_US) interval_us = CONN_INTERVAL_MIN_US;
+            if (interval_us > CONN_INTERVAL_MAX_US) interval_us = CONN_INTERVAL_MAX_US;
+            uint32_t sleep_us = (s.report_period_us < CONN_MAX_SLEEP_US) ? s.report_period_us : CONN_MAX_SLEEP_US;
+            latency = (sleep_us / interval_us) ? (sleep_us / interval_us) - 1 : 0;
+            if (latency > 499) latency = 499;
+
+            interval_min_us = interval_us;
+            interval_max_us = interval_us + (interval_us / 4);
+            /* the timeout must cover the longest sleep, with margin for missed events */
+            timeout_ms = (3 * interval_max_us * (latency + 1)) / 1000;
+            if (timeout_ms < 2000) timeout_ms = 2000;
+            if (timeout_ms > 32000) timeout_ms = 32000;
+        }
+
+        printf("Connection %u: requesting interval %lu-%lu ms, latency %lu, timeout %lu ms%s\r\n", s.handle,
+               interval_min_us / 1000, interval_max_us / 1000, latency, timeout_ms, bulk ? " for bulk transfer" : "");
+
+        ble_error_t error = _ble.gap().updateConnectionParameters(
+            s.handle,
+            ble::conn_interval_t(interval_min_us / 1250),
+            ble::conn_interval_t(interval_max_us / 1250),
+            ble::slave_latency_t(latency),
+            ble::supervision_timeout_t(timeout_ms / 10)
+        );
+        if (error) {
+            print_error(error, "Gap::updateConnectionParameters() failed");
+        }
+    }
+
+    /** Log connection parameters with an estimate of the radio duty cycle they give. */
+    void log_connection_parameters(ble::connection_handle_t connHandle, ble::conn_interval_t interval, uint16_t latency,
+                                   ble::supervision_timeout_t timeout)
+    {
+        uint32_t interval_us = interval.valueInUs();
+        uint32_t wake_us = interval_us * (latency + 1);
+        uint32_t duty_ppm = wake_us ? (uint32_t)(((uint64_t)CONN_EVENT_ACTIVE_US * 1000000) / wake_us) : 0;
+        printf("Connection %u parameters: interval %lu.%02lu ms, latency %u, timeout %lu ms, radio duty cycle ~%lu.%03lu%%\r\n",
+               connHandle, interval_us / 1000, (interval_us % 1000) / 10, latency, timeout.valueInMs(),
+               duty_ppm / 10000, (duty_ppm % 10000) / 10);
+    }
+
+    /** Request the PHY for a policy level on a connection. */
+    void apply_phy(session_t &s, uint8_t level)
+    {
+        if (level == s.phy_policy.get_active() && level == s.phy_requested) return;
+
+        ble::phy_set_t phys(/* 1M */ level == PHY_LEVEL_1M, /* 2M */ level == PHY_LEVEL_2M,
+                            /* coded */ level >= PHY_LEVEL_CODED_S2);
+        ble::coded_symbol_per_bit_t coding = (level == PHY_LEVEL_CODED_S2) ? ble::coded_symbol_per_bit_t::S2 :
+                                             (level == PHY_LEVEL_CODED_S8) ? ble::coded_symbol_per_bit_t::S8 :
+                                             ble::coded_symbol_per_bit_t::UNDEFINED;
+
+        ble_error_t error = _ble.gap().setPhy(s.handle, &phys, &phys, coding);
+        if (error) {
+            print_error(error, "Gap::setPhy() failed");
+            return;
+        }
+        s.phy_requested = level;
+        printf("Connection %u: requesting %s PHY\r\n", s.handle, PMPhyPolicy::level_name(level));
+    }
+
+    /** Close the evaluation window of every connection. */
+    void evaluate_phy()
+    {
+        for (uint8_t i = 0; i < MAX_SESSIONS; i++) {
+            session_t &s = _sessions[i];
+            if (!s.used) continue;
+            account_phy_time(s);
+            uint8_t level = s.phy_policy.evaluate();
+            if (level != s.phy_requested) {
+                apply_phy(s, level);
+            }
+        }
+    }
+
+    /** Add the time since the last call to the PHY a connection is using. */
+    void account_phy_time(session_t &s)
+    {
+        int64_t now_us = _latency_timer.elapsed_time().count();
+        s.phy_policy.on_connected_time((now_us - s.phy_since_us) / 1000);
+        s.phy_since_us = now_us;
+    }
+
+    /** Claim a free slot in the session table for a new connection. */
+    session_t *open_session(ble::connection_handle_t connHandle)
+    {
+        session_t *s = _sessions.open(connHandle, _single_connection_only ? 1 : MAX_SESSIONS);
+        if (s) {
+            s->att_mtu = DEFAULT_ATT_MTU;
+            s->phy_requested = PHY_LEVEL_1M;
+        }
+        return s;
+    }
+
+    static void encode_short_values(const uint16_t *value, uint16_t size, bool msb, uint8_t *u8vals)
+    {
+        if (msb) {
+            for (uint8_t i = 0; i < size; i++) {
+                u8vals[i*2] = value[i] >> 8;
+                u8vals[(i*2)+1] = value[i];
+            }
+        }
+        else {
+            for (uint8_t i = 0; i < size; i++) {
+                u8vals[i*2] = value[i];
+                u8vals[(i*2)+1] = value[i] >> 8;
             }
         }
     }
@@ -756,7 +1668,17 @@ protected:
      */
     void schedule_ble_events(BLE::OnEventsToProcessCallbackContext *event)
     {
-        _event_queue.call(mbed::callback(&event->ble, &BLE::processEvents));
+        BLE *ble = &event->ble;
+        int64_t posted_us = _latency_timer.elapsed_time().count();
+        post(PMQPROBE_SITE_BLE, [this, ble, posted_us]() {
+            /* track how long BLE events wait behind other work in the queue */
+            uint32_t latency_us = _latency_timer.elapsed_time().count() - posted_us;
+            if (latency_us > _max_ble_event_latency_us) {
+                _max_ble_event_latency_us = latency_us;
+            }
+            _ble_event_latency.add(latency_us);
+            ble->processEvents();
+        });
     }
 
 protected:
@@ -771,13 +1693,23 @@ protected:
     UUID::ShortUUIDBytes_t _GATT_uuid16 = 0;
 
     uint16_t _advDuration_sec = 0;
+
+    // broadcast mode: advertised manufacturer specific data
+    uint8_t _broadcast_data[MAX_BROADCAST_DATA_SIZE] = {0};
+    uint8_t _broadcast_len = 0;
+    uint32_t _broadcast_updates = 0;
+    bool _adv_connectable = true;
+
+    // extended and periodic advertising set, alongside the legacy set
+    ble::advertising_handle_t _ext_adv_handle = ble::INVALID_ADVERTISING_HANDLE;
+    bool _ext_adv_unsupported = false;
     
     ble::advertising_handle_t _adv_handle = ble::LEGACY_ADVERTISING_HANDLE;
 
-    ble::connection_handle_t _conn_handle;
     bool _connected = false;
     bool _is_connecting = false;
     bool _is_scanning = false;
+    PMScanFilter<> _scan_filter;
     bool _single_connection_only = false;
 
     mbed::Callback<void(BLE&, events::EventQueue&)> _post_init_cb;
@@ -791,6 +1723,32 @@ protected:
     mbed::Callback<void(ble::connection_handle_t connectionHandle, uint16_t attMtuSize)> _post_mtuchange_cb;
     ChainableGapEventHandler _gap_handler;
     ChainableGattServerEventHandler _gatt_server_handler;
+
+    // notification batching
+    GattAttribute::Handle_t _batch_handle = 0;
+    uint8_t _batch_max_samples = 0;
+    std::chrono::milliseconds _batch_max_age = std::chrono::milliseconds(0);
+    int _batch_age_id = 0;
+    PMBatchRing<BATCH_RING_SAMPLES, MAX_BATCH_SAMPLE_SIZE, MAX_BATCH_PAYLOAD_SIZE> _batch;
+
+    // one entry per connected central
+    session_table_t _sessions;
+    uint32_t _writes_avoided = 0;
+    uint32_t _writes_published = 0;
+
+    mbed::Timer _latency_timer;
+    uint32_t _max_ble_event_latency_us = 0;
+    TimeHistogram _ble_event_latency;
+#if BLEAPP_QUEUE_PROBE
+    PMQueueProbe _queue_probe;
+#endif
+
+    // runtime PHY selection; each session has its own policy, folded into the site policy on disconnection
+    PMPhyPolicy _phy_site;
+    bool _phy_policy_enabled = false;
+    bool _phy_le_2m = false;
+    bool _phy_le_coded = false;
+    int _phy_eval_id = 0;
 };
 
 #endif /* BLE_APP_H_ */
@@ -18,8 +18,32 @@
 
 #include "ble_app2.h"
 #include "DeviceInformationService.h"
+#include "PMSenseService.h"
 
 #include "Panasonic_SNGCJA5.h"
+#include "PMSenseSampler.h"
+#include "PMStats.h"
+#include "PMHistory.h"
+#include "PMTimeSeries.h"
+#include "PMHistoryTransfer.h"
+#include "PMReportPolicy.h"
+#include "PMUpdateCursor.h"
+#include "PMBroadcast.h"
+#include "PMFrameRing.h"
+#include "PMLog.h"
+#include "PMGattTable.h"
+#if MBED_CONF_APP_GATEWAY_MODE
+#include "PMGateway.h"
+#endif
+
+#if DEVICE_TRNG
+#include "hal/trng_api.h"
+#endif
+
+#if MBED_CONF_APP_FLASHLOG_SIZE > 0
+#include "FlashIAPBlockDevice.h"
+#include "PMFlashLog.h"
+#endif
 
 // Xenon Pin Map for Digital - Pin Numbers differ to nRF52840
 #define XEN_D2      p33
@@ -30,15 +54,125 @@
 #define XEN_D7      p44
 #define XEN_D8      p35
 
-static const uint8_t ARRSIZE = 2;
-
-static uint16_t pmcountchar_values[ARRSIZE] = {0x00};
-static uint8_t interval_value = 0x0A;           //10sec
-
-// Handles for button and led and connection
-static uint8_t pmcount_handle = 0;
-static uint8_t pminterval_handle = 0;
-static uint8_t connectionhandle = 0;
+static const uint8_t ARRSIZE = PMSENSE_COUNT_VALUES;
+
+#define PMSENSE_EXTENDED_BROADCAST      (MBED_CONF_APP_EXTENDED_BROADCAST && BLE_FEATURE_EXTENDED_ADVERTISING && BLE_FEATURE_PERIODIC_ADVERTISING)
+
+// History buffer memory budget is set in mbed_app.json
+static const size_t HISTORY_RECORDS = MBED_CONF_APP_HISTORY_BUFFER_SIZE / sizeof(PMHistoryRecord);
+// Per-second sample store budget is set in mbed_app.json (each block also has an index entry)
+static const size_t TIMESERIES_BLOCKS = MBED_CONF_APP_TIMESERIES_BUFFER_SIZE / (PMTS_BLOCK_SIZE + PMTS_INDEX_SIZE);
+
+// Interval records are made every RECORD_INTERVAL seconds; each central chooses how many to combine per update
+static const uint8_t RECORD_INTERVAL = MBED_CONF_APP_RECORD_INTERVAL;
+
+
+// Acquisition and interval aggregation run on their own thread, so BLE work never delays a sensor read
+#define SENSOR_THREAD_STACK     (2048u)
+#define SENSOR_FRAMES           (16u)           // frames the BLE side may fall behind by
+
+#define PMLOG_PULL_SIZE         (128u)          // log records handed out per read of the log characteristic
+
+// Handed from the sensor thread to the BLE side: every per-second sample, then each interval record
+typedef struct {
+    uint32_t timestamp;
+    int8_t error;                               // SAMPLER_ERR_xxx for a sample
+    bool record;                                // an interval record rather than a sample
+    bool interval_error;                        // record: a sample in the interval failed
+    uint8_t samples;                            // record: good samples averaged, 0 if none
+    PM_MDVPC_Data pmdata;                       // the sample, or the interval mean
+    // record: sensor side statistics, so the BLE side never reads state the sensor thread owns
+    uint32_t pm25_min;
+    uint32_t pm25_max;
+    uint32_t pm25_var;
+    uint32_t bus_transactions;
+    uint32_t bus_blocked_us;
+    uint32_t jitter_p50_us;
+    uint32_t jitter_p99_us;
+    uint32_t jitter_max_us;
+    uint32_t sensor_period_ms;
+    bool sensor_locked;
+    uint32_t sensor_duplicates;
+    uint32_t sensor_stale;
+    uint32_t sensor_overruns;
+    uint32_t sensor_stale_events;
+} PMSenseFrame;
+
+static EventQueue sensor_queue(16 * EVENTS_EVENT_SIZE);
+static Thread sensor_thread(osPriorityAboveNormal, SENSOR_THREAD_STACK, nullptr, "sensor");
+static PMFrameRing<PMSenseFrame, SENSOR_FRAMES> PMframes;
+static volatile bool frames_posted = false;     // a consume event is already queued on the BLE side
+
+// Sensor thread only
+static PMIntervalAggregator PMaggregate;
+static TimeHistogram sample_jitter;             // deviation of each sample from the sensor period
+
+// PMsense service, with the characteristics this firmware adds to it, laid out statically
+static PMSenseService PMservice;
+static constexpr PMGattUUID PMBATCH_CHAR = pmgatt_uuid("20220214-1a1a-1a1a-1a1a-f8f381aa84ed");
+static constexpr PMGattUUID PMPOLICY_CHAR = pmgatt_uuid("20220214-1b1b-1b1b-1b1b-f8f381aa84ed");
+#if BLEAPP_QUEUE_PROBE
+static constexpr PMGattUUID PMQPROBE_CHAR = pmgatt_uuid("20220214-1c1c-1c1c-1c1c-f8f381aa84ed");
+#endif
+#if PMLOG_BINARY
+static constexpr PMGattUUID PMLOG_CHAR = pmgatt_uuid("20220214-1d1d-1d1d-1d1d-f8f381aa84ed");
+#endif
+
+// Batched PM Counts: u8 count, then per sample a u32 timestamp and the two PM Count values
+static PMGattCharacteristic<MAX_BATCH_PAYLOAD_SIZE> pmbatch_characteristic(PMBATCH_CHAR,
+        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY, nullptr, nullptr, true, 0);
+// Report Policy: u8 mode, u16 absolute deadband, u8 relative deadband %, u8 heartbeat intervals
+static PMGattCharacteristic<REPORT_POLICY_SIZE> pmpolicy_characteristic(PMPOLICY_CHAR,
+        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE,
+        nullptr, nullptr, true);
+#if BLEAPP_QUEUE_PROBE
+// Event Queue Diagnostics: u16 high water, u16 depth, then per site u32 events, wait p99/max, run p99/max (us)
+// Write 0x01 to print the full histograms on the console, 0x02 to reset them
+static PMGattCharacteristic<PMQPROBE_DIAG_SIZE> pmqprobe_characteristic(PMQPROBE_CHAR,
+        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE,
+        nullptr, nullptr, true);
+#endif
+#if PMLOG_BINARY
+// Binary Log: the oldest records from the log ring, taken out as they are read (see tools/pmlog_decode.py)
+static PMGattCharacteristic<PMLOG_PULL_SIZE> pmlog_characteristic(PMLOG_CHAR,
+        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ, nullptr, nullptr, true, 0);
+#endif
+
+// Characteristic handles
+static GattAttribute::Handle_t pmbatch_handle = 0;
+static GattAttribute::Handle_t pmpolicy_handle = 0;
+#if BLEAPP_QUEUE_PROBE
+static GattAttribute::Handle_t pmqprobe_handle = 0;
+#endif
+
+// Interval history, shared by every central
+static HistoryBuffer<PMHistoryRecord, HISTORY_RECORDS> PMhistory;
+static uint32_t history_delivered = 0;          // records before this have been delivered to (or suppressed for) a central
+
+// Notification state of each central, in the same slot as its BLEApp session
+typedef struct {
+    PMUpdateCursor cursor;                      // next history record to notify, moved on by onDataSent
+    uint32_t policy_seq;                        // update at cursor already evaluated
+    bool report;                                // policy decision for that update
+    PMReportPolicy policy;                      // decides which updates are worth notifying
+} PMSenseSession;
+static PMSenseSession PMsessions[MAX_SESSIONS];
+
+// Compressed per-second samples
+static PMTimeSeries<TIMESERIES_BLOCKS> PMseries;
+
+// Bulk download of the per-second samples
+PMHistoryTransfer<PMTimeSeries<TIMESERIES_BLOCKS> > HistoryTransfer(BLE::Instance(), PMseries,
+                                        "20220214-1818-1818-1818-f8f381aa84ed",     // History Control Point
+                                        "20220214-1919-1919-1919-f8f381aa84ed");    // History Data
+
+#if MBED_CONF_APP_FLASHLOG_SIZE > 0
+// Interval records are also kept in a log at the top of internal flash so they survive a reboot
+FlashIAPBlockDevice flashlog_bd(MBED_ROM_START + MBED_ROM_SIZE - MBED_CONF_APP_FLASHLOG_SIZE, MBED_CONF_APP_FLASHLOG_SIZE);
+PMFlashLog PMflashlog(flashlog_bd);
+static bool flashlog_ready = false;
+#endif
+static uint32_t timestamp_base = 0;             // node time at boot: the last record logged before it
 
 // We create our own user LED to indicate BLE status
 DigitalOut ble_led(XEN_D7, 0);
@@ -48,11 +182,18 @@ I2C i2c(I2C_SDA0, I2C_SCL0);
 
 Panasonic_SNGCJA5 PM(i2c, SNGCJA5_ADDRESS);
 
-int PMSenseEventNo;
+#if MBED_CONF_APP_SENSOR_ASYNC_ACQUISITION
+PMSenseSampler Sampler(PM);
+#endif
 
 Ticker LED_Blink;
 
+#if MBED_CONF_APP_GATEWAY_MODE
+// Also collects from other PMsense nodes in range
+PMGateway app;
+#else
 BLEApp app;
+#endif
 
 void LED_Blinkhandler()
 {
@@ -67,51 +208,467 @@ void debug_printhandler(uint16_t pmval1, uint16_t pmval2)
     
 }
 
-void PMSense_tickerhandler()
+/**
+ * Node time in seconds, used to timestamp samples: seconds since boot, carried on from the last
+ * record in the flash log so timestamps keep increasing across reboots
+ */
+uint32_t PMSense_timestamp()
 {
-    static uint8_t sample_cntr = 1;
+    return timestamp_base +
+           std::chrono::duration_cast<std::chrono::seconds>(Kernel::Clock::now().time_since_epoch()).count();
+}
 
-    char TXdata[1] = {SNGCJA5_STATUS};      // start by looking at sensor status
-    uint8_t SensorStatus[1] = {0x01};
-    int i2cError = 0;
-    // check sensor status to ensure no sensor error
-    if ((i2cError = PM.getData(TXdata, SensorStatus, sizeof(SensorStatus))) == 0) {
-        if (SensorStatus[0] == 0) {
-            TXdata[0] = {SNGCJA5_REG2};      // We want data for 0.5um and above
-            uint8_t UM05data[4] = {'\0'};
-            if ((i2cError = PM.getData(TXdata, UM05data, sizeof(UM05data))) == 0) {
-                TXdata[0] = {SNGCJA5_REG4};      // start by looking at sensor status
-                uint8_t UM25data[6] = {'\0'};
-                if ((i2cError = PM.getData(TXdata, UM25data, sizeof(UM25data))) == 0) {
-                    pmcountchar_values[0] += (PM.convert2byte(UM05data) + PM.convert2byte(UM05data+2));
-                    pmcountchar_values[1] += (PM.convert2byte(UM25data) + PM.convert2byte(UM25data+2) + PM.convert2byte(UM25data+4));
-                }
-            }
+#if PMSENSE_EXTENDED_BROADCAST
+/** Broadcast the interval record and the latest per-second samples on the extended and periodic set */
+void PMSense_extendedbroadcast(const PMHistoryRecord &record, uint8_t status)
+{
+    static uint32_t timestamps[PMBCAST_HISTORY_SAMPLES];
+    static PM_MDVPC_Data samples[PMBCAST_HISTORY_SAMPLES];
+    uint8_t frame[PMBCAST_EXT_FRAME_SIZE];
+
+    uint8_t n = 0;
+    PMTimeSeries<TIMESERIES_BLOCKS>::cursor_t cursor;
+    uint32_t next_seq = PMseries.next_seq();
+    uint32_t start_seq = (next_seq > PMBCAST_HISTORY_SAMPLES) ? (next_seq - PMBCAST_HISTORY_SAMPLES) : 0;
+    if (PMseries.seek_seq(start_seq, cursor)) {
+        while (n < PMBCAST_HISTORY_SAMPLES && PMseries.read(cursor, timestamps[n], samples[n])) {
+            n++;
         }
     }
-    
-    if (sample_cntr < interval_value) {
-        sample_cntr++;
+
+    pmbcast_encode(frame, record.seq, status, record.pmdata);
+    uint8_t len = pmbcast_encode_history(frame, timestamps, samples, n);
+    app.set_extended_broadcast_data(frame, len, std::chrono::seconds(RECORD_INTERVAL));
+}
+#endif
+
+/** History records combined into each PM Count update for a central */
+uint8_t PMSense_recordsperupdate(const BLEApp::session_t &session)
+{
+    if (!session.interval) return 1;
+    uint16_t n = (session.interval + RECORD_INTERVAL - 1) / RECORD_INTERVAL;
+    return (n > UINT8_MAX) ? UINT8_MAX : n;
+}
+
+/** Mean PM Count values over n history records starting at seq */
+void PMSense_meancountvalues(uint32_t seq, uint8_t n, uint16_t values[ARRSIZE])
+{
+    uint32_t sums[ARRSIZE] = {0};
+    uint8_t found = 0;
+    PMHistoryRecord record;
+    for (uint8_t i = 0; i < n; i++) {
+        if (!PMhistory.get(seq + i, record)) continue;
+        uint16_t record_values[ARRSIZE];
+        PMSenseService::count_values(record.pmdata, record_values);
+        for (uint8_t j = 0; j < ARRSIZE; j++) sums[j] += record_values[j];
+        found++;
+    }
+    for (uint8_t j = 0; j < ARRSIZE; j++) values[j] = found ? (sums[j] / found) : 0;
+}
+
+/** Note how far a central's cursor has moved past records it has been sent or will not be sent */
+void PMSense_advancecursor(const PMSenseSession &ps)
+{
+    if (ps.cursor.seq() > history_delivered) history_delivered = ps.cursor.seq();
+}
+
+/**
+ * Notify a subscribed central of the next update it has not yet received.
+ * An update is the mean of the history records covering the central's update interval.
+ * Updates are sent one at a time, and the cursor only moves on once onDataSent confirms
+ * the notification went out, so a disconnect never loses a record. After a confirmation this
+ * runs as a separate event, never from inside onDataSent.
+ * Updates the central's report policy suppresses are skipped without being sent.
+ * Without a subscription nothing is written; the records wait for the central to subscribe.
+ */
+void PMSense_drainhistory(uint8_t index)
+{
+    BLEApp::session_t *session = app.get_session_at(index);
+    if (!session || !app.is_subscribed(*session, PMservice.count_handle())) return;
+    PMSenseSession &ps = PMsessions[index];
+    if (ps.cursor.in_flight()) return;
+
+    if (ps.cursor.seq() < PMhistory.first_seq()) {
+        printf("History overrun on connection %u: %lu records lost\r\n", session->handle, PMhistory.first_seq() - ps.cursor.seq());
+        ps.cursor.skip_to(PMhistory.first_seq());
+    }
+
+    uint8_t n = PMSense_recordsperupdate(*session);
+    while (PMhistory.next_seq() - ps.cursor.seq() >= n) {
+        uint16_t values[ARRSIZE];
+        PMSense_meancountvalues(ps.cursor.seq(), n, values);
+        // evaluate each update once, so a resend after a failed write is not suppressed
+        if (ps.policy_seq != ps.cursor.seq()) {
+            ps.policy_seq = ps.cursor.seq();
+            ps.report = ps.policy.evaluate(values, ARRSIZE);
+        }
+        if (!ps.report) {
+            ps.cursor.skip_to(ps.cursor.seq() + n);
+            PMSense_advancecursor(ps);
+            continue;
+        }
+        if (app.notifyCharacteristicShortValue(session->handle, PMservice.count_handle(), values, ARRSIZE)) {
+            ps.cursor.begin(n);
+        }
+        return;
+    }
+}
+
+/** Offer every central the records it is due */
+void PMSense_drainall()
+{
+    for (uint8_t i = 0; i < MAX_SESSIONS; i++) {
+        PMSense_drainhistory(i);
+    }
+}
+
+/**
+ * Log the interval record and the statistics gathered alongside it. This runs on the BLE queue,
+ * so it goes through PMLOG: with binary-log each line is a token and a few words, not a printf.
+ */
+void PMSense_printrecord(const PMHistoryRecord &record, const PMSenseFrame &frame)
+{
+    PMLOG("PM Counts (0.5um to 2.5um): %u", record.pmdata.reg2_pc + record.pmdata.reg3_pc);
+    PMLOG("PM Counts (greater than 2.5um): %u", record.pmdata.reg4_pc + record.pmdata.reg5_pc + record.pmdata.reg6_pc);
+    PMLOG("History: %lu records held, %lu unsent", PMhistory.count(), PMhistory.next_seq() - history_delivered);
+    for (uint8_t i = 0; i < MAX_SESSIONS; i++) {
+        BLEApp::session_t *session = app.get_session_at(i);
+        if (!session) continue;
+        PMLOG("Connection %u: update every %u s, %lu unmatched confirmations", session->handle,
+              PMSense_recordsperupdate(*session) * RECORD_INTERVAL, PMsessions[i].cursor.get_unmatched());
+        PMLOG("Connection %u: %lu notifications sent, %lu suppressed by report policy", session->handle,
+              PMsessions[i].policy.get_reported(), PMsessions[i].policy.get_suppressed());
+    }
+    PMLOG("GATT writes: %lu published, %lu avoided with no subscribers", app.get_writes_published(),
+          app.get_writes_avoided());
+    if (PMseries.samples()) {
+        PMLOG("Samples: %lu held in %lu bytes (%lu.%02lu bytes/sample)", PMseries.samples(), PMseries.bytes_used(),
+              PMseries.bytes_used() / PMseries.samples(), ((PMseries.bytes_used() * 100) / PMseries.samples()) % 100);
     }
     else {
-        // Update the BLE data
-        // We now divide the data to get the average over the sample period
-        pmcountchar_values[0] = pmcountchar_values[0]/sample_cntr;
-        pmcountchar_values[1] = pmcountchar_values[1]/sample_cntr;
-        app.updateCharacteristicShortValue(pmcount_handle, pmcountchar_values, sizeof(pmcountchar_values)/sizeof(pmcountchar_values[0]));
-        //event.call(debug_printhandler, pmcountchar_values[0], pmcountchar_values[0]);
-        printf("\r\nPM Counts (0.5um to 2.5um): %u\r\n", pmcountchar_values[0]);
-        printf("PM Counts (greater than 2.5um): %u\r\n", pmcountchar_values[1]);
-        // Reset sample counters and data arrays
-        sample_cntr = 1;
-        memset(pmcountchar_values, '\0', ARRSIZE);
-    }
-    /*
-    if (btnvalue != prev_btnvalue) {
-        app.updateCharacteristicValue(pmcount_handle, btnvalue, sizeof(btnvalue));
-    }    
-    prev_btnvalue = btnvalue;
-    */
+        PMLOG("Samples: none held");
+    }
+    PMLOG("PM2.5 mass density: %lu over %u samples", record.pmdata.pm25_mdv, frame.samples);
+    PMLOG("PM2.5 mass density: min %lu, max %lu, var %lu", frame.pm25_min, frame.pm25_max, frame.pm25_var);
+    PMLOG("I2C transactions: %lu (%lu us blocked)", frame.bus_transactions, frame.bus_blocked_us);
+    PMLOG("Sample jitter: p50 <= %lu us, p99 <= %lu us, max %lu us", frame.jitter_p50_us, frame.jitter_p99_us,
+          frame.jitter_max_us);
+    PMLOG("Sensor frames: %lu dropped, up to %lu of %lu queued", PMframes.get_dropped(), PMframes.get_high_water(),
+          PMframes.capacity());
+    const TimeHistogram &latency = app.get_ble_event_latency();
+    PMLOG("BLE event latency: p50 <= %lu us, p99 <= %lu us, max %lu us over %lu", latency.percentile(50),
+          latency.percentile(99), latency.max(), latency.count());
+    PMLOG("Max BLE event latency: %lu us", app.get_max_ble_event_latency_us());
+#if PMLOG_BINARY
+    PMLOG("Binary log: %lu records, %lu dropped", PMLog::instance().get_written(), PMLog::instance().get_dropped());
+#endif
+#if MBED_CONF_APP_GATEWAY_MODE
+    app.print_connect_report();
+    PMLOG("Scan filter: %lu reports, %lu duplicates dropped, %lu peers evicted",
+          app.get_scan_filter().get_reports(), app.get_scan_filter().get_duplicates(),
+          app.get_scan_filter().get_evictions());
+#endif
+#if MBED_CONF_APP_GATEWAY_MODE && MBED_CONF_APP_GATEWAY_POLL
+    app.poll_scheduler().print_report(std::chrono::duration_cast<std::chrono::milliseconds>(
+            Kernel::Clock::now().time_since_epoch()).count());
+#endif
+#if MBED_CONF_APP_SENSOR_ASYNC_ACQUISITION
+    PMLOG("Sensor period %lu ms (locked %u), frames dropped: %lu duplicate, %lu stale", frame.sensor_period_ms,
+          frame.sensor_locked, frame.sensor_duplicates, frame.sensor_stale);
+    PMLOG("Sensor overruns: %lu, late I2C completions dropped: %lu", frame.sensor_overruns,
+          frame.sensor_stale_events);
+#endif
+    app.reset_max_ble_event_latency();
+}
+
+/** Store an interval record from the sensor thread and pass it on to centrals and scanners */
+void PMSense_recordhandler(const PMSenseFrame &frame)
+{
+    if (!frame.samples) {
+        PMLOG("No valid PM samples this interval");
+        return;
+    }
+
+    // Store the interval averages; the BLE side consumes them from the history buffer
+    PMHistoryRecord record;
+    record.seq = PMhistory.next_seq();
+    record.timestamp = frame.timestamp;
+    record.pmdata = frame.pmdata;
+    PMhistory.push(record);
+
+    // gateways subscribe to the batched characteristic to get the same data in fewer notifications
+    uint16_t batch_values[ARRSIZE];
+    PMSenseService::count_values(record.pmdata, batch_values);
+    uint8_t batch_bytes[ARRSIZE * sizeof(uint16_t)];
+    for (uint8_t i = 0; i < ARRSIZE; i++) {
+        batch_bytes[i*2] = batch_values[i] >> 8;
+        batch_bytes[(i*2)+1] = batch_values[i];
+    }
+    app.add_batched_sample(record.timestamp, batch_bytes);
+#if MBED_CONF_APP_FLASHLOG_SIZE > 0
+    if (flashlog_ready && PMflashlog.append(&record, sizeof(record)) != PMFLASHLOG_ERR_OK) {
+        PMLOG("Flash log append failed");
+    }
+#endif
+
+    // only subscribers are written to; reads are served from the service's own buffers
+    PMSense_drainall();
+
+    uint8_t status = 0;
+    if (frame.interval_error) status |= PMBCAST_STATUS_ERROR;
+    if (frame.samples < RECORD_INTERVAL) status |= PMBCAST_STATUS_PARTIAL;
+    if (PMhistory.next_seq() != history_delivered) status |= PMBCAST_STATUS_UNSENT;
+    PMservice.publish(record.pmdata, status);
+
+    // passive scanners pick up the same record from the advertising payload
+#if MBED_CONF_APP_BROADCAST_MODE
+    uint8_t bcast[PMBCAST_FRAME_SIZE];
+    app.set_broadcast_data(bcast, pmbcast_encode(bcast, record.seq, status, record.pmdata));
+#endif
+#if PMSENSE_EXTENDED_BROADCAST
+    PMSense_extendedbroadcast(record, status);
+#endif
+    PMSense_printrecord(record, frame);
+}
+
+/**
+ * An id for the per-second series, different on every boot, so a gateway resuming a history pull
+ * can tell the series (and its sequence numbers) started again.
+ */
+uint32_t PMSense_seriesid()
+{
+    uint32_t id = 0;
+#if DEVICE_TRNG
+    trng_t trng;
+    size_t len = 0;
+    trng_init(&trng);
+    int err = trng_get_bytes(&trng, (uint8_t *)&id, sizeof(id), &len);
+    trng_free(&trng);
+    if (err == 0 && len == sizeof(id)) return id;
+#endif
+    // no entropy source: fall back on node time, which moves on across reboots once the flash log holds records
+    id = PMSense_timestamp() ^ (uint32_t)Kernel::Clock::now().time_since_epoch().count();
+    return id;
+}
+
+#if MBED_CONF_APP_FLASHLOG_SIZE > 0
+/**
+ * Reload the newest logged records into the history buffer after a reboot, so centrals are still
+ * offered everything recorded before it. Sequence numbers and node time carry on from them.
+ */
+void PMSense_replayflashlog()
+{
+    Timer replay_timer;
+    replay_timer.start();
+
+    PMFlashLog::cursor_t cursor;
+    PMflashlog.seek_recent(cursor, HISTORY_RECORDS, sizeof(PMHistoryRecord));
+    uint8_t buf[PMFLASHLOG_MAX_RECORD];
+    uint16_t len;
+    uint32_t replayed = 0;
+    while (PMflashlog.read(cursor, buf, sizeof(buf), len) == PMFLASHLOG_ERR_OK) {
+        if (len != sizeof(PMHistoryRecord)) continue;
+        PMHistoryRecord record;
+        memcpy(&record, buf, sizeof(record));
+        // a gap (a failed append) restarts the buffer, so it never holds records out of order
+        if (record.seq != PMhistory.next_seq()) PMhistory.reset(record.seq);
+        PMhistory.push(record);
+        timestamp_base = record.timestamp;
+        replayed++;
+    }
+    // nobody has had the restored records yet
+    history_delivered = PMhistory.first_seq();
+
+    replay_timer.stop();
+    printf("Flash log: %lu records replayed in %lu us, %lu held from seq %lu\r\n", replayed,
+           (uint32_t)replay_timer.elapsed_time().count(), PMhistory.count(), PMhistory.first_seq());
+}
+#endif
+
+/** Take every frame the sensor thread has finished. Runs on the BLE event queue. */
+void PMSense_consumeframes()
+{
+    // cleared first, so a frame pushed while draining queues another pass
+    core_util_atomic_store_bool(&frames_posted, false);
+
+    PMSenseFrame frame;
+    while (PMframes.pop(frame)) {
+        if (frame.record) {
+            PMSense_recordhandler(frame);
+        }
+        else if (frame.error == SAMPLER_ERR_NONE) {
+            PMseries.append(frame.timestamp, frame.pmdata);
+        }
+    }
+}
+
+/** Hand a frame to the BLE side without waiting on it. Runs on the sensor thread. */
+void PMSense_postframe(const PMSenseFrame &frame)
+{
+    if (!PMframes.push(frame)) {
+        return;                 // counted by the ring; the BLE side is too far behind
+    }
+    if (!core_util_atomic_exchange_bool(&frames_posted, true)) {
+        if (!app.post(PMQPROBE_SITE_APP, PMSense_consumeframes)) {
+            core_util_atomic_store_bool(&frames_posted, false);
+        }
+    }
+}
+
+/** Aggregate each sensor frame into interval records. Runs on the sensor thread. */
+void PMSense_framehandler(int error, const PM_MDVPC_Data &pmdata)
+{
+    static uint8_t sample_cntr = 1;
+    static bool interval_error = false;
+    static Timer frame_timer;
+    static int64_t last_frame_us = -1;
+
+    PMSenseFrame frame = {};
+    frame.timestamp = PMSense_timestamp();
+    frame.error = error;
+    frame.pmdata = pmdata;
+
+    // only use the data if there was no bus or sensor error
+    if (error == SAMPLER_ERR_NONE) {
+        PMaggregate.update(pmdata);
+
+        // how far each sample lands from one sensor period after the last
+        if (last_frame_us < 0) frame_timer.start();           // no-op once running
+        int64_t now_us = frame_timer.elapsed_time().count();
+        if (last_frame_us >= 0) {
+#if MBED_CONF_APP_SENSOR_ASYNC_ACQUISITION
+            int64_t period_us = Sampler.get_period_ms() * 1000;
+#else
+            int64_t period_us = 1000000;
+#endif
+            int64_t deviation_us = (now_us - last_frame_us) - period_us;
+            sample_jitter.add((deviation_us < 0) ? -deviation_us : deviation_us);
+        }
+        last_frame_us = now_us;
+    }
+    else {
+        interval_error = true;
+        // the next good sample is more than a period on, so it starts a new reference instead
+        last_frame_us = -1;
+    }
+    PMSense_postframe(frame);
+
+    if (sample_cntr < RECORD_INTERVAL) {
+        sample_cntr++;
+        return;
+    }
+
+    PMSenseFrame record = {};
+    record.timestamp = PMSense_timestamp();
+    record.record = true;
+    record.interval_error = interval_error;
+    record.samples = PMaggregate.count();
+    if (record.samples) {
+        record.pmdata = PMaggregate.mean();
+        record.pm25_min = PMaggregate.mdv[1].min();
+        record.pm25_max = PMaggregate.mdv[1].max();
+        record.pm25_var = PMaggregate.mdv[1].variance();
+    }
+    record.bus_transactions = PM.getBusTransactions();
+    record.bus_blocked_us = PM.getBusBlockedTime_us();
+    record.jitter_p50_us = sample_jitter.percentile(50);
+    record.jitter_p99_us = sample_jitter.percentile(99);
+    record.jitter_max_us = sample_jitter.max();
+    record.sensor_period_ms = Sampler.get_period_ms();
+    record.sensor_locked = Sampler.is_locked();
+    record.sensor_duplicates = Sampler.get_duplicates();
+    record.sensor_stale = Sampler.get_stale();
+    record.sensor_overruns = Sampler.get_overruns();
+    record.sensor_stale_events = Sampler.get_stale_events();
+    PMSense_postframe(record);
+
+    // Reset sample counter and interval statistics
+    PM.resetBusCounters();
+    sample_cntr = 1;
+    interval_error = false;
+    PMaggregate.reset();
+}
+
+/** Each central reads back the update interval it chose */
+void PMSense_intervalread(GattReadAuthCallbackParams *params)
+{
+    static uint8_t value;
+    BLEApp::session_t *session = app.get_session(params->connHandle);
+    value = RECORD_INTERVAL;
+    if (session && session->interval) value = session->interval;
+    params->data = &value;
+    params->len = sizeof(value);
+    params->authorizationReply = AUTH_CALLBACK_REPLY_SUCCESS;
+}
+
+/** Each central reads back its own report policy */
+void PMSense_policyread(GattReadAuthCallbackParams *params)
+{
+    static uint8_t value[REPORT_POLICY_SIZE];
+    int8_t index = app.get_session_index(params->connHandle);
+    if (index >= 0) {
+        PMsessions[index].policy.get_config(value);
+        params->data = value;
+        params->len = sizeof(value);
+    }
+    params->authorizationReply = AUTH_CALLBACK_REPLY_SUCCESS;
+}
+
+#if BLEAPP_QUEUE_PROBE
+/** Summarise the event queue statistics when they are read */
+void PMSense_queueproberead(GattReadAuthCallbackParams *params)
+{
+    static uint8_t value[PMQPROBE_DIAG_SIZE];
+    params->data = value;
+    params->len = app.queue_probe().encode(value);
+    params->authorizationReply = AUTH_CALLBACK_REPLY_SUCCESS;
+}
+#endif
+
+#if PMLOG_BINARY
+/** Hand out the oldest log records when the log characteristic is read; a long read continues the same records */
+void PMSense_logread(GattReadAuthCallbackParams *params)
+{
+    static uint8_t value[PMLOG_PULL_SIZE];
+    if (params->offset == 0) {
+        params->data = value;
+        params->len = PMLog::instance().read(value, sizeof(value));
+    }
+    params->authorizationReply = AUTH_CALLBACK_REPLY_SUCCESS;
+}
+#endif
+
+#if !MBED_CONF_APP_SENSOR_ASYNC_ACQUISITION
+void PMSense_tickerhandler()
+{
+    PM_MDVPC_Data pmdata;
+    uint8_t SensorStatus = 0x01;
+    int error = SAMPLER_ERR_I2C;
+    // read the full register block in one burst (blocks only the sensor thread while the bus is busy)
+    if (PM.readAll(pmdata, SensorStatus) == 0) {
+        error = (SensorStatus == 0) ? SAMPLER_ERR_NONE : SAMPLER_ERR_SENSOR;
+    }
+    PMSense_framehandler(error, pmdata);
+}
+#endif
+
+/** Let BLEApp slow a connection down to match how often we notify it */
+void PMSense_updatereportperiod(const BLEApp::session_t &session)
+{
+    uint32_t period_s = PMSense_recordsperupdate(session) * RECORD_INTERVAL;
+    // a gateway taking only batches hears from us once per batch
+    if (app.is_subscribed(session, pmbatch_handle) && !app.is_subscribed(session, PMservice.count_handle())) {
+        period_s = RECORD_INTERVAL * MBED_CONF_APP_BATCH_MAX_SAMPLES;
+        if (period_s > MBED_CONF_APP_BATCH_MAX_AGE) period_s = MBED_CONF_APP_BATCH_MAX_AGE;
+    }
+    app.set_report_period(session.handle, std::chrono::seconds(period_s));
+}
+
+/** Use a short connection interval only while a history download is running */
+void PMSense_checkbulktransfer()
+{
+    if (HistoryTransfer.is_active()) app.begin_bulk_transfer(HistoryTransfer.get_connection());
+    else app.end_bulk_transfer(HistoryTransfer.get_connection());
 }
 
 void bleApp_InitCompletehandler(BLE &ble, events::EventQueue &_event)
@@ -122,34 +679,8 @@ void bleApp_InitCompletehandler(BLE &ble, events::EventQueue &_event)
     */
     const char *DEVICE_NAME =         "PMsense";
 
-    // The Gatt Service UUID which is also used to advertise the service
-    const char *GATTSERVICE_UUID =    "20220214-1313-1313-1313-f8f381aa84ed";
-    // PM Count and PM Interval Characteristics
-    const char *PMCOUNTCHAR_UUID =     "20220214-1515-1515-1515-f8f381aa84ed";
-    const char *PMINTERVALCHAR_UUID =  "20220214-1616-1616-1616-f8f381aa84ed";
-    //const char *PMSenseApp::PMDENSITYCHAR_UUID =        "20220214-1414-1414-1414-f8f381aa84ed";
-    //const char *PMSenseApp::PMSTATUSCHAR_UUID =        "20220214-1717-1717-1717-f8f381aa84ed";
-
-    UUID PMSENSE_ATTRI_2901 = 0x2901;                       // attribute UUID containing user description
-    UUID PMSENSE_ATTRI_2904 = 0x2904;                       // attribute UUID containing presentation format
-
-    /* setup the default phy used in connection to 2M to reduce power consumption */
-    if (ble.gap().isFeatureSupported(ble::controller_supported_features_t::LE_2M_PHY)) {
-        ble::phy_set_t phys(/* 1M */ false, /* 2M */ true, /* coded */ false);
-        ble_error_t error = ble.gap().setPreferredPhys(/* tx */&phys, /* rx */&phys);
-        
-        /* PHY 2M communication will only take place if both peers support it */
-        if (error) {
-            print_error(error, "GAP::setPreferedPhys failed\r\n");
-        }
-        else {
-            printf("using 2M PHY\r\n");
-            fflush(stdout);           // Just for serial output
-        }
-    } else {
-        /* otherwise it will use 1M by default */
-        printf("2M not supported. Sticking with 1M PHY\r\n");
-    }
+    /* the PHY is chosen per connection from link quality, starting with 2M where supported */
+    app.enable_phy_policy(MBED_CONF_APP_CODED_PHY);
 
     // Add in new service
     printf("Adding Device Information Service\r\n");
@@ -172,72 +703,69 @@ void bleApp_InitCompletehandler(BLE &ble, events::EventQueue &_event)
     printf("Adding PM Sense Service\r\n");
     fflush(stdout);           // Just for serial output
 
-    uint8_t PMCOUNTCHAR_DESCR[28] = "+0.5um and +2.5um PM Counts";
-    GattAttribute *pmcount_descriptor_attribute  = new GattAttribute( 
-                                PMSENSE_ATTRI_2901, // attribute type
-                                PMCOUNTCHAR_DESCR,           // descriptor 
-                                28,           // length of the buffer containing the value
-                                32,         // max length
-                                true // variable length
-                            );
-
-    // Interval Presentation Format: 0x1B: opaque structure; 0x00: no exponent; 0x27B5: unit = concentration(count per m3); 0x01: Bluetooth SIG namespace; 0x0000: No description
-    uint8_t PMCOUNT_PRESENTFORMAT_STR[7] = {0x1B, 0x00, 0xB5, 0x27, 0x01, 0x00, 0x00};
-    GattAttribute *pmcount_presentformat_attribute = new GattAttribute( 
-                                PMSENSE_ATTRI_2904, // attribute type
-                                PMCOUNT_PRESENTFORMAT_STR,           // descriptor 
-                                7,           // length of the buffer containing the value
-                                7,         // max length
-                                true // variable length
-                            );
-    GattAttribute *pmcount_descriptors[] = {pmcount_descriptor_attribute, pmcount_presentformat_attribute};
-
-
-    uint8_t PMINTERVALCHAR_DESCR[28] = "Update Interval (>= 10 sec)";
-    GattAttribute *pminterval_descriptor_attribute = new GattAttribute( 
-                                PMSENSE_ATTRI_2901, // attribute type
-                                PMINTERVALCHAR_DESCR,           // descriptor 
-                                28,           // length of the buffer containing the value
-                                32,         // max length
-                                true // variable length
-                            );
-
-    // Interval Presentation Format: 0x04: unsigned 8 bit integer; 0x00: no exponent; 0x2703: unit = time(second); 0x01: Bluetooth SIG namespace; 0x0000: No description
-    uint8_t PMINTERVAL_PRESENTFORMAT_STR[7] = {0x04, 0x00, 0x03, 0x27, 0x01, 0x00, 0x00};
-    GattAttribute *pminterval_presentformat_attribute = new GattAttribute( 
-                                PMSENSE_ATTRI_2904, // attribute type
-                                PMINTERVAL_PRESENTFORMAT_STR,           // descriptor 
-                                7,           // length of the buffer containing the value
-                                7,         // max length
-                                true // variable length
-                            );
-    GattAttribute *pminterval_descriptors[] = {pminterval_descriptor_attribute, pminterval_presentformat_attribute};
-
-    // Create our Gatt Service Profile
-    // For PM Count Characteristic, we add in an additional notification property and our descriptors
-    ReadOnlyArrayGattCharacteristic<uint16_t,ARRSIZE> pmcount_characteristic(UUID(PMCOUNTCHAR_UUID), pmcountchar_values, 
-                                        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY, pmcount_descriptors, 2);
-    
-    ReadWriteGattCharacteristic<uint8_t> pminterval_characteristic(UUID(PMINTERVALCHAR_UUID), &interval_value, 
-                                        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NONE, pminterval_descriptors, 2);
-
-    GattCharacteristic *charTable[] = { &pmcount_characteristic, & pminterval_characteristic };
-    GattService BLS_GattService(UUID(GATTSERVICE_UUID), charTable, sizeof(charTable) / sizeof(charTable[0]));
-    
-    // We now add in our button & led service
-    app.add_new_gatt_service(BLS_GattService);
+    PMservice.interval_characteristic().setReadAuthorizationCallback(PMSense_intervalread);
+    PMReportPolicy().get_config(pmpolicy_characteristic.value());
+    pmpolicy_characteristic.setReadAuthorizationCallback(PMSense_policyread);
+#if BLEAPP_QUEUE_PROBE
+    pmqprobe_characteristic.setReadAuthorizationCallback(PMSense_queueproberead);
+#endif
+#if PMLOG_BINARY
+    pmlog_characteristic.setReadAuthorizationCallback(PMSense_logread);
+#endif
+
+    // The service brings the PM readings and interval; this firmware adds batching, history and diagnostics
+    GattCharacteristic *extra[] = { &pmbatch_characteristic, &HistoryTransfer.control_characteristic(),
+                                    &HistoryTransfer.data_characteristic(), &pmpolicy_characteristic,
+#if BLEAPP_QUEUE_PROBE
+                                    &pmqprobe_characteristic,
+#endif
+#if PMLOG_BINARY
+                                    &pmlog_characteristic,
+#endif
+                                  };
+    ble_error_t error = PMservice.add_service(ble, RECORD_INTERVAL, extra, sizeof(extra) / sizeof(extra[0]));
+    if (error) {
+        print_error(error, "Error adding PM Sense Service");
+    }
 
-    pmcount_handle = pmcount_characteristic.getValueHandle();
-    pminterval_handle = pminterval_characteristic.getValueHandle();
-    printf("PM Count Charactertistic handle: %u\r\n", pmcount_handle);
-    printf("PM Interval Charactertistic handle: %u\r\n", pminterval_handle);
+    pmpolicy_handle = pmpolicy_characteristic.getValueHandle();
+    pmbatch_handle = pmbatch_characteristic.getValueHandle();
+#if BLEAPP_QUEUE_PROBE
+    pmqprobe_handle = pmqprobe_characteristic.getValueHandle();
+#endif
+    app.set_batching(pmbatch_handle, ARRSIZE * sizeof(uint16_t),
+                     MBED_CONF_APP_BATCH_MAX_SAMPLES, std::chrono::seconds(MBED_CONF_APP_BATCH_MAX_AGE));
+    printf("PM Count Charactertistic handle: %u\r\n", PMservice.count_handle());
+    printf("PM Interval Charactertistic handle: %u\r\n", PMservice.interval_handle());
     fflush(stdout);           // Just for serial output
 
+#if MBED_CONF_APP_GATEWAY_MODE
+    app.start_gateway(PMSENSE_SERVICE_UUID, PMSENSE_COUNT_UUID);
+#if MBED_CONF_APP_GATEWAY_POLL
+    // visit nodes in turn and pull their history, for sites with more nodes than links
+    app.enable_polling("20220214-1818-1818-1818-f8f381aa84ed", "20220214-1919-1919-1919-f8f381aa84ed");
+#endif
+#if MBED_CONF_APP_GATEWAY_ACCEPT_LIST && BLE_FEATURE_WHITELIST
+    // let the controller drop reports from other devices once the nodes are known
+    app.enable_accept_list();
+#endif
+#endif
+
     // Set up advertising information
-    app.set_GattUUID_128(GATTSERVICE_UUID);
+    app.set_GattUUID_128(PMSENSE_SERVICE_UUID);
 
     app.set_advertising_name(DEVICE_NAME);
 
+    // Sampling runs whether or not a central is connected; data is kept in the history buffer
+    // It has its own higher priority thread, and hands finished frames back to this event queue
+    sensor_thread.start(callback(&sensor_queue, &EventQueue::dispatch_forever));
+    // Initialise a event call every 1 second to retrieve data from the panasonic PM sensor (spec says data updated every 1 second)
+#if MBED_CONF_APP_SENSOR_ASYNC_ACQUISITION
+    sensor_queue.call([]() { Sampler.start(sensor_queue, 1000ms); });
+#else
+    sensor_queue.call_every(1000ms, &PMSense_tickerhandler);
+#endif
+
 }
 
 void bleApp_Connectionhandler(BLE &ble, events::EventQueue &event, const ble::ConnectionCompleteEvent &params)
@@ -245,52 +773,99 @@ void bleApp_Connectionhandler(BLE &ble, events::EventQueue &event, const ble::Co
     LED_Blink.detach();
     ble_led = 1;
 
-    connectionhandle = params.getConnectionHandle();
-
     printf("Now connected to: ");
     print_address(params.getPeerAddress());
-    printf("Connection handle %u.\r\n", connectionhandle);
-
-    // Initialise a event call every 1 second to retrieve data from the panasonic PM sensor (spec says data updated every 1 second)
-    PMSenseEventNo = event.call_every(1000ms, &PMSense_tickerhandler);
+    printf("Connection handle %u, %u of %u centrals.\r\n", params.getConnectionHandle(), app.get_session_count(), MAX_SESSIONS);
+
+    // a new central catches up on records nobody has had yet
+    int8_t index = app.get_session_index(params.getConnectionHandle());
+    if (index < 0) return;
+    PMsessions[index] = PMSenseSession();
+    PMsessions[index].cursor.reset(history_delivered);
+    PMsessions[index].policy_seq = UINT32_MAX;
+    PMSense_updatereportperiod(*app.get_session_at(index));
 }
 
 void bleApp_Disconnectionhandler(BLE &ble, events::EventQueue &event, const ble::DisconnectionCompleteEvent &params)
 {
     printf("Disconnection event. Handle %u\r\n", params.getConnectionHandle());
-    // Detach ticker
-    event.cancel(PMSenseEventNo);
-    LED_Blink.attach(LED_Blinkhandler, 1s);
+    // Sampling carries on; anything in flight is resent from the history buffer on reconnect
+    int8_t index = app.get_session_index(params.getConnectionHandle());
+    if (index >= 0) PMsessions[index].cursor.cancel();
+    HistoryTransfer.on_disconnect(params.getConnectionHandle());
+    // the session is still open while this runs
+    if (app.get_session_count() <= 1) LED_Blink.attach(LED_Blinkhandler, 1s);
 }
 
 void bleApp_UpdatesEnabledhandler(const GattUpdatesEnabledCallbackParams &params)
 {
-    printf("Updates Enabled.\r\n");
-    
+    PMLOG("Updates Enabled on connection %u.", params.connHandle);
+    int8_t index = app.get_session_index(params.connHandle);
+    if (index < 0) return;
+    if (params.attHandle == PMservice.count_handle()) {
+        // catch up on anything recorded while nobody was listening
+        PMSense_drainhistory(index);
+    }
+    PMSense_updatereportperiod(*app.get_session_at(index));
+
 }
 
 void bleApp_UpdatesDisabledhandler(const GattUpdatesDisabledCallbackParams &params)
 {
-    printf("Updates Disabled.\r\n");
-    
+    PMLOG("Updates Disabled on connection %u.", params.connHandle);
+    int8_t index = app.get_session_index(params.connHandle);
+    if (index < 0) return;
+    if (params.attHandle == PMservice.count_handle()) {
+        PMsessions[index].cursor.cancel();
+    }
+    PMSense_updatereportperiod(*app.get_session_at(index));
+
 }
 
 void bleApp_WriteEventhandler(const GattWriteCallbackParams &params)
 {
-    printf("Write Event via connection handle %u.\r\n", params.connHandle);
-    if (params.handle == pminterval_handle) {
-        interval_value = params.data[0];
-        printf("Update Interval changed to %u seconds\r\n", interval_value);
+    PMLOG("Write Event via connection handle %u.", params.connHandle);
+    if (HistoryTransfer.on_data_written(params, app.get_att_mtu(params.connHandle))) {
+        PMSense_checkbulktransfer();
+        return;
+    }
+    int8_t index = app.get_session_index(params.connHandle);
+    if (index < 0 || params.len < 1) return;
+    BLEApp::session_t &session = *app.get_session_at(index);
+
+    if (params.handle == PMservice.interval_handle()) {
+        session.interval = (params.data[0] < RECORD_INTERVAL) ? RECORD_INTERVAL : params.data[0];
+        PMLOG("Update Interval changed to %u seconds on connection %u", session.interval, params.connHandle);
+        PMSense_updatereportperiod(session);
         //led = !ledvalue;
     }
+    else if (params.handle == pmpolicy_handle) {
+        if (PMsessions[index].policy.set_config(params.data, params.len)) {
+            PMLOG("Report policy changed to mode %u on connection %u", params.data[0], params.connHandle);
+        }
+        else {
+            PMLOG("Invalid report policy ignored");
+        }
+    }
+#if BLEAPP_QUEUE_PROBE
+    else if (params.handle == pmqprobe_handle) {
+        if (params.data[0] == 0x01) {
+            app.queue_probe().print();
+        }
+        else if (params.data[0] == 0x02) {
+            app.queue_probe().reset();
+            printf("Event queue statistics reset\r\n");
+        }
+    }
+#endif
     
 }
 
 void bleApp_ReadEventhandler(const GattReadCallbackParams &params)
 {
-    printf("Read Event via connection handle %u.\r\n", params.connHandle);
-    if (params.handle == pminterval_handle) printf("Sample Interval characteristic data read: %u\r\n", params.data[0]);
-    else if (params.handle == pmcount_handle) printf("PM Count characteristic data read: %u %u\r\n", params.data[0], params.data[2]);
+    PMLOG("Read Event via connection handle %u.", params.connHandle);
+    if (params.handle == PMservice.interval_handle()) PMLOG("Sample Interval characteristic data read: %u", params.data[0]);
+    else if (params.handle == PMservice.count_handle()) PMLOG("PM Count characteristic data read: %u %u", params.data[0], params.data[2]);
     
 }
 
@@ -299,17 +874,46 @@ void bleApp_ReadEventhandler(const GattReadCallbackParams &params)
     */
 void onDataSenthandler(const GattDataSentCallbackParams &params)
 {
-    if (params.attHandle == pmcount_handle) {
-        printf("PM Count update callback\r\n");
+    HistoryTransfer.on_data_sent(params);
+    PMSense_checkbulktransfer();
+    int8_t index = app.get_session_index(params.connHandle);
+    if (params.attHandle == PMservice.count_handle() && index >= 0) {
+        PMLOG("PM Count update callback on connection %u", params.connHandle);
+        PMSenseSession &ps = PMsessions[index];
+        if (ps.cursor.confirm()) {
+            PMSense_advancecursor(ps);
+            // send the next update once this callback has returned, so a repeat of it confirms nothing
+            app.post(PMQPROBE_SITE_APP, [index]() { PMSense_drainhistory(index); });
+        }
     }
 }
 
 
+/** Bulk transfer packets count towards the PHY policy's link quality */
+void bleApp_TransferWritehandler(uint16_t len, bool failed)
+{
+    PMPhyPolicy *policy = app.phy_policy(HistoryTransfer.get_connection());
+    if (!policy) return;
+    if (failed) policy->on_error();
+    else policy->on_sent(len, app.get_phy_time_us());
+}
+
+#if MBED_CONF_APP_GATEWAY_MODE
+/** Merged feed from the nodes the gateway collects from */
+void bleApp_GatewaySamplehandler(const PMGatewaySample &sample)
+{
+    static const char *sources[] = {"notified", "broadcast", "pulled"};
+    printf("Node %u %s at %lu: %u %u\r\n", sample.node, sources[sample.source], sample.timestamp,
+            sample.values[0], sample.values[1]);
+}
+#endif
+
 void bleApp_MTUchangehandler(ble::connection_handle_t connectionHandle, uint16_t attMtuSize)
 {
-    printf("MTU change alert.\r\n");
-    printf("connection handle: %u\r\n", connectionHandle);
-    printf("New Mtu Size: %u\r\n", attMtuSize);
+    PMLOG("MTU change alert: connection handle %u, new MTU size %u", connectionHandle, attMtuSize);
+    if (HistoryTransfer.is_active() && HistoryTransfer.get_connection() == connectionHandle) {
+        HistoryTransfer.set_mtu(attMtuSize);
+    }
     
 }
 
@@ -320,10 +924,31 @@ int main()
     printf("\r\nPanasonic SN-GCJA5 Particulate Matter Sensing BLE Application\r\n");
     printf("Monitoring 0.5um to 2.5um and +2.5um counts\r\n");
 
+#if PMLOG_BINARY && MBED_CONF_APP_BINARY_LOG_DRAIN
+    // log records go out on the console in the background, for tools/pmlog_decode.py
+    PMLog::instance().start_drain();
+#endif
+
     // Set our i2c frequency for project
     i2c.frequency(400000);      //400kHz
 
-    app.set_single_connection_only(true);       // only want one connection for demo
+#if MBED_CONF_APP_SENSOR_ASYNC_ACQUISITION
+    Sampler.on_frame(PMSense_framehandler);
+#endif
+
+#if MBED_CONF_APP_FLASHLOG_SIZE > 0
+    if (PMflashlog.init() == PMFLASHLOG_ERR_OK) {
+        flashlog_ready = true;
+        printf("Flash log recovered in %lu us (%lu segments, max erase count %lu)\r\n", PMflashlog.get_recovery_time_us(),
+                PMflashlog.get_segments(), PMflashlog.get_max_erase_count());
+        PMSense_replayflashlog();
+    }
+    else {
+        printf("Flash log not available\r\n");
+    }
+#endif
+    HistoryTransfer.set_series_id(PMSense_seriesid());
+    printf("History series %08lx\r\n", HistoryTransfer.get_series_id());
 
     // We set up all our optional Gatt Server event handlers   
     app.on_connect(bleApp_Connectionhandler);
@@ -334,6 +959,10 @@ int main()
     app.on_serverreadevent(bleApp_ReadEventhandler);
     app.on_serversentevent(onDataSenthandler);
     app.on_AttMtuChange(bleApp_MTUchangehandler);
+    HistoryTransfer.on_write(bleApp_TransferWritehandler);
+#if MBED_CONF_APP_GATEWAY_MODE
+    app.on_gateway_sample(bleApp_GatewaySamplehandler);
+#endif
 
     printf("Waiting for PM Sensor to warm up (takes 8 seconds)...");
     fflush(stdout);           // Just for serial output
@@ -19,7 +19,21 @@
 
 #include <mbed.h>
 #include "ble/BLE.h"
+#include "PMLog.h"
 
+#if PMLOG_BINARY
+/** True if a message has no line break, which would end up inside its log token's format. */
+constexpr bool print_error_one_line(const char *msg)
+{
+    return !*msg || (*msg != '\r' && *msg != '\n' && print_error_one_line(msg + 1));
+}
+
+/* Only the message token and the error code are logged; tools/pmlog_decode.py names the error */
+#define print_error(error, msg)         do { \
+        static_assert(print_error_one_line(msg), "print_error() ends the line, leave the line break out of msg"); \
+        PMLOG(msg ": %d", (int)(error)); \
+    } while (0)
+#else
 inline void print_error(ble_error_t error, const char* msg)
 {
     printf("%s: ", msg);
@@ -71,6 +85,7 @@ inline void print_error(ble_error_t error, const char* msg)
     }
     printf("\r\n");
 }
+#endif
 
 /** print device address to the terminal */
 inline void print_address(const ble::address_t &addr)
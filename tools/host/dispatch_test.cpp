@@ -0,0 +1,223 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* GattServer callbacks through the handler chain, for eight centrals connecting one after another.
+ *
+ * The app registers with the chain as BLEApp does and keeps main.cpp's count update cursor for
+ * each session: one update in flight, moved on by onDataSent. Every central subscribes, then the
+ * history grows and each confirmation is delivered through the chain. Each onDataSent must reach
+ * the app once, and each confirmation must move its cursor over exactly the records it confirms.
+ *
+ * The same run with the handler added on every connection, as BLEApp used to, delivers the eighth
+ * central's callbacks eight times. Because the next update is only sent from a posted event, the
+ * repeats find nothing in flight: every cursor must still move by exactly what was confirmed, and
+ * the repeats must all be counted as unmatched. */
+
+#include <stdio.h>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "ChainableGattServerEventHandler.h"
+#include "PMSessionTable.h"
+#include "PMUpdateCursor.h"
+
+#define CENTRALS            (8u)
+#define SUBSCRIPTIONS       (4u)
+#define COUNT_HANDLE        (0x0012u)
+#define RECORDS_PER_ROUND   (12u)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+typedef struct {
+    bool used;
+    ble::connection_handle_t handle;
+    GattAttribute::Handle_t subscriptions[SUBSCRIPTIONS];
+    uint8_t records_per_update;             // the central's update interval, in records
+} session_t;
+
+typedef PMSessionTable<session_t, CENTRALS, SUBSCRIPTIONS> table_t;
+
+/** Registration as BLEApp does it, and the count updates as main.cpp sends them. */
+class App : public ble::GattServer::EventHandler {
+public:
+    App(ble::GattServer &server, bool per_connection) : _server(server), _per_connection(per_connection)
+    {
+    }
+
+    void start()
+    {
+        if (!_per_connection) register_handler();
+    }
+
+    void connect(ble::connection_handle_t handle, uint8_t records_per_update)
+    {
+        session_t *s = _sessions.open(handle);
+        s->records_per_update = records_per_update;
+        int8_t i = _sessions.index_of(handle);
+        _cursors[i].reset(_next_seq);
+        _first[i] = _next_seq;
+        if (_per_connection) register_handler();
+    }
+
+    /** New interval records, offered to every central. */
+    void record(uint32_t n)
+    {
+        _next_seq += n;
+        for (uint8_t i = 0; i < CENTRALS; i++) drain(i);
+    }
+
+    void onUpdatesEnabled(const GattUpdatesEnabledCallbackParams &params) override
+    {
+        session_t *s = _sessions.get(params.connHandle);
+        if (!s) return;
+        table_t::add_subscription(*s, params.attHandle);
+        drain(_sessions.index_of(params.connHandle));
+    }
+
+    void onDataSent(const GattDataSentCallbackParams &params) override
+    {
+        int8_t i = _sessions.index_of(params.connHandle);
+        if (i < 0 || params.attHandle != COUNT_HANDLE) return;
+        _callbacks[i]++;
+        if (_cursors[i].confirm()) {
+            posted.push_back(i);            // main.cpp posts the drain rather than calling it
+        }
+    }
+
+    /** Run the drains posted to the event queue. */
+    void dispatch()
+    {
+        std::vector<uint8_t> now;
+        now.swap(posted);
+        for (uint8_t i : now) drain(i);
+    }
+
+    /** Notifications queued in the stack, oldest first, with the records each holds. */
+    std::deque<std::pair<GattDataSentCallbackParams, uint8_t> > queued;
+    std::vector<uint8_t> posted;
+
+    uint32_t _next_seq = 100;
+    PMUpdateCursor _cursors[CENTRALS];
+    uint32_t _first[CENTRALS] = {};
+    uint32_t _sent[CENTRALS] = {};          // records in updates queued
+    uint32_t _notifications[CENTRALS] = {};
+    uint32_t _callbacks[CENTRALS] = {};
+
+private:
+    void register_handler()
+    {
+        _chain.addEventHandler(this);
+        _server.setEventHandler(&_chain);
+    }
+
+    /** PMSense_drainhistory: one update at a time, from the cursor. */
+    void drain(uint8_t i)
+    {
+        session_t *s = _sessions.at(i);
+        if (!s || !table_t::is_subscribed(*s, COUNT_HANDLE) || _cursors[i].in_flight()) return;
+        uint8_t n = s->records_per_update;
+        if (_next_seq - _cursors[i].seq() < n) return;
+        queued.push_back(std::make_pair(GattDataSentCallbackParams{s->handle, COUNT_HANDLE}, n));
+        _cursors[i].begin(n);
+        _sent[i] += n;
+        _notifications[i]++;
+    }
+
+    ble::GattServer &_server;
+    bool _per_connection;
+    ChainableGattServerEventHandler _chain;
+    table_t _sessions;
+};
+
+/**
+ * Connect the centrals one after another, each subscribing and taking rounds of records.
+ * Returns the confirmations that moved a cursor by anything but the records they confirmed.
+ */
+static uint32_t run(App &app, ble::GattServer &server)
+{
+    uint32_t wrong_moves = 0;
+    app.start();
+    for (uint8_t c = 0; c < CENTRALS; c++) {
+        ble::connection_handle_t handle = 0x40 + c;
+        app.connect(handle, 1 + c % 4);
+        server.getEventHandler().onUpdatesEnabled({handle, COUNT_HANDLE, COUNT_HANDLE - 1});
+        for (uint8_t round = 0; round < 3; round++) {
+            app.record(RECORDS_PER_ROUND);
+            while (!app.queued.empty()) {
+                GattDataSentCallbackParams params = app.queued.front().first;
+                uint8_t records = app.queued.front().second;
+                app.queued.pop_front();
+                uint8_t i = params.connHandle - 0x40;
+                uint32_t before = app._cursors[i].seq();
+                server.getEventHandler().onDataSent(params);
+                if (app._cursors[i].seq() - before != records) wrong_moves++;
+                app.dispatch();
+            }
+        }
+    }
+    return wrong_moves;
+}
+
+static void test_registered_once()
+{
+    ble::GattServer server;
+    App app(server, false);
+    CHECK(run(app, server) == 0);
+
+    for (uint8_t i = 0; i < CENTRALS; i++) {
+        /* each confirmation reached the app once and moved the cursor over what that update held */
+        CHECK(app._callbacks[i] == app._notifications[i]);
+        CHECK(app._cursors[i].seq() - app._first[i] == app._sent[i]);
+        CHECK(!app._cursors[i].in_flight());
+        CHECK(app._next_seq - app._cursors[i].seq() < 1u + i % 4);
+        printf("central %u: %2lu updates, %2lu callbacks, cursor moved %3lu over %3lu records sent\r\n", i,
+               (unsigned long)app._notifications[i], (unsigned long)app._callbacks[i],
+               (unsigned long)(app._cursors[i].seq() - app._first[i]), (unsigned long)app._sent[i]);
+    }
+}
+
+static void test_registered_per_connection()
+{
+    ble::GattServer server;
+    App app(server, true);
+    uint32_t wrong_moves = run(app, server);
+
+    uint8_t last = CENTRALS - 1;
+    /* the chain holds the app once per connection made, yet no repeat moves a cursor */
+    CHECK(app._callbacks[last] == CENTRALS * app._notifications[last]);
+    CHECK(wrong_moves == 0);
+    for (uint8_t i = 0; i < CENTRALS; i++) {
+        CHECK(app._cursors[i].seq() - app._first[i] == app._sent[i]);
+        CHECK(app._cursors[i].get_unmatched() == app._callbacks[i] - app._notifications[i]);
+    }
+    printf("registered per connection: central %u got %lu callbacks for %lu updates, %lu unmatched, %lu cursor moves wrong\r\n",
+           last, (unsigned long)app._callbacks[last], (unsigned long)app._notifications[last],
+           (unsigned long)app._cursors[last].get_unmatched(), (unsigned long)wrong_moves);
+}
+
+int main()
+{
+    test_registered_once();
+    test_registered_per_connection();
+    printf("dispatch_test: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
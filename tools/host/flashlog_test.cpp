@@ -0,0 +1,262 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMFlashLog on a HeapBlockDevice: append rate, recovery after power cuts at every point in a
+ * record, replay of the newest records into the history buffer and wear spread. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PMFlashLog.h"
+#include "PMHistory.h"
+#include "blockdevice/HeapBlockDevice.h"
+
+#define SEGMENTS        (16u)
+#define SEG_SIZE        (4096u)             // nRF52 internal flash page
+#define PROGRAM_SIZE    (4u)
+#define HISTORY_RECORDS (64u)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/** Heap device that loses power part way through a program once its byte budget runs out. */
+class PowerCutBlockDevice : public mbed::HeapBlockDevice
+{
+public:
+    PowerCutBlockDevice() : HeapBlockDevice(SEGMENTS * SEG_SIZE, 1, PROGRAM_SIZE, SEG_SIZE)
+    {
+    }
+
+    /** Cut power after another budget bytes have been programmed. */
+    void arm(uint32_t budget)
+    {
+        _armed = true;
+        _budget = budget;
+    }
+
+    /** Power back on. */
+    void restore()
+    {
+        _armed = false;
+    }
+
+    int program(const void *buffer, bd_addr_t addr, bd_size_t size) override
+    {
+        if (!_armed) return HeapBlockDevice::program(buffer, addr, size);
+        bd_size_t done = (size < _budget) ? size : _budget;
+        const uint8_t *p = (const uint8_t *)buffer;
+        for (bd_size_t i = 0; i < done; i++) _data[addr + i] &= p[i];
+        _budget -= done;
+        return (done == size) ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+    }
+
+    int erase(bd_addr_t addr, bd_size_t size) override
+    {
+        if (_armed && _budget == 0) return BD_ERROR_DEVICE_ERROR;
+        return HeapBlockDevice::erase(addr, size);
+    }
+
+protected:
+    bool _armed = false;
+    uint32_t _budget = 0;
+};
+
+static PMHistoryRecord make_record(uint32_t seq)
+{
+    PMHistoryRecord record;
+    memset(&record, 0, sizeof(record));
+    record.seq = seq;
+    record.timestamp = seq * 60;
+    record.pmdata.pm25_mdv = seq * 7;
+    return record;
+}
+
+/** Read the whole log back. Returns the number of records, checking they run on from first. */
+static uint32_t read_back(PMFlashLog &log, uint32_t &first, uint32_t &last)
+{
+    PMFlashLog::cursor_t cursor;
+    log.seek_oldest(cursor);
+    uint8_t buf[PMFLASHLOG_MAX_RECORD];
+    uint16_t len;
+    uint32_t count = 0;
+    while (log.read(cursor, buf, sizeof(buf), len) == PMFLASHLOG_ERR_OK) {
+        PMHistoryRecord record;
+        CHECK(len == sizeof(record));
+        memcpy(&record, buf, sizeof(record));
+        CHECK(record.timestamp == record.seq * 60 && record.pmdata.pm25_mdv == record.seq * 7);
+        if (count == 0) first = record.seq;
+        else CHECK(record.seq == last + 1);
+        last = record.seq;
+        count++;
+    }
+    return count;
+}
+
+/** The boot-time replay in main.cpp: newest records into the history buffer. */
+static uint32_t replay(PMFlashLog &log, HistoryBuffer<PMHistoryRecord, HISTORY_RECORDS> &history)
+{
+    PMFlashLog::cursor_t cursor;
+    log.seek_recent(cursor, HISTORY_RECORDS, sizeof(PMHistoryRecord));
+    uint8_t buf[PMFLASHLOG_MAX_RECORD];
+    uint16_t len;
+    uint32_t replayed = 0;
+    while (log.read(cursor, buf, sizeof(buf), len) == PMFLASHLOG_ERR_OK) {
+        if (len != sizeof(PMHistoryRecord)) continue;
+        PMHistoryRecord record;
+        memcpy(&record, buf, sizeof(record));
+        if (record.seq != history.next_seq()) history.reset(record.seq);
+        history.push(record);
+        replayed++;
+    }
+    return replayed;
+}
+
+static void test_append_rate()
+{
+    PowerCutBlockDevice bd;
+    PMFlashLog log(bd);
+    CHECK(log.init() == PMFLASHLOG_ERR_OK);
+
+    const uint32_t appends = 100000;
+    mbed::Timer timer;
+    timer.start();
+    for (uint32_t seq = 0; seq < appends; seq++) {
+        PMHistoryRecord record = make_record(seq);
+        if (log.append(&record, sizeof(record)) != PMFLASHLOG_ERR_OK) {
+            CHECK(false);
+            break;
+        }
+    }
+    timer.stop();
+    uint64_t us = timer.elapsed_time().count();
+
+    uint32_t first = 0, last = 0;
+    uint32_t held = read_back(log, first, last);
+    CHECK(last == appends - 1);
+    CHECK(held > 0 && held == last - first + 1);
+
+    printf("append: %lu records in %llu us, %.0f records/s, %lu held, max erase count %lu\r\n",
+           (unsigned long)appends, (unsigned long long)us, us ? appends * 1e6 / us : 0.0,
+           (unsigned long)held, (unsigned long)log.get_max_erase_count());
+
+    // a reboot finds the same wear
+    PMFlashLog log2(bd);
+    CHECK(log2.init() == PMFLASHLOG_ERR_OK);
+    CHECK(log2.get_max_erase_count() == log.get_max_erase_count());
+}
+
+static void test_power_cut()
+{
+    // cut power at every byte of a record, at a point where the tail segment is part full and
+    // again where the record would open a new segment
+    const uint32_t record_size = PMFLASHLOG_REC_HEADER_SIZE + sizeof(PMHistoryRecord);
+    const uint32_t per_segment = (SEG_SIZE - PMFLASHLOG_SEG_HEADER_SIZE) / ((record_size + PROGRAM_SIZE - 1) & ~(PROGRAM_SIZE - 1));
+    const uint32_t prefill[] = { 37, per_segment * 3 };
+    uint32_t cuts = 0, worst_recovery_us = 0;
+
+    for (uint32_t p = 0; p < sizeof(prefill) / sizeof(prefill[0]); p++) {
+        for (uint32_t budget = 0; budget <= record_size + PMFLASHLOG_SEG_HEADER_SIZE; budget++) {
+            PowerCutBlockDevice bd;
+            uint32_t written = 0;
+            {
+                PMFlashLog log(bd);
+                CHECK(log.init() == PMFLASHLOG_ERR_OK);
+                for (; written < prefill[p]; written++) {
+                    PMHistoryRecord record = make_record(written);
+                    CHECK(log.append(&record, sizeof(record)) == PMFLASHLOG_ERR_OK);
+                }
+                bd.arm(budget);
+                PMHistoryRecord record = make_record(written);
+                if (log.append(&record, sizeof(record)) == PMFLASHLOG_ERR_OK) written++;
+            }
+            bd.restore();
+            cuts++;
+
+            // reboot: everything acknowledged survives, nothing torn is read back
+            PMFlashLog log(bd);
+            CHECK(log.init() == PMFLASHLOG_ERR_OK);
+            if (log.get_recovery_time_us() > worst_recovery_us) worst_recovery_us = log.get_recovery_time_us();
+            uint32_t first = 0, last = 0;
+            uint32_t held = read_back(log, first, last);
+            CHECK(first == 0);
+            CHECK(held == written || held == written + 1);  // a cut after the last byte still lands
+            uint32_t next = held;
+
+            // and logging carries on after it
+            for (uint32_t i = 0; i < 5; i++, next++) {
+                PMHistoryRecord record = make_record(next);
+                CHECK(log.append(&record, sizeof(record)) == PMFLASHLOG_ERR_OK);
+            }
+            held = read_back(log, first, last);
+            CHECK(first == 0 && last == next - 1 && held == next);
+        }
+    }
+    printf("power cut: %lu cuts recovered, worst recovery %lu us\r\n", (unsigned long)cuts,
+           (unsigned long)worst_recovery_us);
+}
+
+static void test_replay()
+{
+    PowerCutBlockDevice bd;
+    const uint32_t logged = 1000;
+    {
+        PMFlashLog log(bd);
+        CHECK(log.init() == PMFLASHLOG_ERR_OK);
+        for (uint32_t seq = 0; seq < logged; seq++) {
+            PMHistoryRecord record = make_record(seq);
+            CHECK(log.append(&record, sizeof(record)) == PMFLASHLOG_ERR_OK);
+        }
+    }
+
+    PMFlashLog log(bd);
+    CHECK(log.init() == PMFLASHLOG_ERR_OK);
+    HistoryBuffer<PMHistoryRecord, HISTORY_RECORDS> history;
+    mbed::Timer timer;
+    timer.start();
+    uint32_t replayed = replay(log, history);
+    timer.stop();
+
+    // the newest records come back and numbering carries on from them
+    CHECK(replayed >= HISTORY_RECORDS && replayed < HISTORY_RECORDS + 2 * SEG_SIZE / sizeof(PMHistoryRecord));
+    CHECK(history.next_seq() == logged);
+    CHECK(history.count() == HISTORY_RECORDS);
+    for (uint32_t seq = history.first_seq(); seq < history.next_seq(); seq++) {
+        PMHistoryRecord record;
+        CHECK(history.get(seq, record) && record.seq == seq && record.timestamp == seq * 60);
+    }
+    printf("replay: %lu records read in %llu us, history holds seq %lu to %lu\r\n", (unsigned long)replayed,
+           (unsigned long long)timer.elapsed_time().count(), (unsigned long)history.first_seq(),
+           (unsigned long)(history.next_seq() - 1));
+
+    // an empty log replays nothing
+    PowerCutBlockDevice empty_bd;
+    PMFlashLog empty(empty_bd);
+    CHECK(empty.init() == PMFLASHLOG_ERR_OK);
+    HistoryBuffer<PMHistoryRecord, HISTORY_RECORDS> empty_history;
+    CHECK(replay(empty, empty_history) == 0 && empty_history.count() == 0);
+}
+
+int main()
+{
+    test_append_rate();
+    test_power_cut();
+    test_replay();
+    printf("flashlog_test: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
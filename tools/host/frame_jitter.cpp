@@ -0,0 +1,279 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Sample jitter and BLE event latency under a synthetic load, before and after the sensor thread.
+ *
+ * A radio thread posts BLE events to the BLE event queue at random, each costing 50 to 1500 us of
+ * CPU to handle, and a background thread spins at a lower priority. The sensor ticks every
+ * SIM_PERIOD_US (a scaled down sensor period).
+ *
+ * shared:  the sensor tick is one more event on the BLE queue, as before user-021, so it waits
+ *          behind whatever BLE event is running.
+ * thread:  the tick runs on its own higher priority thread and hands a frame through PMFrameRing,
+ *          posting one consume event to the BLE queue, as main.cpp does now.
+ *
+ * Sample jitter is each tick's deviation from one period after the last, as PMSense_framehandler
+ * measures it, and BLE latency is how long an event waited in the queue, as schedule_ble_events
+ * records it. Both are shown exact and as the TimeHistogram the firmware reports. The higher
+ * priority needs SCHED_FIFO; without it the sensor thread runs at the normal priority, and the
+ * run says so. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PMFrameRing.h"
+#include "PMStats.h"
+
+#define SIM_PERIOD_US           (10000u)
+#define SIM_TICKS               (600u)
+#define BLE_EVENT_GAP_US        (3000u)             ///< Mean time between BLE events
+#define BLE_EVENT_MIN_US        (50u)
+#define BLE_EVENT_MAX_US        (1500u)
+#define FRAME_HANDLER_US        (200u)              ///< BLE side work per frame, mostly printf
+#define SENSOR_FRAMES           (16u)               // as main.cpp
+
+typedef std::chrono::steady_clock clock_type;
+
+static int64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now().time_since_epoch()).count();
+}
+
+static void spin_us(int64_t us)
+{
+    int64_t end = now_us() + us;
+    while (now_us() < end) {
+    }
+}
+
+static uint32_t rng_state = 0x2545f491u;
+
+static uint32_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+/** What the BLE thread dispatches: a BLE event, a sensor tick or a frame consume. */
+typedef enum {
+    EVENT_BLE,
+    EVENT_TICK,
+    EVENT_CONSUME
+} event_kind_t;
+
+typedef struct {
+    event_kind_t kind;
+    int64_t posted_us;
+    uint32_t cost_us;
+} event_t;
+
+typedef struct {
+    uint32_t seq;
+    int64_t tick_us;
+} frame_t;
+
+/** The BLE thread's EventQueue: FIFO, dispatched by one thread. */
+class EventQueueModel {
+public:
+    void post(const event_t &event)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _events.push_back(event);
+        }
+        _ready.notify_one();
+    }
+
+    /** Next event, or false once stopped and empty. */
+    bool wait(event_t &event)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.wait(lock, [this]() {
+            return !_events.empty() || _stopped;
+        });
+        if (_events.empty()) return false;
+        event = _events.front();
+        _events.pop_front();
+        return true;
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped = true;
+        }
+        _ready.notify_all();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::deque<event_t> _events;
+    bool _stopped = false;
+};
+
+typedef struct {
+    std::vector<uint32_t> exact;
+    TimeHistogram hist;
+
+    void add(int64_t us)
+    {
+        if (us < 0) us = -us;
+        exact.push_back(us);
+        hist.add(us);
+    }
+} series_t;
+
+static uint32_t exact_percentile(std::vector<uint32_t> v, uint8_t percent)
+{
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (v.size() * percent + 99) / 100 - 1)];
+}
+
+static void print_series(const char *name, const series_t &s)
+{
+    printf("  %-13s p50 %6lu us, p90 %6lu us, p99 %6lu us, max %6lu us over %lu\r\n", name,
+           (unsigned long)exact_percentile(s.exact, 50), (unsigned long)exact_percentile(s.exact, 90),
+           (unsigned long)exact_percentile(s.exact, 99), (unsigned long)s.hist.max(), (unsigned long)s.exact.size());
+    printf("  %-13s p50 <= %lu us, p99 <= %lu us (TimeHistogram)\r\n", "", (unsigned long)s.hist.percentile(50),
+           (unsigned long)s.hist.percentile(99));
+}
+
+/** Raise the calling thread above the BLE thread, as osPriorityAboveNormal does. */
+static bool raise_priority()
+{
+    sched_param param = {};
+    param.sched_priority = 10;
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
+
+static bool run(bool sensor_thread)
+{
+    EventQueueModel queue;
+    PMFrameRing<frame_t, SENSOR_FRAMES> frames;
+    volatile bool frames_posted = false;
+    volatile bool running = true;
+    bool raised = false;
+    series_t jitter, latency;
+    uint32_t received = 0;
+    int64_t last_tick_us = -1;
+
+    /* the sensor tick, wherever it runs */
+    auto tick = [&](uint32_t seq) {
+        int64_t t = now_us();
+        if (last_tick_us >= 0) jitter.add((t - last_tick_us) - SIM_PERIOD_US);
+        last_tick_us = t;
+        if (!sensor_thread) {
+            spin_us(FRAME_HANDLER_US);
+            received++;
+            return;
+        }
+        frame_t frame = {seq, t};
+        if (frames.push(frame) && !core_util_atomic_exchange_bool(&frames_posted, true)) {
+            queue.post({EVENT_CONSUME, now_us(), 0});
+        }
+    };
+
+    std::thread ble([&]() {
+        event_t event;
+        while (queue.wait(event)) {
+            latency.add(now_us() - event.posted_us);
+            if (event.kind == EVENT_BLE) {
+                spin_us(event.cost_us);
+            }
+            else if (event.kind == EVENT_TICK) {
+                tick(event.cost_us);
+            }
+            else {
+                core_util_atomic_store_bool(&frames_posted, false);
+                frame_t frame;
+                while (frames.pop(frame)) {
+                    spin_us(FRAME_HANDLER_US);
+                    received++;
+                }
+            }
+        }
+    });
+
+    std::thread radio([&]() {
+        while (core_util_atomic_load_bool(&running)) {
+            std::this_thread::sleep_for(std::chrono::microseconds(rng() % (2 * BLE_EVENT_GAP_US)));
+            queue.post({EVENT_BLE, now_us(), BLE_EVENT_MIN_US + rng() % (BLE_EVENT_MAX_US - BLE_EVENT_MIN_US)});
+        }
+    });
+
+    std::thread background([&]() {
+        setpriority(PRIO_PROCESS, 0, 10);
+        while (core_util_atomic_load_bool(&running)) spin_us(1000);
+    });
+
+    /* ticks come from a timer either way: posted to the BLE queue, or run on the sensor thread */
+    std::thread sensor([&]() {
+        if (sensor_thread) raised = raise_priority();
+        clock_type::time_point next = clock_type::now();
+        for (uint32_t seq = 0; seq < SIM_TICKS; seq++) {
+            next += std::chrono::microseconds(SIM_PERIOD_US);
+            std::this_thread::sleep_until(next);
+            if (sensor_thread) tick(seq);
+            else queue.post({EVENT_TICK, now_us(), seq});
+        }
+    });
+
+    sensor.join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    core_util_atomic_store_bool(&running, false);
+    radio.join();
+    background.join();
+    queue.stop();
+    ble.join();
+
+    printf("%s%s: %lu frames handled, %lu dropped, ring high water %lu\r\n",
+           sensor_thread ? "thread" : "shared",
+           sensor_thread ? (raised ? " (SCHED_FIFO)" : " (no SCHED_FIFO, same priority)") : "",
+           (unsigned long)received, (unsigned long)frames.get_dropped(), (unsigned long)frames.get_high_water());
+    print_series("sample jitter", jitter);
+    print_series("BLE latency", latency);
+    return received + frames.get_dropped() == SIM_TICKS;
+}
+
+int main()
+{
+    printf("frame_jitter: %u ticks of %u us, BLE events every %u us on average costing %u to %u us, %u CPUs\r\n",
+           SIM_TICKS, SIM_PERIOD_US, BLE_EVENT_GAP_US, BLE_EVENT_MIN_US, BLE_EVENT_MAX_US,
+           std::thread::hardware_concurrency());
+    bool ok = run(false);
+    ok &= run(true);
+    printf("frame_jitter: %s\r\n", ok ? "passed" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMFrameRing between a producer and a consumer thread.
+ *
+ * Frames are as large as a PMSenseFrame and carry their sequence number in every word, so a frame
+ * read while it was being written shows up. In the lossless run the producer retries a full ring,
+ * and every frame must arrive once, intact and in order, with the refusals counted as dropped. In
+ * the lossy run the producer never retries, and what arrives plus what was dropped must be what
+ * was sent, still in order; it sends in bursts so the ring both fills and drains. The high water
+ * mark must never pass the capacity. */
+
+#include <stdio.h>
+
+#include <thread>
+
+#include "PMFrameRing.h"
+
+#define RING_FRAMES         (16u)               // SENSOR_FRAMES in main.cpp
+#define FRAME_WORDS         (20u)
+#define LOSSLESS_FRAMES     (2000000u)
+#define LOSSY_FRAMES        (2000000u)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+typedef struct {
+    uint32_t seq;
+    uint32_t words[FRAME_WORDS - 1];
+} frame_t;
+
+typedef PMFrameRing<frame_t, RING_FRAMES> ring_t;
+
+static frame_t make_frame(uint32_t seq)
+{
+    frame_t frame;
+    frame.seq = seq;
+    for (uint32_t i = 0; i < FRAME_WORDS - 1; i++) frame.words[i] = seq * 2654435761u + i;
+    return frame;
+}
+
+static bool intact(const frame_t &frame)
+{
+    for (uint32_t i = 0; i < FRAME_WORDS - 1; i++) {
+        if (frame.words[i] != frame.seq * 2654435761u + i) return false;
+    }
+    return true;
+}
+
+/** Pop until the producer is done and the ring is empty; every frame must be intact and later than the last. */
+static void consume(ring_t &ring, const volatile bool &done, uint32_t &received, uint32_t &torn, uint32_t &out_of_order)
+{
+    int64_t last = -1;
+    frame_t frame;
+    for (;;) {
+        if (!ring.pop(frame)) {
+            if (__atomic_load_n(&done, __ATOMIC_ACQUIRE) && !ring.pop(frame)) break;
+            std::this_thread::yield();
+            continue;
+        }
+        received++;
+        if (!intact(frame)) torn++;
+        if ((int64_t)frame.seq <= last) out_of_order++;
+        last = frame.seq;
+    }
+}
+
+static void test_lossless()
+{
+    static ring_t ring;
+    volatile bool done = false;
+    uint32_t refused = 0, received = 0, torn = 0, out_of_order = 0;
+
+    std::thread consumer([&]() {
+        consume(ring, done, received, torn, out_of_order);
+    });
+    for (uint32_t seq = 0; seq < LOSSLESS_FRAMES; seq++) {
+        frame_t frame = make_frame(seq);
+        while (!ring.push(frame)) {
+            refused++;
+            std::this_thread::yield();
+        }
+    }
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    consumer.join();
+
+    CHECK(received == LOSSLESS_FRAMES);
+    CHECK(torn == 0);
+    CHECK(out_of_order == 0);
+    CHECK(ring.get_dropped() == refused);
+    CHECK(ring.get_high_water() <= RING_FRAMES);
+    printf("lossless: %lu frames, %lu refused while full, high water %lu of %u\r\n", (unsigned long)received,
+           (unsigned long)refused, (unsigned long)ring.get_high_water(), RING_FRAMES);
+}
+
+static void test_lossy()
+{
+    static ring_t ring;
+    volatile bool done = false;
+    uint32_t received = 0, torn = 0, out_of_order = 0;
+
+    std::thread consumer([&]() {
+        consume(ring, done, received, torn, out_of_order);
+    });
+    /* bursts of 1 to 32 frames, so the consumer sometimes keeps up and sometimes does not */
+    uint32_t burst = 0;
+    for (uint32_t seq = 0; seq < LOSSY_FRAMES; seq++) {
+        ring.push(make_frame(seq));
+        if (burst-- == 0) {
+            burst = (seq * 2654435761u) >> 27;
+            std::this_thread::yield();
+        }
+    }
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    consumer.join();
+
+    CHECK(received + ring.get_dropped() == LOSSY_FRAMES);
+    CHECK(torn == 0);
+    CHECK(out_of_order == 0);
+    CHECK(ring.get_high_water() <= RING_FRAMES);
+    printf("lossy: %lu frames sent, %lu received, %lu dropped, high water %lu of %u\r\n",
+           (unsigned long)LOSSY_FRAMES, (unsigned long)received, (unsigned long)ring.get_dropped(),
+           (unsigned long)ring.get_high_water(), RING_FRAMES);
+}
+
+/** Single threaded edges: empty, full, and the index wrapping past 2^32. */
+static void test_edges()
+{
+    static ring_t ring;
+    frame_t frame;
+    CHECK(!ring.pop(frame));
+    for (uint32_t i = 0; i < RING_FRAMES; i++) CHECK(ring.push(make_frame(i)));
+    CHECK(!ring.push(make_frame(RING_FRAMES)));
+    CHECK(ring.get_dropped() == 1 && ring.get_high_water() == RING_FRAMES);
+    for (uint32_t i = 0; i < RING_FRAMES; i++) CHECK(ring.pop(frame) && frame.seq == i && intact(frame));
+    CHECK(!ring.pop(frame));
+
+    struct wrapped_t : ring_t {
+        wrapped_t()
+        {
+            _head = _tail = 0xFFFFFFF8u;
+        }
+    };
+    static wrapped_t wrapped;
+    for (uint32_t i = 0; i < RING_FRAMES; i++) CHECK(wrapped.push(make_frame(i)));
+    CHECK(!wrapped.push(make_frame(RING_FRAMES)));
+    for (uint32_t i = 0; i < RING_FRAMES; i++) CHECK(wrapped.pop(frame) && frame.seq == i);
+    CHECK(!wrapped.pop(frame));
+}
+
+int main()
+{
+    test_edges();
+    test_lossless();
+    test_lossy();
+    printf("frame_test: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,239 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMSenseSampler phase lock against a simulated sensor clock, skewed from -500 to +500 ppm.
+ *
+ * Each run is three simulated hours of sensor frames, every update up to 2 ms early or late.
+ * Once locked the sampler must pass every sensor frame on exactly once, read each one within a
+ * guard, a retry and a full nudge of its update, and track the sensor's period to the ms. The
+ * free running 1 s readAll() tick it replaced is run against the same clocks; its repeated and
+ * skipped frames are what the sampler removes.
+ *
+ * A run with the data held for 20 frames at a time (steady air) checks the holdover: three
+ * retries, then one unchanged frame per period until the data moves again. */
+
+#include <stdio.h>
+
+#include "PMSenseSampler.h"
+#include "sim_sensor.h"
+
+#define RUN_US              (3ll * 3600 * 1000000)
+#define SETTLE_US           (60ll * 1000000)         ///< lock in time, not counted
+#define JITTER_US           (2000)
+#define HOLD_FRAMES         (20u)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+Panasonic_SNGCJA5::~Panasonic_SNGCJA5()
+{
+}
+
+/** The sampler, with its probe step in view. */
+class ProbedSampler : public PMSenseSampler {
+public:
+    ProbedSampler(Panasonic_SNGCJA5 &sensor) : PMSenseSampler(sensor)
+    {
+    }
+
+    uint8_t get_nudge_ms() const
+    {
+        return _nudge_ms;
+    }
+};
+
+typedef struct {
+    uint32_t frames;
+    uint32_t repeats;                   // frames passed on with the value of the one before
+    uint32_t missed;                    // sensor frames never passed on
+    uint32_t errors;
+    int64_t age_sum_us;                 // time from the sensor update to the read
+    int64_t age_max_us;
+    uint32_t aged;
+    uint32_t last;
+    uint8_t nudge_max;
+    uint32_t settle_duplicates;         // sampler counters at the end of the lock in time
+    uint32_t settle_holdovers;
+} result_t;
+
+static result_t result;
+static SimSensorBus *bus;
+static ProbedSampler *sampler;
+
+static void on_frame(int error, const PM_MDVPC_Data &pmdata)
+{
+    if (host_sim_time_us() < SETTLE_US) {
+        result.last = pmdata.pm10_mdv;
+        if (sampler) {
+            result.settle_duplicates = sampler->get_duplicates();
+            result.settle_holdovers = sampler->get_holdovers();
+        }
+        return;
+    }
+    if (error != SAMPLER_ERR_NONE) {
+        result.errors++;
+        return;
+    }
+    result.frames++;
+    if (pmdata.pm10_mdv == result.last) result.repeats++;
+    else if (pmdata.pm10_mdv > result.last + 1) result.missed += pmdata.pm10_mdv - result.last - 1;
+    if (pmdata.pm10_mdv != result.last && bus->hold == 1) {
+        int64_t age_us = bus->get_last_read_us() - bus->update_of(bus->frame_at(bus->get_last_read_us()));
+        result.age_sum_us += age_us;
+        result.aged++;
+        if (age_us > result.age_max_us) result.age_max_us = age_us;
+    }
+    result.last = pmdata.pm10_mdv;
+    if (sampler && sampler->get_nudge_ms() > result.nudge_max) result.nudge_max = sampler->get_nudge_ms();
+}
+
+/** Run the queue and the bus interrupts on simulated time. */
+static void run(events::EventQueue &queue, int64_t end_us)
+{
+    while (true) {
+        int64_t next = queue.next_due_us();
+        int64_t irq = bus->next_due_us();
+        if (irq >= 0 && (next < 0 || irq < next)) next = irq;
+        if (next < 0 || next > end_us) break;
+        if (next > host_sim_time_us()) host_sim_time_us() = next;
+        bus->fire_due();
+        queue.dispatch_once();
+    }
+}
+
+static void setup(SimSensorBus &sim, int ppm, uint32_t hold)
+{
+    sim.period_us = 1000000 + ppm * 1000000ll / 1000000;
+    sim.phase_us = 613000;
+    sim.jitter_us = JITTER_US;
+    sim.hold = hold;
+    result = result_t();
+    bus = &sim;
+    sampler = nullptr;
+    host_sim_time_us() = 0;
+}
+
+static Panasonic_SNGCJA5 *blocking_sensor;
+
+/** The free running readAll() tick the sampler replaced. */
+static void blocking_tick(events::EventQueue *queue)
+{
+    queue->call_in(1000ms, [queue]() {
+        blocking_tick(queue);
+    });
+    PM_MDVPC_Data pmdata;
+    uint8_t status = 0x01;
+    if (blocking_sensor->readAll(pmdata, status) == 0 && status == 0) on_frame(SAMPLER_ERR_NONE, pmdata);
+    else on_frame(SAMPLER_ERR_I2C, pmdata);
+}
+
+/** Repeated plus skipped frames for the free running tick. */
+static uint32_t run_freerunning(int ppm)
+{
+    SimSensorBus sim;
+    setup(sim, ppm, 1);
+    Panasonic_SNGCJA5 sensor(sim, SNGCJA5_ADDRESS);
+    blocking_sensor = &sensor;
+    events::EventQueue queue;
+    queue.call([&queue]() {
+        blocking_tick(&queue);
+    });
+    run(queue, RUN_US);
+    return result.repeats + result.missed;
+}
+
+static void run_skew(int ppm)
+{
+    uint32_t freerunning = run_freerunning(ppm);
+
+    SimSensorBus sim;
+    setup(sim, ppm, 1);
+    Panasonic_SNGCJA5 sensor(sim, SNGCJA5_ADDRESS);
+    ProbedSampler probed(sensor);
+    events::EventQueue queue;
+    sampler = &probed;
+    probed.on_frame(on_frame);
+    probed.start(queue, 1000ms);
+    run(queue, RUN_US);
+
+    uint32_t sensor_frames = sim.frame_at(RUN_US) - sim.frame_at(SETTLE_US);
+    double duplicate_rate = (double)probed.get_duplicates() / (sensor_frames ? sensor_frames : 1);
+    printf("%+5d ppm: %5lu of %5lu frames, %lu repeated, %lu missed (free running: %3lu); %.3f re-reads/frame; "
+           "read %4.1f ms after update (max %4.1f); period %lu ms; nudge up to %u ms\r\n",
+           ppm, result.frames, sensor_frames, result.repeats, result.missed, freerunning, duplicate_rate,
+           result.aged ? result.age_sum_us / 1000.0 / result.aged : 0.0, result.age_max_us / 1000.0,
+           probed.get_period_ms(), result.nudge_max);
+
+    CHECK(probed.is_locked());
+    CHECK(result.errors == 0);
+    CHECK(result.repeats == 0);
+    CHECK(result.missed == 0);
+    CHECK(result.frames + 1 >= sensor_frames && result.frames <= sensor_frames + 1);
+    CHECK(probed.get_holdovers() == 0);
+    CHECK(result.age_max_us <= (SAMPLER_GUARD_MS + SAMPLER_RETRY_MS + SAMPLER_NUDGE_MAX_MS) * 1000);
+    CHECK(result.nudge_max >= SAMPLER_NUDGE_MIN_MS && result.nudge_max <= SAMPLER_NUDGE_MAX_MS);
+    CHECK(duplicate_rate < 0.5);
+    int64_t period_ms = (sim.period_us + 500) / 1000;
+    CHECK(probed.get_period_ms() + 1 >= period_ms && probed.get_period_ms() <= period_ms + 1);
+    if (ppm == 500 || ppm == -500) CHECK(freerunning > 0);
+}
+
+/** Steady air: the data only changes every HOLD_FRAMES sensor frames. */
+static void run_holdover()
+{
+    SimSensorBus sim;
+    setup(sim, 0, HOLD_FRAMES);
+    Panasonic_SNGCJA5 sensor(sim, SNGCJA5_ADDRESS);
+    ProbedSampler probed(sensor);
+    events::EventQueue queue;
+    sampler = &probed;
+    probed.on_frame(on_frame);
+    probed.start(queue, 1000ms);
+    run(queue, RUN_US);
+
+    uint32_t sensor_frames = sim.frame_at(RUN_US) - sim.frame_at(SETTLE_US);
+    uint32_t changes = sensor_frames / HOLD_FRAMES;
+    uint32_t holdovers = probed.get_holdovers() - result.settle_holdovers;
+    uint32_t retries = probed.get_duplicates() - result.settle_duplicates - holdovers;
+    printf("hold %2u: %5lu of %5lu frames passed on, %lu unchanged (%lu holdovers), %lu missed; "
+           "%lu retries over %lu changes\r\n", HOLD_FRAMES, result.frames, sensor_frames, result.repeats, holdovers,
+           result.missed, retries, changes);
+
+    CHECK(result.errors == 0);
+    CHECK(result.missed == 0);
+    // one frame per period whether or not the data moved
+    CHECK(result.frames + 2 >= sensor_frames && result.frames <= sensor_frames + 2);
+    CHECK(result.repeats == holdovers);
+    CHECK(result.repeats + changes + 2 >= sensor_frames);
+    // three retries after each change, then none while freewheeling
+    CHECK(retries <= SAMPLER_MAX_RETRIES * (changes + 1));
+    CHECK(retries + SAMPLER_MAX_RETRIES >= SAMPLER_MAX_RETRIES * changes);
+}
+
+int main()
+{
+    static const int skews[] = {-500, -250, -100, 0, 100, 250, 500};
+    for (unsigned i = 0; i < sizeof(skews) / sizeof(skews[0]); i++) {
+        run_skew(skews[i]);
+    }
+    run_holdover();
+
+    printf("phaselock_test: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
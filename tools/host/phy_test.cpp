@@ -0,0 +1,252 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMPhyPolicy: stepping down on errors, RSSI and link loss, stepping back up only after
+ * PHY_CLEAN_WINDOWS clean windows and PHY_RSSI_HYSTERESIS dB of margin, and late confirmations
+ * counting as retried packets.
+ *
+ * A window is PHY_EVENTS connection events of a bulk transfer: each event the stack sends the
+ * notifications queued in it and confirms them at its end, unless the event is missed, in which
+ * case they go out on the next one. */
+
+#include <stdio.h>
+
+#include "PMPhyPolicy.h"
+
+#define INTERVAL_US             (7500u)
+#define PHY_EVENTS              (20u)               // connection events per evaluation window
+#define EVENT_PACKETS           (3u)                // notifications queued per connection event
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static uint32_t now_us = 0;
+
+/** Run one window of connection events, every miss_every'th of them missed, and evaluate it. */
+static uint8_t window(PMPhyPolicy &policy, uint32_t miss_every = 0)
+{
+    uint32_t queued = 0;
+    for (uint32_t e = 1; e <= PHY_EVENTS; e++) {
+        for (uint32_t i = 0; i < EVENT_PACKETS; i++) {
+            policy.on_sent(20, now_us);
+            queued++;
+        }
+        now_us += INTERVAL_US;
+        if (miss_every && (e % miss_every) == 0) continue;
+        for (; queued; queued--) {
+            policy.on_data_sent(now_us);
+        }
+    }
+    for (; queued; queued--) {
+        now_us += INTERVAL_US;
+        policy.on_data_sent(now_us);
+    }
+    now_us += 1000000;                          // idle until the next window
+    return policy.evaluate();
+}
+
+/** Send and confirm packets within a connection event. */
+static void send(PMPhyPolicy &policy, uint32_t packets)
+{
+    for (uint32_t i = 0; i < packets; i++) policy.on_sent(20, now_us);
+    now_us += INTERVAL_US;
+    for (uint32_t i = 0; i < packets; i++) policy.on_data_sent(now_us);
+}
+
+/** Count the clean windows it takes to move up a level, or 0 if it does not within limit. */
+static uint32_t windows_to_step_up(PMPhyPolicy &policy, uint32_t limit = 4 * PHY_CLEAN_WINDOWS)
+{
+    uint8_t level = policy.get_level();
+    for (uint32_t n = 1; n <= limit; n++) {
+        if (window(policy) < level) return n;
+    }
+    return 0;
+}
+
+static PMPhyPolicy make_policy(uint8_t level)
+{
+    PMPhyPolicy policy;
+    policy.set_supported(true, true);
+    policy.set_level(level);
+    policy.set_interval_us(INTERVAL_US);
+    return policy;
+}
+
+static void test_step_up()
+{
+    // without an RSSI, clean windows alone bring the link back up, one level at a time
+    PMPhyPolicy policy = make_policy(PHY_LEVEL_CODED_S8);
+    CHECK(windows_to_step_up(policy) == PHY_CLEAN_WINDOWS && policy.get_level() == PHY_LEVEL_CODED_S2);
+    CHECK(windows_to_step_up(policy) == PHY_CLEAN_WINDOWS && policy.get_level() == PHY_LEVEL_1M);
+    CHECK(windows_to_step_up(policy) == PHY_CLEAN_WINDOWS && policy.get_level() == PHY_LEVEL_2M);
+    CHECK(windows_to_step_up(policy) == 0 && policy.get_level() == PHY_LEVEL_2M);
+
+    // an idle window is neither clean nor an error
+    policy = make_policy(PHY_LEVEL_1M);
+    for (uint32_t n = 1; n < PHY_CLEAN_WINDOWS; n++) window(policy);
+    CHECK(policy.evaluate() == PHY_LEVEL_1M);
+    CHECK(window(policy) == PHY_LEVEL_2M);
+
+    // the controller or application may rule out the faster or the coded PHYs
+    policy = make_policy(PHY_LEVEL_CODED_S8);
+    policy.set_supported(false, true);
+    for (uint32_t n = 0; n < 4 * PHY_CLEAN_WINDOWS; n++) window(policy);
+    CHECK(policy.get_level() == PHY_LEVEL_1M);
+    policy.set_supported(true, false);
+    CHECK(policy.get_level() == PHY_LEVEL_1M);
+    for (uint32_t n = 0; n < 4; n++) policy.on_link_loss();
+    CHECK(policy.get_level() == PHY_LEVEL_1M);
+}
+
+static void test_rssi_hysteresis()
+{
+    // 2M needs -75 dBm; from 1M the RSSI must reach -75 + PHY_RSSI_HYSTERESIS before trying it
+    PMPhyPolicy policy = make_policy(PHY_LEVEL_1M);
+    policy.set_rssi(-75 + PHY_RSSI_HYSTERESIS - 1);
+    CHECK(windows_to_step_up(policy) == 0 && policy.get_level() == PHY_LEVEL_1M);
+    policy.set_rssi(-75 + PHY_RSSI_HYSTERESIS);
+    CHECK(windows_to_step_up(policy) == 1 && policy.get_level() == PHY_LEVEL_2M);
+
+    // below a level's threshold steps down at once, without waiting for errors
+    policy.set_rssi(-76);
+    CHECK(window(policy) == PHY_LEVEL_1M);
+
+    // an RSSI swinging across the 2M threshold does not flap between 2M and 1M
+    uint32_t changes = 0;
+    uint8_t level = policy.get_level();
+    for (uint32_t n = 0; n < 10 * PHY_CLEAN_WINDOWS; n++) {
+        policy.set_rssi((n & 1) ? -72 : -78);
+        uint8_t next = window(policy);
+        if (next != level) changes++;
+        level = next;
+    }
+    CHECK(changes == 0 && level == PHY_LEVEL_1M);
+
+    // a weak link walks down through each threshold: -82 for 1M, -90 for Coded S2
+    policy.set_rssi(-91);
+    CHECK(window(policy) == PHY_LEVEL_CODED_S2);
+    CHECK(window(policy) == PHY_LEVEL_CODED_S8);
+    CHECK(window(policy) == PHY_LEVEL_CODED_S8);
+
+    // and climbs back only with the margin above the next level's threshold
+    policy.set_rssi(-90 + PHY_RSSI_HYSTERESIS - 1);
+    CHECK(windows_to_step_up(policy) == 0);
+    policy.set_rssi(-90 + PHY_RSSI_HYSTERESIS);
+    CHECK(windows_to_step_up(policy) == 1 && policy.get_level() == PHY_LEVEL_CODED_S2);
+}
+
+static void test_errors()
+{
+    PMPhyPolicy policy = make_policy(PHY_LEVEL_2M);
+
+    // too few packets to trust the rate
+    send(policy, PHY_MIN_WINDOW_PACKETS - 2);
+    policy.on_error();
+    CHECK(policy.evaluate() == PHY_LEVEL_2M);
+
+    // PHY_MAX_ERROR_PERCENT is still tolerated, more is not
+    uint32_t sent = (100 / PHY_MAX_ERROR_PERCENT) - 1;
+    send(policy, sent);
+    policy.on_error();
+    CHECK(policy.evaluate() == PHY_LEVEL_2M);
+    send(policy, sent - 1);
+    policy.on_error();
+    CHECK(policy.evaluate() == PHY_LEVEL_1M);
+
+    // a link loss restarts the count of clean windows
+    for (uint32_t n = 1; n < PHY_CLEAN_WINDOWS; n++) window(policy);
+    policy.on_link_loss();
+    CHECK(policy.get_level() == PHY_LEVEL_CODED_S2);
+    CHECK(windows_to_step_up(policy) == PHY_CLEAN_WINDOWS);
+
+    // errors and link losses are counted against the PHY in use
+    policy.set_active(PHY_LEVEL_CODED_S8);
+    policy.on_link_loss();
+    policy.on_error();
+    CHECK(policy.get_stats(PHY_LEVEL_CODED_S8).link_losses == 1 && policy.get_stats(PHY_LEVEL_CODED_S8).errors == 1);
+    CHECK(policy.get_stats(PHY_LEVEL_1M).link_losses == 1 && policy.get_stats(PHY_LEVEL_1M).errors == 3);
+}
+
+static void test_late_confirmations()
+{
+    // a missed connection event puts two intervals between confirmations, which is not late
+    PMPhyPolicy policy = make_policy(PHY_LEVEL_2M);
+    CHECK(window(policy, 4) == PHY_LEVEL_2M);
+    CHECK(policy.get_stats(PHY_LEVEL_1M).errors == 0);
+
+    // confirmations held back for more than PHY_LATE_INTERVALS intervals are retries
+    policy.set_active(PHY_LEVEL_2M);
+    for (uint32_t i = 0; i < EVENT_PACKETS; i++) policy.on_sent(20, now_us);
+    now_us += INTERVAL_US * PHY_LATE_INTERVALS;
+    policy.on_data_sent(now_us);
+    CHECK(policy.get_stats(PHY_LEVEL_2M).errors == 0);
+    now_us += INTERVAL_US * (PHY_LATE_INTERVALS + 1);
+    policy.on_data_sent(now_us);
+    policy.on_data_sent(now_us);
+    CHECK(policy.get_stats(PHY_LEVEL_2M).errors == 1);
+    for (uint32_t i = 0; i < 2 * PHY_MIN_WINDOW_PACKETS; i++) {
+        policy.on_sent(20, now_us);
+        now_us += INTERVAL_US;
+        policy.on_data_sent(now_us);
+    }
+    CHECK(policy.evaluate() == PHY_LEVEL_2M);
+
+    // a link whose confirmations keep arriving several intervals apart steps down without a
+    // failed write
+    policy = make_policy(PHY_LEVEL_2M);
+    uint32_t queued = 0;
+    for (uint32_t e = 0; e < PHY_EVENTS; e++) {
+        policy.on_sent(20, now_us);
+        queued++;
+        now_us += INTERVAL_US;
+        if ((e % 4) == 3) {
+            now_us += INTERVAL_US * PHY_LATE_INTERVALS;
+            for (; queued; queued--) policy.on_data_sent(now_us);
+        }
+    }
+    CHECK(policy.evaluate() == PHY_LEVEL_1M);
+
+    // idle time with nothing queued, confirmations nothing was queued for, and an unknown
+    // connection interval do not count
+    policy = make_policy(PHY_LEVEL_2M);
+    policy.on_data_sent(now_us);
+    policy.on_sent(20, now_us);
+    now_us += INTERVAL_US;
+    policy.on_data_sent(now_us);
+    now_us += 10 * INTERVAL_US;
+    policy.on_sent(20, now_us);
+    now_us += INTERVAL_US;
+    policy.on_data_sent(now_us);
+    policy.on_data_sent(now_us + 10 * INTERVAL_US);
+    policy.set_interval_us(0);
+    policy.on_sent(20, now_us);
+    policy.on_data_sent(now_us + 10 * INTERVAL_US);
+    CHECK(policy.get_stats(PHY_LEVEL_1M).errors == 0);
+}
+
+int main()
+{
+    test_step_up();
+    test_rssi_hysteresis();
+    test_errors();
+    test_late_confirmations();
+
+    printf("phy_test: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
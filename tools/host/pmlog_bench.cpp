@@ -0,0 +1,191 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMLOG cost per call against the printf it replaced, and PMLog under several writers.
+ *
+ * Per call: PMLOG with two arguments, with the ring drained into /dev/null every eight records as
+ * the drain thread would, against fprintf of the same line plus fflush to /dev/null. Both leave
+ * out the UART; on the target the printf path also waits for it once the serial buffer fills.
+ *
+ * Stress: PMLOG_WRITERS threads each log PMLOG_STRESS_RECORDS records of (writer, sequence) and
+ * retry when the ring is full, while a reader thread takes the stream out with read() and decodes
+ * it. Every writer's records must arrive complete and in order, and the records lost reported in
+ * the stream must add up to get_dropped(), which must be the refused writes. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "PMLog.h"
+#include "platform/mbed_retarget.h"
+
+#define PMLOG_CALLS             (2000000u)
+#define PMLOG_DRAIN_EVERY       (8u)
+#define PMLOG_WRITERS           (3u)
+#define PMLOG_STRESS_RECORDS    (200000u)
+
+#define BENCH_FMT               "Data sent on connection %u, handle %u."
+#define STRESS_FMT              "writer %u record %u"
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static double ns_per_call(std::chrono::steady_clock::time_point start, uint32_t calls)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void bench_per_call(int devnull)
+{
+    PMLog &log = PMLog::instance();
+    mbed::FileHandle *console = mbed::mbed_file_handle(STDOUT_FILENO);
+    console->set_fd(devnull);
+    uint8_t buf[PMLOG_MAX_ENCODED * PMLOG_DRAIN_EVERY];
+
+    uint32_t dropped = log.get_dropped();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < PMLOG_CALLS; i++) {
+        PMLOG(BENCH_FMT, i & 7, i);
+        if (i % PMLOG_DRAIN_EVERY == PMLOG_DRAIN_EVERY - 1) {
+            console->write(buf, log.read(buf, sizeof(buf)));
+        }
+    }
+    double pmlog_ns = ns_per_call(start, PMLOG_CALLS);
+    CHECK(log.get_dropped() == dropped);
+
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < PMLOG_CALLS; i++) {
+        PMLOG(BENCH_FMT, i & 7, i);
+        console->write(buf, log.read(buf, sizeof(buf)));
+    }
+    double pmlog_each_ns = ns_per_call(start, PMLOG_CALLS);
+
+    FILE *f = fdopen(dup(devnull), "w");
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < PMLOG_CALLS; i++) {
+        fprintf(f, BENCH_FMT "\r\n", i & 7, i);
+        fflush(f);
+    }
+    double printf_ns = ns_per_call(start, PMLOG_CALLS);
+    fclose(f);
+
+    printf("per call: PMLOG %.0f ns draining every %u, %.0f ns draining every record, fprintf+fflush %.0f ns\r\n",
+           pmlog_ns, PMLOG_DRAIN_EVERY, pmlog_each_ns, printf_ns);
+}
+
+static void stress()
+{
+    PMLog &log = PMLog::instance();
+    const uint32_t token = pmlog_token(STRESS_FMT);
+    uint32_t dropped_before = log.get_dropped();
+    uint32_t written_before = log.get_written();
+    volatile bool done = false;
+    std::vector<uint32_t> refused(PMLOG_WRITERS);
+
+    /* the reader decodes the stream as tools/pmlog_decode.py does */
+    std::vector<uint32_t> next(PMLOG_WRITERS);
+    uint32_t other = 0, out_of_order = 0, reported_lost = 0, malformed = 0;
+    std::thread reader([&]() {
+        uint8_t buf[PMLOG_MAX_ENCODED * 8];
+        for (;;) {
+            /* writers have all finished before done is set, so an empty read after it is the end */
+            bool finished = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+            size_t len = log.read(buf, sizeof(buf));
+            if (!len) {
+                if (finished) break;
+                std::this_thread::yield();
+                continue;
+            }
+            for (size_t i = 0; i < len;) {
+                uint8_t nargs = buf[i + 9];
+                if (buf[i] != PMLOG_MARKER || nargs > PMLOG_MAX_ARGS || i + PMLOG_HEADER_SIZE + nargs * 4 > len) {
+                    malformed++;
+                    break;
+                }
+                uint32_t rec_token = get_u32(buf + i + 1);
+                const uint8_t *args = buf + i + PMLOG_HEADER_SIZE;
+                if (rec_token == PMLOG_TOKEN_DROPPED && nargs == 1) {
+                    reported_lost += get_u32(args);
+                }
+                else if (rec_token == token && nargs == 2 && get_u32(args) < PMLOG_WRITERS) {
+                    uint32_t w = get_u32(args);
+                    if (get_u32(args + 4) != next[w]) out_of_order++;
+                    next[w] = get_u32(args + 4) + 1;
+                }
+                else {
+                    other++;
+                }
+                i += PMLOG_HEADER_SIZE + nargs * 4;
+            }
+        }
+    });
+
+    std::vector<std::thread> writers;
+    for (uint32_t w = 0; w < PMLOG_WRITERS; w++) {
+        writers.push_back(std::thread([&, w]() {
+            for (uint32_t seq = 0; seq < PMLOG_STRESS_RECORDS; seq++) {
+                while (!PMLOG(STRESS_FMT, w, seq)) {
+                    refused[w]++;
+                    std::this_thread::yield();
+                }
+            }
+        }));
+    }
+    for (std::thread &t : writers) t.join();
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    reader.join();
+
+    uint32_t refused_total = 0;
+    for (uint32_t w = 0; w < PMLOG_WRITERS; w++) {
+        CHECK(next[w] == PMLOG_STRESS_RECORDS);
+        refused_total += refused[w];
+    }
+    CHECK(out_of_order == 0);
+    CHECK(malformed == 0);
+    CHECK(other == 0);
+    CHECK(log.get_written() - written_before == PMLOG_WRITERS * PMLOG_STRESS_RECORDS);
+    CHECK(log.get_dropped() - dropped_before == refused_total);
+    CHECK(reported_lost == refused_total);
+    printf("stress: %u writers x %u records arrived in order, %lu refused while full and reported in the stream\r\n",
+           PMLOG_WRITERS, PMLOG_STRESS_RECORDS, (unsigned long)refused_total);
+}
+
+int main()
+{
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+        printf("pmlog_bench: cannot open /dev/null\r\n");
+        return 1;
+    }
+    printf("pmlog_bench: %u records in the ring\r\n", PMLOG_RECORDS);
+    bench_per_call(devnull);
+    stress();
+    printf("pmlog_bench: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
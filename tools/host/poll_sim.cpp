@@ -0,0 +1,319 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMPollScheduler driving a simulated gateway and hundreds of virtual nodes.
+ *
+ * The gateway side follows PMGateway in poll mode: a poll tick every second connects to the node
+ * select() picks while fewer than PMGW_POLL_LINKS links are up, one connection is set up at a time,
+ * one pull runs at a time, and failed nodes back off from PMGW_RETRY_MIN_S to PMGW_RETRY_MAX_S.
+ * Nodes advertise every second (with a broadcast frame carrying their record sequence number, or
+ * without one), make an interval record every 10 to 60 seconds and keep per-second samples, which
+ * a pull downloads at a fixed throughput. Some connections fail and some links drop mid-pull.
+ *
+ * Reports how long the gateway takes to catch up with the hour of samples every node holds when it
+ * starts, then the collection latency of every interval record made after SIM_WARMUP_S (exact, from
+ * the simulation) next to the scheduler's own bucketed percentiles, and the radio utilisation.
+ * A pull moves SAMPLE_BYTES for every second since the last one, so one link keeps up with at most
+ * throughput / SAMPLE_BYTES nodes however they are scheduled. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "PMPollScheduler.h"
+
+#define SIM_NODES_MAX           (250u)              // scheduler indexes are uint8_t
+#define SIM_HOURS               (6u)
+#define SIM_TICK_MS             (50u)
+#define SIM_START_S             (2u * 3600u)        ///< Clock when the gateway starts
+#define SIM_NODE_UPTIME_S       (3600u)             ///< Nodes have been running this long by then
+#define SIM_WARMUP_S            (3600u)             ///< Latency counts records made after this
+
+// mirror PMGateway.h
+#define PMGW_POLL_LINKS         (2u)
+#define PMGW_POLL_SEEN_S        (60u)
+#define PMGW_RETRY_MIN_S        (5u)
+#define PMGW_RETRY_MAX_S        (300u)
+
+// radio model
+#define SEEN_PERCENT            (70u)               ///< Advertising reports heard, scan duty cycle
+#define CONNECT_FAIL_PERCENT    (3u)
+#define DROP_PERCENT            (1u)                ///< Links lost part way through a pull
+#define CONNECT_MS_MAX          (1000u)             ///< Waiting for the node's next advertising event
+#define SETUP_CACHED_MS         (150u)              ///< Database Hash read and subscribe
+#define SETUP_DISCOVER_MS       (1500u)             ///< Full discovery on the first visit
+#define PULL_OVERHEAD_MS        (120u)              ///< Request write and the last packet
+#define DISCONNECT_MS           (60u)
+#define SAMPLE_BYTES            (28u)               ///< HISTXFER_RECORD_SIZE
+#define SERIES_HOLD_S           (4u * 3600u)        ///< Per-second samples a node holds
+
+static uint32_t rng_state = 0x12345678u;
+
+static uint32_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static bool chance(uint32_t percent)
+{
+    return rng() % 100 < percent;
+}
+
+typedef struct {
+    uint32_t record_s;                  // interval record period
+    uint32_t phase_s;                   // time of its first record
+    bool broadcasts;
+    bool discovered;                    // handles cached after the first visit
+
+    bool known;
+    uint32_t last_seen_s;
+    uint32_t retry_at_s;
+    uint32_t retry_s;
+    bool busy;                          // on a link
+
+    bool pulled;                        // pulled completely at least once
+    uint32_t collected_upto_s;          // per-second samples pulled up to here
+    uint32_t next_record;               // first interval record not yet collected
+} sim_node_t;
+
+enum { LINK_FREE, LINK_CONNECTING, LINK_SETUP, LINK_READY, LINK_PULLING, LINK_DISCONNECTING };
+
+typedef struct {
+    uint8_t phase;
+    uint8_t node;
+    uint64_t until_ms;
+    uint32_t pull_from_s;
+    uint32_t pull_to_s;
+    bool drop;
+} sim_link_t;
+
+typedef struct {
+    uint32_t nodes;
+    uint32_t throughput;                // history bytes per second over one link
+} scenario_t;
+
+static uint32_t records_made(const sim_node_t &n, uint32_t now_s)
+{
+    return (now_s < n.phase_s) ? 0 : (now_s - n.phase_s) / n.record_s + 1;
+}
+
+static uint32_t percentile(std::vector<uint32_t> &v, uint32_t percent)
+{
+    if (v.empty()) return 0;
+    size_t i = (v.size() * percent + 99) / 100;
+    return v[(i ? i : 1) - 1];
+}
+
+/** Upper bound of a scheduler latency bucket; the last one is open ended. */
+static const char *bucket_text(uint32_t limit)
+{
+    static char text[4][8];
+    static uint8_t next = 0;
+    char *t = text[next++ % 4];
+    if (limit == UINT32_MAX) snprintf(t, sizeof(text[0]), ">3600");
+    else snprintf(t, sizeof(text[0]), "%lu", (unsigned long)limit);
+    return t;
+}
+
+static void run(const scenario_t &sc)
+{
+    static PMPollScheduler<SIM_NODES_MAX> poll;
+    poll = PMPollScheduler<SIM_NODES_MAX>();
+    rng_state = 0x12345678u ^ sc.nodes;
+
+    std::vector<sim_node_t> nodes(sc.nodes);
+    for (uint32_t i = 0; i < sc.nodes; i++) {
+        sim_node_t &n = nodes[i];
+        memset(&n, 0, sizeof(n));
+        static const uint32_t periods[] = {10, 30, 60};
+        n.record_s = periods[rng() % 3];
+        n.phase_s = SIM_START_S - SIM_NODE_UPTIME_S + rng() % n.record_s;
+        n.broadcasts = chance(80);
+        n.collected_upto_s = n.phase_s - 1;
+    }
+
+    sim_link_t links[PMGW_POLL_LINKS] = {};
+    int connecting = -1, pulling = -1;
+    std::vector<uint32_t> latency;
+    uint32_t pulls = 0, failures = 0, max_behind_s = 0;
+    uint32_t caught_up = 0, caught_up_s = 0;
+
+    const uint64_t end_ms = (uint64_t)(SIM_START_S + SIM_HOURS * 3600) * 1000;
+    for (uint64_t now_ms = (uint64_t)SIM_START_S * 1000; now_ms < end_ms; now_ms += SIM_TICK_MS) {
+        uint32_t now = now_ms / 1000;
+        bool second = (now_ms % 1000) == 0;
+
+        // advertising reports
+        if (second) {
+            for (uint32_t i = 0; i < sc.nodes; i++) {
+                sim_node_t &n = nodes[i];
+                if (n.busy || !chance(SEEN_PERCENT)) continue;
+                if (!n.known) {
+                    poll.reset(i, now);
+                    n.known = true;
+                }
+                n.last_seen_s = now;
+                poll.on_seen(i, now, n.broadcasts, (uint16_t)records_made(n, now));
+            }
+        }
+
+        // links move on
+        for (uint8_t l = 0; l < PMGW_POLL_LINKS; l++) {
+            sim_link_t &k = links[l];
+            if (k.phase == LINK_FREE || now_ms < k.until_ms) continue;
+            sim_node_t &n = nodes[k.node];
+            switch (k.phase) {
+                case LINK_CONNECTING:
+                    connecting = -1;
+                    if (chance(CONNECT_FAIL_PERCENT)) {
+                        poll.on_link(false, now_ms);
+                        poll.on_failed(k.node);
+                        failures++;
+                        n.busy = false;
+                        n.retry_s = (n.retry_s < PMGW_RETRY_MIN_S) ? PMGW_RETRY_MIN_S : n.retry_s * 2;
+                        if (n.retry_s > PMGW_RETRY_MAX_S) n.retry_s = PMGW_RETRY_MAX_S;
+                        n.retry_at_s = now + n.retry_s;
+                        k.phase = LINK_FREE;
+                        break;
+                    }
+                    k.phase = LINK_SETUP;
+                    k.until_ms = now_ms + (n.discovered ? SETUP_CACHED_MS : SETUP_DISCOVER_MS);
+                    n.discovered = true;
+                    break;
+                case LINK_SETUP:
+                    k.phase = LINK_READY;
+                    break;
+                case LINK_PULLING: {
+                    pulling = -1;
+                    uint32_t upto = k.pull_to_s;
+                    if (k.drop) upto = k.pull_from_s + (k.pull_to_s - k.pull_from_s) * (rng() % 100) / 100;
+                    n.collected_upto_s = upto;
+                    uint32_t made = records_made(n, upto);
+                    for (; n.next_record < made; n.next_record++) {
+                        uint32_t made_s = n.phase_s + n.next_record * n.record_s;
+                        if (made_s >= SIM_START_S + SIM_WARMUP_S) latency.push_back(now - made_s);
+                    }
+                    if (k.drop) {
+                        poll.on_failed(k.node);
+                        failures++;
+                        n.retry_s = PMGW_RETRY_MIN_S;
+                        n.retry_at_s = now + n.retry_s;
+                    }
+                    else {
+                        poll.on_pulled(k.node, now, k.pull_to_s - k.pull_from_s);
+                        n.retry_s = 0;
+                        pulls++;
+                        if (!n.pulled) {
+                            n.pulled = true;
+                            if (++caught_up == sc.nodes) caught_up_s = now - SIM_START_S;
+                        }
+                    }
+                    k.phase = LINK_DISCONNECTING;
+                    k.until_ms = now_ms + DISCONNECT_MS;
+                    break;
+                }
+                case LINK_DISCONNECTING:
+                    poll.on_link(false, now_ms);
+                    n.busy = false;
+                    k.phase = LINK_FREE;
+                    break;
+            }
+        }
+
+        // one pull at a time, on the first link ready
+        if (pulling < 0) {
+            for (uint8_t l = 0; l < PMGW_POLL_LINKS; l++) {
+                sim_link_t &k = links[l];
+                if (k.phase != LINK_READY) continue;
+                sim_node_t &n = nodes[k.node];
+                uint32_t oldest = (now > SERIES_HOLD_S) ? now - SERIES_HOLD_S : 0;
+                k.pull_from_s = (n.collected_upto_s < oldest) ? oldest : n.collected_upto_s;
+                k.pull_to_s = now;
+                uint64_t bytes = (uint64_t)(k.pull_to_s - k.pull_from_s) * SAMPLE_BYTES;
+                k.phase = LINK_PULLING;
+                k.until_ms = now_ms + PULL_OVERHEAD_MS + bytes * 1000 / sc.throughput;
+                k.drop = chance(DROP_PERCENT);
+                pulling = l;
+                break;
+            }
+        }
+
+        // poll tick
+        if (second && connecting < 0) {
+            int free_link = -1, up = 0;
+            for (uint8_t l = 0; l < PMGW_POLL_LINKS; l++) {
+                if (links[l].phase == LINK_FREE) free_link = l;
+                else up++;
+            }
+            if (free_link >= 0 && up < (int)PMGW_POLL_LINKS) {
+                int next = poll.select(now, [&nodes, now, &sc](uint8_t i) {
+                    const sim_node_t &n = nodes[i];
+                    return i < sc.nodes && n.known && !n.busy && now >= n.retry_at_s &&
+                           now - n.last_seen_s <= PMGW_POLL_SEEN_S;
+                });
+                if (next >= 0) {
+                    sim_link_t &k = links[free_link];
+                    k.phase = LINK_CONNECTING;
+                    k.node = next;
+                    k.until_ms = now_ms + 30 + rng() % CONNECT_MS_MAX;
+                    nodes[next].busy = true;
+                    connecting = free_link;
+                    poll.on_link(true, now_ms);
+                }
+            }
+        }
+
+        if (second && now % 60 == 0) {
+            for (uint32_t i = 0; i < sc.nodes; i++) {
+                uint32_t behind = now - nodes[i].collected_upto_s;
+                if (now >= SIM_START_S + SIM_WARMUP_S && behind > max_behind_s) max_behind_s = behind;
+            }
+        }
+    }
+
+    std::sort(latency.begin(), latency.end());
+    char catch_up[16];
+    if (caught_up == sc.nodes) snprintf(catch_up, sizeof(catch_up), "%lu", (unsigned long)caught_up_s);
+    else snprintf(catch_up, sizeof(catch_up), "%lu left", (unsigned long)(sc.nodes - caught_up));
+    printf("%5lu %6lu %9s %6lu %6lu %8lu %6lu %6lu %6lu %6lu   %5s %5s %5s %5lu%% %7lu\r\n",
+           (unsigned long)sc.nodes, (unsigned long)sc.throughput, catch_up, (unsigned long)pulls,
+           (unsigned long)failures, (unsigned long)latency.size(), (unsigned long)percentile(latency, 50),
+           (unsigned long)percentile(latency, 90), (unsigned long)percentile(latency, 99),
+           (unsigned long)(latency.empty() ? 0 : latency.back()), bucket_text(poll.latency_percentile(50)),
+           bucket_text(poll.latency_percentile(90)), bucket_text(poll.latency_percentile(99)),
+           (unsigned long)poll.utilisation(end_ms), (unsigned long)max_behind_s);
+}
+
+int main()
+{
+    static const scenario_t scenarios[] = {
+        {50, 8000}, {100, 8000}, {200, 8000}, {250, 8000},
+        {250, 2000},                    // ATT MTU 23 on 1M PHY
+        {250, 20000},                   // ATT MTU 247 with data length extension on 2M PHY
+    };
+    printf("poll_sim: %u h per run, latency in s of records made after the first %u s\r\n", SIM_HOURS, SIM_WARMUP_S);
+    printf("nodes    B/s  catch-up  pulls failed  records    p50    p90    p99    max   sched p50/p90/p99 radio lag max\r\n");
+    for (const scenario_t &sc : scenarios) run(sc);
+    return 0;
+}
@@ -0,0 +1,310 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMReportPolicy: each mode, each deadband, the heartbeat and set_config() validation, then the
+ * notifications each policy saves on a day of replayed count updates.
+ *
+ * The replay makes the two PM Count values main.cpp notifies (0.5 to 2.5 um, and 2.5 um and up)
+ * from Poisson counts per second, averaged into 60 s updates as a central asking for one a
+ * minute gets them, for clean air, an urban day with a cooking spike, and still air. A central
+ * only sees reported values, so for every update the policy suppressed, the value it still holds
+ * must be within the deadband of the true one. */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "PMReportPolicy.h"
+
+#define VALUES                  (2u)
+#define UPDATE_SECONDS          (60u)
+#define DAY_UPDATES             (24u * 3600u / UPDATE_SECONDS)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static bool set(PMReportPolicy &policy, uint8_t mode, uint16_t abs_deadband, uint8_t rel_deadband, uint8_t heartbeat,
+                uint16_t len = REPORT_POLICY_SIZE)
+{
+    uint8_t data[REPORT_POLICY_SIZE] = {mode, (uint8_t)abs_deadband, (uint8_t)(abs_deadband >> 8), rel_deadband, heartbeat};
+    return policy.set_config(data, len);
+}
+
+static bool evaluate(PMReportPolicy &policy, uint16_t a, uint16_t b)
+{
+    uint16_t values[VALUES] = {a, b};
+    return policy.evaluate(values, VALUES);
+}
+
+static void test_modes()
+{
+    PMReportPolicy always;
+    CHECK(evaluate(always, 10, 10) && evaluate(always, 10, 10) && evaluate(always, 10, 10));
+    CHECK(always.get_reported() == 3 && always.get_suppressed() == 0);
+
+    // any change, with both deadbands 0
+    PMReportPolicy any;
+    CHECK(set(any, REPORT_MODE_ON_CHANGE, 0, 0, 0));
+    CHECK(evaluate(any, 10, 10));               // the first is always reported
+    CHECK(!evaluate(any, 10, 10));
+    CHECK(evaluate(any, 10, 11));
+    CHECK(!evaluate(any, 10, 11));
+    CHECK(evaluate(any, 9, 11));
+    CHECK(any.get_evaluated() == 5 && any.get_reported() == 3 && any.get_suppressed() == 2);
+
+    // absolute: more than 10 away from the last reported value, so small steps add up
+    PMReportPolicy abs_policy;
+    CHECK(set(abs_policy, REPORT_MODE_ON_CHANGE, 10, 0, 0));
+    CHECK(evaluate(abs_policy, 100, 100));
+    CHECK(!evaluate(abs_policy, 110, 90));
+    CHECK(evaluate(abs_policy, 111, 100));
+    CHECK(!evaluate(abs_policy, 116, 100));
+    CHECK(!evaluate(abs_policy, 121, 100));
+    CHECK(evaluate(abs_policy, 122, 100));
+    CHECK(evaluate(abs_policy, 122, 0));
+    CHECK(evaluate(abs_policy, 122, 65535));
+
+    // relative: more than 10% of the last reported value
+    PMReportPolicy rel;
+    CHECK(set(rel, REPORT_MODE_ON_CHANGE, 0, 10, 0));
+    CHECK(evaluate(rel, 200, 1000));
+    CHECK(!evaluate(rel, 220, 900));
+    CHECK(evaluate(rel, 221, 1000));
+    CHECK(!evaluate(rel, 221, 1100));
+    CHECK(evaluate(rel, 221, 1101));
+    CHECK(evaluate(rel, 0, 1101));
+    CHECK(evaluate(rel, 1, 1101));              // any change from 0 is beyond a relative deadband
+    CHECK(!evaluate(rel, 1, 1101));
+
+    // either deadband is enough
+    PMReportPolicy both;
+    CHECK(set(both, REPORT_MODE_ON_CHANGE, 50, 10, 0));
+    CHECK(evaluate(both, 1000, 100));
+    CHECK(!evaluate(both, 1050, 110));
+    CHECK(evaluate(both, 1051, 100));           // absolute only: 5.1% is within the relative deadband
+    CHECK(evaluate(both, 1051, 111));           // relative only: 11 is within the absolute deadband
+
+    // a heartbeat forces every 4th update through when nothing moves
+    PMReportPolicy on_change_hb;
+    CHECK(set(on_change_hb, REPORT_MODE_ON_CHANGE, 0, 0, 4));
+    CHECK(evaluate(on_change_hb, 5, 5));
+    CHECK(!evaluate(on_change_hb, 5, 5));
+    CHECK(!evaluate(on_change_hb, 5, 5));
+    CHECK(!evaluate(on_change_hb, 5, 5));
+    CHECK(evaluate(on_change_hb, 5, 5));
+    CHECK(evaluate(on_change_hb, 6, 5));        // a change restarts the count
+    CHECK(!evaluate(on_change_hb, 6, 5));
+    CHECK(!evaluate(on_change_hb, 6, 5));
+    CHECK(!evaluate(on_change_hb, 6, 5));
+    CHECK(evaluate(on_change_hb, 6, 5));
+
+    // heartbeat only: every 3rd update whatever the values do
+    PMReportPolicy heartbeat;
+    CHECK(set(heartbeat, REPORT_MODE_HEARTBEAT, 0, 0, 3));
+    uint32_t reported = 0;
+    for (uint16_t i = 0; i < 30; i++) {
+        bool r = evaluate(heartbeat, i * 100, i);
+        CHECK(r == (i % 3 == 0));
+        reported += r;
+    }
+    CHECK(reported == 10 && heartbeat.get_reported() == 10);
+
+    PMReportPolicy every;
+    CHECK(set(every, REPORT_MODE_HEARTBEAT, 0, 0, 1));
+    CHECK(evaluate(every, 1, 1) && evaluate(every, 1, 1));
+}
+
+static void test_config()
+{
+    PMReportPolicy policy;
+    CHECK(set(policy, REPORT_MODE_ON_CHANGE, 0x1234, 15, 6));
+    uint8_t config[REPORT_POLICY_SIZE];
+    policy.get_config(config);
+    CHECK(config[0] == REPORT_MODE_ON_CHANGE && config[1] == 0x34 && config[2] == 0x12 && config[3] == 15 && config[4] == 6);
+
+    // rejected configs leave the policy as it was
+    CHECK(!set(policy, REPORT_MODE_ON_CHANGE, 0, 0, 0, REPORT_POLICY_SIZE - 1));
+    CHECK(!set(policy, REPORT_MODE_ON_CHANGE, 0, 0, 0, 0));
+    CHECK(!set(policy, REPORT_MODE_HEARTBEAT + 1, 0, 0, 1));
+    CHECK(!set(policy, 0xFF, 0, 0, 1));
+    CHECK(!set(policy, REPORT_MODE_HEARTBEAT, 10, 10, 0));
+    uint8_t after[REPORT_POLICY_SIZE];
+    policy.get_config(after);
+    for (uint8_t i = 0; i < REPORT_POLICY_SIZE; i++) CHECK(after[i] == config[i]);
+
+    // a longer value is accepted, ignoring the rest
+    CHECK(set(policy, REPORT_MODE_ALWAYS, 0, 0, 0, REPORT_POLICY_SIZE + 3));
+
+    // more values than the policy keeps are compared up to REPORT_MAX_VALUES
+    PMReportPolicy wide;
+    CHECK(set(wide, REPORT_MODE_ON_CHANGE, 0, 0, 0));
+    uint16_t values[REPORT_MAX_VALUES + 2] = {0};
+    CHECK(wide.evaluate(values, REPORT_MAX_VALUES + 2));
+    values[REPORT_MAX_VALUES + 1] = 1;
+    CHECK(!wide.evaluate(values, REPORT_MAX_VALUES + 2));
+    values[REPORT_MAX_VALUES - 1] = 1;
+    CHECK(wide.evaluate(values, REPORT_MAX_VALUES + 2));
+}
+
+static uint32_t rng_state = 0x6b8b4567u;
+
+static uint32_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double uniform()
+{
+    return (rng() + 0.5) / 4294967296.0;
+}
+
+static uint32_t poisson(double mean)
+{
+    if (mean > 50) {
+        double n = sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform());
+        double v = mean + sqrt(mean) * n + 0.5;
+        return (v < 0) ? 0 : (uint32_t)v;
+    }
+    double limit = exp(-mean), p = uniform();
+    uint32_t k = 0;
+    while (p > limit) {
+        p *= uniform();
+        k++;
+    }
+    return k;
+}
+
+typedef struct {
+    uint16_t values[VALUES];
+} update_t;
+
+typedef enum {
+    TRACE_CLEAN,
+    TRACE_URBAN,
+    TRACE_STILL
+} trace_kind_t;
+
+/** A day of 60 s mean count updates. */
+static std::vector<update_t> make_trace(trace_kind_t kind)
+{
+    /* share of the 0.3 um count in the 0.5-2.5 um and 2.5 um and up values */
+    static const double share[VALUES] = {0.43, 0.0205};
+    double level = (kind == TRACE_CLEAN) ? 8.0 : (kind == TRACE_URBAN) ? 400.0 : 150.0;
+
+    std::vector<update_t> trace;
+    for (uint32_t u = 0; u < DAY_UPDATES; u++) {
+        double mean = level;
+        if (kind == TRACE_URBAN) {
+            uint32_t s = u * UPDATE_SECONDS;
+            mean *= 1.0 + 0.5 * sin(2 * M_PI * s / (6 * 3600.0));
+            if (s > 18 * 3600 && s < 18 * 3600 + 1800) mean *= 8.0;     // cooking
+        }
+        update_t update;
+        for (uint8_t v = 0; v < VALUES; v++) {
+            uint32_t sum = 0;
+            for (uint32_t s = 0; s < UPDATE_SECONDS; s++) {
+                sum += (kind == TRACE_STILL) ? (uint32_t)(mean * share[v]) : poisson(mean * share[v]);
+            }
+            update.values[v] = (sum + UPDATE_SECONDS / 2) / UPDATE_SECONDS;
+        }
+        trace.push_back(update);
+    }
+    return trace;
+}
+
+typedef struct {
+    const char *name;
+    uint8_t mode;
+    uint16_t abs_deadband;
+    uint8_t rel_deadband;
+    uint8_t heartbeat;
+} policy_t;
+
+static void replay(const char *trace_name, const std::vector<update_t> &trace)
+{
+    static const policy_t policies[] = {
+        {"always", REPORT_MODE_ALWAYS, 0, 0, 0},
+        {"any change", REPORT_MODE_ON_CHANGE, 0, 0, 0},
+        {"abs 5", REPORT_MODE_ON_CHANGE, 5, 0, 0},
+        {"rel 10%", REPORT_MODE_ON_CHANGE, 0, 10, 0},
+        {"rel 10% hb 15", REPORT_MODE_ON_CHANGE, 0, 10, 15},
+        {"abs 5 rel 10%", REPORT_MODE_ON_CHANGE, 5, 10, 0},
+        {"heartbeat 15", REPORT_MODE_HEARTBEAT, 0, 0, 15}
+    };
+
+    printf("%s, %u updates:\r\n", trace_name, DAY_UPDATES);
+    for (unsigned p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        const policy_t &cfg = policies[p];
+        PMReportPolicy policy;
+        CHECK(set(policy, cfg.mode, cfg.abs_deadband, cfg.rel_deadband, cfg.heartbeat));
+
+        uint16_t held[VALUES] = {0};
+        uint32_t worst = 0, outside = 0;
+        uint32_t longest_gap = 0, gap = 0;
+        for (size_t u = 0; u < trace.size(); u++) {
+            uint16_t values[VALUES] = {trace[u].values[0], trace[u].values[1]};
+            if (policy.evaluate(values, VALUES)) {
+                for (uint8_t v = 0; v < VALUES; v++) held[v] = values[v];
+                gap = 0;
+                continue;
+            }
+            if (++gap > longest_gap) longest_gap = gap;
+            for (uint8_t v = 0; v < VALUES; v++) {
+                uint32_t diff = (values[v] > held[v]) ? values[v] - held[v] : held[v] - values[v];
+                if (diff > worst) worst = diff;
+                if (cfg.mode != REPORT_MODE_ON_CHANGE) continue;
+                bool abs_ok = cfg.abs_deadband && diff <= cfg.abs_deadband;
+                bool rel_ok = cfg.rel_deadband && diff * 100 <= (uint32_t)held[v] * cfg.rel_deadband;
+                if (cfg.abs_deadband == 0 && cfg.rel_deadband == 0) abs_ok = (diff == 0);
+                if (cfg.abs_deadband && cfg.rel_deadband) {
+                    if (!(diff <= cfg.abs_deadband && diff * 100 <= (uint32_t)held[v] * cfg.rel_deadband)) outside++;
+                }
+                else if (!abs_ok && !rel_ok) {
+                    outside++;
+                }
+            }
+        }
+        uint32_t sent = policy.get_reported();
+        printf("  %-15s %5lu sent, %5.1f%% saved, held value off by up to %4lu, longest silence %3lu min\r\n",
+               cfg.name, sent, 100.0 * policy.get_suppressed() / policy.get_evaluated(), worst, longest_gap);
+
+        CHECK(policy.get_evaluated() == trace.size());
+        CHECK(outside == 0);
+        if (cfg.mode == REPORT_MODE_ALWAYS) CHECK(sent == trace.size());
+        if (cfg.heartbeat) CHECK(longest_gap < cfg.heartbeat);
+        if (cfg.mode == REPORT_MODE_HEARTBEAT) CHECK(sent == (trace.size() + cfg.heartbeat - 1) / cfg.heartbeat);
+    }
+}
+
+int main()
+{
+    test_modes();
+    test_config();
+
+    replay("clean air", make_trace(TRACE_CLEAN));
+    replay("urban day", make_trace(TRACE_URBAN));
+    replay("still air", make_trace(TRACE_STILL));
+
+    printf("report_test: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMSenseSampler on the stub event queue, against a simulated SN-GCJA5 on an asynchronous I2C bus.
+ *
+ * A BLE connection event is posted every 7 ms on the same queue and records how late it runs.
+ * The sampler must never block dispatch: every event, its own and the BLE ones, runs at the
+ * time it is due. The blocking readAll() tick it replaced is run the same way for comparison.
+ *
+ * Then transfers are made to stall, so the next tick overruns and aborts them, with their
+ * completion interrupt firing just after the abort, while the next transfer is on the bus. The
+ * late completions must be counted as stale and never advance the state machine: no transfer
+ * errors, and every frame passed on is a frame the sensor held when it was read. */
+
+#include <stdio.h>
+
+#include "PMSenseSampler.h"
+#include "sim_sensor.h"
+
+#define RUN_US              (600ll * 1000000)        ///< ten minutes of sensor frames
+#define BLE_INTERVAL_MS     (7)                  ///< prime to the 1 s tick, so every phase between them is seen
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+Panasonic_SNGCJA5::~Panasonic_SNGCJA5()
+{
+}
+
+typedef struct {
+    uint32_t frames;
+    uint32_t errors[4];                 // by -SAMPLER_ERR_xxx
+    uint32_t repeats;                   // frames with the value of the one before
+    uint32_t missed;                    // sensor frames never passed on
+    uint32_t wrong;                     // frames the sensor did not hold when they were read
+    uint32_t last;
+    int64_t ble_events;
+    int64_t ble_worst_us;
+    int64_t blocked_us;                 // simulated time spent inside dispatch
+} result_t;
+
+static result_t result;
+static SimSensorBus *bus;
+
+static void on_frame(int error, const PM_MDVPC_Data &pmdata)
+{
+    if (error != SAMPLER_ERR_NONE) {
+        result.errors[-error]++;
+        return;
+    }
+    result.frames++;
+    uint32_t now = bus->value_of(bus->frame_at(host_sim_time_us()));
+    if (pmdata.pm10_mdv > now || pmdata.pm10_mdv < result.last) result.wrong++;
+    if (pmdata.pm10_mdv == result.last) result.repeats++;
+    else if (result.last && pmdata.pm10_mdv > result.last + 1) result.missed += pmdata.pm10_mdv - result.last - 1;
+    result.last = pmdata.pm10_mdv;
+}
+
+/** A connection event, due at due_us, that posts the next one. */
+static void ble_event(events::EventQueue *queue, int64_t due_us)
+{
+    int64_t late_us = host_sim_time_us() - due_us;
+    if (late_us > result.ble_worst_us) result.ble_worst_us = late_us;
+    result.ble_events++;
+    int64_t next_us = due_us + BLE_INTERVAL_MS * 1000;
+    queue->call_in(std::chrono::milliseconds((next_us - host_sim_time_us()) / 1000), [queue, next_us]() {
+        ble_event(queue, next_us);
+    });
+}
+
+/** Run the queue and the bus interrupts on simulated time. */
+static void run(events::EventQueue &queue, int64_t end_us)
+{
+    queue.call_in(std::chrono::milliseconds(BLE_INTERVAL_MS), [&queue]() {
+        ble_event(&queue, BLE_INTERVAL_MS * 1000);
+    });
+    while (true) {
+        int64_t next = queue.next_due_us();
+        int64_t irq = bus->next_due_us();
+        if (irq >= 0 && (next < 0 || irq < next)) next = irq;
+        if (next < 0 || next > end_us) break;
+        if (next > host_sim_time_us()) host_sim_time_us() = next;
+        bus->fire_due();
+        int64_t before = host_sim_time_us();
+        queue.dispatch_once();
+        result.blocked_us += host_sim_time_us() - before;
+    }
+}
+
+static void reset(SimSensorBus &sim)
+{
+    result = result_t();
+    bus = &sim;
+    host_sim_time_us() = 0;
+}
+
+static void print(const char *name, const PMSenseSampler *sampler)
+{
+    printf("%-22s %6lu frames, %2lu repeated, %3lu missed, %lu wrong; errors: %lu bus, %lu sensor, %lu overrun\r\n",
+           name, result.frames, result.repeats, result.missed, result.wrong,
+           result.errors[-SAMPLER_ERR_I2C], result.errors[-SAMPLER_ERR_SENSOR], result.errors[-SAMPLER_ERR_OVERRUN]);
+    printf("%-22s BLE dispatch worst %lld us over %lld events, %lld us blocked in dispatch\r\n",
+           "", result.ble_worst_us, result.ble_events, result.blocked_us);
+    if (sampler) {
+        printf("%-22s sampler: %lu duplicate, %lu overruns, %lu late completions dropped, period %lu ms\r\n",
+               "", sampler->get_duplicates(), sampler->get_overruns(), sampler->get_stale_events(),
+               sampler->get_period_ms());
+    }
+}
+
+/** The asynchronous sampler on a healthy bus. */
+static int64_t run_async()
+{
+    SimSensorBus sim;
+    sim.phase_us = 337000;
+    reset(sim);
+    Panasonic_SNGCJA5 sensor(sim, SNGCJA5_ADDRESS);
+    PMSenseSampler sampler(sensor);
+    events::EventQueue queue;
+    sampler.on_frame(on_frame);
+    sampler.start(queue, 1000ms);
+    run(queue, RUN_US);
+    print("async", &sampler);
+
+    CHECK(sim.get_blocking() == 0);
+    CHECK(result.blocked_us == 0);
+    CHECK(result.ble_worst_us == 0);
+    CHECK(result.frames >= RUN_US / 1000000 - 5);
+    CHECK(result.wrong == 0);
+    CHECK(result.errors[-SAMPLER_ERR_I2C] == 0 && result.errors[-SAMPLER_ERR_OVERRUN] == 0);
+    return result.ble_worst_us;
+}
+
+static Panasonic_SNGCJA5 *blocking_sensor;
+
+/** The readAll() tick the sampler replaced, once a second. */
+static void blocking_tick(events::EventQueue *queue)
+{
+    queue->call_in(1000ms, [queue]() {
+        blocking_tick(queue);
+    });
+    PM_MDVPC_Data pmdata;
+    uint8_t status = 0x01;
+    int error = SAMPLER_ERR_I2C;
+    if (blocking_sensor->readAll(pmdata, status) == 0) {
+        error = (status == 0) ? SAMPLER_ERR_NONE : SAMPLER_ERR_SENSOR;
+    }
+    on_frame(error, pmdata);
+}
+
+static int64_t run_blocking()
+{
+    SimSensorBus sim;
+    sim.phase_us = 337000;
+    reset(sim);
+    Panasonic_SNGCJA5 sensor(sim, SNGCJA5_ADDRESS);
+    blocking_sensor = &sensor;
+    events::EventQueue queue;
+    queue.call_in(1ms, [&queue]() {
+        blocking_tick(&queue);
+    });
+    run(queue, RUN_US);
+    print("blocking readAll", nullptr);
+
+    CHECK(sim.get_blocking() > 0);
+    CHECK(result.ble_worst_us > 0);
+    return result.ble_worst_us;
+}
+
+/** Stalled transfers, aborted by the next tick, with or without a completion after the abort. */
+static void run_stalls(int64_t isr_after_abort_us)
+{
+    SimSensorBus sim;
+    sim.phase_us = 337000;
+    sim.stall_every = 7;
+    sim.isr_after_abort_us = isr_after_abort_us;
+    reset(sim);
+    Panasonic_SNGCJA5 sensor(sim, SNGCJA5_ADDRESS);
+    PMSenseSampler sampler(sensor);
+    events::EventQueue queue;
+    sampler.on_frame(on_frame);
+    sampler.start(queue, 1000ms);
+    run(queue, RUN_US);
+    print(isr_after_abort_us < 0 ? "stalls" : "stalls, late completion", &sampler);
+
+    CHECK(sim.get_stalls() > 0);
+    CHECK(sampler.get_overruns() == sim.get_stalls());
+    CHECK(result.errors[-SAMPLER_ERR_OVERRUN] == sim.get_stalls());
+    CHECK(sampler.get_stale_events() == sim.get_late());
+    if (isr_after_abort_us >= 0) CHECK(sim.get_late() == sim.get_stalls());
+    CHECK(result.errors[-SAMPLER_ERR_I2C] == 0);
+    CHECK(result.wrong == 0);
+    CHECK(result.blocked_us == 0);
+    CHECK(result.ble_worst_us == 0);
+}
+
+int main()
+{
+    int64_t async_us = run_async();
+    int64_t blocking_us = run_blocking();
+    CHECK(async_us < blocking_us);
+    run_stalls(-1);
+    run_stalls(100);
+
+    printf("sampler_test: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
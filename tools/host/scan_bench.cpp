@@ -0,0 +1,253 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMScanFilter replayed against a synthetic dense scan.
+ *
+ * Every peer advertises at its own interval plus the 0 to 10 ms advDelay, and an active scan gets
+ * a scan response after each advertisement. A few peers are PMsense nodes, whose advertisement
+ * carries the service UUID and a broadcast frame that changes every second. Most of the rest send
+ * the same payload every time; a share rotate part of their manufacturer data on every
+ * advertisement, as some phones do, and cannot be dropped as duplicates.
+ *
+ * The report stream is built first, then replayed through is_duplicate() and match() as the
+ * gateway does, and through the parse every report went through before the filter, as a baseline.
+ * Reports CPU time per report, the reports per second that makes, and what the filter dropped and
+ * evicted. Each peer the baseline found must also be found through the filter. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "PMScanFilter.h"
+
+#define SIM_SECONDS             (60u)
+#define SIM_REPEATS             (20u)               ///< Replays timed, for a measurable CPU time
+#define NODE_PERCENT            (10u)               ///< Peers that are PMsense nodes
+#define ROTATING_PERCENT        (15u)               ///< Peers whose payload changes every advertisement
+#define ADV_INTERVAL_MIN_MS     (20u)
+#define ADV_INTERVAL_MAX_MS     (1000u)
+#define ADV_DELAY_MAX_MS        (10u)
+
+#define NODE_NAME               "PMsense"
+#define NODE_SERVICE            "a3c87500-8ed3-4bdf-8a39-a01bebede295"
+
+static uint32_t rng_state = 0x9e3779b9u;
+
+static uint32_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+typedef struct {
+    ble::address_t address;
+    bool node;
+    bool rotating;
+    uint32_t interval_ms;
+    uint8_t adv[31];
+    uint8_t adv_len;
+    uint8_t scan_rsp[31];
+    uint8_t scan_rsp_len;
+} peer_t;
+
+typedef struct {
+    uint32_t time_ms;
+    uint16_t peer;
+    bool scan_response;
+    uint8_t len;
+    uint8_t payload[31];
+} report_t;
+
+static size_t put_field(uint8_t *p, uint8_t type, const void *value, size_t len)
+{
+    p[0] = len + 1;
+    p[1] = type;
+    memcpy(p + 2, value, len);
+    return len + 2;
+}
+
+static void make_peer(peer_t &peer, const UUID &service)
+{
+    for (size_t i = 0; i < ble::address_t::size(); i++) peer.address[i] = rng();
+    peer.node = rng() % 100 < NODE_PERCENT;
+    peer.rotating = !peer.node && rng() % 100 < ROTATING_PERCENT;
+    peer.interval_ms = ADV_INTERVAL_MIN_MS + rng() % (ADV_INTERVAL_MAX_MS - ADV_INTERVAL_MIN_MS);
+
+    static const uint8_t flags = 0x06;
+    uint8_t manufacturer[20];
+    for (size_t i = 0; i < sizeof(manufacturer); i++) manufacturer[i] = rng();
+    size_t len = put_field(peer.adv, 0x01, &flags, 1);
+    if (peer.node) {
+        len += put_field(peer.adv + len, ble::adv_data_type_t::COMPLETE_LIST_128BIT_SERVICE_IDS,
+                         service.getBaseUUID(), UUID::LENGTH_OF_LONG_UUID);
+        len += put_field(peer.adv + len, ble::adv_data_type_t::MANUFACTURER_SPECIFIC_DATA, manufacturer, 8);
+    }
+    else {
+        len += put_field(peer.adv + len, ble::adv_data_type_t::MANUFACTURER_SPECIFIC_DATA, manufacturer, 8 + rng() % 18);
+    }
+    peer.adv_len = len;
+
+    /* names as long as ours but different are the costly ones to reject */
+    char name[PMSCAN_MAX_NAME + 1];
+    if (peer.node) strcpy(name, NODE_NAME);
+    else snprintf(name, sizeof(name), (rng() & 1) ? "PMsens%c" : "Device-%08x", 'a' + rng() % 26, rng());
+    peer.scan_rsp_len = put_field(peer.scan_rsp, ble::adv_data_type_t::COMPLETE_LOCAL_NAME, name, strlen(name));
+}
+
+/* advertisements and scan responses heard in SIM_SECONDS, in time order */
+static std::vector<report_t> make_reports(std::vector<peer_t> &peers)
+{
+    std::vector<report_t> reports;
+    for (size_t p = 0; p < peers.size(); p++) {
+        peer_t &peer = peers[p];
+        for (uint32_t t = rng() % peer.interval_ms; t < SIM_SECONDS * 1000u;
+             t += peer.interval_ms + rng() % (ADV_DELAY_MAX_MS + 1)) {
+            report_t r;
+            r.time_ms = t;
+            r.peer = p;
+            r.scan_response = false;
+            r.len = peer.adv_len;
+            memcpy(r.payload, peer.adv, peer.adv_len);
+            /* the broadcast frame's sequence number, or a rotating identifier */
+            uint8_t *data = r.payload + r.len - 4;
+            if (peer.node) {
+                uint32_t seq = t / 1000u;
+                memcpy(data, &seq, sizeof(seq));
+            }
+            else if (peer.rotating) {
+                uint32_t id = rng();
+                memcpy(data, &id, sizeof(id));
+            }
+            reports.push_back(r);
+
+            r.time_ms = t + 1;
+            r.scan_response = true;
+            r.len = peer.scan_rsp_len;
+            memcpy(r.payload, peer.scan_rsp, peer.scan_rsp_len);
+            reports.push_back(r);
+        }
+    }
+    std::stable_sort(reports.begin(), reports.end(), [](const report_t &a, const report_t &b) {
+        return a.time_ms < b.time_ms;
+    });
+    return reports;
+}
+
+/* the per report parse from before PMScanFilter: strlen on the name, every long UUID compared in full */
+static bool baseline_match(mbed::Span<const uint8_t> payload, const char *name, const UUID &service)
+{
+    bool found = false;
+    const uint8_t *p = payload.data();
+    size_t remaining = payload.size();
+    while (remaining >= 2) {
+        uint8_t len = p[0];
+        if (len == 0 || len >= remaining) break;
+        const uint8_t *value = p + 2;
+        size_t value_len = len - 1;
+        if (p[1] == ble::adv_data_type_t::COMPLETE_LOCAL_NAME) {
+            if (value_len == strlen(name) && memcmp(value, name, value_len) == 0) found = true;
+        }
+        else if (p[1] == ble::adv_data_type_t::COMPLETE_LIST_128BIT_SERVICE_IDS ||
+                 p[1] == ble::adv_data_type_t::INCOMPLETE_LIST_128BIT_SERVICE_IDS) {
+            for (size_t i = 0; i + UUID::LENGTH_OF_LONG_UUID <= value_len; i += UUID::LENGTH_OF_LONG_UUID) {
+                if (memcmp(value + i, service.getBaseUUID(), UUID::LENGTH_OF_LONG_UUID) == 0) found = true;
+            }
+        }
+        p += len + 1;
+        remaining -= len + 1;
+    }
+    return found;
+}
+
+static double cpu_ns_per_report(clock_t start, size_t reports)
+{
+    return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / reports;
+}
+
+static bool run(size_t peer_count)
+{
+    UUID service(NODE_SERVICE);
+    std::vector<peer_t> peers(peer_count);
+    for (size_t p = 0; p < peer_count; p++) make_peer(peers[p], service);
+    std::vector<report_t> reports = make_reports(peers);
+    const ble::peer_address_type_t type(ble::peer_address_type_t::RANDOM);
+
+    /* baseline: every report parsed */
+    std::vector<bool> found_baseline(peer_count);
+    clock_t start = clock();
+    for (unsigned repeat = 0; repeat < SIM_REPEATS; repeat++) {
+        for (const report_t &r : reports) {
+            if (baseline_match(mbed::make_const_Span(r.payload, r.len), NODE_NAME, service)) {
+                found_baseline[r.peer] = true;
+            }
+        }
+    }
+    double baseline_ns = cpu_ns_per_report(start, reports.size() * SIM_REPEATS);
+
+    /* filtered: duplicates dropped first, then a single pass match */
+    std::vector<bool> found(peer_count);
+    PMScanFilter<> filter;
+    uint32_t passed = 0;
+    start = clock();
+    for (unsigned repeat = 0; repeat < SIM_REPEATS; repeat++) {
+        filter = PMScanFilter<>();
+        filter.set_name(NODE_NAME);
+        filter.add_service(service);
+        passed = 0;
+        for (const report_t &r : reports) {
+            mbed::Span<const uint8_t> payload = mbed::make_const_Span(r.payload, r.len);
+            if (filter.is_duplicate(type, peers[r.peer].address, r.scan_response, payload, r.time_ms)) continue;
+            passed++;
+            PMScanFilter<>::match_t match = filter.match(payload);
+            if (match.name || match.service) found[r.peer] = true;
+        }
+    }
+    double filtered_ns = cpu_ns_per_report(start, reports.size() * SIM_REPEATS);
+
+    size_t nodes = 0, missed = 0;
+    for (size_t p = 0; p < peer_count; p++) {
+        if (peers[p].node) nodes++;
+        if (found_baseline[p] && !found[p]) missed++;
+    }
+
+    printf("%4u peers (%2u nodes) %7u reports  passed %6u (%4.1f%%)  duplicates %6u  evictions %6u\r\n",
+           (unsigned)peer_count, (unsigned)nodes, (unsigned)reports.size(), passed,
+           100.0 * passed / reports.size(), filter.get_duplicates(), filter.get_evictions());
+    printf("     filtered %6.1f ns/report (%6.1f M reports/s)  baseline %6.1f ns/report  nodes missed %u\r\n",
+           filtered_ns, 1e3 / filtered_ns, baseline_ns, (unsigned)missed);
+    return missed == 0;
+}
+
+int main()
+{
+    printf("scan_bench: %u s of scanning per run, PMSCAN_PEER_SLOTS %u, PMSCAN_HOLD_MS %u\r\n",
+           SIM_SECONDS, PMSCAN_PEER_SLOTS, PMSCAN_HOLD_MS);
+    bool ok = true;
+    const size_t peer_counts[] = {10, 40, 100, 250};
+    for (size_t n : peer_counts) {
+        ok &= run(n);
+    }
+    printf("scan_bench: %s\r\n", ok ? "passed" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,293 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Eight simulated centrals on the session table, the shared batch ring and per-session history
+ * cursors. Each central has its own ATT MTU and takes a different number of notifications per
+ * connection event; one stalls long enough to overrun the ring, one reconnects and one stops
+ * its batches part way. Every central must get each sample once and in order, apart from gaps
+ * exactly as large as the losses reported for it. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "PMBatchRing.h"
+#include "PMHistory.h"
+#include "PMSessionTable.h"
+
+#define SESSIONS            (8u)
+#define SUBSCRIPTIONS       (6u)
+#define RING_SAMPLES        (32u)
+#define MAX_SAMPLE_SIZE     (16u)
+#define MAX_PAYLOAD         (244u)
+#define SAMPLE_SIZE         (4u)                // two big endian counts, as main.cpp batches
+#define MAX_SAMPLES         (5u)                // app.batch-max-samples
+#define AGE_SAMPLES         (10u)               // app.batch-max-age at one sample a second
+#define BATCH_HANDLE        (0x0030u)
+#define OTHER_HANDLE        (0x0020u)
+#define HISTORY_RECORDS     (16u)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/** The session fields BLEApp keeps that the table and ring use. */
+typedef struct {
+    bool used;
+    ble::connection_handle_t handle;
+    uint16_t att_mtu;
+    GattAttribute::Handle_t subscriptions[SUBSCRIPTIONS];
+    uint32_t batch_cursor;
+} session_t;
+
+typedef PMSessionTable<session_t, SESSIONS, SUBSCRIPTIONS> table_t;
+typedef PMBatchRing<RING_SAMPLES, MAX_SAMPLE_SIZE, MAX_PAYLOAD> ring_t;
+
+/** What a central receives, and how much its link takes. */
+typedef struct {
+    uint16_t mtu;
+    uint8_t buffers;                    // notifications the stack takes per connection event
+    uint8_t left;
+    bool have_last;
+    uint32_t last;                      // last timestamp received
+    uint32_t received;
+    uint32_t lost;                      // reported by catch_up
+    uint32_t gaps;                      // seen in the stream
+    uint32_t batches;
+} central_t;
+
+static table_t table;
+static ring_t ring;
+static central_t centrals[SESSIONS];
+
+static uint16_t capacity(const session_t &s)
+{
+    return s.att_mtu - 3;
+}
+
+/** BLEApp::flush_batch for one session, with the central's link in place of the stack. */
+static bool flush(session_t &s)
+{
+    central_t &c = centrals[table.index_of(s.handle)];
+    c.lost += ring.catch_up(s.batch_cursor);
+    uint8_t limit = ring.limit(capacity(s), MAX_SAMPLES);
+    return ring.flush(s.batch_cursor, limit, [&c, &s, limit](const uint8_t *buf, uint16_t len) {
+        if (!c.left) return false;
+        c.left--;
+        c.batches++;
+        CHECK(len <= capacity(s));
+        CHECK(buf[0] >= 1 && buf[0] <= limit && len == 1 + buf[0] * (4 + SAMPLE_SIZE));
+        for (uint8_t i = 0; i < buf[0]; i++) {
+            const uint8_t *p = buf + 1 + i * (4 + SAMPLE_SIZE);
+            uint32_t ts = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+            CHECK(p[4] == (uint8_t)(ts >> 8) && p[5] == (uint8_t)ts && p[6] == 0x5A && p[7] == (uint8_t)~ts);
+            if (c.have_last) {
+                CHECK(ts > c.last);
+                c.gaps += ts - c.last - 1;
+            }
+            c.have_last = true;
+            c.last = ts;
+            c.received++;
+        }
+        return true;
+    });
+}
+
+/** BLEApp::add_batched_sample: push, then send any session with a full batch. */
+static void add_sample(uint32_t ts)
+{
+    uint8_t value[SAMPLE_SIZE] = {(uint8_t)(ts >> 8), (uint8_t)ts, 0x5A, (uint8_t)~ts};
+    if (!table.subscriber_count(BATCH_HANDLE)) return;
+    ring.push(ts, value);
+    for (uint8_t i = 0; i < SESSIONS; i++) {
+        session_t &s = table[i];
+        if (s.used && table_t::is_subscribed(s, BATCH_HANDLE) &&
+            ring.pending(s.batch_cursor) >= ring.limit(capacity(s), MAX_SAMPLES)) {
+            flush(s);
+        }
+    }
+}
+
+static void flush_all()
+{
+    for (uint8_t i = 0; i < SESSIONS; i++) {
+        session_t &s = table[i];
+        if (s.used && table_t::is_subscribed(s, BATCH_HANDLE)) flush(s);
+    }
+}
+
+/** BLEApp::onUpdatesEnabled for the batch characteristic. */
+static void subscribe(session_t &s)
+{
+    CHECK(table_t::add_subscription(s, BATCH_HANDLE));
+    s.batch_cursor = ring.next();
+}
+
+static void test_table()
+{
+    table_t t;
+    for (uint8_t i = 0; i < SESSIONS; i++) {
+        session_t *s = t.open(0x40 + i);
+        CHECK(s && t.index_of(0x40 + i) == i && t.get(0x40 + i) == s && t.at(i) == s);
+    }
+    CHECK(t.count() == SESSIONS);
+    CHECK(t.open(0x50) == nullptr);
+
+    // a slot freed by a disconnection is reused, and the others keep theirs
+    t[3].used = false;
+    CHECK(t.get(0x43) == nullptr && t.index_of(0x43) == -1 && t.at(3) == nullptr);
+    session_t *s = t.open(0x50);
+    CHECK(s == &t[3] && t.index_of(0x50) == 3 && t.index_of(0x47) == 7);
+    CHECK(s->batch_cursor == 0 && s->subscriptions[0] == 0);
+
+    // subscriptions are kept per session, without duplicates, up to the table size
+    for (uint8_t i = 0; i < SESSIONS; i++) {
+        if (i % 2) CHECK(table_t::add_subscription(t[i], OTHER_HANDLE));
+    }
+    CHECK(table_t::add_subscription(t[1], OTHER_HANDLE));
+    CHECK(t.subscriber_count(OTHER_HANDLE) == SESSIONS / 2);
+    for (uint8_t h = 1; h < SUBSCRIPTIONS; h++) CHECK(table_t::add_subscription(t[0], h));
+    CHECK(table_t::add_subscription(t[0], OTHER_HANDLE));
+    CHECK(!table_t::add_subscription(t[0], 0x99));
+    table_t::remove_subscription(t[1], OTHER_HANDLE);
+    CHECK(!table_t::is_subscribed(t[1], OTHER_HANDLE) && t.subscriber_count(OTHER_HANDLE) == SESSIONS / 2);
+
+    // single connection mode
+    t.clear();
+    CHECK(t.count() == 0);
+    CHECK(t.open(0x60, 1) && !t.open(0x61, 1));
+}
+
+static void test_batches()
+{
+    static const uint16_t mtus[SESSIONS] = {23, 27, 48, 64, 100, 185, 247, 23};
+    static const uint8_t buffers[SESSIONS] = {1, 1, 2, 3, 4, 4, 4, 2};
+    ring.set_sample_size(SAMPLE_SIZE);
+
+    for (uint8_t i = 0; i < SESSIONS; i++) {
+        session_t *s = table.open(0x40 + i);
+        s->att_mtu = mtus[i];
+        centrals[i] = central_t();
+        centrals[i].mtu = mtus[i];
+        centrals[i].buffers = buffers[i];
+        // half subscribe straight away, the rest over the first few seconds
+        if (i % 2 == 0) subscribe(*s);
+    }
+
+    const uint32_t samples = 20000;
+    uint32_t reconnected_from = 0, unsubscribed_at = 0;
+    for (uint32_t ts = 1; ts <= samples; ts++) {
+        // a connection event on every link
+        for (uint8_t i = 0; i < SESSIONS; i++) centrals[i].left = centrals[i].buffers;
+        // central 7 stalls for a minute, longer than the ring lasts
+        if (ts >= 5000 && ts < 5060) centrals[7].left = 0;
+
+        if (ts < 2 * SESSIONS && ts % 2 && table.at(ts / 2) && !table_t::is_subscribed(table[ts / 2], BATCH_HANDLE)) {
+            subscribe(table[ts / 2]);
+        }
+        // central 3 disconnects; a new central takes its slot and subscribes
+        if (ts == 8000) {
+            table[3].used = false;
+            session_t *s = table.open(0x70);
+            CHECK(s == &table[3]);
+            s->att_mtu = 64;
+            centrals[3] = central_t();
+            centrals[3].buffers = 3;
+            centrals[3].left = 3;
+            subscribe(*s);
+            reconnected_from = ts;
+        }
+        // central 5 turns its batches off
+        if (ts == 12000) {
+            table_t::remove_subscription(table[5], BATCH_HANDLE);
+            unsubscribed_at = centrals[5].received;
+        }
+
+        add_sample(ts);
+        if (ts % AGE_SAMPLES == 0) flush_all();
+    }
+    for (uint8_t i = 0; i < SESSIONS; i++) centrals[i].left = 255;
+    flush_all();
+
+    for (uint8_t i = 0; i < SESSIONS; i++) {
+        const central_t &c = centrals[i];
+        printf("central %u: MTU %3u, %u per event, %5lu samples in %5lu batches, %3lu lost\r\n", i,
+               table[i].att_mtu, c.buffers, (unsigned long)c.received, (unsigned long)c.batches, (unsigned long)c.lost);
+        CHECK(c.gaps == c.lost);
+        if (i != 5) CHECK(c.last == samples);
+        if (i != 7) CHECK(c.lost == 0);
+    }
+    CHECK(centrals[7].lost > 0);
+    CHECK(centrals[3].received == samples - reconnected_from + 1);
+    CHECK(centrals[5].received == unsubscribed_at && centrals[5].last < 12000);
+    CHECK(centrals[0].received == samples);
+}
+
+/** Per-session history cursors as main.cpp keeps them, over one shared HistoryBuffer. */
+static void test_history_cursors()
+{
+    HistoryBuffer<uint32_t, HISTORY_RECORDS> history;
+    uint32_t cursor[SESSIONS] = {0};
+    uint32_t next_value[SESSIONS] = {0};
+    uint32_t lost[SESSIONS] = {0};
+    uint32_t got[SESSIONS] = {0};
+    static const uint8_t every[SESSIONS] = {1, 1, 2, 3, 5, 8, 13, 21};     // records between visits
+
+    const uint32_t records = 5000;
+    for (uint32_t r = 0; r < records; r++) {
+        history.push(r);
+        for (uint8_t i = 0; i < SESSIONS; i++) {
+            if (r % every[i]) continue;
+            if (cursor[i] < history.first_seq()) {
+                lost[i] += history.first_seq() - cursor[i];
+                next_value[i] = history.first_seq();
+                cursor[i] = history.first_seq();
+            }
+            uint32_t value;
+            while (history.get(cursor[i], value)) {
+                CHECK(value == next_value[i]);
+                next_value[i]++;
+                cursor[i]++;
+                got[i]++;
+            }
+        }
+    }
+    for (uint8_t i = 0; i < SESSIONS; i++) {
+        uint32_t value;
+        while (history.get(cursor[i], value)) {
+            cursor[i]++;
+            got[i]++;
+        }
+        CHECK(got[i] + lost[i] == records);
+        CHECK((every[i] > HISTORY_RECORDS) == (lost[i] > 0));
+    }
+    printf("history: %lu records, cursors visiting every 1 to 21 lost %lu, %lu, %lu, %lu, %lu, %lu, %lu, %lu\r\n",
+           (unsigned long)records, (unsigned long)lost[0], (unsigned long)lost[1], (unsigned long)lost[2],
+           (unsigned long)lost[3], (unsigned long)lost[4], (unsigned long)lost[5], (unsigned long)lost[6],
+           (unsigned long)lost[7]);
+}
+
+int main()
+{
+    test_table();
+    test_batches();
+    test_history_cursors();
+    printf("session_test: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,225 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A simulated SN-GCJA5 on a 100 kHz I2C bus, on the stub clock (host_sim_time_us()).
+ *
+ * The sensor refreshes its registers every period_us of its own clock, starting at phase_us,
+ * each update up to jitter_us early or late.
+ * Frame k holds k + 1 in the PM1.0 register, so a harness can tell which frame a read returned,
+ * or the same value for hold frames in a row if hold > 1 (steady air).
+ *
+ * Blocking reads take the bus time out of the simulated clock, as they would out of the thread.
+ * Asynchronous transfers complete from "interrupt context" when the harness calls fire_due().
+ * A transfer can be made to stall; it then only ends when aborted, and if isr_after_abort_us is
+ * not negative its completion still fires that long after the abort, as when the interrupt was
+ * already pending. Aborted transfers write nothing into the receive buffer. */
+
+#ifndef PMSENSE_HOST_SIM_SENSOR_H
+#define PMSENSE_HOST_SIM_SENSOR_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "mbed.h"
+#include "Panasonic_SNGCJA5.h"
+
+#define SIM_BYTE_US             (90)                 ///< 9 clocks per byte at 100 kHz
+#define SIM_NEVER               (INT64_MAX)
+
+class SimSensorBus : public mbed::I2C {
+public:
+    int64_t period_us = 1000000;    ///< sensor update period, on the sensor's clock
+    int64_t phase_us = 0;           ///< time of the first update
+    int64_t jitter_us = 0;          ///< spread of each update around its nominal time
+    uint32_t hold = 1;              ///< frames in a row with the same data
+    uint8_t status = 0;             ///< status register
+    uint32_t stall_every = 0;       ///< stall every nth asynchronous transfer, 0 for never
+    int64_t isr_after_abort_us = -1;
+
+    /** Time of the update to frame k. */
+    int64_t update_of(int64_t k) const
+    {
+        int64_t t = phase_us + k * period_us;
+        if (jitter_us && k > 0) {
+            uint32_t h = (uint32_t)k * 2654435761u;   // same spread for the same frame every time
+            t += (int64_t)(h % (uint32_t)(2 * jitter_us + 1)) - jitter_us;
+        }
+        return t;
+    }
+
+    /** Index of the sensor frame in the registers at time t. */
+    int64_t frame_at(int64_t t) const
+    {
+        if (t < phase_us) return -1;
+        int64_t k = (t - phase_us) / period_us;
+        if (t < update_of(k)) k--;
+        else if (t >= update_of(k + 1)) k++;
+        return k;
+    }
+
+    /** PM1.0 value the sensor reports for frame k. */
+    uint32_t value_of(int64_t k) const
+    {
+        return (uint32_t)(k / hold) + 1;
+    }
+
+    int write(int address, const char *data, int length, bool repeated = false) override
+    {
+        _reg = (uint8_t)data[0];
+        host_sim_time_us() += (1 + length) * SIM_BYTE_US;
+        _blocking++;
+        return 0;
+    }
+
+    int read(int address, char *data, int length, bool repeated = false) override
+    {
+        host_sim_time_us() += (1 + length) * SIM_BYTE_US;
+        fill(host_sim_time_us(), _reg, (uint8_t *)data, length);
+        _blocking++;
+        return 0;
+    }
+
+    int transfer(int address, const char *tx, int tx_length, char *rx, int rx_length,
+                 const event_callback_t &callback) override
+    {
+        if (_busy) return -1;
+        _busy = true;
+        _started++;
+        pending_t p;
+        p.reg = (uint8_t)tx[0];
+        p.rx = (uint8_t *)rx;
+        p.length = rx_length;
+        p.cb = callback;
+        p.aborted = false;
+        p.due_us = host_sim_time_us() + (2 + tx_length + rx_length) * SIM_BYTE_US;
+        if (stall_every && (_started % stall_every) == 0) {
+            p.due_us = SIM_NEVER;
+            _stalls++;
+        }
+        _pending.push_back(p);
+        return 0;
+    }
+
+    void abort_transfer() override
+    {
+        for (size_t i = 0; i < _pending.size(); i++) {
+            if (_pending[i].aborted) continue;
+            _pending[i].aborted = true;
+            if (isr_after_abort_us >= 0) {
+                _pending[i].due_us = host_sim_time_us() + isr_after_abort_us;
+            }
+            else {
+                _pending.erase(_pending.begin() + i);
+            }
+            break;
+        }
+        _busy = false;
+    }
+
+    /** When the next completion interrupt is due, or -1 if none is. */
+    int64_t next_due_us() const
+    {
+        int64_t next = -1;
+        for (size_t i = 0; i < _pending.size(); i++) {
+            if (_pending[i].due_us == SIM_NEVER) continue;
+            if (next < 0 || _pending[i].due_us < next) next = _pending[i].due_us;
+        }
+        return next;
+    }
+
+    /** Run the completion interrupts that are due. */
+    void fire_due()
+    {
+        for (size_t i = 0; i < _pending.size();) {
+            if (_pending[i].due_us > host_sim_time_us()) {
+                i++;
+                continue;
+            }
+            pending_t p = _pending[i];
+            _pending.erase(_pending.begin() + i);
+            if (p.aborted) {
+                _late++;
+            }
+            else {
+                fill(p.due_us, p.reg, p.rx, p.length);
+                _busy = false;
+            }
+            // an already pending interrupt reports success, the worst case for the driver
+            p.cb(I2C_EVENT_TRANSFER_COMPLETE);
+        }
+    }
+
+    /** When the last read, blocking or not, latched the registers. */
+    int64_t get_last_read_us() const
+    {
+        return _last_read_us;
+    }
+
+    /** Blocking reads and writes issued. */
+    uint32_t get_blocking() const
+    {
+        return _blocking;
+    }
+
+    uint32_t get_stalls() const
+    {
+        return _stalls;
+    }
+
+    /** Completions that fired after their transfer was aborted. */
+    uint32_t get_late() const
+    {
+        return _late;
+    }
+
+private:
+    typedef struct {
+        uint8_t reg;
+        uint8_t *rx;
+        int length;
+        event_callback_t cb;
+        bool aborted;
+        int64_t due_us;
+    } pending_t;
+
+    /** The register block as it reads at time t. */
+    void fill(int64_t t, uint8_t reg, uint8_t *rx, int length)
+    {
+        uint8_t block[SNGCJA5_BLOCKSIZE] = {0};
+        _last_read_us = t;
+        uint32_t pm10 = value_of(frame_at(t));
+        memcpy(block, &pm10, sizeof(pm10));             // little endian like the sensor
+        block[SNGCJA5_STATUS] = status;
+        for (int i = 0; i < length; i++) {
+            rx[i] = (reg + i < (int)SNGCJA5_BLOCKSIZE) ? block[reg + i] : 0;
+        }
+    }
+
+    std::vector<pending_t> _pending;
+    bool _busy = false;
+    uint8_t _reg = 0;
+    int64_t _last_read_us = -1;
+    uint32_t _started = 0;
+    uint32_t _blocking = 0;
+    uint32_t _stalls = 0;
+    uint32_t _late = 0;
+};
+
+#endif // PMSENSE_HOST_SIM_SENSOR_H
@@ -0,0 +1,216 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* StreamingStats against a long double reference, and the cost per update of StreamingStats and
+ * TimeHistogram.
+ *
+ * Particle counts (uint16_t) and mass densities (uint32_t) are drawn around a drifting level,
+ * as on a 1 s interval, and at the extremes of their types: full range, a tiny spread on a
+ * large offset, and constant runs of 0, 1 and the type maximum. The rounded mean must match
+ * the reference to within 1, and the variance to within 0.5% plus 1; a constant run must have a
+ * variance of exactly 0, and a variance beyond 32 bits must saturate. TimeHistogram percentiles
+ * must bound the exact ones from above, within a factor of 2.
+ *
+ * Cost is reported in TSC cycles (x86) and ns per update, for one channel and for the
+ * PMIntervalAggregator update main.cpp makes per sensor frame. */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC                (1)
+#else
+#define HAVE_TSC                (0)
+#endif
+
+#include "PMStats.h"
+
+#define RUN_SAMPLES             (1000000u)
+#define TIMING_UPDATES          (10000000u)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/** Feed samples to StreamingStats and compare with a two pass long double reference. */
+template <typename T>
+static void check(const char *name, const std::vector<T> &samples)
+{
+    StreamingStats<T> stats;
+    long double sum = 0;
+    T lo = samples[0], hi = samples[0];
+    for (size_t i = 0; i < samples.size(); i++) {
+        stats.update(samples[i]);
+        sum += samples[i];
+        lo = std::min(lo, samples[i]);
+        hi = std::max(hi, samples[i]);
+    }
+    long double mean = sum / samples.size();
+    long double m2 = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        m2 += (samples[i] - mean) * (samples[i] - mean);
+    }
+    long double var = m2 / samples.size();
+
+    double mean_err = fabs((double)stats.mean() - (double)mean);
+    double var_err = fabs((double)stats.variance() - (double)std::min(var, (long double)UINT32_MAX));
+    printf("%-26s n %7zu  mean %12.1f err %5.2f  variance %14.1f err %9.1f (%.4f%%)\r\n", name, samples.size(),
+           (double)mean, mean_err, (double)var, var_err, var > 0 ? 100.0 * var_err / (double)var : 0.0);
+
+    CHECK(stats.count() == samples.size());
+    CHECK(stats.min() == lo && stats.max() == hi);
+    CHECK(stats.sum() == (uint32_t)std::min(sum, (long double)UINT32_MAX));
+    CHECK(mean_err <= 1.0);
+    if (var > UINT32_MAX) CHECK(stats.variance() == UINT32_MAX);
+    else if (lo == hi) CHECK(stats.variance() == 0);
+    else CHECK(var_err <= 0.005 * (double)var + 1.0);
+}
+
+/** Counts around a level that drifts over the run, like a day of 1 s frames. */
+template <typename T>
+static std::vector<T> drifting(std::mt19937 &rng, double level, double spread)
+{
+    std::vector<T> samples(RUN_SAMPLES);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    for (size_t i = 0; i < samples.size(); i++) {
+        double centre = level * (1.0 + 0.5 * sin(i * 2.0 * M_PI / 86400.0));
+        double x = centre + spread * centre * noise(rng);
+        x = std::max(0.0, std::min(x, (double)std::numeric_limits<T>::max()));
+        samples[i] = (T)x;
+    }
+    return samples;
+}
+
+template <typename T>
+static std::vector<T> uniform(std::mt19937 &rng, T lo, T hi)
+{
+    std::vector<T> samples(RUN_SAMPLES);
+    std::uniform_int_distribution<uint32_t> dist(lo, hi);
+    for (size_t i = 0; i < samples.size(); i++) samples[i] = (T)dist(rng);
+    return samples;
+}
+
+static void check_histogram(std::mt19937 &rng)
+{
+    std::vector<uint32_t> samples(RUN_SAMPLES);
+    std::lognormal_distribution<double> dist(6.0, 1.5);
+    TimeHistogram hist;
+    hist.reset();
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples[i] = (uint32_t)std::min(dist(rng), 4.0e9);
+        hist.add(samples[i]);
+    }
+    std::sort(samples.begin(), samples.end());
+    static const uint8_t percents[] = {50, 90, 99, 100};
+    for (unsigned i = 0; i < sizeof(percents); i++) {
+        uint32_t exact = samples[((uint64_t)samples.size() * percents[i] + 99) / 100 - 1];
+        uint32_t bound = hist.percentile(percents[i]);
+        printf("TimeHistogram p%-3u exact %8lu us  reported <= %8lu us\r\n", percents[i], exact, bound);
+        CHECK(bound >= exact);
+        CHECK(bound <= 2 * exact + 1 || percents[i] == 100);
+    }
+    CHECK(hist.max() == samples.back());
+}
+
+static uint64_t ticks()
+{
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/** Print the cost per update of f() over TIMING_UPDATES calls. */
+template <typename F>
+static void time_updates(const char *name, F f)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t t0 = ticks();
+    for (uint32_t i = 0; i < TIMING_UPDATES; i++) f(i);
+    uint64_t cycles = ticks() - t0;
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-34s %6.1f cycles  %6.2f ns per update\r\n", name, (double)cycles / TIMING_UPDATES, ns / TIMING_UPDATES);
+}
+
+static void bench(std::mt19937 &rng)
+{
+    // precomputed so the timing is of the update alone
+    std::vector<uint16_t> counts = drifting<uint16_t>(rng, 2000.0, 0.2);
+    std::vector<uint32_t> densities = drifting<uint32_t>(rng, 12000.0, 0.2);
+    std::vector<uint32_t> times = uniform<uint32_t>(rng, 0, 600000);
+
+    StreamingStats<uint16_t> count_stats;
+    time_updates("StreamingStats<uint16_t>::update", [&](uint32_t i) {
+        count_stats.update(counts[i % RUN_SAMPLES]);
+    });
+    StreamingStats<uint32_t> density_stats;
+    time_updates("StreamingStats<uint32_t>::update", [&](uint32_t i) {
+        density_stats.update(densities[i % RUN_SAMPLES]);
+    });
+    PMIntervalAggregator aggregator;
+    aggregator.reset();
+    PM_MDVPC_Data pmdata = {};
+    time_updates("PMIntervalAggregator::update (9)", [&](uint32_t i) {
+        uint32_t j = i % RUN_SAMPLES;
+        pmdata.pm10_mdv = densities[j];
+        pmdata.pm25_mdv = densities[j] + 7;
+        pmdata.pm100_mdv = densities[j] + 11;
+        pmdata.reg1_pc = pmdata.reg2_pc = pmdata.reg3_pc = counts[j];
+        pmdata.reg4_pc = pmdata.reg5_pc = pmdata.reg6_pc = counts[j] >> 4;
+        aggregator.update(pmdata);
+    });
+    TimeHistogram hist;
+    hist.reset();
+    time_updates("TimeHistogram::add", [&](uint32_t i) {
+        hist.add(times[i % RUN_SAMPLES]);
+    });
+    // keep the results live
+    printf("(means %u %lu %lu, p50 %lu)\r\n", count_stats.mean(), density_stats.mean(),
+           aggregator.mean().pm10_mdv, hist.percentile(50));
+}
+
+int main()
+{
+    std::mt19937 rng(20220614);
+
+    check("count, drifting", drifting<uint16_t>(rng, 2000.0, 0.2));
+    check("count, clean air", drifting<uint16_t>(rng, 3.0, 1.0));
+    check("count, full range", uniform<uint16_t>(rng, 0, UINT16_MAX));
+    check("count, constant 0", std::vector<uint16_t>(RUN_SAMPLES, 0));
+    check("count, constant 1", std::vector<uint16_t>(RUN_SAMPLES, 1));
+    check("count, constant max", std::vector<uint16_t>(RUN_SAMPLES, UINT16_MAX));
+    check("density, drifting", drifting<uint32_t>(rng, 12000.0, 0.2));
+    check("density, large offset", uniform<uint32_t>(rng, UINT32_MAX - 10, UINT32_MAX));
+    check("density, 2^31 offset", uniform<uint32_t>(rng, 1u << 31, (1u << 31) + 60000));
+    check("density, full range", uniform<uint32_t>(rng, 0, UINT32_MAX));
+    check("density, constant max", std::vector<uint32_t>(RUN_SAMPLES, UINT32_MAX));
+    check("density, two samples", std::vector<uint32_t>{0, UINT32_MAX});
+    check_histogram(rng);
+
+    bench(rng);
+
+    printf("stats_bench: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for mbed's ChainableGattServerEventHandler. Like the real one it calls every
+ * handler in the order added, and adds a handler again however often it is already there. */
+
+#ifndef PMSENSE_HOST_CHAINABLE_GATT_SERVER_EVENT_HANDLER_H
+#define PMSENSE_HOST_CHAINABLE_GATT_SERVER_EVENT_HANDLER_H
+
+#include <vector>
+
+#include "ble/BLE.h"
+
+class ChainableGattServerEventHandler : public ble::GattServer::EventHandler {
+public:
+    bool addEventHandler(ble::GattServer::EventHandler *handler)
+    {
+        _handlers.push_back(handler);
+        return true;
+    }
+
+    void onDataSent(const GattDataSentCallbackParams &params) override
+    {
+        for (ble::GattServer::EventHandler *h : _handlers) h->onDataSent(params);
+    }
+
+    void onUpdatesEnabled(const GattUpdatesEnabledCallbackParams &params) override
+    {
+        for (ble::GattServer::EventHandler *h : _handlers) h->onUpdatesEnabled(params);
+    }
+
+    void onUpdatesDisabled(const GattUpdatesDisabledCallbackParams &params) override
+    {
+        for (ble::GattServer::EventHandler *h : _handlers) h->onUpdatesDisabled(params);
+    }
+
+    void onAttMtuChange(ble::connection_handle_t connectionHandle, uint16_t attMtuSize) override
+    {
+        for (ble::GattServer::EventHandler *h : _handlers) h->onAttMtuChange(connectionHandle, attMtuSize);
+    }
+
+private:
+    std::vector<ble::GattServer::EventHandler *> _handlers;
+};
+
+#endif // PMSENSE_HOST_CHAINABLE_GATT_SERVER_EVENT_HANDLER_H
@@ -0,0 +1,381 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for the BLE API types the PMsense helpers use, for tools/host only */
+
+#ifndef PMSENSE_HOST_BLE_H
+#define PMSENSE_HOST_BLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "platform/Span.h"
+
+enum ble_error_t {
+    BLE_ERROR_NONE = 0,
+    BLE_ERROR_BUFFER_OVERFLOW,
+    BLE_ERROR_NOT_IMPLEMENTED,
+    BLE_ERROR_PARAM_OUT_OF_RANGE,
+    BLE_ERROR_INVALID_PARAM,
+    BLE_STACK_BUSY,
+    BLE_ERROR_INVALID_STATE,
+    BLE_ERROR_NO_MEM,
+    BLE_ERROR_OPERATION_NOT_PERMITTED,
+    BLE_ERROR_INITIALIZATION_INCOMPLETE,
+    BLE_ERROR_ALREADY_INITIALIZED,
+    BLE_ERROR_UNSPECIFIED,
+    BLE_ERROR_INTERNAL_STACK_FAILURE,
+    BLE_ERROR_NOT_FOUND
+};
+
+namespace ble {
+
+typedef uintptr_t connection_handle_t;
+typedef uint16_t attribute_handle_t;
+
+struct own_address_type_t {
+    enum type {
+        PUBLIC = 0,
+        RANDOM
+    };
+
+    own_address_type_t(type value = PUBLIC) : _value(value)
+    {
+    }
+
+private:
+    type _value;
+};
+
+struct phy_t {
+    enum type {
+        NONE = 0,
+        LE_1M = 1,
+        LE_2M = 2,
+        LE_CODED = 3
+    };
+
+    phy_t(type value = NONE) : _value(value)
+    {
+    }
+
+    type value() const
+    {
+        return _value;
+    }
+
+private:
+    type _value;
+};
+
+struct peer_address_type_t {
+    enum type {
+        PUBLIC = 0,
+        RANDOM,
+        PUBLIC_IDENTITY,
+        RANDOM_STATIC_IDENTITY,
+        ANONYMOUS = 0xFF
+    };
+
+    peer_address_type_t(type value = PUBLIC) : _value(value)
+    {
+    }
+
+    type value() const
+    {
+        return _value;
+    }
+
+private:
+    type _value;
+};
+
+class address_t {
+public:
+    address_t()
+    {
+        memset(_bytes, 0, sizeof(_bytes));
+    }
+
+    address_t(const uint8_t *bytes)
+    {
+        memcpy(_bytes, bytes, sizeof(_bytes));
+    }
+
+    const uint8_t *data() const
+    {
+        return _bytes;
+    }
+
+    uint8_t *data()
+    {
+        return _bytes;
+    }
+
+    static size_t size()
+    {
+        return 6;
+    }
+
+    uint8_t &operator[](size_t index)
+    {
+        return _bytes[index];
+    }
+
+    uint8_t operator[](size_t index) const
+    {
+        return _bytes[index];
+    }
+
+private:
+    uint8_t _bytes[6];
+};
+
+struct adv_data_type_t {
+    enum type {
+        INCOMPLETE_LIST_16BIT_SERVICE_IDS = 0x02,
+        COMPLETE_LIST_16BIT_SERVICE_IDS = 0x03,
+        INCOMPLETE_LIST_128BIT_SERVICE_IDS = 0x06,
+        COMPLETE_LIST_128BIT_SERVICE_IDS = 0x07,
+        SHORTENED_LOCAL_NAME = 0x08,
+        COMPLETE_LOCAL_NAME = 0x09,
+        MANUFACTURER_SPECIFIC_DATA = 0xFF
+    };
+};
+
+}
+
+/* UUID bytes are held little endian, as on the air; the string form is big endian */
+class UUID {
+public:
+    typedef uint16_t ShortUUIDBytes_t;
+    static const unsigned LENGTH_OF_LONG_UUID = 16;
+
+    UUID() : _len(0)
+    {
+        memset(_base, 0, sizeof(_base));
+    }
+
+    UUID(ShortUUIDBytes_t uuid) : _len(sizeof(ShortUUIDBytes_t))
+    {
+        memset(_base, 0, sizeof(_base));
+        _base[0] = uuid;
+        _base[1] = uuid >> 8;
+    }
+
+    UUID(const char *str) : _len(LENGTH_OF_LONG_UUID)
+    {
+        memset(_base, 0, sizeof(_base));
+        size_t n = 0;
+        for (; *str && n < 2 * LENGTH_OF_LONG_UUID; str++) {
+            int nibble = hex(*str);
+            if (nibble < 0) continue;
+            uint8_t &byte = _base[LENGTH_OF_LONG_UUID - 1 - n / 2];
+            byte = (n & 1) ? (byte | nibble) : (nibble << 4);
+            n++;
+        }
+    }
+
+    const uint8_t *getBaseUUID() const
+    {
+        return _base;
+    }
+
+    uint8_t getLen() const
+    {
+        return _len;
+    }
+
+    bool operator==(const UUID &other) const
+    {
+        return _len == other._len && memcmp(_base, other._base, _len) == 0;
+    }
+
+private:
+    static int hex(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    uint8_t _base[LENGTH_OF_LONG_UUID];
+    uint8_t _len;
+};
+
+class GattAttribute {
+public:
+    typedef ble::attribute_handle_t Handle_t;
+};
+
+/** A characteristic; value handles are handed out in order of construction */
+class GattCharacteristic {
+public:
+    enum Properties_t {
+        BLE_GATT_CHAR_PROPERTIES_READ = 0x02,
+        BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE = 0x04,
+        BLE_GATT_CHAR_PROPERTIES_WRITE = 0x08,
+        BLE_GATT_CHAR_PROPERTIES_NOTIFY = 0x10
+    };
+
+    GattCharacteristic(const UUID &uuid, uint8_t *value, uint16_t len, uint16_t maxLen, uint8_t props) :
+        _uuid(uuid), _handle(next_handle())
+    {
+    }
+
+    GattAttribute::Handle_t getValueHandle() const
+    {
+        return _handle;
+    }
+
+private:
+    static GattAttribute::Handle_t next_handle()
+    {
+        static GattAttribute::Handle_t last = 0x0010;
+        last += 2;
+        return last;
+    }
+
+    UUID _uuid;
+    GattAttribute::Handle_t _handle;
+};
+
+struct GattWriteCallbackParams {
+    ble::connection_handle_t connHandle;
+    GattAttribute::Handle_t handle;
+    uint16_t offset;
+    uint16_t len;
+    const uint8_t *data;
+};
+
+struct GattDataSentCallbackParams {
+    ble::connection_handle_t connHandle;
+    GattAttribute::Handle_t attHandle;
+};
+
+struct GattUpdateCallbackParams {
+    ble::connection_handle_t connHandle;
+    GattAttribute::Handle_t attHandle;
+    GattAttribute::Handle_t charHandle;
+};
+
+typedef GattUpdateCallbackParams GattUpdatesEnabledCallbackParams;
+typedef GattUpdateCallbackParams GattUpdatesDisabledCallbackParams;
+
+namespace ble {
+
+/** The GattServer events the PMsense code handles */
+class GattServer {
+public:
+    class EventHandler {
+    public:
+        virtual void onDataSent(const GattDataSentCallbackParams &params)
+        {
+        }
+
+        virtual void onUpdatesEnabled(const GattUpdatesEnabledCallbackParams &params)
+        {
+        }
+
+        virtual void onUpdatesDisabled(const GattUpdatesDisabledCallbackParams &params)
+        {
+        }
+
+        virtual void onAttMtuChange(connection_handle_t connectionHandle, uint16_t attMtuSize)
+        {
+        }
+
+    protected:
+        ~EventHandler() = default;
+    };
+
+    void setEventHandler(EventHandler *handler)
+    {
+        _handler = handler;
+    }
+
+    EventHandler &getEventHandler()
+    {
+        return *_handler;
+    }
+
+    /** Notify a value; nothing is connected, a harness overrides it */
+    virtual ble_error_t write(connection_handle_t connectionHandle, GattAttribute::Handle_t attributeHandle,
+                              const uint8_t *value, uint16_t size, bool localOnly = false)
+    {
+        return BLE_ERROR_INVALID_STATE;
+    }
+
+    virtual ble_error_t areUpdatesEnabled(connection_handle_t connectionHandle,
+                                          const GattCharacteristic &characteristic, bool *enabled)
+    {
+        *enabled = false;
+        return BLE_ERROR_NONE;
+    }
+
+    virtual ~GattServer()
+    {
+    }
+
+private:
+    EventHandler *_handler = nullptr;
+};
+
+class Gap {
+public:
+    ble_error_t getAddress(own_address_type_t &typeP, address_t &address)
+    {
+        return BLE_ERROR_NONE;
+    }
+};
+
+}
+
+/** The BLE instance; gattServer() is whichever stand-in the harness sets */
+class BLE {
+public:
+    static BLE &Instance()
+    {
+        static BLE ble;
+        return ble;
+    }
+
+    ble::GattServer &gattServer()
+    {
+        return *_server;
+    }
+
+    ble::Gap &gap()
+    {
+        return _gap;
+    }
+
+    void set_gatt_server(ble::GattServer *server)
+    {
+        _server = server ? server : &_default;
+    }
+
+private:
+    ble::GattServer _default;
+    ble::GattServer *_server = &_default;
+    ble::Gap _gap;
+};
+
+#endif // PMSENSE_HOST_BLE_H
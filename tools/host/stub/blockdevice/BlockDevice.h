@@ -0,0 +1,53 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for mbed::BlockDevice */
+
+#ifndef PMSENSE_HOST_BLOCKDEVICE_H
+#define PMSENSE_HOST_BLOCKDEVICE_H
+
+#include <stdint.h>
+
+typedef uint64_t bd_addr_t;
+typedef uint64_t bd_size_t;
+
+#define BD_ERROR_OK                     (0)
+#define BD_ERROR_DEVICE_ERROR           (-4001)
+
+namespace mbed {
+
+class BlockDevice {
+public:
+    virtual ~BlockDevice()
+    {
+    }
+
+    virtual int init() = 0;
+    virtual int deinit() = 0;
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int erase(bd_addr_t addr, bd_size_t size) = 0;
+    virtual bd_size_t get_read_size() const = 0;
+    virtual bd_size_t get_program_size() const = 0;
+    virtual bd_size_t get_erase_size() const = 0;
+    virtual bd_size_t size() const = 0;
+};
+
+}
+
+#endif // PMSENSE_HOST_BLOCKDEVICE_H
@@ -0,0 +1,100 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for mbed::HeapBlockDevice. Erasing fills with 0xFF and programming can only
+ * clear bits, like the internal flash it stands in for, so a write to unerased space shows up. */
+
+#ifndef PMSENSE_HOST_HEAPBLOCKDEVICE_H
+#define PMSENSE_HOST_HEAPBLOCKDEVICE_H
+
+#include <string.h>
+#include <vector>
+
+#include "blockdevice/BlockDevice.h"
+
+namespace mbed {
+
+class HeapBlockDevice : public BlockDevice {
+public:
+    HeapBlockDevice(bd_size_t size, bd_size_t read, bd_size_t program, bd_size_t erase) :
+        _data(size, 0xFF), _read_size(read), _program_size(program), _erase_size(erase)
+    {
+    }
+
+    int init() override
+    {
+        return BD_ERROR_OK;
+    }
+
+    int deinit() override
+    {
+        return BD_ERROR_OK;
+    }
+
+    int read(void *buffer, bd_addr_t addr, bd_size_t size) override
+    {
+        if (addr % _read_size || size % _read_size || addr + size > _data.size()) return BD_ERROR_DEVICE_ERROR;
+        memcpy(buffer, &_data[addr], size);
+        return BD_ERROR_OK;
+    }
+
+    int program(const void *buffer, bd_addr_t addr, bd_size_t size) override
+    {
+        if (addr % _program_size || size % _program_size || addr + size > _data.size()) return BD_ERROR_DEVICE_ERROR;
+        const uint8_t *p = (const uint8_t *)buffer;
+        for (bd_size_t i = 0; i < size; i++) _data[addr + i] &= p[i];
+        return BD_ERROR_OK;
+    }
+
+    int erase(bd_addr_t addr, bd_size_t size) override
+    {
+        if (addr % _erase_size || size % _erase_size || addr + size > _data.size()) return BD_ERROR_DEVICE_ERROR;
+        memset(&_data[addr], 0xFF, size);
+        return BD_ERROR_OK;
+    }
+
+    bd_size_t get_read_size() const override
+    {
+        return _read_size;
+    }
+
+    bd_size_t get_program_size() const override
+    {
+        return _program_size;
+    }
+
+    bd_size_t get_erase_size() const override
+    {
+        return _erase_size;
+    }
+
+    bd_size_t size() const override
+    {
+        return _data.size();
+    }
+
+protected:
+    std::vector<uint8_t> _data;
+    bd_size_t _read_size;
+    bd_size_t _program_size;
+    bd_size_t _erase_size;
+};
+
+}
+
+#endif // PMSENSE_HOST_HEAPBLOCKDEVICE_H
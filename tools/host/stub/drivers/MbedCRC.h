@@ -0,0 +1,70 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for mbed::MbedCRC, CRC-32 (ANSI) only */
+
+#ifndef PMSENSE_HOST_MBEDCRC_H
+#define PMSENSE_HOST_MBEDCRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POLY_32BIT_ANSI                 (0x04C11DB7u)
+
+namespace mbed {
+
+template <uint32_t polynomial, int width>
+class MbedCRC {
+    static_assert(polynomial == POLY_32BIT_ANSI && width == 32, "Only CRC-32 is stubbed");
+
+public:
+    int compute(const void *buffer, size_t size, uint32_t *crc)
+    {
+        compute_partial_start(crc);
+        compute_partial(buffer, size, crc);
+        return compute_partial_stop(crc);
+    }
+
+    int compute_partial_start(uint32_t *crc)
+    {
+        *crc = 0xFFFFFFFFu;
+        return 0;
+    }
+
+    int compute_partial(const void *buffer, size_t size, uint32_t *crc)
+    {
+        const uint8_t *p = (const uint8_t *)buffer;
+        for (size_t i = 0; i < size; i++) {
+            *crc ^= p[i];
+            for (int b = 0; b < 8; b++) {
+                *crc = (*crc >> 1) ^ (0xEDB88320u & (0u - (*crc & 1u)));
+            }
+        }
+        return 0;
+    }
+
+    int compute_partial_stop(uint32_t *crc)
+    {
+        *crc ^= 0xFFFFFFFFu;
+        return 0;
+    }
+};
+
+}
+
+#endif // PMSENSE_HOST_MBEDCRC_H
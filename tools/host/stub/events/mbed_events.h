@@ -0,0 +1,134 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for events::EventQueue, on simulated time (host_sim_time_us() in mbed.h).
+ *
+ * Nothing runs by itself: the harness moves the clock and calls dispatch_once(), which runs every
+ * event that is due in due order, including ones posted meanwhile. An event that takes simulated
+ * time, by a blocking bus access or wait_us(), delays the ones behind it, as it would on the
+ * target, and get_max_delay_us() reports the longest any event ran late. */
+
+#ifndef PMSENSE_HOST_MBED_EVENTS_H
+#define PMSENSE_HOST_MBED_EVENTS_H
+
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <utility>
+
+#include "mbed.h"
+
+#define EVENTS_EVENT_SIZE               (64u)
+
+namespace events {
+
+class EventQueue {
+public:
+    EventQueue(unsigned size = 0, unsigned char *buffer = nullptr)
+    {
+    }
+
+    template <typename F>
+    int call(F f)
+    {
+        return post(0, std::function<void()>(f));
+    }
+
+    template <typename F>
+    int call_in(std::chrono::milliseconds delay, F f)
+    {
+        return post(delay.count() * 1000, std::function<void()>(f));
+    }
+
+    template <typename T, typename R, typename... Args, typename... BoundArgs>
+    int call(T *obj, R(T::*method)(Args...), BoundArgs... args)
+    {
+        return post(0, [obj, method, args...]() {
+            (obj->*method)(args...);
+        });
+    }
+
+    template <typename T, typename R, typename... Args, typename... BoundArgs>
+    int call_in(std::chrono::milliseconds delay, T *obj, R(T::*method)(Args...), BoundArgs... args)
+    {
+        return post(delay.count() * 1000, [obj, method, args...]() {
+            (obj->*method)(args...);
+        });
+    }
+
+    bool cancel(int id)
+    {
+        for (typename queue_t::iterator i = _events.begin(); i != _events.end(); ++i) {
+            if (i->second.id == id) {
+                _events.erase(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Run every event due by now, including those they post for now. */
+    void dispatch_once()
+    {
+        while (!_events.empty() && _events.begin()->first.first <= host_sim_time_us()) {
+            event_t event = _events.begin()->second;
+            int64_t due = _events.begin()->first.first;
+            _events.erase(_events.begin());
+            if (host_sim_time_us() - due > _max_delay_us) _max_delay_us = host_sim_time_us() - due;
+            event.f();
+        }
+    }
+
+    /** When the next event is due in us, or -1 if none is queued. */
+    int64_t next_due_us() const
+    {
+        return _events.empty() ? -1 : _events.begin()->first.first;
+    }
+
+    int64_t get_max_delay_us() const
+    {
+        return _max_delay_us;
+    }
+
+private:
+    typedef struct {
+        int id;
+        std::function<void()> f;
+    } event_t;
+
+    /* keyed on due time, then on order posted */
+    typedef std::map<std::pair<int64_t, uint64_t>, event_t> queue_t;
+
+    int post(int64_t delay_us, std::function<void()> f)
+    {
+        int id = ++_last_id;
+        _events[std::make_pair(host_sim_time_us() + delay_us, _posted++)] = {id, f};
+        return id;
+    }
+
+    queue_t _events;
+    int _last_id = 0;
+    uint64_t _posted = 0;
+    int64_t _max_delay_us = 0;
+};
+
+}
+
+#endif // PMSENSE_HOST_MBED_EVENTS_H
@@ -0,0 +1,149 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for the parts of mbed OS the PMsense headers use, for tools/host only */
+
+#ifndef PMSENSE_HOST_MBED_H
+#define PMSENSE_HOST_MBED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "platform/Callback.h"
+#include "platform/NonCopyable.h"
+#include "platform/mbed_atomic.h"
+
+#define DEVICE_I2C_ASYNCH               (1)
+#define I2C_EVENT_ERROR                 (1 << 1)
+#define I2C_EVENT_TRANSFER_COMPLETE     (1 << 3)
+
+/**
+ * Simulated time in us, or -1 to use the host clock. A harness that sets it drives the clock
+ * itself: the RTOS tick, Timer, wait_us() and the stub EventQueue all follow it.
+ */
+inline int64_t &host_sim_time_us()
+{
+    static int64_t now = -1;
+    return now;
+}
+
+/** Microseconds from the simulated clock, or from the host steady clock. */
+inline int64_t host_now_us()
+{
+    if (host_sim_time_us() >= 0) return host_sim_time_us();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+namespace rtos {
+namespace Kernel {
+/** Milliseconds from the host or simulated clock, like the RTOS tick */
+struct Clock {
+    typedef std::chrono::milliseconds duration;
+    typedef std::chrono::time_point<Clock> time_point;
+
+    static time_point now()
+    {
+        return time_point(duration(host_now_us() / 1000));
+    }
+};
+}
+}
+
+namespace mbed {
+
+typedef Callback<void(int)> event_callback_t;
+
+/** Microsecond stopwatch on the host or simulated clock */
+class Timer {
+public:
+    void start()
+    {
+        if (!_running) _start = host_now_us();
+        _running = true;
+    }
+
+    void stop()
+    {
+        if (_running) _elapsed += host_now_us() - _start;
+        _running = false;
+    }
+
+    void reset()
+    {
+        _elapsed = 0;
+        _start = host_now_us();
+    }
+
+    std::chrono::microseconds elapsed_time() const
+    {
+        int64_t d = _elapsed;
+        if (_running) d += host_now_us() - _start;
+        return std::chrono::microseconds(d);
+    }
+
+private:
+    int64_t _start = 0;
+    int64_t _elapsed = 0;
+    bool _running = false;
+};
+
+/** I2C bus with nothing on it; a harness overrides what it needs */
+class I2C {
+public:
+    virtual ~I2C()
+    {
+    }
+
+    virtual int write(int address, const char *data, int length, bool repeated = false)
+    {
+        return 2;
+    }
+
+    virtual int read(int address, char *data, int length, bool repeated = false)
+    {
+        return 2;
+    }
+
+    virtual int transfer(int address, const char *tx, int tx_length, char *rx, int rx_length,
+                         const event_callback_t &callback)
+    {
+        return -1;
+    }
+
+    virtual void abort_transfer()
+    {
+    }
+};
+
+}
+
+/** Busy waits take simulated time and no host time. */
+inline void wait_us(int us)
+{
+    if (host_sim_time_us() >= 0) host_sim_time_us() += us;
+}
+
+using namespace mbed;
+using namespace std::chrono_literals;
+
+#endif // PMSENSE_HOST_MBED_H
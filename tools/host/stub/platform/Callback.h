@@ -0,0 +1,97 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for mbed::Callback, on std::function */
+
+#ifndef PMSENSE_HOST_CALLBACK_H
+#define PMSENSE_HOST_CALLBACK_H
+
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+namespace mbed {
+
+template <typename F>
+class Callback;
+
+template <typename R, typename... Args>
+class Callback<R(Args...)> {
+public:
+    Callback()
+    {
+    }
+
+    Callback(std::nullptr_t)
+    {
+    }
+
+    Callback(R(*f)(Args...))
+    {
+        if (f) _f = f;
+    }
+
+    template <typename T, typename U>
+    Callback(U *obj, R(T::*method)(Args...)) :
+        _f([obj, method](Args... args) {
+        return (obj->*method)(args...);
+    })
+    {
+    }
+
+    template <typename L, typename = typename std::enable_if<
+                  !std::is_same<typename std::decay<L>::type, Callback>::value &&
+                  !std::is_pointer<typename std::decay<L>::type>::value>::type>
+    Callback(L f) : _f(std::move(f))
+    {
+    }
+
+    R call(Args... args) const
+    {
+        return _f(args...);
+    }
+
+    R operator()(Args... args) const
+    {
+        return _f(args...);
+    }
+
+    explicit operator bool() const
+    {
+        return (bool)_f;
+    }
+
+private:
+    std::function<R(Args...)> _f;
+};
+
+template <typename R, typename... Args>
+Callback<R(Args...)> callback(R(*f)(Args...))
+{
+    return Callback<R(Args...)>(f);
+}
+
+template <typename T, typename U, typename R, typename... Args>
+Callback<R(Args...)> callback(U *obj, R(T::*method)(Args...))
+{
+    return Callback<R(Args...)>(obj, method);
+}
+
+}
+
+#endif // PMSENSE_HOST_CALLBACK_H
@@ -0,0 +1,73 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for mbed::Span, a pointer and a length, for tools/host only */
+
+#ifndef PMSENSE_HOST_SPAN_H
+#define PMSENSE_HOST_SPAN_H
+
+#include <stddef.h>
+
+namespace mbed {
+
+template <typename T>
+class Span {
+public:
+    Span() : _data(nullptr), _size(0)
+    {
+    }
+
+    Span(T *data, size_t size) : _data(data), _size(size)
+    {
+    }
+
+    T *data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    T &operator[](size_t index) const
+    {
+        return _data[index];
+    }
+
+private:
+    T *_data;
+    size_t _size;
+};
+
+template <typename T>
+Span<T> make_Span(T *data, size_t size)
+{
+    return Span<T>(data, size);
+}
+
+template <typename T>
+Span<const T> make_const_Span(const T *data, size_t size)
+{
+    return Span<const T>(data, size);
+}
+
+}
+
+#endif // PMSENSE_HOST_SPAN_H
@@ -0,0 +1,102 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for mbed_atomic.h, on the compiler's __atomic builtins */
+
+#ifndef PMSENSE_HOST_MBED_ATOMIC_H
+#define PMSENSE_HOST_MBED_ATOMIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    mbed_memory_order_relaxed = __ATOMIC_RELAXED,
+    mbed_memory_order_consume = __ATOMIC_CONSUME,
+    mbed_memory_order_acquire = __ATOMIC_ACQUIRE,
+    mbed_memory_order_release = __ATOMIC_RELEASE,
+    mbed_memory_order_acq_rel = __ATOMIC_ACQ_REL,
+    mbed_memory_order_seq_cst = __ATOMIC_SEQ_CST
+} mbed_memory_order;
+
+typedef struct {
+    uint8_t _flag;
+} core_util_atomic_flag;
+
+#define CORE_UTIL_ATOMIC_FLAG_INIT      { 0 }
+
+inline uint32_t core_util_atomic_load_u32(const volatile uint32_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+inline uint32_t core_util_atomic_load_explicit_u32(const volatile uint32_t *p, mbed_memory_order order)
+{
+    return __atomic_load_n(p, order);
+}
+
+inline void core_util_atomic_store_u32(volatile uint32_t *p, uint32_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+inline void core_util_atomic_store_explicit_u32(volatile uint32_t *p, uint32_t v, mbed_memory_order order)
+{
+    __atomic_store_n(p, v, order);
+}
+
+inline bool core_util_atomic_load_bool(const volatile bool *p)
+{
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+inline void core_util_atomic_store_bool(volatile bool *p, bool v)
+{
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+inline bool core_util_atomic_exchange_bool(volatile bool *p, bool v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+inline uint32_t core_util_atomic_incr_u32(volatile uint32_t *p, uint32_t delta)
+{
+    return __atomic_add_fetch(p, delta, __ATOMIC_SEQ_CST);
+}
+
+inline uint32_t core_util_atomic_decr_u32(volatile uint32_t *p, uint32_t delta)
+{
+    return __atomic_sub_fetch(p, delta, __ATOMIC_SEQ_CST);
+}
+
+inline bool core_util_atomic_cas_u32(volatile uint32_t *p, uint32_t *expected, uint32_t desired)
+{
+    return __atomic_compare_exchange_n(p, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+inline bool core_util_atomic_flag_test_and_set(volatile core_util_atomic_flag *flag)
+{
+    return __atomic_test_and_set(&flag->_flag, __ATOMIC_SEQ_CST);
+}
+
+inline void core_util_atomic_flag_clear(volatile core_util_atomic_flag *flag)
+{
+    __atomic_clear(&flag->_flag, __ATOMIC_SEQ_CST);
+}
+
+#endif // PMSENSE_HOST_MBED_ATOMIC_H
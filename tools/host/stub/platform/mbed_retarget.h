@@ -0,0 +1,60 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for the console FileHandle; a harness points it at any file descriptor */
+
+#ifndef PMSENSE_HOST_MBED_RETARGET_H
+#define PMSENSE_HOST_MBED_RETARGET_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace mbed {
+
+class FileHandle {
+public:
+    explicit FileHandle(int fd) : _fd(fd)
+    {
+    }
+
+    ssize_t write(const void *buffer, size_t size)
+    {
+        return ::write(_fd, buffer, size);
+    }
+
+    void set_fd(int fd)
+    {
+        _fd = fd;
+    }
+
+private:
+    int _fd;
+};
+
+/** Every descriptor shares one handle, which writes to the host stdout until set_fd() moves it. */
+inline FileHandle *mbed_file_handle(int fd)
+{
+    static FileHandle console(STDOUT_FILENO);
+    (void)fd;
+    return &console;
+}
+
+}
+
+#endif // PMSENSE_HOST_MBED_RETARGET_H
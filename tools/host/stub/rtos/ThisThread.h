@@ -0,0 +1,43 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for rtos::ThisThread */
+
+#ifndef PMSENSE_HOST_THISTHREAD_H
+#define PMSENSE_HOST_THISTHREAD_H
+
+#include <chrono>
+#include <thread>
+
+namespace rtos {
+namespace ThisThread {
+
+inline void sleep_for(std::chrono::milliseconds ms)
+{
+    std::this_thread::sleep_for(ms);
+}
+
+inline void yield()
+{
+    std::this_thread::yield();
+}
+
+}
+}
+
+#endif // PMSENSE_HOST_THISTHREAD_H
@@ -0,0 +1,61 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for rtos::Thread, on std::thread */
+
+#ifndef PMSENSE_HOST_THREAD_H
+#define PMSENSE_HOST_THREAD_H
+
+#include <stdint.h>
+#include <thread>
+
+#include "platform/Callback.h"
+
+typedef enum {
+    osPriorityLow = 8,
+    osPriorityNormal = 24,
+    osPriorityAboveNormal = 32
+} osPriority_t;
+
+typedef int32_t osStatus;
+#define osOK                            (0)
+
+namespace rtos {
+
+/** Priority and stack size are ignored; the thread runs detached until the process exits. */
+class Thread {
+public:
+    Thread(osPriority_t priority = osPriorityNormal, uint32_t stack_size = 0, unsigned char *stack_mem = nullptr,
+           const char *name = nullptr)
+    {
+        (void)priority;
+        (void)stack_size;
+        (void)stack_mem;
+        (void)name;
+    }
+
+    osStatus start(mbed::Callback<void()> task)
+    {
+        std::thread(task).detach();
+        return osOK;
+    }
+};
+
+}
+
+#endif // PMSENSE_HOST_THREAD_H
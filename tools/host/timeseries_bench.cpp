@@ -0,0 +1,305 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMTimeSeries on 1 Hz dust traces: bytes per sample, encode and decode throughput, and a
+ * bit-exact round trip.
+ *
+ * Each trace is replayed into a store the size main.cpp makes from app.timeseries-buffer-size,
+ * and into a small one that drops blocks all through the run. Everything still held must read
+ * back bit-exactly, in order and with consecutive sequence numbers; seek_seq() into a dropped
+ * block must land on the oldest sample held, and seek_seq() and seek() to samples still held
+ * must find them.
+ *
+ * The built in traces are synthetic. Particle counts are Poisson draws around a slowly drifting
+ * concentration, as a counting sensor reports them, and the mass densities follow the counts in
+ * the sensor's 0.001 ug/m3 units, so nearly every field changes every second; one trace is clean
+ * air with mostly empty bins, one is an urban day with a cooking spike, and one holds nearly
+ * still as a best case. Seconds with no valid sample leave gaps. A recorded trace can be replayed
+ * instead by naming CSV files on the command line, one sample per line as
+ * timestamp,pm1,pm2.5,pm10,count0.3,count0.5,count1,count2.5,count5,count7.5 in the sensor's
+ * units. */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+#include "PMTimeSeries.h"
+
+#define TRACE_SECONDS           (6u * 3600u)
+#define BUDGET_BYTES            (49152u)            // app.timeseries-buffer-size
+#define BUDGET_BLOCKS           (BUDGET_BYTES / (PMTS_BLOCK_SIZE + PMTS_INDEX_SIZE))
+#define SMALL_BLOCKS            (8u)
+#define TIMING_REPEATS          (5u)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+typedef struct {
+    uint32_t timestamp;
+    PM_MDVPC_Data pmdata;
+} sample_t;
+
+static uint32_t rng_state = 0x6b8b4567u;
+
+static uint32_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double uniform()
+{
+    return (rng() + 0.5) / 4294967296.0;
+}
+
+static uint32_t poisson(double mean)
+{
+    if (mean > 50) {
+        double n = sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform());
+        double v = mean + sqrt(mean) * n + 0.5;
+        return (v < 0) ? 0 : (uint32_t)v;
+    }
+    double limit = exp(-mean), p = uniform();
+    uint32_t k = 0;
+    while (p > limit) {
+        p *= uniform();
+        k++;
+    }
+    return k;
+}
+
+static uint16_t clamp16(uint32_t v)
+{
+    return (v > UINT16_MAX) ? UINT16_MAX : v;
+}
+
+typedef enum {
+    TRACE_CLEAN,
+    TRACE_URBAN,
+    TRACE_STILL
+} trace_kind_t;
+
+static std::vector<sample_t> make_trace(trace_kind_t kind)
+{
+    /* share of the 0.3 um count in each bin, and the mass each adds in 0.001 ug/m3 */
+    static const double bin_share[6] = {1.0, 0.35, 0.08, 0.015, 0.004, 0.0015};
+    static const double bin_mass[6] = {0.4, 1.6, 9.0, 60.0, 300.0, 900.0};
+
+    std::vector<sample_t> trace;
+    double level = (kind == TRACE_CLEAN) ? 8.0 : (kind == TRACE_URBAN) ? 400.0 : 150.0;
+    PM_MDVPC_Data still = {};
+    uint32_t t = 1000000;
+    for (uint32_t s = 0; s < TRACE_SECONDS; s++, t++) {
+        if (rng() % 100 == 0) continue;                     // an error frame
+        if (rng() % 5000 == 0) t += 5 + rng() % 30;         // the sensor restarting
+
+        sample_t sample;
+        sample.timestamp = t;
+        if (kind == TRACE_STILL) {
+            if (s == 0 || rng() % 10 == 0) {
+                uint32_t counts[6];
+                for (int b = 0; b < 6; b++) counts[b] = (uint32_t)(level * bin_share[b]) + rng() % 2;
+                still.reg1_pc = counts[0];
+                still.reg2_pc = counts[1];
+                still.reg3_pc = counts[2];
+                still.reg4_pc = counts[3];
+                still.reg5_pc = counts[4];
+                still.reg6_pc = counts[5];
+                still.pm10_mdv = 3000 + rng() % 2;
+                still.pm25_mdv = 4000 + rng() % 2;
+                still.pm100_mdv = 5000 + rng() % 2;
+            }
+            sample.pmdata = still;
+            trace.push_back(sample);
+            continue;
+        }
+
+        double mean = level;
+        if (kind == TRACE_URBAN) {
+            mean *= 1.0 + 0.5 * sin(2 * M_PI * s / (6 * 3600.0));
+            if (s >= 2 * 3600 && s < 2 * 3600 + 1200) mean *= 10;   // cooking
+        }
+        level *= exp(0.002 * (uniform() - 0.5));
+        uint32_t counts[6];
+        double mass[3] = {0, 0, 0};
+        for (int b = 0; b < 6; b++) {
+            counts[b] = poisson(mean * bin_share[b]);
+            double m = counts[b] * bin_mass[b];
+            if (b < 3) mass[0] += m;
+            if (b < 4) mass[1] += m;
+            mass[2] += m;
+        }
+        sample.pmdata.reg1_pc = clamp16(counts[0]);
+        sample.pmdata.reg2_pc = clamp16(counts[1]);
+        sample.pmdata.reg3_pc = clamp16(counts[2]);
+        sample.pmdata.reg4_pc = clamp16(counts[3]);
+        sample.pmdata.reg5_pc = clamp16(counts[4]);
+        sample.pmdata.reg6_pc = clamp16(counts[5]);
+        sample.pmdata.pm10_mdv = (uint32_t)mass[0];
+        sample.pmdata.pm25_mdv = (uint32_t)mass[1];
+        sample.pmdata.pm100_mdv = (uint32_t)mass[2];
+        trace.push_back(sample);
+    }
+    return trace;
+}
+
+static bool load_trace(const char *path, std::vector<sample_t> &trace)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        sample_t s;
+        unsigned long v[10];
+        if (sscanf(line, "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+                   &v[7], &v[8], &v[9]) != 10) continue;
+        s.timestamp = v[0];
+        s.pmdata.pm10_mdv = v[1];
+        s.pmdata.pm25_mdv = v[2];
+        s.pmdata.pm100_mdv = v[3];
+        s.pmdata.reg1_pc = v[4];
+        s.pmdata.reg2_pc = v[5];
+        s.pmdata.reg3_pc = v[6];
+        s.pmdata.reg4_pc = v[7];
+        s.pmdata.reg5_pc = v[8];
+        s.pmdata.reg6_pc = v[9];
+        trace.push_back(s);
+    }
+    fclose(f);
+    return !trace.empty();
+}
+
+static bool same(const PM_MDVPC_Data &a, const PM_MDVPC_Data &b)
+{
+    return a.pm10_mdv == b.pm10_mdv && a.pm25_mdv == b.pm25_mdv && a.pm100_mdv == b.pm100_mdv &&
+           a.reg1_pc == b.reg1_pc && a.reg2_pc == b.reg2_pc && a.reg3_pc == b.reg3_pc && a.reg4_pc == b.reg4_pc &&
+           a.reg5_pc == b.reg5_pc && a.reg6_pc == b.reg6_pc;
+}
+
+/** Replay a trace into a store and check everything it still holds, and the seeks into it. */
+template <typename Series>
+static void check_round_trip(Series &series, const std::vector<sample_t> &trace)
+{
+    for (const sample_t &s : trace) series.append(s.timestamp, s.pmdata);
+
+    uint32_t held = series.samples();
+    uint32_t first = trace.size() - held;
+    CHECK(held > 0 && held <= trace.size());
+    CHECK(series.next_seq() == trace.size());
+
+    typename Series::cursor_t c;
+    CHECK(series.seek_oldest(c));
+    CHECK(c.seq == first);
+    uint32_t timestamp, n = 0, mismatches = 0;
+    PM_MDVPC_Data pmdata;
+    while (series.read(c, timestamp, pmdata)) {
+        const sample_t &s = trace[first + n];
+        if (c.seq - 1 != first + n || timestamp != s.timestamp || !same(pmdata, s.pmdata)) mismatches++;
+        n++;
+    }
+    CHECK(n == held);
+    CHECK(mismatches == 0);
+
+    if (first > 0) {
+        /* a sequence number in a dropped block lands on the oldest sample held */
+        CHECK(series.seek_seq(first - 1, c));
+        CHECK(series.read(c, timestamp, pmdata));
+        CHECK(c.seq - 1 == first && timestamp == trace[first].timestamp && same(pmdata, trace[first].pmdata));
+    }
+
+    for (uint32_t probe = 0; probe < 50; probe++) {
+        uint32_t seq = first + rng() % held;
+        CHECK(series.seek_seq(seq, c));
+        CHECK(series.read(c, timestamp, pmdata));
+        CHECK(c.seq - 1 == seq && timestamp == trace[seq].timestamp && same(pmdata, trace[seq].pmdata));
+
+        /* seek() is block granular: it lands at or before the time, and reading on reaches it */
+        CHECK(series.seek(trace[seq].timestamp, c));
+        bool found = false;
+        while (series.read(c, timestamp, pmdata) && timestamp <= trace[seq].timestamp) {
+            if (c.seq - 1 == seq) found = same(pmdata, trace[seq].pmdata);
+        }
+        CHECK(found);
+    }
+    CHECK(!series.seek_seq(series.next_seq(), c));
+}
+
+static void run(const char *name, const std::vector<sample_t> &trace)
+{
+    static PMTimeSeries<BUDGET_BLOCKS> budget;
+    static PMTimeSeries<SMALL_BLOCKS> small;
+
+    budget = PMTimeSeries<BUDGET_BLOCKS>();
+    check_round_trip(budget, trace);
+    small = PMTimeSeries<SMALL_BLOCKS>();
+    check_round_trip(small, trace);
+    CHECK(small.get_evicted() > 0);
+
+    /* throughput, on the store main.cpp uses */
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < TIMING_REPEATS; r++) {
+        budget = PMTimeSeries<BUDGET_BLOCKS>();
+        for (const sample_t &s : trace) budget.append(s.timestamp, s.pmdata);
+    }
+    double encode_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+                       (TIMING_REPEATS * trace.size());
+
+    uint32_t read = 0, timestamp;
+    PM_MDVPC_Data pmdata;
+    start = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < TIMING_REPEATS; r++) {
+        PMTimeSeries<BUDGET_BLOCKS>::cursor_t c;
+        budget.seek_oldest(c);
+        while (budget.read(c, timestamp, pmdata)) read++;
+    }
+    double decode_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / read;
+
+    double per_sample = (double)budget.bytes_used() / budget.samples();
+    double hours = (double)BUDGET_BLOCKS * PMTS_BLOCK_SIZE / per_sample / 3600.0;
+    printf("%-8s %6u samples  %5.2f bytes/sample (%4.1f%% of 28)  %4.1f h in %u bytes  encode %5.1f ns  decode %5.1f ns\r\n",
+           name, (unsigned)trace.size(), per_sample, 100.0 * per_sample / 28, hours, BUDGET_BYTES, encode_ns, decode_ns);
+}
+
+int main(int argc, char **argv)
+{
+    printf("timeseries_bench: %u blocks of %u bytes, and %u blocks for the eviction checks\r\n", BUDGET_BLOCKS,
+           PMTS_BLOCK_SIZE, SMALL_BLOCKS);
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            std::vector<sample_t> trace;
+            if (!load_trace(argv[i], trace)) {
+                printf("cannot read a trace from %s\r\n", argv[i]);
+                return 1;
+            }
+            run(argv[i], trace);
+        }
+    }
+    else {
+        run("clean", make_trace(TRACE_CLEAN));
+        run("urban", make_trace(TRACE_URBAN));
+        run("still", make_trace(TRACE_STILL));
+    }
+    printf("timeseries_bench: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
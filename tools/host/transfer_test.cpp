@@ -0,0 +1,389 @@
+/* mbed Microcontroller Library for
+ * Panasonic SN-GCJA5 Particular Matter Sensor
+ * Copyright (c) 2022 C Gerrish (Gerrikoio)
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMHistoryTransfer against a BLE stack stand-in with a few transmit buffers and slow
+ * confirmations, on simulated time.
+ *
+ * The stand-in sends up to PACKETS_PER_EVENT notifications each 7.5 ms connection event and
+ * confirms each one with onDataSent a connection event later; a buffer is only free again once
+ * its notification is confirmed. Like Cordio it can also drop a notification it has no buffer
+ * for while reporting success, so the transfer must never queue more than its credits.
+ *
+ * Two hours of samples are downloaded at ATT MTUs of 48, 100 and 247: every record must arrive
+ * once, in order and as stored, and the throughput is reported. At the default MTU of 23 not
+ * one record fits in a packet, so the request must be ignored. Then the link is dropped part
+ * way through and the client resumes from the sequence number after its last record; a resume
+ * naming another series, or records the store has since dropped, must restart from the oldest
+ * sample held. An abort followed at once by a new request must not over-commit the stack. */
+
+#include <stdio.h>
+
+#include <deque>
+#include <vector>
+
+#include "PMHistoryTransfer.h"
+#include "PMTimeSeries.h"
+
+#define CONN                    (1u)
+#define CONN_INTERVAL_US        (7500)
+#define PACKETS_PER_EVENT       (6u)
+#define STACK_BUFFERS           (HISTXFER_CREDITS)
+#define TRACE_SECONDS           (2u * 3600u)
+#define START_TIME              (1000000u)
+#define SERIES_ID               (0x5eed0001u)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\r\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+Panasonic_SNGCJA5::~Panasonic_SNGCJA5()
+{
+}
+
+typedef PMTimeSeries<183> series_t;
+
+/** What the central holds: the records received, by sequence number. */
+class Client {
+public:
+    void reset()
+    {
+        records.clear();
+        first_seq = 0;
+        next_seq = 0;
+        out_of_order = 0;
+        complete = false;
+        bytes = 0;
+    }
+
+    void receive(const uint8_t *packet, uint16_t len)
+    {
+        uint32_t seq = get_u32(packet + 5);
+        series = get_u32(packet + 1);
+        if (records.empty()) first_seq = seq;
+        else if (seq != next_seq) out_of_order++;
+        for (uint16_t at = HISTXFER_HEADER_SIZE; at + HISTXFER_RECORD_SIZE <= len; at += HISTXFER_RECORD_SIZE) {
+            record_t r;
+            r.timestamp = get_u32(packet + at);
+            r.pm10 = get_u32(packet + at + 4);
+            r.count = packet[at + 16] | packet[at + 17] << 8;
+            records.push_back(r);
+            seq++;
+        }
+        next_seq = seq;
+        bytes += len;
+        if (packet[0] & HISTXFER_FLAG_LAST) complete = true;
+    }
+
+    typedef struct {
+        uint32_t timestamp;
+        uint32_t pm10;
+        uint16_t count;
+    } record_t;
+
+    std::vector<record_t> records;
+    uint32_t series = 0;
+    uint32_t first_seq = 0;
+    uint32_t next_seq = 0;
+    uint32_t out_of_order = 0;
+    uint32_t bytes = 0;
+    bool complete = false;
+
+private:
+    static uint32_t get_u32(const uint8_t *p)
+    {
+        return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+    }
+};
+
+/** The stack: a few transmit buffers, sent on connection events and confirmed an event later. */
+class SimGattServer : public ble::GattServer {
+public:
+    SimGattServer(Client &client) : _client(client)
+    {
+    }
+
+    ble_error_t write(ble::connection_handle_t connectionHandle, GattAttribute::Handle_t attributeHandle,
+                      const uint8_t *value, uint16_t size, bool localOnly = false) override
+    {
+        if (!connected) return BLE_ERROR_INVALID_STATE;
+        if (_queued.size() + _sent.size() >= STACK_BUFFERS) {
+            dropped++;
+            return BLE_ERROR_NONE;      // as Cordio does when its buffer pool is empty
+        }
+        packet_t p;
+        p.handle = attributeHandle;
+        p.data.assign(value, value + size);
+        _queued.push_back(p);
+        if (_queued.size() + _sent.size() > peak) peak = _queued.size() + _sent.size();
+        return BLE_ERROR_NONE;
+    }
+
+    ble_error_t areUpdatesEnabled(ble::connection_handle_t connectionHandle,
+                                  const GattCharacteristic &characteristic, bool *enabled) override
+    {
+        *enabled = connected;
+        return BLE_ERROR_NONE;
+    }
+
+    /** One connection event: confirm what the last one sent, then send what is queued. */
+    template <typename Transfer>
+    void connection_event(Transfer &transfer)
+    {
+        std::deque<packet_t> confirmed;
+        confirmed.swap(_sent);
+        for (uint32_t i = 0; i < PACKETS_PER_EVENT && !_queued.empty(); i++) {
+            _client.receive(_queued.front().data.data(), _queued.front().data.size());
+            _sent.push_back(_queued.front());
+            _queued.pop_front();
+        }
+        for (size_t i = 0; i < confirmed.size(); i++) {
+            GattDataSentCallbackParams params = {CONN, confirmed[i].handle};
+            transfer.on_data_sent(params);
+        }
+    }
+
+    void disconnect()
+    {
+        connected = false;
+        _queued.clear();
+        _sent.clear();
+    }
+
+    bool idle() const
+    {
+        return _queued.empty() && _sent.empty();
+    }
+
+    bool connected = true;
+    uint32_t dropped = 0;
+    size_t peak = 0;
+
+private:
+    typedef struct {
+        GattAttribute::Handle_t handle;
+        std::vector<uint8_t> data;
+    } packet_t;
+
+    Client &_client;
+    std::deque<packet_t> _queued;
+    std::deque<packet_t> _sent;
+};
+
+typedef PMHistoryTransfer<series_t> transfer_t;
+
+static void fill(series_t &series, uint32_t seconds)
+{
+    for (uint32_t t = 0; t < seconds; t++) {
+        PM_MDVPC_Data pmdata = {};
+        pmdata.pm10_mdv = 1000 + (t * 7) % 500;
+        pmdata.pm25_mdv = pmdata.pm10_mdv + 100;
+        pmdata.pm100_mdv = pmdata.pm25_mdv + 100;
+        pmdata.reg1_pc = 300 + (t * 13) % 200;
+        pmdata.reg2_pc = pmdata.reg1_pc / 2;
+        series.append(START_TIME + t, pmdata);
+    }
+}
+
+static void request(transfer_t &transfer, uint8_t op, uint32_t arg, uint16_t mtu, uint32_t series_id = SERIES_ID)
+{
+    uint8_t data[13] = {op};
+    for (uint8_t i = 0; i < 4; i++) {
+        data[1 + i] = arg >> (8 * i);
+        data[5 + i] = HISTXFER_END_OF_TIME >> (8 * i);
+        data[9 + i] = series_id >> (8 * i);
+    }
+    GattWriteCallbackParams params = {CONN, transfer.control_characteristic().getValueHandle(), 0,
+                                      (uint16_t)((op == HISTXFER_OP_RESUME) ? 13 : 9), data
+                                     };
+    transfer.on_data_written(params, mtu);
+}
+
+/** Run connection events until the transfer is done, or for at most max_events. */
+template <typename Transfer>
+static uint32_t run(SimGattServer &stack, Transfer &transfer, uint32_t max_events = UINT32_MAX)
+{
+    uint32_t events = 0;
+    while (events < max_events && (transfer.is_active() || !stack.idle())) {
+        host_sim_time_us() += CONN_INTERVAL_US;
+        stack.connection_event(transfer);
+        CHECK(transfer.get_inflight() <= HISTXFER_CREDITS);
+        events++;
+    }
+    return events;
+}
+
+/** Every record from the series, each once and as stored, starting at first_seq. */
+static void check_records(const series_t &series, const Client &client, uint32_t first_seq)
+{
+    series_t::cursor_t c;
+    CHECK(series.seek_seq(first_seq, c));
+    CHECK(client.first_seq == first_seq);
+    uint32_t wrong = 0;
+    size_t i = 0;
+    uint32_t timestamp;
+    PM_MDVPC_Data pmdata;
+    while (series.read(c, timestamp, pmdata)) {
+        if (i >= client.records.size() || client.records[i].timestamp != timestamp ||
+                client.records[i].pm10 != pmdata.pm10_mdv || client.records[i].count != pmdata.reg1_pc) {
+            wrong++;
+        }
+        i++;
+    }
+    CHECK(wrong == 0);
+    CHECK(client.records.size() == i);
+    CHECK(client.out_of_order == 0);
+    CHECK(client.complete);
+}
+
+static void run_throughput(series_t &series, uint16_t mtu)
+{
+    Client client;
+    SimGattServer stack(client);
+    BLE::Instance().set_gatt_server(&stack);
+    transfer_t transfer(BLE::Instance(), series, "00000001-0000-1000-8000-00805f9b34fb", "00000002-0000-1000-8000-00805f9b34fb");
+    transfer.set_series_id(SERIES_ID);
+    host_sim_time_us() = 0;
+
+    request(transfer, HISTXFER_OP_START, 0, mtu);
+    run(stack, transfer);
+
+    printf("MTU %3u: %5zu records, %6lu bytes in %5.1f s, %5lu bytes/s; peak %zu queued, %lu dropped\r\n",
+           mtu, client.records.size(), client.bytes, host_sim_time_us() / 1e6, transfer.get_throughput(),
+           stack.peak, stack.dropped);
+    check_records(series, client, series.next_seq() - series.samples());
+    CHECK(stack.dropped == 0);
+    CHECK(stack.peak <= HISTXFER_CREDITS);
+    CHECK(transfer.get_throughput() > 0);
+    BLE::Instance().set_gatt_server(nullptr);
+}
+
+static void run_too_small(series_t &series)
+{
+    Client client;
+    SimGattServer stack(client);
+    BLE::Instance().set_gatt_server(&stack);
+    transfer_t transfer(BLE::Instance(), series, "00000001-0000-1000-8000-00805f9b34fb", "00000002-0000-1000-8000-00805f9b34fb");
+    host_sim_time_us() = 0;
+
+    request(transfer, HISTXFER_OP_START, 0, 23);
+    CHECK(!transfer.is_active());
+    CHECK(stack.idle() && stack.peak == 0);
+    request(transfer, HISTXFER_OP_START, 0, HISTXFER_MIN_MTU);
+    CHECK(transfer.is_active());
+    run(stack, transfer);
+    CHECK(client.complete && client.records.size() == series.samples());
+    BLE::Instance().set_gatt_server(nullptr);
+}
+
+static void run_resume(series_t &series)
+{
+    Client client;
+    SimGattServer stack(client);
+    BLE::Instance().set_gatt_server(&stack);
+    transfer_t transfer(BLE::Instance(), series, "00000001-0000-1000-8000-00805f9b34fb", "00000002-0000-1000-8000-00805f9b34fb");
+    transfer.set_series_id(SERIES_ID);
+    host_sim_time_us() = 0;
+    uint32_t oldest = series.next_seq() - series.samples();
+
+    // drop the link with notifications still queued and unconfirmed
+    request(transfer, HISTXFER_OP_START, 0, 247);
+    run(stack, transfer, 40);
+    CHECK(transfer.is_active() && !stack.idle());
+    stack.disconnect();
+    transfer.on_disconnect(CONN);
+    CHECK(!transfer.is_active() && transfer.get_inflight() == 0);
+    size_t before = client.records.size();
+
+    stack.connected = true;
+    request(transfer, HISTXFER_OP_RESUME, client.next_seq, 247);
+    run(stack, transfer);
+    printf("resume: %zu records before the link dropped, %zu after, from seq %lu\r\n", before,
+           client.records.size() - before, oldest + before);
+    check_records(series, client, oldest);
+    CHECK(stack.dropped == 0);
+
+    // abort with packets in flight and ask again straight away
+    client.reset();
+    request(transfer, HISTXFER_OP_START, 0, 247);
+    run(stack, transfer, 3);
+    request(transfer, HISTXFER_OP_ABORT, 0, 247);
+    CHECK(!transfer.is_active() && transfer.get_inflight() > 0);
+    client.reset();
+    request(transfer, HISTXFER_OP_START, 0, 247);
+    run(stack, transfer);
+    CHECK(stack.dropped == 0);
+    CHECK(stack.peak <= HISTXFER_CREDITS);
+    CHECK(client.complete);
+
+    // another boot's series starts again from the oldest sample held
+    client.reset();
+    request(transfer, HISTXFER_OP_RESUME, oldest + 100, 247, SERIES_ID + 1);
+    run(stack, transfer);
+    check_records(series, client, oldest);
+    BLE::Instance().set_gatt_server(nullptr);
+}
+
+/** A resume into records the store has dropped since. */
+static void run_resume_evicted()
+{
+    PMTimeSeries<8> small;
+    for (uint32_t t = 0; t < TRACE_SECONDS; t++) {
+        PM_MDVPC_Data pmdata = {};
+        pmdata.pm10_mdv = 1000 + (t * 7) % 500;
+        pmdata.reg1_pc = 300 + (t * 13) % 200;
+        small.append(START_TIME + t, pmdata);
+    }
+    Client client;
+    SimGattServer stack(client);
+    BLE::Instance().set_gatt_server(&stack);
+    PMHistoryTransfer<PMTimeSeries<8> > transfer(BLE::Instance(), small, "00000001-0000-1000-8000-00805f9b34fb",
+            "00000002-0000-1000-8000-00805f9b34fb");
+    transfer.set_series_id(SERIES_ID);
+    host_sim_time_us() = 0;
+    uint32_t oldest = small.next_seq() - small.samples();
+    CHECK(oldest > 10);
+
+    uint8_t data[13] = {HISTXFER_OP_RESUME, 10, 0, 0, 0, 0xff, 0xff, 0xff, 0xff,
+                        SERIES_ID & 0xff, (SERIES_ID >> 8) & 0xff, (SERIES_ID >> 16) & 0xff, SERIES_ID >> 24
+                       };
+    GattWriteCallbackParams params = {CONN, transfer.control_characteristic().getValueHandle(), 0, 13, data};
+    transfer.on_data_written(params, 247);
+    run(stack, transfer);
+    printf("resume from seq 10 after eviction: served from seq %lu, %zu records\r\n", client.first_seq,
+           client.records.size());
+    CHECK(client.first_seq == oldest);
+    CHECK(client.records.size() == small.samples());
+    CHECK(client.complete && client.out_of_order == 0);
+    BLE::Instance().set_gatt_server(nullptr);
+}
+
+int main()
+{
+    static series_t series;
+    fill(series, TRACE_SECONDS);
+
+    run_too_small(series);
+    run_throughput(series, 48);
+    run_throughput(series, 100);
+    run_throughput(series, 247);
+    run_resume(series);
+    run_resume_evicted();
+
+    printf("transfer_test: %s\r\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
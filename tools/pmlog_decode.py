@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+#
+# mbed Microcontroller Library for
+# Panasonic SN-GCJA5 Particular Matter Sensor
+# Copyright (c) 2022 C Gerrish (Gerrikoio)
+# SPDX-License-Identifier: Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Turn PMsense binary log records back into text.
+
+The firmware logs PMLOG() calls as a token (FNV-1a of the format string), a timestamp and the
+integer arguments; see PMLog.h. This finds every PMLOG() and print_error() format string in the
+sources, so it must be run against the same sources the firmware was built from.
+
+Console output mixes the records with ordinary printf text, which is passed through unchanged:
+
+    pmlog_decode.py capture.bin
+    pmlog_decode.py --port /dev/ttyACM0            (needs pyserial)
+
+Values read from the Binary Log characteristic can be given as hex, one read per line:
+
+    pmlog_decode.py --hex reads.txt
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+MARKER = 0x1E
+HEADER = struct.Struct('<IIB')          # token, time (us), argument count; after the marker
+MAX_ARGS = 4
+TOKEN_DROPPED = 0
+
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+
+BLE_ERRORS = {
+    0: 'BLE_ERROR_NONE', 1: 'BLE_ERROR_BUFFER_OVERFLOW', 2: 'BLE_ERROR_NOT_IMPLEMENTED',
+    3: 'BLE_ERROR_PARAM_OUT_OF_RANGE', 4: 'BLE_ERROR_INVALID_PARAM', 5: 'BLE_STACK_BUSY',
+    6: 'BLE_ERROR_INVALID_STATE', 7: 'BLE_ERROR_NO_MEM', 8: 'BLE_ERROR_OPERATION_NOT_PERMITTED',
+    9: 'BLE_ERROR_INITIALIZATION_INCOMPLETE', 10: 'BLE_ERROR_ALREADY_INITIALIZED',
+    11: 'BLE_ERROR_UNSPECIFIED', 12: 'BLE_ERROR_INTERNAL_STACK_FAILURE', 13: 'BLE_ERROR_NOT_FOUND',
+}
+
+LITERALS = r'((?:"(?:[^"\\\n]|\\.)*"\s*)+)'
+PMLOG_CALL = re.compile(r'\bPMLOG\(\s*' + LITERALS)
+PRINT_ERROR_CALL = re.compile(r'\bprint_error\(\s*[^,;]+,\s*' + LITERALS + r'\)')
+ESCAPES = {'n': '\n', 'r': '\r', 't': '\t', '"': '"', '\\': '\\', "'": "'", '0': '\0'}
+CONVERSION = re.compile(r'%([-+ #0]*\d*(?:\.\d+)?)(hh|h|ll|l|z|j|t)?([diuxXoc%])')
+
+
+def fnv1a(text):
+    h = FNV_OFFSET
+    for b in text.encode('latin-1'):
+        h = ((h ^ b) * FNV_PRIME) & 0xFFFFFFFF
+    return h
+
+
+def join_literals(group):
+    """Concatenate adjacent C string literals and resolve their escapes."""
+    text = ''.join(re.findall(r'"((?:[^"\\]|\\.)*)"', group))
+    return re.sub(r'\\(.)', lambda m: ESCAPES.get(m.group(1), m.group(1)), text)
+
+
+def load_formats(roots):
+    formats = {TOKEN_DROPPED: ('%u log records dropped', False)}
+    for root in roots:
+        for dirpath, _, files in os.walk(root):
+            for name in files:
+                if not name.endswith(('.h', '.cpp', '.c')):
+                    continue
+                with open(os.path.join(dirpath, name), encoding='utf-8', errors='replace') as f:
+                    source = f.read()
+                found = [(join_literals(m.group(1)), False) for m in PMLOG_CALL.finditer(source)]
+                # print_error() logs the message with the error code appended, see pretty_printer.h
+                found += [(join_literals(m.group(1)) + ': %d', True) for m in PRINT_ERROR_CALL.finditer(source)]
+                for fmt, is_error in found:
+                    token = fnv1a(fmt)
+                    if token in formats and formats[token][0] != fmt:
+                        print('warning: token %08x is shared by "%s" and "%s"' % (token, formats[token][0], fmt),
+                              file=sys.stderr)
+                    formats[token] = (fmt, is_error)
+    return formats
+
+
+def render(fmt, is_error, args):
+    """Apply a C format string to the 32 bit arguments."""
+    if is_error and args:
+        code = args[-1] - (1 << 32) if args[-1] & 0x80000000 else args[-1]
+        return fmt[:-len('%d')] + BLE_ERRORS.get(code, 'Unknown error %d' % code)
+
+    values = iter(args)
+
+    def convert(m):
+        flags, conv = m.group(1), m.group(3)
+        if conv == '%':
+            return '%'
+        value = next(values, 0)
+        if conv in 'di' and value & 0x80000000:
+            value -= 1 << 32
+        return ('%' + flags + conv) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def decode_record(formats, token, time_us, args):
+    entry = formats.get(token)
+    if entry is None:
+        text = '<unknown token %08x> %s' % (token, ' '.join('%08x' % a for a in args))
+    else:
+        text = render(entry[0], entry[1], args)
+    return '[%10.6f] %s' % (time_us / 1e6, text)
+
+
+class StreamDecoder:
+    """Splits a byte stream into text and records, keeping partial records between feeds."""
+
+    def __init__(self, formats, out):
+        self.formats = formats
+        self.out = out
+        self.pending = b''
+
+    def feed(self, data):
+        buf = self.pending + data
+        text_start = i = 0
+        while True:
+            i = buf.find(bytes([MARKER]), i)
+            if i < 0:
+                self.emit_text(buf[text_start:])
+                self.pending = b''
+                return
+            if len(buf) - i < 1 + HEADER.size:
+                break
+            token, time_us, nargs = HEADER.unpack_from(buf, i + 1)
+            if nargs > MAX_ARGS:
+                i += 1                  # a stray marker byte in the text
+                continue
+            end = i + 1 + HEADER.size + 4 * nargs
+            if end > len(buf):
+                break
+            self.emit_text(buf[text_start:i])
+            args = list(struct.unpack_from('<%dI' % nargs, buf, i + 1 + HEADER.size))
+            self.out.write(decode_record(self.formats, token, time_us, args) + '\n')
+            text_start = i = end
+        self.emit_text(buf[text_start:i])
+        self.pending = buf[i:]
+
+    def emit_text(self, data):
+        if data:
+            self.out.write(data.decode('latin-1').replace('\r', ''))
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('input', nargs='?', default='-', help='captured console output, or - for stdin')
+    parser.add_argument('--src', action='append', help='source directory to read format strings from '
+                        '(default: the repository)')
+    parser.add_argument('--port', help='serial port to read from instead of a file')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--hex', action='store_true', help='input is hex text, e.g. characteristic reads')
+    opts = parser.parse_args()
+
+    formats = load_formats(opts.src or [os.path.dirname(here)])
+    decoder = StreamDecoder(formats, sys.stdout)
+
+    if opts.port:
+        import serial
+        with serial.Serial(opts.port, opts.baud, timeout=0.1) as port:
+            while True:
+                decoder.feed(port.read(256))
+                sys.stdout.flush()
+    elif opts.hex:
+        source = sys.stdin if opts.input == '-' else open(opts.input)
+        for line in source:
+            decoder.feed(bytes.fromhex(re.sub(r'[^0-9a-fA-F]', '', line)))
+    else:
+        source = sys.stdin.buffer if opts.input == '-' else open(opts.input, 'rb')
+        decoder.feed(source.read())
+
+
+if __name__ == '__main__':
+    main()